@@ -0,0 +1,349 @@
+#include "append_log.hpp"
+#include "util.hpp"
+
+#include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ *  The log starts with the bytes EXOLOG, followed by the commands in the order
+ *  they were run. A command is the number of tokens (std::size_t), followed by
+ *  each token. A token is its size in bytes (std::size_t) followed by its
+ *  contents.
+ */
+
+namespace
+{
+    const std::string log_header = "EXOLOG";
+
+    std::string errno_string(const std::string& what)
+    {
+        return what + ": " + std::strerror(errno);
+    }
+
+    void append_size(std::vector<unsigned char>& out, std::size_t size)
+    {
+        auto bytes = reinterpret_cast<const unsigned char*>(&size);
+        out.insert(out.end(), bytes, bytes + sizeof(size));
+    }
+
+    void write_all(int fd, const unsigned char* data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            auto written = ::write(fd, data, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw append_log::log_error(
+                    errno_string("Writing to the append-only log failed"));
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    std::size_t file_size(const std::string& path)
+    {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0)
+        {
+            return 0;
+        }
+        return st.st_size;
+    }
+}
+
+const unsigned int append_log::rewrite_retry_seconds;
+
+append_log::append_log(std::string file_path, unsigned int rewrite_percentage,
+    std::size_t rewrite_min_size)
+    : file_path_(file_path), rewrite_percentage_(rewrite_percentage),
+      rewrite_min_size_(rewrite_min_size), fd_(-1), size_(0), base_size_(0),
+      rewriting_(false), last_rewrite_failed_(false)
+{
+}
+
+append_log::~append_log()
+{
+    close();
+}
+
+void append_log::open()
+{
+    if (fd_ != -1)
+    {
+        return;
+    }
+
+    bool is_new = !exists(file_path_);
+    fd_ = ::open(file_path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd_ == -1)
+    {
+        throw log_error(errno_string("Could not open " + file_path_));
+    }
+
+    if (is_new)
+    {
+        std::vector<unsigned char> header;
+        write_header(header);
+        write_all(fd_, header.data(), header.size());
+    }
+    size_ = file_size(file_path_);
+    base_size_ = size_;
+}
+
+void append_log::close()
+{
+    if (fd_ != -1)
+    {
+        ::fsync(fd_);
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+const std::string& append_log::path() const
+{
+    return file_path_;
+}
+
+std::string append_log::rewrite_path() const
+{
+    return file_path_ + ".rewrite";
+}
+
+void append_log::append(const append_log::command& cmd)
+{
+    if (fd_ == -1)
+    {
+        return;
+    }
+
+    encode_buffer_.clear();
+    write_command(encode_buffer_, cmd);
+    write_out(encode_buffer_);
+    if (rewriting_)
+    {
+        rewrite_buffer_.insert(rewrite_buffer_.end(), encode_buffer_.begin(),
+            encode_buffer_.end());
+    }
+}
+
+void append_log::sync()
+{
+    if (fd_ != -1)
+    {
+        ::fsync(fd_);
+    }
+}
+
+std::size_t append_log::size() const
+{
+    return size_;
+}
+
+bool append_log::rewrite_due() const
+{
+    if (rewrite_percentage_ == 0 || rewriting_ || size_ < rewrite_min_size_)
+    {
+        return false;
+    }
+    // Back off after a failure rather than forking on every check.
+    if (last_rewrite_failed_ && std::chrono::steady_clock::now()
+        - last_rewrite_failure_ < std::chrono::seconds(rewrite_retry_seconds))
+    {
+        return false;
+    }
+
+    auto base = base_size_ > 0 ? base_size_ : 1;
+    return (size_ - base) * 100 / base >= rewrite_percentage_;
+}
+
+void append_log::begin_rewrite()
+{
+    rewriting_ = true;
+    rewrite_buffer_.clear();
+}
+
+void append_log::end_rewrite(bool success)
+{
+    rewriting_ = false;
+    auto new_path = rewrite_path();
+
+    if (success)
+    {
+        // Add the commands that came in during the rewrite, then swap.
+        int new_fd = ::open(new_path.c_str(), O_WRONLY | O_APPEND);
+        if (new_fd == -1)
+        {
+            success = false;
+        }
+        else
+        {
+            try
+            {
+                write_all(new_fd, rewrite_buffer_.data(), rewrite_buffer_.size());
+                if (::fsync(new_fd) != 0
+                    || std::rename(new_path.c_str(), file_path_.c_str()) != 0)
+                {
+                    success = false;
+                }
+            }
+            catch (const log_error&)
+            {
+                success = false;
+            }
+        }
+
+        if (success)
+        {
+            // The new file is now in place, keep appending to it.
+            if (fd_ != -1)
+            {
+                ::close(fd_);
+            }
+            fd_ = new_fd;
+            size_ = file_size(file_path_);
+            base_size_ = size_;
+        }
+        else if (new_fd != -1)
+        {
+            ::close(new_fd);
+        }
+    }
+
+    if (!success)
+    {
+        std::remove(new_path.c_str());
+        last_rewrite_failure_ = std::chrono::steady_clock::now();
+    }
+    last_rewrite_failed_ = !success;
+    rewrite_buffer_.clear();
+    rewrite_buffer_.shrink_to_fit();
+}
+
+bool append_log::rewriting() const
+{
+    return rewriting_;
+}
+
+bool append_log::exists(const std::string& path)
+{
+    return ::access(path.c_str(), F_OK) == 0;
+}
+
+void append_log::write_header(std::vector<unsigned char>& out)
+{
+    out.insert(out.end(), log_header.begin(), log_header.end());
+}
+
+void append_log::write_command(std::vector<unsigned char>& out,
+    const append_log::command& cmd)
+{
+    append_size(out, cmd.size());
+    for (const auto& token: cmd)
+    {
+        append_size(out, token.size());
+        out.insert(out.end(), token.begin(), token.end());
+    }
+}
+
+void append_log::replay(const std::string& path,
+    std::function<void(const append_log::command&)> f)
+{
+    std::ifstream in(path, std::ifstream::binary);
+    if (!in.is_open())
+    {
+        throw log_error("Could not open " + path);
+    }
+
+    const std::size_t total_size = file_size(path);
+    std::vector<unsigned char> header(log_header.size());
+    in.read(reinterpret_cast<char*>(header.data()), header.size());
+    if (!in || vec_to_string(header) != log_header)
+    {
+        throw log_error("Incorrect append-only log header");
+    }
+
+    // Offset just past the last complete command.
+    std::size_t good_offset = header.size();
+    command cmd;
+    bool truncated = false;
+    while (good_offset < total_size)
+    {
+        std::size_t remaining = total_size - good_offset;
+        std::size_t num_tokens;
+        if (remaining < sizeof(num_tokens)
+            || !in.read(reinterpret_cast<char*>(&num_tokens), sizeof(num_tokens)))
+        {
+            truncated = true;
+            break;
+        }
+        remaining -= sizeof(num_tokens);
+
+        // Every token needs at least its size. The count was read whole, so
+        // one that can't fit in the rest of the file is garbage rather than
+        // a torn write, and cutting the log there would lose the commands
+        // after it.
+        if (num_tokens == 0 || num_tokens > remaining / sizeof(std::size_t))
+        {
+            throw log_error("Corrupt append-only log");
+        }
+
+        cmd.resize(num_tokens);
+        std::size_t command_size = sizeof(num_tokens);
+        for (auto& token: cmd)
+        {
+            std::size_t token_size;
+            if (remaining < sizeof(token_size)
+                || !in.read(reinterpret_cast<char*>(&token_size),
+                    sizeof(token_size)))
+            {
+                truncated = true;
+                break;
+            }
+            remaining -= sizeof(token_size);
+            if (token_size > remaining)
+            {
+                truncated = true;
+                break;
+            }
+            token.resize(token_size);
+            in.read(reinterpret_cast<char*>(token.data()), token_size);
+            remaining -= token_size;
+            command_size += sizeof(token_size) + token_size;
+        }
+
+        if (truncated)
+        {
+            break;
+        }
+
+        f(cmd);
+        good_offset += command_size;
+    }
+
+    if (truncated)
+    {
+        in.close();
+        if (::truncate(path.c_str(), good_offset) != 0)
+        {
+            throw log_error(errno_string("Could not truncate " + path));
+        }
+    }
+}
+
+void append_log::write_out(const std::vector<unsigned char>& data)
+{
+    write_all(fd_, data.data(), data.size());
+    size_ += data.size();
+}
@@ -0,0 +1,101 @@
+#ifndef __EXOREDIS_APPEND_LOG_HPP__
+#define __EXOREDIS_APPEND_LOG_HPP__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <cstddef>
+#include <chrono>
+
+
+/*
+ * The append-only command log. Every command that modifies the database is
+ * appended to the log, so that the database can be rebuilt by replaying it.
+ *
+ * Because the log grows without bound, it can be rewritten: a minimal log is
+ * generated from the current keyspace (usually in a forked child) while
+ * commands logged in the meantime are buffered. When the rewrite is done the
+ * buffer is appended to the new log, which then atomically replaces the old
+ * one.
+ */
+class append_log
+{
+public:
+    typedef std::vector<std::vector<unsigned char>> command;
+
+    static const unsigned int rewrite_retry_seconds = 60;
+
+    class log_error: public std::runtime_error
+    {
+    public:
+        log_error(std::string msg) : runtime_error(msg) {}
+    };
+
+    // A rewrite is due once the log has grown by rewrite_percentage percent
+    // since the last rewrite, but only if it is at least rewrite_min_size
+    // bytes long, and not within rewrite_retry_seconds of a failed rewrite.
+    // A percentage of zero disables automatic rewrites.
+    append_log(std::string file_path, unsigned int rewrite_percentage,
+        std::size_t rewrite_min_size);
+    ~append_log();
+
+    append_log(const append_log&) = delete;
+    append_log& operator=(const append_log&) = delete;
+
+    // Opens the log for appending, creating it if it doesn't exist.
+    void open();
+    void close();
+
+    const std::string& path() const;
+    // Path of the temporary file the rewritten log is written to.
+    std::string rewrite_path() const;
+
+    // Appends a command to the log.
+    void append(const command& cmd);
+    // Flushes the log to disk.
+    void sync();
+
+    // Current size of the log in bytes.
+    std::size_t size() const;
+    bool rewrite_due() const;
+
+    // Starts buffering appended commands for the rewritten log.
+    void begin_rewrite();
+    // If successful, appends the buffered commands to the rewritten log and
+    // swaps it in. Otherwise throws away the rewritten log.
+    void end_rewrite(bool success);
+    bool rewriting() const;
+
+    static bool exists(const std::string& path);
+
+    // Writes the log header to a new log.
+    static void write_header(std::vector<unsigned char>& out);
+    // Serializes a command in the log format.
+    static void write_command(std::vector<unsigned char>& out,
+        const command& cmd);
+
+    // Calls f for every command in the log at path. A truncated command at
+    // the end of the log (as left by a crash) is dropped and cut off the
+    // file. Throws log_error if the log is corrupt.
+    static void replay(const std::string& path,
+        std::function<void(const command&)> f);
+
+private:
+    void write_out(const std::vector<unsigned char>& data);
+
+    std::string file_path_;
+    unsigned int rewrite_percentage_;
+    std::size_t rewrite_min_size_;
+    int fd_;
+    std::size_t size_;
+    // Size of the log right after the last rewrite.
+    std::size_t base_size_;
+    bool rewriting_;
+    bool last_rewrite_failed_;
+    std::chrono::steady_clock::time_point last_rewrite_failure_;
+    std::vector<unsigned char> rewrite_buffer_;
+    std::vector<unsigned char> encode_buffer_;
+};
+
+#endif
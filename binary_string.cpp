@@ -1,21 +1,82 @@
 #include "binary_string.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+namespace
+{
+    bool get_bit_in(const std::vector<unsigned char>& data, std::uint64_t bit)
+    {
+        return bit / 8 < data.size()
+            && (data[bit / 8] & (0x80 >> (bit % 8))) != 0;
+    }
+
+    // Strings SETBIT stretches to at least this many bytes are considered
+    // for the sparse form.
+    const std::size_t sparse_min_size = 64 * 1024;
+}
 
 binary_string::binary_string()
-    : expiry_set_(false)
+    : expiry_set_(false), integer_set_(false), integer_(0)
 {
 }
 
-binary_string::binary_string(const std::vector<unsigned char>& bdata)
-    : expiry_set_(false), bdata_(bdata)
+binary_string::binary_string(std::vector<unsigned char> bdata)
+    : expiry_set_(false), integer_set_(false), integer_(0)
 {
+    bdata_ = std::move(bdata);
+    encode();
 }
 
-binary_string::binary_string(const std::vector<unsigned char>& bdata,
+binary_string::binary_string(std::vector<unsigned char> bdata,
     long long expiry_milliseconds)
-    : bdata_(bdata), expiry_set_(true)
+    : expiry_set_(true), integer_set_(false), integer_(0)
 {
     expiry_time_ = chrono::system_clock::now()
         + chrono::milliseconds(expiry_milliseconds);
+    bdata_ = std::move(bdata);
+    encode();
+}
+
+binary_string::binary_string(std::vector<unsigned char> bdata,
+    chrono::system_clock::time_point expiry_time)
+    : expiry_set_(true), integer_set_(false), expiry_time_(expiry_time),
+      integer_(0)
+{
+    bdata_ = std::move(bdata);
+    encode();
+}
+
+binary_string::binary_string(const binary_string& other)
+    : expiry_set_(other.expiry_set_), integer_set_(other.integer_set_),
+      expiry_time_(other.expiry_time_), integer_(other.integer_),
+      bdata_(other.bdata_)
+{
+    if (other.sparse_)
+    {
+        sparse_.reset(new sparse_bitmap(*other.sparse_));
+    }
+}
+
+binary_string& binary_string::operator=(const binary_string& other)
+{
+    if (this != &other)
+    {
+        binary_string copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+void binary_string::encode()
+{
+    long long value;
+    if (parse_integer(bdata_, value))
+    {
+        set_integer(value);
+    }
 }
 
 const std::vector<unsigned char>& binary_string::bdata() const
@@ -25,9 +86,168 @@ const std::vector<unsigned char>& binary_string::bdata() const
 
 std::vector<unsigned char>& binary_string::bdata()
 {
+    if (integer_set_)
+    {
+        bdata_ = string_to_vec(std::to_string(integer_));
+        integer_set_ = false;
+    }
+    else if (sparse_)
+    {
+        bdata_ = sparse_->to_bytes();
+        sparse_.reset();
+    }
+    return bdata_;
+}
+
+std::vector<unsigned char> binary_string::bytes() const
+{
+    if (integer_set_)
+    {
+        return string_to_vec(std::to_string(integer_));
+    }
+    if (sparse_)
+    {
+        return sparse_->to_bytes();
+    }
     return bdata_;
 }
 
+void binary_string::set_bytes(const std::vector<unsigned char>& bdata)
+{
+    integer_set_ = false;
+    sparse_.reset();
+    bdata_ = bdata;
+    encode();
+}
+
+std::size_t binary_string::size() const
+{
+    if (integer_set_)
+    {
+        return std::to_string(integer_).size();
+    }
+    if (sparse_)
+    {
+        return sparse_->size();
+    }
+    return bdata_.size();
+}
+
+std::size_t binary_string::capacity() const
+{
+    if (sparse_)
+    {
+        return sparse_->memory_usage();
+    }
+    return bdata_.capacity();
+}
+
+bool binary_string::has_bytes() const
+{
+    return !integer_set_ && !sparse_;
+}
+
+bool binary_string::is_integer() const
+{
+    return integer_set_;
+}
+
+long long binary_string::integer() const
+{
+    return integer_;
+}
+
+void binary_string::set_integer(long long value)
+{
+    integer_ = value;
+    integer_set_ = true;
+    sparse_.reset();
+    std::vector<unsigned char>().swap(bdata_);
+}
+
+bool binary_string::is_sparse() const
+{
+    return static_cast<bool>(sparse_);
+}
+
+const sparse_bitmap& binary_string::sparse() const
+{
+    return *sparse_;
+}
+
+void binary_string::set_sparse(sparse_bitmap bitmap)
+{
+    integer_set_ = false;
+    std::vector<unsigned char>().swap(bdata_);
+    sparse_.reset(new sparse_bitmap(std::move(bitmap)));
+    densify_if_needed();
+}
+
+bool binary_string::get_bit(std::uint64_t bit) const
+{
+    if (sparse_)
+    {
+        return sparse_->get(bit);
+    }
+    if (integer_set_)
+    {
+        return get_bit_in(bytes(), bit);
+    }
+    return get_bit_in(bdata_, bit);
+}
+
+bool binary_string::set_bit(std::uint64_t bit, bool value)
+{
+    if (sparse_)
+    {
+        auto old = sparse_->set(bit, value);
+        densify_if_needed();
+        return old;
+    }
+
+    auto& data = bdata();
+    const std::uint64_t byte_offset = bit / 8;
+    if (byte_offset >= data.size())
+    {
+        // A string stretched far past its length is mostly clear bits, so it
+        // may be smaller as a sparse bitmap.
+        const std::uint64_t new_size = byte_offset + 1;
+        if (new_size >= sparse_min_size && new_size > 2 * data.size())
+        {
+            std::unique_ptr<sparse_bitmap> bitmap(new sparse_bitmap(data));
+            bitmap->set(bit, value);
+            if (bitmap->memory_usage() * 2 < new_size)
+            {
+                std::vector<unsigned char>().swap(bdata_);
+                sparse_ = std::move(bitmap);
+                return false;
+            }
+        }
+        data.resize(new_size, 0);
+    }
+
+    const unsigned char mask = 0x80 >> (bit % 8);
+    const bool old = (data[byte_offset] & mask) != 0;
+    if (value)
+    {
+        data[byte_offset] |= mask;
+    }
+    else
+    {
+        data[byte_offset] &= ~mask;
+    }
+    return old;
+}
+
+void binary_string::densify_if_needed()
+{
+    if (sparse_ && sparse_->memory_usage() * 2 > sparse_->size())
+    {
+        bdata_ = sparse_->to_bytes();
+        sparse_.reset();
+    }
+}
+
 bool binary_string::has_expired() const
 {
     if (!expiry_set_)
@@ -37,3 +257,13 @@ bool binary_string::has_expired() const
 
     return expiry_time_ < chrono::system_clock::now();
 }
+
+bool binary_string::has_expiry() const
+{
+    return expiry_set_;
+}
+
+chrono::system_clock::time_point binary_string::expiry_time() const
+{
+    return expiry_time_;
+}
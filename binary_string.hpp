@@ -3,6 +3,9 @@
 
 #include <vector>
 #include <chrono>
+#include <cstddef>
+#include <memory>
+#include "sparse_bitmap.hpp"
 
 namespace chrono = std::chrono;
 
@@ -10,24 +13,84 @@ namespace chrono = std::chrono;
 /*
  * Represents a binary-safe string value in the database. It is associated with
  * an optional expiry time.
+ *
+ * A string that holds a decimal integer, written the way it would be printed,
+ * is kept as a 64-bit integer instead of bytes. This makes counters small and
+ * lets INCR and friends work without parsing. The bytes are only produced when
+ * the contents are asked for, and asking for them mutably converts the string
+ * to bytes for good.
+ *
+ * A string used as a large bitmap with few bits set, such as one that SETBIT
+ * has stretched to a far offset, is kept as a sparse_bitmap instead. The same
+ * rules apply: the bytes are produced on demand, and asking for them mutably
+ * converts the string back.
  */
 class binary_string
 {
 public:
     binary_string();
-    binary_string(const std::vector<unsigned char>& bdata);    // No expiry time for this one
-    binary_string(const std::vector<unsigned char>& bdata,
+    // The contents are moved in if passed as an rvalue.
+    binary_string(std::vector<unsigned char> bdata);    // No expiry time for this one
+    binary_string(std::vector<unsigned char> bdata,
         long long expiry_milliseconds);
+    binary_string(std::vector<unsigned char> bdata,
+        chrono::system_clock::time_point expiry_time);
+    binary_string(const binary_string& other);
+    binary_string(binary_string&& other) = default;
+    binary_string& operator=(const binary_string& other);
+    binary_string& operator=(binary_string&& other) = default;
 
+    // The contents. Must not be called unless has_bytes() is true; see
+    // bytes().
     const std::vector<unsigned char>& bdata() const;
+    // The contents, for changing them. Converts an integer or a sparse bitmap
+    // to bytes.
     std::vector<unsigned char>& bdata();
+    // A copy of the contents, whichever way they are kept.
+    std::vector<unsigned char> bytes() const;
+    // Replaces the contents, keeping the expiry time.
+    void set_bytes(const std::vector<unsigned char>& bdata);
+    // Length of the contents in bytes.
+    std::size_t size() const;
+    // Bytes allocated for the contents. Zero for an integer.
+    std::size_t capacity() const;
+    // Whether the contents are kept as bytes.
+    bool has_bytes() const;
+
+    bool is_integer() const;
+    // Only meaningful if is_integer() is true.
+    long long integer() const;
+    void set_integer(long long value);
+
+    bool is_sparse() const;
+    // Only meaningful if is_sparse() is true.
+    const sparse_bitmap& sparse() const;
+    void set_sparse(sparse_bitmap bitmap);
+
+    // Reads and writes single bits, as GETBIT and SETBIT do, without leaving
+    // the sparse form. set_bit() returns the old value of the bit, and may
+    // switch between bytes and a sparse bitmap depending on which is smaller.
+    bool get_bit(std::uint64_t bit) const;
+    bool set_bit(std::uint64_t bit, bool value);
 
     bool has_expired() const;
+    bool has_expiry() const;
+    // Only meaningful if has_expiry() is true.
+    chrono::system_clock::time_point expiry_time() const;
 
 private:
+    // Switches to the integer form if the contents are a canonical integer.
+    void encode();
+    // Switches from a sparse bitmap to bytes, if the bitmap has grown too
+    // dense to be worth keeping.
+    void densify_if_needed();
+
     bool expiry_set_;
+    bool integer_set_;
     chrono::system_clock::time_point expiry_time_;
+    long long integer_;
     std::vector<unsigned char> bdata_;
+    std::unique_ptr<sparse_bitmap> sparse_;
 };
 
 #endif
@@ -0,0 +1,588 @@
+#include "bitops.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define EXOREDIS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    std::uint64_t load_word(const unsigned char* data)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        return word;
+    }
+
+    // Counts the bits of a word without a popcount instruction.
+    std::uint64_t swar_popcount(std::uint64_t x)
+    {
+        x = x - ((x >> 1) & 0x5555555555555555ULL);
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        return (x * 0x0101010101010101ULL) >> 56;
+    }
+
+    std::uint64_t popcount_portable(const unsigned char* data,
+        std::size_t size)
+    {
+        std::uint64_t count = 0;
+        std::size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            count += swar_popcount(load_word(data + i));
+        }
+        for (; i < size; i++)
+        {
+            count += swar_popcount(data[i]);
+        }
+        return count;
+    }
+
+    std::size_t find_byte_not_portable(const unsigned char* data,
+        std::size_t size, unsigned char skip)
+    {
+        const std::uint64_t skip_word = 0x0101010101010101ULL * skip;
+        std::size_t i = 0;
+        while (i + 8 <= size && load_word(data + i) == skip_word)
+        {
+            i += 8;
+        }
+        while (i < size && data[i] == skip)
+        {
+            i++;
+        }
+        return i;
+    }
+
+    // Combines the bytes of the sources from start to end, which all of
+    // them cover.
+    void combine_bytes(bit_operation op, const std::vector<bit_source>& sources,
+        unsigned char* dest, std::size_t start, std::size_t end)
+    {
+        for (auto i = start; i < end; i++)
+        {
+            unsigned char result = sources[0].data[i];
+            for (std::size_t j = 1; j < sources.size(); j++)
+            {
+                switch (op)
+                {
+                case bit_operation::bitwise_and:
+                    result &= sources[j].data[i];
+                    break;
+                case bit_operation::bitwise_or:
+                    result |= sources[j].data[i];
+                    break;
+                default:
+                    result ^= sources[j].data[i];
+                    break;
+                }
+            }
+            dest[i] = op == bit_operation::bitwise_not ? ~result : result;
+        }
+    }
+
+    // Each version combines the bytes from start to end, which all the
+    // sources cover. A block of every source is read before it is stored,
+    // so dest can be one of the sources.
+    void combine_bits_portable(bit_operation op,
+        const std::vector<bit_source>& sources, unsigned char* dest,
+        std::size_t start, std::size_t end)
+    {
+        auto i = start;
+        for (; i + 8 <= end; i += 8)
+        {
+            auto result = load_word(sources[0].data + i);
+            for (std::size_t j = 1; j < sources.size(); j++)
+            {
+                auto word = load_word(sources[j].data + i);
+                switch (op)
+                {
+                case bit_operation::bitwise_and:
+                    result &= word;
+                    break;
+                case bit_operation::bitwise_or:
+                    result |= word;
+                    break;
+                default:
+                    result ^= word;
+                    break;
+                }
+            }
+            if (op == bit_operation::bitwise_not)
+            {
+                result = ~result;
+            }
+            std::memcpy(dest + i, &result, sizeof(result));
+        }
+        combine_bytes(op, sources, dest, i, end);
+    }
+
+#ifdef EXOREDIS_X86_KERNELS
+    __attribute__((target("sse4.2")))
+    void combine_bits_sse42(bit_operation op,
+        const std::vector<bit_source>& sources, unsigned char* dest,
+        std::size_t start, std::size_t end)
+    {
+        const __m128i ones = _mm_set1_epi8(-1);
+        auto i = start;
+        for (; i + 16 <= end; i += 16)
+        {
+            auto result = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(sources[0].data + i));
+            for (std::size_t j = 1; j < sources.size(); j++)
+            {
+                auto block = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(sources[j].data + i));
+                switch (op)
+                {
+                case bit_operation::bitwise_and:
+                    result = _mm_and_si128(result, block);
+                    break;
+                case bit_operation::bitwise_or:
+                    result = _mm_or_si128(result, block);
+                    break;
+                default:
+                    result = _mm_xor_si128(result, block);
+                    break;
+                }
+            }
+            if (op == bit_operation::bitwise_not)
+            {
+                result = _mm_xor_si128(result, ones);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), result);
+        }
+        combine_bytes(op, sources, dest, i, end);
+    }
+
+    __attribute__((target("avx2")))
+    void combine_bits_avx2(bit_operation op,
+        const std::vector<bit_source>& sources, unsigned char* dest,
+        std::size_t start, std::size_t end)
+    {
+        const __m256i ones = _mm256_set1_epi8(-1);
+        auto i = start;
+        for (; i + 32 <= end; i += 32)
+        {
+            auto result = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(sources[0].data + i));
+            for (std::size_t j = 1; j < sources.size(); j++)
+            {
+                auto block = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(sources[j].data + i));
+                switch (op)
+                {
+                case bit_operation::bitwise_and:
+                    result = _mm256_and_si256(result, block);
+                    break;
+                case bit_operation::bitwise_or:
+                    result = _mm256_or_si256(result, block);
+                    break;
+                default:
+                    result = _mm256_xor_si256(result, block);
+                    break;
+                }
+            }
+            if (op == bit_operation::bitwise_not)
+            {
+                result = _mm256_xor_si256(result, ones);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), result);
+        }
+        combine_bytes(op, sources, dest, i, end);
+    }
+
+    __attribute__((target("popcnt")))
+    std::uint64_t popcount_sse42(const unsigned char* data, std::size_t size)
+    {
+        // Four independent sums, so the popcnt instructions can overlap.
+        std::uint64_t counts[4] = {0, 0, 0, 0};
+        std::size_t i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            counts[0] += _mm_popcnt_u64(load_word(data + i));
+            counts[1] += _mm_popcnt_u64(load_word(data + i + 8));
+            counts[2] += _mm_popcnt_u64(load_word(data + i + 16));
+            counts[3] += _mm_popcnt_u64(load_word(data + i + 24));
+        }
+        for (; i + 8 <= size; i += 8)
+        {
+            counts[0] += _mm_popcnt_u64(load_word(data + i));
+        }
+        for (; i < size; i++)
+        {
+            counts[0] += _mm_popcnt_u32(data[i]);
+        }
+        return counts[0] + counts[1] + counts[2] + counts[3];
+    }
+
+    __attribute__((target("sse4.2")))
+    std::size_t find_byte_not_sse42(const unsigned char* data,
+        std::size_t size, unsigned char skip)
+    {
+        const __m128i skip_bytes = _mm_set1_epi8(static_cast<char>(skip));
+        std::size_t i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            auto chunk = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(data + i));
+            auto equal = static_cast<unsigned int>(_mm_movemask_epi8(
+                _mm_cmpeq_epi8(chunk, skip_bytes)));
+            if (equal != 0xffff)
+            {
+                return i + __builtin_ctz(~equal);
+            }
+        }
+        return i + find_byte_not_portable(data + i, size - i, skip);
+    }
+
+    // Counts each byte with a nibble lookup table, then sums the bytes of
+    // every 8 byte lane (Mula's method).
+    __attribute__((target("avx2,popcnt")))
+    std::uint64_t popcount_avx2(const unsigned char* data, std::size_t size)
+    {
+        const __m256i table = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low_mask = _mm256_set1_epi8(0x0f);
+        __m256i totals = _mm256_setzero_si256();
+        std::size_t i = 0;
+        while (i + 32 <= size)
+        {
+            // Byte counts can hold up to 255, so they are summed into the
+            // 64-bit totals every 31 chunks at most.
+            __m256i counts = _mm256_setzero_si256();
+            for (int chunks = 0; chunks < 31 && i + 32 <= size;
+                chunks++, i += 32)
+            {
+                auto chunk = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(data + i));
+                auto low = _mm256_and_si256(chunk, low_mask);
+                auto high = _mm256_and_si256(_mm256_srli_epi16(chunk, 4),
+                    low_mask);
+                counts = _mm256_add_epi8(counts, _mm256_add_epi8(
+                    _mm256_shuffle_epi8(table, low),
+                    _mm256_shuffle_epi8(table, high)));
+            }
+            totals = _mm256_add_epi64(totals,
+                _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+        }
+
+        std::uint64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), totals);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+            + popcount_sse42(data + i, size - i);
+    }
+
+    __attribute__((target("avx2")))
+    std::size_t find_byte_not_avx2(const unsigned char* data,
+        std::size_t size, unsigned char skip)
+    {
+        const __m256i skip_bytes = _mm256_set1_epi8(static_cast<char>(skip));
+        std::size_t i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            auto chunk = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(data + i));
+            auto equal = static_cast<unsigned int>(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(chunk, skip_bytes)));
+            if (equal != 0xffffffffu)
+            {
+                return i + __builtin_ctz(~equal);
+            }
+        }
+        return i + find_byte_not_sse42(data + i, size - i, skip);
+    }
+#endif
+
+    simd_level supported_level(simd_level level)
+    {
+        auto detected = detected_simd_level();
+        return level > detected ? detected : level;
+    }
+
+    // The first byte masked to the bits from first_bit on, and the last to
+    // the bits up to last_bit. Both masks apply when they are the same byte.
+    unsigned char first_byte_mask(std::uint64_t first_bit)
+    {
+        return 0xff >> (first_bit % 8);
+    }
+
+    unsigned char last_byte_mask(std::uint64_t last_bit)
+    {
+        return 0xff << (7 - last_bit % 8);
+    }
+}
+
+simd_level detected_simd_level()
+{
+    static const simd_level level = []()
+    {
+#ifdef EXOREDIS_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        {
+            return simd_level::avx2;
+        }
+        if (__builtin_cpu_supports("sse4.2")
+            && __builtin_cpu_supports("popcnt"))
+        {
+            return simd_level::sse42;
+        }
+#endif
+        return simd_level::portable;
+    }();
+    return level;
+}
+
+std::uint64_t popcount(const unsigned char* data, std::size_t size,
+    simd_level level)
+{
+    switch (supported_level(level))
+    {
+#ifdef EXOREDIS_X86_KERNELS
+    case simd_level::avx2:
+        return popcount_avx2(data, size);
+    case simd_level::sse42:
+        return popcount_sse42(data, size);
+#endif
+    default:
+        return popcount_portable(data, size);
+    }
+}
+
+std::size_t find_byte_not(const unsigned char* data, std::size_t size,
+    unsigned char skip, simd_level level)
+{
+    switch (supported_level(level))
+    {
+#ifdef EXOREDIS_X86_KERNELS
+    case simd_level::avx2:
+        return find_byte_not_avx2(data, size, skip);
+    case simd_level::sse42:
+        return find_byte_not_sse42(data, size, skip);
+#endif
+    default:
+        return find_byte_not_portable(data, size, skip);
+    }
+}
+
+void combine_bits(bit_operation op, const std::vector<bit_source>& sources,
+    unsigned char* dest, std::size_t size, simd_level level)
+{
+    level = supported_level(level);
+    // Worked on in stretches where the same sources are left, so that the
+    // vector loops never need to pad a source.
+    auto active = sources;
+    std::size_t start = 0;
+    while (start < size)
+    {
+        active.erase(std::remove_if(active.begin(), active.end(),
+            [start](const bit_source& source)
+            {
+                return source.size <= start;
+            }), active.end());
+        // Past the end of any source, AND gives zeros, as do the others once
+        // every source has ended.
+        if (active.empty() || (op == bit_operation::bitwise_and
+            && active.size() < sources.size()))
+        {
+            std::memset(dest + start, 0, size - start);
+            return;
+        }
+
+        auto end = size;
+        for (const auto& source: active)
+        {
+            end = std::min(end, source.size);
+        }
+        switch (level)
+        {
+#ifdef EXOREDIS_X86_KERNELS
+        case simd_level::avx2:
+            combine_bits_avx2(op, active, dest, start, end);
+            break;
+        case simd_level::sse42:
+            combine_bits_sse42(op, active, dest, start, end);
+            break;
+#endif
+        default:
+            combine_bits_portable(op, active, dest, start, end);
+            break;
+        }
+        start = end;
+    }
+}
+
+std::uint64_t count_bits(const unsigned char* data, std::uint64_t first_bit,
+    std::uint64_t last_bit)
+{
+    auto first_byte = first_bit / 8;
+    auto last_byte = last_bit / 8;
+    if (first_byte == last_byte)
+    {
+        unsigned char byte = data[first_byte] & first_byte_mask(first_bit)
+            & last_byte_mask(last_bit);
+        return popcount(&byte, 1);
+    }
+
+    unsigned char ends[2] = {
+        static_cast<unsigned char>(data[first_byte]
+            & first_byte_mask(first_bit)),
+        static_cast<unsigned char>(data[last_byte] & last_byte_mask(last_bit))
+    };
+    return popcount(ends, 2)
+        + popcount(data + first_byte + 1, last_byte - first_byte - 1);
+}
+
+long long find_bit(const unsigned char* data, std::uint64_t first_bit,
+    std::uint64_t last_bit, bool bit)
+{
+    // Looking for a clear bit is looking for a set bit in the complement,
+    // and either way whole bytes of the other bit are skipped.
+    const unsigned char flip = bit ? 0 : 0xff;
+    auto first_byte = first_bit / 8;
+    auto last_byte = last_bit / 8;
+
+    auto byte_at = [&](std::uint64_t i)
+    {
+        unsigned char byte = data[i] ^ flip;
+        if (i == first_byte)
+        {
+            byte &= first_byte_mask(first_bit);
+        }
+        if (i == last_byte)
+        {
+            byte &= last_byte_mask(last_bit);
+        }
+        return byte;
+    };
+    auto found = [](std::uint64_t i, unsigned char byte)
+    {
+        return static_cast<long long>(i * 8 + __builtin_clz(byte) - 24);
+    };
+
+    if (auto byte = byte_at(first_byte))
+    {
+        return found(first_byte, byte);
+    }
+    if (first_byte == last_byte)
+    {
+        return -1;
+    }
+
+    auto middle = first_byte + 1;
+    auto i = middle + find_byte_not(data + middle, last_byte - middle, flip);
+    if (i < last_byte)
+    {
+        return found(i, data[i] ^ flip);
+    }
+    if (auto byte = byte_at(last_byte))
+    {
+        return found(last_byte, byte);
+    }
+    return -1;
+}
+
+std::uint64_t get_field(const unsigned char* data, std::size_t size,
+    std::uint64_t offset, unsigned bits)
+{
+    std::uint64_t value = 0;
+    for (auto bit = offset; bit < offset + bits; bit++)
+    {
+        auto byte = bit / 8 < size ? data[bit / 8] : 0;
+        value = (value << 1) | ((byte >> (7 - bit % 8)) & 1);
+    }
+    return value;
+}
+
+void set_field(unsigned char* data, std::uint64_t offset, unsigned bits,
+    std::uint64_t value)
+{
+    for (unsigned i = 0; i < bits; i++)
+    {
+        auto bit = offset + i;
+        unsigned char mask = 0x80 >> (bit % 8);
+        if ((value >> (bits - 1 - i)) & 1)
+        {
+            data[bit / 8] |= mask;
+        }
+        else
+        {
+            data[bit / 8] &= ~mask;
+        }
+    }
+}
+
+long long sign_extend(std::uint64_t raw, unsigned bits)
+{
+    if (bits < 64 && ((raw >> (bits - 1)) & 1))
+    {
+        raw |= ~std::uint64_t(0) << bits;
+    }
+    return static_cast<long long>(raw);
+}
+
+bool add_to_field(long long value, long long incr, bool is_signed,
+    unsigned bits, field_overflow overflow, long long& result)
+{
+    long long max;
+    if (is_signed)
+    {
+        max = bits == 64 ? std::numeric_limits<long long>::max()
+            : (1LL << (bits - 1)) - 1;
+    }
+    else
+    {
+        max = static_cast<long long>((std::uint64_t(1) << bits) - 1);
+    }
+    const long long min = is_signed ? -max - 1 : 0;
+
+    // Which limit the sum went past, if any.
+    long long sum;
+    int direction = 0;
+    if (__builtin_add_overflow(value, incr, &sum))
+    {
+        direction = incr > 0 ? 1 : -1;
+    }
+    else if (sum > max)
+    {
+        direction = 1;
+    }
+    else if (sum < min)
+    {
+        direction = -1;
+    }
+    if (direction == 0)
+    {
+        result = sum;
+        return true;
+    }
+
+    switch (overflow)
+    {
+    case field_overflow::fail:
+        return false;
+    case field_overflow::sat:
+        result = direction > 0 ? max : min;
+        return true;
+    default:
+    {
+        // Two's complement addition, cut down to the field.
+        auto raw = static_cast<std::uint64_t>(value)
+            + static_cast<std::uint64_t>(incr);
+        if (bits < 64)
+        {
+            raw &= (std::uint64_t(1) << bits) - 1;
+        }
+        result = is_signed ? sign_extend(raw, bits)
+            : static_cast<long long>(raw);
+        return true;
+    }
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef __EXOREDIS_BITOPS_HPP__
+#define __EXOREDIS_BITOPS_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/*
+ * Kernels for bitmaps kept in strings, as used by BITCOUNT, BITPOS and BITOP,
+ * and the field arithmetic of BITFIELD.
+ * Bits are numbered from the most significant bit of the first byte, as with
+ * GETBIT and SETBIT.
+ *
+ * Each kernel has a portable version and versions for SSE4.2 and AVX2. The
+ * best one the CPU supports is picked at runtime, so the binary still runs on
+ * older processors.
+ */
+enum class simd_level
+{
+    portable,
+    sse42,
+    avx2
+};
+
+// The best level the CPU supports. Detected the first time it is called.
+simd_level detected_simd_level();
+
+// Returns the number of set bits in size bytes. Levels the CPU doesn't support
+// fall back to the best one it does.
+std::uint64_t popcount(const unsigned char* data, std::size_t size,
+    simd_level level=detected_simd_level());
+
+// Returns the index of the first byte that isn't skip, or size if there is
+// none.
+std::size_t find_byte_not(const unsigned char* data, std::size_t size,
+    unsigned char skip, simd_level level=detected_simd_level());
+
+enum class bit_operation
+{
+    bitwise_and,
+    bitwise_or,
+    bitwise_xor,
+    bitwise_not
+};
+
+// A buffer to be combined by combine_bits().
+struct bit_source
+{
+    const unsigned char* data;
+    std::size_t size;
+};
+
+// Applies op to the sources and writes the size bytes of the result to dest,
+// in a single pass over all of them. Sources shorter than size are taken to
+// be padded with zero bytes. bitwise_not takes exactly one source. dest may
+// be one of the sources.
+void combine_bits(bit_operation op, const std::vector<bit_source>& sources,
+    unsigned char* dest, std::size_t size,
+    simd_level level=detected_simd_level());
+
+// Returns the number of set bits from first_bit to last_bit, inclusive.
+std::uint64_t count_bits(const unsigned char* data, std::uint64_t first_bit,
+    std::uint64_t last_bit);
+
+// Returns the position of the first bit equal to bit from first_bit to
+// last_bit, inclusive, or -1 if there is none.
+long long find_bit(const unsigned char* data, std::uint64_t first_bit,
+    std::uint64_t last_bit, bool bit);
+
+// Reads the bits wide field starting at bit offset as an unsigned number,
+// most significant bit first. Bits past size bytes read as clear. bits is
+// from 1 to 64.
+std::uint64_t get_field(const unsigned char* data, std::size_t size,
+    std::uint64_t offset, unsigned bits);
+
+// Writes the low bits of value to the field starting at bit offset. The field
+// must lie within the buffer.
+void set_field(unsigned char* data, std::uint64_t offset, unsigned bits,
+    std::uint64_t value);
+
+// Reads the raw bits of a signed field as a number.
+long long sign_extend(std::uint64_t raw, unsigned bits);
+
+// What BITFIELD does when a result doesn't fit in its field.
+enum class field_overflow
+{
+    wrap,
+    sat,
+    fail
+};
+
+// Adds incr to value, as stored in a field of the given width and sign, and
+// puts the result in result. A result that doesn't fit wraps around,
+// saturates at the nearest limit or fails, as overflow says. Returns false if
+// it fails. Signed fields are 1 to 64 bits wide, unsigned ones 1 to 63.
+bool add_to_field(long long value, long long incr, bool is_signed,
+    unsigned bits, field_overflow overflow, long long& result);
+
+#endif
@@ -0,0 +1,211 @@
+#include "config.hpp"
+#include "exostore.hpp"
+
+#include <boost/lexical_cast.hpp>
+
+server_config::server_config()
+    : load_threads(0), async_load(false), log_rewrite_percentage(100),
+      log_rewrite_min_size(64 * 1024 * 1024), spill_idle_seconds(3600),
+      spill_min_size(64), max_memory(0), max_memory_policy("noeviction"),
+      max_memory_samples(5), active_defrag(false),
+      active_defrag_threshold(10),
+      active_defrag_ignore_bytes(100 * 1024 * 1024),
+      pubsub_hard_limit(32 * 1024 * 1024), pubsub_soft_limit(8 * 1024 * 1024),
+      pubsub_soft_seconds(60)
+{
+}
+
+server_config server_config::from_args(const std::vector<std::string>& args)
+{
+    if (args.empty())
+    {
+        throw config_error("No database path given");
+    }
+
+    server_config config;
+    config.db_path = args[0];
+
+    for (auto it = args.begin() + 1; it != args.end(); it++)
+    {
+        const auto& option = *it;
+        if (it + 1 == args.end())
+        {
+            throw config_error("No value given for " + option);
+        }
+        const auto& value = *(++it);
+
+        try
+        {
+            if (option == "--load-threads")
+            {
+                config.load_threads = boost::lexical_cast<std::size_t>(value);
+            }
+            else if (option == "--async-load")
+            {
+                if (value != "yes" && value != "no")
+                {
+                    throw boost::bad_lexical_cast();
+                }
+                config.async_load = (value == "yes");
+            }
+            else if (option == "--save")
+            {
+                // Given as <seconds>:<changes>
+                auto colon = value.find(':');
+                if (colon == std::string::npos)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+                save_policy policy;
+                policy.seconds = boost::lexical_cast<unsigned int>(
+                    value.substr(0, colon));
+                policy.changes = boost::lexical_cast<std::size_t>(
+                    value.substr(colon + 1));
+                config.save_policies.push_back(policy);
+            }
+            else if (option == "--appendonly")
+            {
+                config.log_path = value;
+            }
+            else if (option == "--aof-rewrite-percentage")
+            {
+                config.log_rewrite_percentage =
+                    boost::lexical_cast<unsigned int>(value);
+            }
+            else if (option == "--aof-rewrite-min-size")
+            {
+                config.log_rewrite_min_size =
+                    boost::lexical_cast<std::size_t>(value);
+            }
+            else if (option == "--mapped-file")
+            {
+                config.mapped_path = value;
+            }
+            else if (option == "--spill-file")
+            {
+                config.spill_path = value;
+            }
+            else if (option == "--spill-after")
+            {
+                config.spill_idle_seconds =
+                    boost::lexical_cast<unsigned int>(value);
+            }
+            else if (option == "--spill-min-size")
+            {
+                config.spill_min_size = boost::lexical_cast<std::size_t>(value);
+            }
+            else if (option == "--maxmemory")
+            {
+                config.max_memory = boost::lexical_cast<std::size_t>(value);
+            }
+            else if (option == "--maxmemory-policy")
+            {
+                try
+                {
+                    exostore::eviction_policy_from_name(value);
+                }
+                catch (const std::invalid_argument&)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+                config.max_memory_policy = value;
+            }
+            else if (option == "--maxmemory-samples")
+            {
+                config.max_memory_samples =
+                    boost::lexical_cast<std::size_t>(value);
+                if (config.max_memory_samples == 0)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+            }
+            else if (option == "--activedefrag")
+            {
+                if (value != "yes" && value != "no")
+                {
+                    throw boost::bad_lexical_cast();
+                }
+                config.active_defrag = (value == "yes");
+            }
+            else if (option == "--active-defrag-threshold")
+            {
+                config.active_defrag_threshold =
+                    boost::lexical_cast<unsigned int>(value);
+            }
+            else if (option == "--active-defrag-ignore-bytes")
+            {
+                config.active_defrag_ignore_bytes =
+                    boost::lexical_cast<std::size_t>(value);
+            }
+            else if (option == "--pubsub-output-limit")
+            {
+                // Given as <hard>:<soft>:<seconds>
+                auto first = value.find(':');
+                auto second = first == std::string::npos ? first
+                    : value.find(':', first + 1);
+                if (second == std::string::npos)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+                config.pubsub_hard_limit = boost::lexical_cast<std::size_t>(
+                    value.substr(0, first));
+                config.pubsub_soft_limit = boost::lexical_cast<std::size_t>(
+                    value.substr(first + 1, second - first - 1));
+                config.pubsub_soft_seconds = boost::lexical_cast<unsigned int>(
+                    value.substr(second + 1));
+            }
+            else
+            {
+                throw config_error("Unknown option " + option);
+            }
+        }
+        catch (const boost::bad_lexical_cast&)
+        {
+            throw config_error("Invalid value for " + option + ": " + value);
+        }
+    }
+
+    if (!config.log_path.empty() && !config.mapped_path.empty())
+    {
+        throw config_error(
+            "--appendonly and --mapped-file can't be used together");
+    }
+    if (!config.mapped_path.empty() && !config.spill_path.empty())
+    {
+        throw config_error(
+            "--mapped-file and --spill-file can't be used together");
+    }
+
+    return config;
+}
+
+std::string server_config::usage()
+{
+    return
+        "Usage: exoredis <db_path> [--option value]...\n"
+        "Options:\n"
+        "  --load-threads <n>               Threads used to load the database\n"
+        "  --async-load <yes|no>            Load the database in the background\n"
+        "  --save <seconds>:<changes>       Save in the background after\n"
+        "                                   <seconds> if there were <changes>\n"
+        "  --appendonly <path>              Log commands to an append-only log\n"
+        "  --aof-rewrite-percentage <n>     Rewrite the log when it grows by n%\n"
+        "  --aof-rewrite-min-size <bytes>   Minimum log size for a rewrite\n"
+        "  --mapped-file <path>             Keep strings in a memory-mapped file\n"
+        "  --spill-file <path>              Move cold strings to a file\n"
+        "  --spill-after <seconds>          Idle time before a string is moved\n"
+        "  --spill-min-size <bytes>         Smallest string that is moved\n"
+        "  --maxmemory <bytes>              Memory limit, 0 for no limit\n"
+        "  --maxmemory-policy <policy>      noeviction, allkeys-lru,\n"
+        "                                   volatile-lru, allkeys-lfu or\n"
+        "                                   volatile-ttl\n"
+        "  --maxmemory-samples <n>          Keys sampled for each eviction\n"
+        "  --activedefrag <yes|no>          Defragment memory in the background\n"
+        "  --active-defrag-threshold <n>    Start when n% of memory is wasted\n"
+        "  --active-defrag-ignore-bytes <bytes>\n"
+        "                                   Least waste worth defragmenting\n"
+        "  --pubsub-output-limit <hard>:<soft>:<seconds>\n"
+        "                                   Disconnect subscribers with more\n"
+        "                                   than <hard> bytes waiting, or\n"
+        "                                   <soft> bytes for <seconds>\n";
+}
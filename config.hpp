@@ -0,0 +1,95 @@
+#ifndef __EXOREDIS_CONFIG_HPP__
+#define __EXOREDIS_CONFIG_HPP__
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstddef>
+
+
+/*
+ * Server settings. They are read from the command line:
+ *
+ *     exoredis <db_path> [--option value]...
+ *
+ * Options that aren't given keep their default values.
+ */
+struct server_config
+{
+    class config_error: public std::runtime_error
+    {
+    public:
+        config_error(std::string msg) : runtime_error(msg) {}
+    };
+
+    // Save in the background once at least `changes` changes have been made
+    // and `seconds` seconds have passed since the last save.
+    struct save_policy
+    {
+        unsigned int seconds;
+        std::size_t changes;
+    };
+
+    server_config();
+
+    // Parses the arguments that follow the program name.
+    // Throws config_error if they are invalid.
+    static server_config from_args(const std::vector<std::string>& args);
+
+    // Usage message listing all the options.
+    static std::string usage();
+
+    std::string db_path;
+    // Threads used to load the snapshot. Zero means one per core.
+    std::size_t load_threads;
+    // Load the snapshot in the background while serving connections.
+    bool async_load;
+    // Automatic save policies. None by default.
+    std::vector<save_policy> save_policies;
+
+    // Path of the append-only log. Empty if the log is disabled.
+    std::string log_path;
+    // The log is rewritten once it has grown by this many percent since the
+    // last rewrite. Zero disables automatic rewrites.
+    unsigned int log_rewrite_percentage;
+    // Logs smaller than this are never rewritten automatically.
+    std::size_t log_rewrite_min_size;
+
+    // Path of the memory-mapped file strings are kept in. Empty if strings
+    // are kept in the snapshot. Can't be used with the append-only log.
+    std::string mapped_path;
+
+    // Path of the file cold strings are spilled to. Empty if nothing is
+    // spilled. Can't be used with the mapped file.
+    std::string spill_path;
+    // Strings are spilled once they haven't been accessed for this long.
+    unsigned int spill_idle_seconds;
+    // Strings smaller than this are never spilled.
+    std::size_t spill_min_size;
+
+    // Memory limit in bytes. Zero means no limit.
+    std::size_t max_memory;
+    // Name of the eviction policy, as accepted by
+    // exostore::eviction_policy_from_name().
+    std::string max_memory_policy;
+    // Number of keys sampled for each eviction.
+    std::size_t max_memory_samples;
+
+    // Whether slab-allocated data is defragmented in the background.
+    bool active_defrag;
+    // Defragmentation starts once the slabs waste more than this percentage
+    // of the memory in use...
+    unsigned int active_defrag_threshold;
+    // ...and more than this many bytes.
+    std::size_t active_defrag_ignore_bytes;
+
+    // Subscribers with more than this many bytes of messages waiting to be
+    // sent are disconnected...
+    std::size_t pubsub_hard_limit;
+    // ...as are those with more than this many bytes waiting for
+    // pubsub_soft_seconds. Zero disables a limit.
+    std::size_t pubsub_soft_limit;
+    unsigned int pubsub_soft_seconds;
+};
+
+#endif
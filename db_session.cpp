@@ -1,10 +1,15 @@
 #include "db_session.hpp"
 #include "util.hpp"
+#include "bitops.hpp"
 #include <vector>
 #include <functional>
 #include <iostream>
 #include <sstream>
 #include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <boost/tokenizer.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/clamp.hpp>
@@ -12,10 +17,43 @@
 
 namespace asio = boost::asio;
 
-db_session::db_session(tcp::socket socket, exostore& db,
+namespace
+{
+    // Commands that can modify the database. These are written to the
+    // append-only log.
+    const std::set<std::string> write_commands = {
+        "SET", "SETBIT", "ZADD", "DEL", "UNLINK", "FLUSHALL", "INCR", "DECR",
+        "INCRBY", "DECRBY", "INCRBYFLOAT", "APPEND", "SETRANGE", "BITOP",
+        "BITFIELD", "PFADD", "PFMERGE", "HSET", "HMSET", "HINCRBY",
+        "ZUNIONSTORE", "ZINTERSTORE", "ZDIFFSTORE", "ZREMRANGEBYRANK",
+        "ZREMRANGEBYSCORE"
+    };
+
+    // Commands that can add data. These are refused when memory use is over
+    // the limit and nothing can be evicted.
+    const std::set<std::string> growing_commands = {
+        "SET", "SETBIT", "ZADD", "INCR", "DECR", "INCRBY", "DECRBY",
+        "INCRBYFLOAT", "APPEND", "SETRANGE", "BITOP", "BITFIELD", "PFADD",
+        "PFMERGE", "HSET", "HMSET", "HINCRBY", "ZUNIONSTORE", "ZINTERSTORE",
+        "ZDIFFSTORE"
+    };
+
+    // Commands a session subscribed to channels can run.
+    const std::set<std::string> subscription_commands = {
+        "SUBSCRIBE", "UNSUBSCRIBE", "PSUBSCRIBE", "PUNSUBSCRIBE"
+    };
+
+    // Strings can't be made longer than this by APPEND and SETRANGE.
+    const std::size_t max_string_size = 512 * 1024 * 1024;
+}
+
+db_session::db_session(tcp::socket socket, exostore& db, pubsub& pubsub,
     std::set<db_session::pointer>& session_set)
-    : socket_(std::move(socket)), db_(db), session_set_(session_set),
-      out_stream_(&(this->write_buffer_))
+    : socket_(std::move(socket)), db_(db), pubsub_(pubsub),
+      session_set_(session_set), out_stream_(&(this->write_buffer_)),
+      command_failed_(false), replaying_(false), message_bytes_(0),
+      over_soft_limit_(false), writing_(false), response_ready_(false),
+      closing_(false)
 {
 }
 
@@ -28,10 +66,60 @@ void db_session::start()
 
 void db_session::stop()
 {
+    unsubscribe_all();
     socket_.close();
     session_set_.erase(shared_from_this());
 }
 
+// Queues a published message. Runs while the publisher's command does, so
+// the session is only disconnected once that is over.
+void db_session::deliver(const pubsub::message& m)
+{
+    if (closing_)
+    {
+        return;
+    }
+    messages_.push_back(m);
+    message_bytes_ += m->size();
+    if (over_output_limit())
+    {
+        closing_ = true;
+        asio::post(socket_.get_executor(),
+            boost::bind(&db_session::stop, shared_from_this()));
+        return;
+    }
+    flush_output();
+}
+
+bool db_session::over_output_limit()
+{
+    const auto& limits = pubsub_.limits();
+    if (limits.hard_limit != 0 && message_bytes_ > limits.hard_limit)
+    {
+        return true;
+    }
+    if (limits.soft_limit == 0 || message_bytes_ <= limits.soft_limit)
+    {
+        over_soft_limit_ = false;
+        return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (!over_soft_limit_)
+    {
+        over_soft_limit_ = true;
+        over_soft_limit_since_ = now;
+    }
+    return now - over_soft_limit_since_
+        >= std::chrono::seconds(limits.soft_seconds);
+}
+
+void db_session::replay(const db_session::token_list& command_tokens)
+{
+    replaying_ = true;
+    call(command_tokens);
+}
+
 // Parses the command and calls it.
 void db_session::handle_command_line(const boost::system::error_code& ec,
     std::size_t bytes_transferred)
@@ -63,6 +151,16 @@ void db_session::handle_command_line(const boost::system::error_code& ec,
             return;
         }
 
+        // Values that were spilled to disk are read back on a worker thread
+        // before the command runs, so that the event loop doesn't wait on the
+        // disk.
+        auto spilled = db_.spilled_keys(command_tokens);
+        if (!spilled.empty())
+        {
+            read_back_and_call(command_tokens, spilled);
+            return;
+        }
+
         call(command_tokens);
     }
     else
@@ -71,20 +169,44 @@ void db_session::handle_command_line(const boost::system::error_code& ec,
     }
 }
 
+void db_session::read_back_and_call(const db_session::token_list& command_tokens,
+    const db_session::token_list& keys)
+{
+    auto self(shared_from_this());
+    auto executor = socket_.get_executor();
+    db_.read_back(keys, [this, self, executor, command_tokens]()
+    {
+        // This runs on the worker thread, the command runs on ours.
+        asio::post(executor, [this, self, command_tokens]()
+        {
+            db_.finish_read_back();
+            call(command_tokens);
+        });
+    });
+}
+
 // Writes the response...
 void db_session::do_write()
 {
-    asio::async_write(socket_, write_buffer_,
-        boost::bind(&db_session::handle_write, shared_from_this(),
-            asio::placeholders::error));
+    if (replaying_)
+    {
+        write_buffer_.consume(write_buffer_.size());
+        return;
+    }
+
+    response_ready_ = true;
+    flush_output();
 }
 
 // ...then starts reading again.
 void db_session::handle_write(boost::system::error_code ec)
 {
+    writing_ = false;
+    response_ready_ = false;
     if (!ec)
     {
         start();
+        flush_output();
     }
     else
     {
@@ -92,12 +214,85 @@ void db_session::handle_write(boost::system::error_code ec)
     }
 }
 
+void db_session::flush_output()
+{
+    // Messages are written a batch at a time, in a single gathering write.
+    const std::size_t max_batch = 64;
+
+    if (writing_ || !socket_.is_open())
+    {
+        return;
+    }
+    if (response_ready_)
+    {
+        writing_ = true;
+        asio::async_write(socket_, write_buffer_,
+            boost::bind(&db_session::handle_write, shared_from_this(),
+                asio::placeholders::error));
+    }
+    else if (!messages_.empty())
+    {
+        writing_ = true;
+        std::vector<asio::const_buffer> buffers;
+        for (std::size_t i = 0; i < messages_.size() && i < max_batch; i++)
+        {
+            buffers.push_back(asio::buffer(*messages_[i]));
+        }
+        asio::async_write(socket_, buffers,
+            boost::bind(&db_session::handle_message_write, shared_from_this(),
+                asio::placeholders::error, buffers.size()));
+    }
+}
+
+void db_session::handle_message_write(boost::system::error_code ec,
+    std::size_t count)
+{
+    writing_ = false;
+    if (ec)
+    {
+        stop();
+        return;
+    }
+    for (std::size_t i = 0; i < count; i++)
+    {
+        message_bytes_ -= messages_.front()->size();
+        messages_.pop_front();
+    }
+    flush_output();
+}
+
 // Calls the appropriate command, or writes out an error response if the
 // format is invalid.
 void db_session::call(const db_session::token_list& command_tokens)
 {
     // Stringify the first token, which is the command name.
     std::string command_name = toupper_string(vec_to_string(command_tokens[0]));
+    command_failed_ = false;
+
+    // Only INFO works while the database is loading.
+    if (db_.loading() && command_name != "INFO")
+    {
+        error_loading();
+        return;
+    }
+
+    // A subscribed session can only change its subscriptions.
+    if ((!channels_.empty() || !patterns_.empty())
+        && subscription_commands.count(command_name) == 0)
+    {
+        error_custom("only (P)SUBSCRIBE / (P)UNSUBSCRIBE are allowed in "
+            "this context");
+        return;
+    }
+
+    // Make room before adding anything. The log is replayed whatever the
+    // limit.
+    if (!replaying_ && growing_commands.count(command_name) != 0
+        && !db_.make_room())
+    {
+        error_out_of_memory();
+        return;
+    }
 
     // Dispatch on command name.
     if (command_name == "GET")
@@ -108,14 +303,111 @@ void db_session::call(const db_session::token_list& command_tokens)
     {
         set_command(command_tokens);
     }
+    else if (command_name == "DEL" || command_name == "UNLINK")
+    {
+        del_command(command_tokens);
+    }
+    else if (command_name == "FLUSHALL")
+    {
+        flushall_command(command_tokens);
+    }
+    else if (command_name == "INCR" || command_name == "DECR"
+        || command_name == "INCRBY" || command_name == "DECRBY")
+    {
+        incrby_command(command_tokens);
+    }
+    else if (command_name == "INCRBYFLOAT")
+    {
+        incrbyfloat_command(command_tokens);
+    }
+    else if (command_name == "APPEND")
+    {
+        append_command(command_tokens);
+    }
+    else if (command_name == "GETRANGE")
+    {
+        getrange_command(command_tokens);
+    }
+    else if (command_name == "SETRANGE")
+    {
+        setrange_command(command_tokens);
+    }
+    else if (command_name == "STRLEN")
+    {
+        strlen_command(command_tokens);
+    }
     else if (command_name == "GETBIT")
     {
         getbit_command(command_tokens);
     }
+    else if (command_name == "BITCOUNT")
+    {
+        bitcount_command(command_tokens);
+    }
+    else if (command_name == "BITPOS")
+    {
+        bitpos_command(command_tokens);
+    }
+    else if (command_name == "BITOP")
+    {
+        bitop_command(command_tokens);
+    }
     else if (command_name == "SETBIT")
     {
         setbit_command(command_tokens);
     }
+    else if (command_name == "BITFIELD")
+    {
+        bitfield_command(command_tokens);
+    }
+    else if (command_name == "PFADD")
+    {
+        pfadd_command(command_tokens);
+    }
+    else if (command_name == "PFCOUNT")
+    {
+        pfcount_command(command_tokens);
+    }
+    else if (command_name == "PFMERGE")
+    {
+        pfmerge_command(command_tokens);
+    }
+    else if (command_name == "HSET" || command_name == "HMSET")
+    {
+        hset_command(command_tokens);
+    }
+    else if (command_name == "HGET")
+    {
+        hget_command(command_tokens);
+    }
+    else if (command_name == "HMGET")
+    {
+        hmget_command(command_tokens);
+    }
+    else if (command_name == "HGETALL")
+    {
+        hgetall_command(command_tokens);
+    }
+    else if (command_name == "HINCRBY")
+    {
+        hincrby_command(command_tokens);
+    }
+    else if (command_name == "SUBSCRIBE" || command_name == "PSUBSCRIBE")
+    {
+        subscribe_command(command_tokens);
+    }
+    else if (command_name == "UNSUBSCRIBE" || command_name == "PUNSUBSCRIBE")
+    {
+        unsubscribe_command(command_tokens);
+    }
+    else if (command_name == "PUBLISH")
+    {
+        publish_command(command_tokens);
+    }
+    else if (command_name == "PUBSUB")
+    {
+        pubsub_command(command_tokens);
+    }
     else if (command_name == "ZADD")
     {
         zadd_command(command_tokens);
@@ -128,18 +420,115 @@ void db_session::call(const db_session::token_list& command_tokens)
     {
         zcount_command(command_tokens);
     }
+    else if (command_name == "ZUNIONSTORE" || command_name == "ZINTERSTORE"
+        || command_name == "ZDIFFSTORE")
+    {
+        zstore_command(command_tokens);
+    }
+    else if (command_name == "ZREMRANGEBYRANK"
+        || command_name == "ZREMRANGEBYSCORE")
+    {
+        zremrange_command(command_tokens);
+    }
+    else if (command_name == "ZHISTOGRAM")
+    {
+        zhistogram_command(command_tokens);
+    }
     else if (command_name == "ZRANGE")
     {
         zrange_command(command_tokens);
     }
+    else if (command_name == "SCAN")
+    {
+        scan_command(command_tokens);
+    }
+    else if (command_name == "ZSCAN")
+    {
+        zscan_command(command_tokens);
+    }
     else if (command_name == "SAVE")
     {
         save_command(command_tokens);
     }
+    else if (command_name == "BGSAVE")
+    {
+        bgsave_command(command_tokens);
+    }
+    else if (command_name == "BGREWRITEAOF")
+    {
+        bgrewriteaof_command(command_tokens);
+    }
+    else if (command_name == "INFO")
+    {
+        info_command(command_tokens);
+    }
+    else if (command_name == "MEMORY")
+    {
+        memory_command(command_tokens);
+    }
     else
     {
         error_unknown_command(command_name);
     }
+
+    if (!command_failed_ && db_.log_enabled()
+        && write_commands.count(command_name) != 0)
+    {
+        db_.log_command(loggable_command(command_tokens));
+    }
+}
+
+// Relative expiry times would be wrong by the time the log is replayed, so a
+// SET with EX or PX is logged with the absolute expiry time of the value.
+db_session::token_list db_session::loggable_command(
+    const db_session::token_list& command_tokens)
+{
+    if (command_tokens.size() <= 3
+        || toupper_string(vec_to_string(command_tokens[0])) != "SET")
+    {
+        return command_tokens;
+    }
+
+    db_session::token_list result(command_tokens.begin(),
+        command_tokens.begin() + 3);
+    bool relative_expiry = false;
+    for (auto it = command_tokens.begin() + 3; it != command_tokens.end(); it++)
+    {
+        auto option = toupper_string(vec_to_string(*it));
+        if (option == "EX" || option == "PX")
+        {
+            relative_expiry = true;
+            it++;
+        }
+        else
+        {
+            result.push_back(*it);
+        }
+    }
+
+    if (!relative_expiry)
+    {
+        return command_tokens;
+    }
+
+    try
+    {
+        auto& value = db_.get<exostore::bstring>(command_tokens[1]);
+        if (!value.has_expiry())
+        {
+            return command_tokens;
+        }
+        auto expiry_ms = chrono::duration_cast<chrono::milliseconds>(
+            value.expiry_time().time_since_epoch()).count();
+        result.push_back(string_to_vec("PXAT"));
+        result.push_back(string_to_vec(
+            boost::lexical_cast<std::string>(expiry_ms)));
+        return result;
+    }
+    catch (const std::runtime_error&)
+    {
+        return command_tokens;
+    }
 }
 
 /*************
@@ -187,10 +576,12 @@ void db_session::set_command(const db_session::token_list& args)
 
     bool ex_set = false;
     bool px_set = false;
+    bool pxat_set = false;
     bool nx_set = false;
     bool xx_set = false;
     long long milliseconds = 0;
     long long seconds = 0;
+    long long unix_milliseconds = 0;
 
     // Parse the command and set flags.
     if (args.size() > 3)
@@ -222,6 +613,17 @@ void db_session::set_command(const db_session::token_list& args)
                     }
                     px_set = true;
                 }
+                else if (option == "PXAT")
+                {
+                    unix_milliseconds = boost::lexical_cast<long long>(
+                        vec_to_string(*(++it)));
+                    if (unix_milliseconds <= 0)
+                    {
+                        error_syntax_error();
+                        return;
+                    }
+                    pxat_set = true;
+                }
                 else if (option == "XX")
                 {
                     xx_set = true;
@@ -244,7 +646,7 @@ void db_session::set_command(const db_session::token_list& args)
         }
     }
 
-    if ((px_set && ex_set) || (nx_set && xx_set))
+    if ((px_set + ex_set + pxat_set > 1) || (nx_set && xx_set))
     {
         error_syntax_error();
         return;
@@ -265,6 +667,11 @@ void db_session::set_command(const db_session::token_list& args)
     {
         db_.set(key, exostore::bstring(args[2], milliseconds));
     }
+    else if (pxat_set)
+    {
+        db_.set(key, exostore::bstring(args[2], chrono::system_clock::time_point(
+            chrono::milliseconds(unix_milliseconds))));
+    }
     else
     {
         db_.set(key, exostore::bstring(args[2]));
@@ -272,315 +679,2270 @@ void db_session::set_command(const db_session::token_list& args)
     write_simple_string("OK");
 }
 
-void db_session::getbit_command(const db_session::token_list& args)
+// Also serves UNLINK. Either way, large values are freed in the background.
+void db_session::del_command(const db_session::token_list& args)
 {
-    if (args.size() != 3)
+    if (args.size() < 2)
     {
-        error_incorrect_number_of_args("GETBIT");
+        error_incorrect_number_of_args(
+            toupper_string(vec_to_string(args[0])));
         return;
     }
 
-    auto& key = args[1];
-    if (!db_.key_exists(key))
+    long long removed = 0;
+    for (auto it = args.begin() + 1; it != args.end(); it++)
     {
-        write_integer(0);
-        return;
+        if (db_.remove(*it))
+        {
+            removed++;
+        }
     }
+    write_integer(removed);
+}
 
-    try
+// FLUSHALL [ASYNC|SYNC]. With ASYNC, the keyspace is always freed in the
+// background; otherwise only a large keyspace is.
+void db_session::flushall_command(const db_session::token_list& args)
+{
+    if (args.size() > 2)
     {
-        auto& value = db_.get<exostore::bstring>(key);
-        auto int_offset = boost::lexical_cast<long long>(
-            vec_to_string(args[2])
-        );
+        error_incorrect_number_of_args("FLUSHALL");
+        return;
+    }
 
-        if (int_offset < 0)
+    bool lazily = false;
+    if (args.size() == 2)
+    {
+        auto mode = toupper_string(vec_to_string(args[1]));
+        if (mode == "ASYNC")
+        {
+            lazily = true;
+        }
+        else if (mode != "SYNC")
         {
             error_syntax_error();
             return;
         }
+    }
+
+    db_.clear(lazily);
+    write_simple_string("OK");
+}
 
-        auto byte_offset = int_offset / 8;
-        int bit_offset_from_right = 7 - (int_offset % 8);
+// Also serves INCR, DECR and DECRBY. A missing key counts as zero, and an
+// existing key keeps its expiry time.
+void db_session::incrby_command(const db_session::token_list& args)
+{
+    auto command_name = toupper_string(vec_to_string(args[0]));
+    bool by = command_name == "INCRBY" || command_name == "DECRBY";
+    if (args.size() != (by ? 3 : 2))
+    {
+        error_incorrect_number_of_args(command_name);
+        return;
+    }
 
-        if ((byte_offset) >= value.bdata().size())
+    long long increment = 1;
+    if (by && !parse_integer(args[2], increment))
+    {
+        error_not_integer();
+        return;
+    }
+    if (command_name == "DECR" || command_name == "DECRBY")
+    {
+        if (increment == std::numeric_limits<long long>::min())
         {
-            write_integer(0);
+            error_custom("decrement would overflow");
             return;
         }
+        increment = -increment;
+    }
 
-        unsigned char byte_in_question = value.bdata()[byte_offset];
-        // When bit shifting, we prefer left shift since the fill value for
-        // right shift is not defined for signed data types.
-        unsigned char bit_value = (byte_in_question << (7 - bit_offset_from_right))
-            & static_cast<unsigned char>(0x80u);
-        if (bit_value != 0)
+    auto& key = args[1];
+    try
+    {
+        exostore::bstring* counter = nullptr;
+        long long value = 0;
+        if (db_.key_exists(key))
         {
-            write_integer(1);
+            counter = &db_.get<exostore::bstring>(key);
+            if (counter->is_integer())
+            {
+                value = counter->integer();
+            }
+            // A sparse bitmap is never an integer, and isn't worth
+            // converting to find out.
+            else if (counter->is_sparse()
+                || !parse_integer(counter->bdata(), value))
+            {
+                error_not_integer();
+                return;
+            }
+        }
+
+        if ((increment > 0
+                && value > std::numeric_limits<long long>::max() - increment)
+            || (increment < 0
+                && value < std::numeric_limits<long long>::min() - increment))
+        {
+            error_custom("increment or decrement would overflow");
             return;
         }
+        value += increment;
+
+        if (counter != nullptr)
+        {
+            counter->set_integer(value);
+            db_.touch(key);
+        }
         else
         {
-            write_integer(0);
-            return;
+            exostore::bstring new_counter;
+            new_counter.set_integer(value);
+            db_.set(key, new_counter);
         }
+        write_integer(value);
     }
     catch (const exostore::key_error&)
     {
-        write_integer(0);
-        return;
+        error_key_does_not_exist();
     }
     catch (const exostore::type_error&)
     {
         error_incorrect_type();
+    }
+}
+
+// The result is stored as a string, or as an integer if it is a whole number.
+void db_session::incrbyfloat_command(const db_session::token_list& args)
+{
+    if (args.size() != 3)
+    {
+        error_incorrect_number_of_args("INCRBYFLOAT");
         return;
     }
+
+    long double increment;
+    try
+    {
+        increment = boost::lexical_cast<long double>(vec_to_string(args[2]));
+    }
     catch (const boost::bad_lexical_cast&)
     {
-        error_syntax_error();
+        error_custom("value is not a valid float");
         return;
     }
-}
-
-void db_session::setbit_command(const db_session::token_list& args)
-{
-    if (args.size() != 4)
+    if (std::isnan(increment) || std::isinf(increment))
     {
-        error_incorrect_number_of_args("SETBIT");
+        error_custom("value is not a valid float");
         return;
     }
 
-
+    auto& key = args[1];
     try
     {
-        auto int_offset = boost::lexical_cast<long long>(
-            vec_to_string(args[2])
-        );
-
-        if (int_offset < 0)
+        exostore::bstring* number = nullptr;
+        long double value = 0;
+        if (db_.key_exists(key))
         {
-            std::cout << "Offset error" << std::endl;
-            error_syntax_error();
+            number = &db_.get<exostore::bstring>(key);
+            if (number->is_integer())
+            {
+                value = number->integer();
+            }
+            else if (number->is_sparse())
+            {
+                error_custom("value is not a valid float");
+                return;
+            }
+            else
+            {
+                try
+                {
+                    value = boost::lexical_cast<long double>(
+                        vec_to_string(number->bdata()));
+                }
+                catch (const boost::bad_lexical_cast&)
+                {
+                    error_custom("value is not a valid float");
+                    return;
+                }
+            }
+        }
+
+        value += increment;
+        if (std::isnan(value) || std::isinf(value))
+        {
+            error_custom("increment would produce NaN or Infinity");
+            return;
+        }
+
+        // Printed with enough digits to survive a round trip, without an
+        // exponent or trailing zeros.
+        char buffer[5120];
+        std::snprintf(buffer, sizeof(buffer), "%.17Lf", value);
+        std::string result(buffer);
+        if (result.find('.') != std::string::npos)
+        {
+            result.erase(result.find_last_not_of('0') + 1);
+            if (result.back() == '.')
+            {
+                result.pop_back();
+            }
+        }
+
+        if (number != nullptr)
+        {
+            number->set_bytes(string_to_vec(result));
+            db_.touch(key);
+        }
+        else
+        {
+            db_.set(key, exostore::bstring(string_to_vec(result)));
+        }
+        write_bstring(result);
+    }
+    catch (const exostore::key_error&)
+    {
+        error_key_does_not_exist();
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+// Appends to the stored buffer, which grows geometrically, so a run of
+// appends takes time proportional to what is appended.
+void db_session::append_command(const db_session::token_list& args)
+{
+    if (args.size() != 3)
+    {
+        error_incorrect_number_of_args("APPEND");
+        return;
+    }
+
+    auto& key = args[1];
+    try
+    {
+        if (!db_.key_exists(key))
+        {
+            db_.set(key, exostore::bstring(args[2]));
+            write_integer(args[2].size());
+            return;
+        }
+
+        auto& value = db_.get<exostore::bstring>(key);
+        if (value.size() + args[2].size() > max_string_size)
+        {
+            error_custom("string exceeds maximum allowed size");
+            return;
+        }
+        auto& bdata = value.bdata();
+        bdata.insert(bdata.end(), args[2].begin(), args[2].end());
+        db_.touch(key, bdata.size() - args[2].size(), args[2].size());
+        write_integer(bdata.size());
+    }
+    catch (const exostore::key_error&)
+    {
+        error_key_does_not_exist();
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+// Negative offsets count back from the end. The range is clamped to the
+// string, and written straight from the stored buffer.
+void db_session::getrange_command(const db_session::token_list& args)
+{
+    if (args.size() != 4)
+    {
+        error_incorrect_number_of_args("GETRANGE");
+        return;
+    }
+
+    long long start, end;
+    if (!parse_integer(args[2], start) || !parse_integer(args[3], end))
+    {
+        error_not_integer();
+        return;
+    }
+
+    auto& key = args[1];
+    if (!db_.key_exists(key))
+    {
+        write_bstring(std::string());
+        return;
+    }
+
+    try
+    {
+        const auto& value = db_.get<exostore::bstring>(key);
+        long long size = value.size();
+        if (start < 0)
+        {
+            start = std::max(size + start, 0LL);
+        }
+        if (end < 0)
+        {
+            end = size + end;
+        }
+        end = std::min(end, size - 1);
+        if (start > end || size == 0)
+        {
+            write_bstring(std::string());
+            return;
+        }
+        if (value.is_sparse())
+        {
+            write_bstring(value.sparse().to_bytes(start, end + 1));
+            return;
+        }
+
+        // Reading an integer shouldn't turn it into bytes.
+        auto digits = value.has_bytes() ? std::vector<unsigned char>()
+            : value.bytes();
+        const auto& bdata = value.has_bytes() ? value.bdata() : digits;
+        write_bstring(bdata.data() + start, end - start + 1);
+    }
+    catch (const exostore::key_error&)
+    {
+        write_bstring(std::string());
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+// Overwrites part of a string, padding it with zero bytes if the offset is
+// past the end.
+void db_session::setrange_command(const db_session::token_list& args)
+{
+    if (args.size() != 4)
+    {
+        error_incorrect_number_of_args("SETRANGE");
+        return;
+    }
+
+    long long offset;
+    if (!parse_integer(args[2], offset))
+    {
+        error_not_integer();
+        return;
+    }
+    if (offset < 0)
+    {
+        error_custom("offset is out of range");
+        return;
+    }
+    auto& patch = args[3];
+    if (static_cast<std::size_t>(offset) + patch.size() > max_string_size)
+    {
+        error_custom("string exceeds maximum allowed size");
+        return;
+    }
+
+    auto& key = args[1];
+    try
+    {
+        if (!db_.key_exists(key))
+        {
+            // Nothing is created for an empty patch.
+            if (patch.empty())
+            {
+                write_integer(0);
+                return;
+            }
+            std::vector<unsigned char> bdata(offset, 0);
+            bdata.insert(bdata.end(), patch.begin(), patch.end());
+            db_.set(key, exostore::bstring(bdata));
+            write_integer(bdata.size());
+            return;
+        }
+
+        auto& value = db_.get<exostore::bstring>(key);
+        if (patch.empty())
+        {
+            write_integer(value.size());
+            return;
+        }
+        auto& bdata = value.bdata();
+        // The padding before the patch changes too.
+        const std::size_t changed = std::min<std::size_t>(offset, bdata.size());
+        if (offset + patch.size() > bdata.size())
+        {
+            bdata.resize(offset + patch.size(), 0);
+        }
+        std::copy(patch.begin(), patch.end(), bdata.begin() + offset);
+        db_.touch(key, changed, offset + patch.size() - changed);
+        write_integer(bdata.size());
+    }
+    catch (const exostore::key_error&)
+    {
+        error_key_does_not_exist();
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+void db_session::strlen_command(const db_session::token_list& args)
+{
+    if (args.size() != 2)
+    {
+        error_incorrect_number_of_args("STRLEN");
+        return;
+    }
+
+    auto& key = args[1];
+    if (!db_.key_exists(key))
+    {
+        write_integer(0);
+        return;
+    }
+
+    try
+    {
+        write_integer(db_.get<exostore::bstring>(key).size());
+    }
+    catch (const exostore::key_error&)
+    {
+        write_integer(0);
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+void db_session::getbit_command(const db_session::token_list& args)
+{
+    if (args.size() != 3)
+    {
+        error_incorrect_number_of_args("GETBIT");
+        return;
+    }
+
+    auto& key = args[1];
+    if (!db_.key_exists(key))
+    {
+        write_integer(0);
+        return;
+    }
+
+    try
+    {
+        const auto& value = db_.get<exostore::bstring>(key);
+        auto int_offset = boost::lexical_cast<long long>(
+            vec_to_string(args[2])
+        );
+
+        if (int_offset < 0)
+        {
+            error_syntax_error();
+            return;
+        }
+
+        // Reads the sparse form and integers without converting them.
+        write_integer(value.get_bit(int_offset) ? 1 : 0);
+    }
+    catch (const exostore::key_error&)
+    {
+        write_integer(0);
+        return;
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+        return;
+    }
+    catch (const boost::bad_lexical_cast&)
+    {
+        error_syntax_error();
+        return;
+    }
+}
+
+bool db_session::parse_bit_range(const db_session::token_list& args,
+    std::size_t start_index, std::size_t size, std::uint64_t& first_bit,
+    std::uint64_t& last_bit, bool& empty)
+{
+    long long start = 0;
+    long long end = -1;
+    bool bits = false;
+    if (args.size() > start_index
+        && !parse_integer(args[start_index], start))
+    {
+        error_not_integer();
+        return false;
+    }
+    if (args.size() > start_index + 1
+        && !parse_integer(args[start_index + 1], end))
+    {
+        error_not_integer();
+        return false;
+    }
+    if (args.size() > start_index + 2)
+    {
+        auto unit = toupper_string(vec_to_string(args[start_index + 2]));
+        if (unit != "BYTE" && unit != "BIT")
+        {
+            error_syntax_error();
+            return false;
+        }
+        bits = unit == "BIT";
+    }
+
+    long long total = bits ? size * 8 : size;
+    if (start < 0)
+    {
+        start = std::max(total + start, 0LL);
+    }
+    if (end < 0)
+    {
+        end = std::max(total + end, 0LL);
+    }
+    end = std::min(end, total - 1);
+    empty = total == 0 || start > end;
+    if (!empty)
+    {
+        first_bit = bits ? start : start * 8;
+        last_bit = bits ? end : end * 8 + 7;
+    }
+    return true;
+}
+
+// BITCOUNT key [start end [BYTE|BIT]]
+void db_session::bitcount_command(const db_session::token_list& args)
+{
+    if (args.size() != 2 && args.size() != 4 && args.size() != 5)
+    {
+        error_incorrect_number_of_args("BITCOUNT");
+        return;
+    }
+
+    auto& key = args[1];
+    if (!db_.key_exists(key))
+    {
+        write_integer(0);
+        return;
+    }
+
+    try
+    {
+        const auto& value = db_.get<exostore::bstring>(key);
+        std::uint64_t first_bit, last_bit;
+        bool empty;
+        if (!parse_bit_range(args, 2, value.size(), first_bit, last_bit,
+            empty))
+        {
+            return;
+        }
+        if (empty)
+        {
+            write_integer(0);
+            return;
+        }
+        if (value.is_sparse())
+        {
+            write_integer(value.sparse().count(first_bit, last_bit));
+            return;
+        }
+
+        auto digits = value.has_bytes() ? std::vector<unsigned char>()
+            : value.bytes();
+        const auto& bdata = value.has_bytes() ? value.bdata() : digits;
+        write_integer(count_bits(bdata.data(), first_bit, last_bit));
+    }
+    catch (const exostore::key_error&)
+    {
+        write_integer(0);
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+// BITPOS key bit [start [end [BYTE|BIT]]]
+// Without an end, a string is taken to be followed by clear bits, so looking
+// for a clear bit in a string of set bits finds the bit after it.
+void db_session::bitpos_command(const db_session::token_list& args)
+{
+    if (args.size() < 3 || args.size() > 6)
+    {
+        error_incorrect_number_of_args("BITPOS");
+        return;
+    }
+
+    long long bit;
+    if (!parse_integer(args[2], bit))
+    {
+        error_not_integer();
+        return;
+    }
+    if (bit != 0 && bit != 1)
+    {
+        error_custom("The bit argument must be 1 or 0.");
+        return;
+    }
+
+    auto& key = args[1];
+    if (!db_.key_exists(key))
+    {
+        write_integer(bit ? -1 : 0);
+        return;
+    }
+
+    try
+    {
+        const auto& value = db_.get<exostore::bstring>(key);
+        std::uint64_t first_bit, last_bit;
+        bool empty;
+        if (!parse_bit_range(args, 3, value.size(), first_bit, last_bit,
+            empty))
+        {
+            return;
+        }
+        if (empty)
+        {
+            write_integer(-1);
+            return;
+        }
+
+        long long position;
+        if (value.is_sparse())
+        {
+            position = value.sparse().find(first_bit, last_bit, bit);
+        }
+        else
+        {
+            auto digits = value.has_bytes() ? std::vector<unsigned char>()
+                : value.bytes();
+            const auto& bdata = value.has_bytes() ? value.bdata() : digits;
+            position = find_bit(bdata.data(), first_bit, last_bit, bit);
+        }
+        bool end_given = args.size() > 4;
+        if (position == -1 && bit == 0 && !end_given)
+        {
+            position = last_bit + 1;
+        }
+        write_integer(position);
+    }
+    catch (const exostore::key_error&)
+    {
+        write_integer(bit ? -1 : 0);
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+// BITOP AND|OR|XOR|NOT destkey srckey [srckey ...]
+// The result is as long as the longest source, and is built in a single pass
+// straight into the buffer of the new value. A result of no bytes deletes the
+// destination. If any source is a sparse bitmap, AND, OR and XOR combine
+// sparse bitmaps instead, so a large sparse source is never expanded.
+void db_session::bitop_command(const db_session::token_list& args)
+{
+    if (args.size() < 4)
+    {
+        error_incorrect_number_of_args("BITOP");
+        return;
+    }
+
+    auto op_name = toupper_string(vec_to_string(args[1]));
+    bit_operation op;
+    if (op_name == "AND")
+    {
+        op = bit_operation::bitwise_and;
+    }
+    else if (op_name == "OR")
+    {
+        op = bit_operation::bitwise_or;
+    }
+    else if (op_name == "XOR")
+    {
+        op = bit_operation::bitwise_xor;
+    }
+    else if (op_name == "NOT")
+    {
+        op = bit_operation::bitwise_not;
+        if (args.size() != 4)
+        {
+            error_custom("BITOP NOT must be called with a single source key.");
+            return;
+        }
+    }
+    else
+    {
+        error_syntax_error();
+        return;
+    }
+
+    std::vector<const exostore::bstring*> values;
+    try
+    {
+        for (auto it = args.begin() + 3; it != args.end(); it++)
+        {
+            values.push_back(db_.key_exists(*it)
+                ? &db_.get<exostore::bstring>(*it) : nullptr);
+        }
+    }
+    catch (const exostore::key_error&)
+    {
+        error_key_does_not_exist();
+        return;
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+        return;
+    }
+
+    auto& dest_key = args[2];
+    bool any_sparse = std::any_of(values.begin(), values.end(),
+        [](const exostore::bstring* value)
+        {
+            return value != nullptr && value->is_sparse();
+        });
+    if (any_sparse && op != bit_operation::bitwise_not)
+    {
+        bitop_sparse(op, dest_key, values);
+        return;
+    }
+
+    // Missing keys are empty strings. Integers and sparse bitmaps are read
+    // through copies of their bytes, kept here until the result is built.
+    std::vector<bit_source> sources;
+    std::vector<std::vector<unsigned char>> copies;
+    copies.reserve(values.size());
+    std::size_t size = 0;
+    for (auto value: values)
+    {
+        if (value == nullptr)
+        {
+            sources.push_back({nullptr, 0});
+            continue;
+        }
+        if (value->has_bytes())
+        {
+            sources.push_back({value->bdata().data(), value->bdata().size()});
+        }
+        else
+        {
+            copies.push_back(value->bytes());
+            sources.push_back({copies.back().data(), copies.back().size()});
+        }
+        size = std::max(size, sources.back().size);
+    }
+
+    if (size == 0)
+    {
+        db_.remove(dest_key);
+        write_integer(0);
+        return;
+    }
+
+    // The sources stay valid until the destination is replaced, even if it
+    // is one of them.
+    std::vector<unsigned char> result(size);
+    combine_bits(op, sources, result.data(), size);
+    db_.set(dest_key, exostore::bstring(std::move(result)));
+    write_integer(size);
+}
+
+// BITOP with at least one sparse source. The other sources are converted to
+// sparse bitmaps, and the result stays sparse unless it is dense.
+void db_session::bitop_sparse(bit_operation op,
+    const std::vector<unsigned char>& dest_key,
+    const std::vector<const exostore::bstring*>& values)
+{
+    std::vector<sparse_bitmap> converted;
+    converted.reserve(values.size());
+    std::vector<const sparse_bitmap*> sources;
+    for (auto value: values)
+    {
+        if (value != nullptr && value->is_sparse())
+        {
+            sources.push_back(&value->sparse());
+        }
+        else
+        {
+            converted.push_back(value == nullptr ? sparse_bitmap()
+                : sparse_bitmap(value->bytes()));
+            sources.push_back(&converted.back());
+        }
+    }
+
+    auto result = sparse_bitmap::combine(op, sources);
+    auto size = result.size();
+    if (size == 0)
+    {
+        db_.remove(dest_key);
+        write_integer(0);
+        return;
+    }
+    exostore::bstring value;
+    value.set_sparse(std::move(result));
+    db_.set(dest_key, std::move(value));
+    write_integer(size);
+}
+
+void db_session::setbit_command(const db_session::token_list& args)
+{
+    if (args.size() != 4)
+    {
+        error_incorrect_number_of_args("SETBIT");
+        return;
+    }
+
+
+    try
+    {
+        auto int_offset = boost::lexical_cast<long long>(
+            vec_to_string(args[2])
+        );
+
+        if (int_offset < 0)
+        {
+            std::cout << "Offset error" << std::endl;
+            error_syntax_error();
+            return;
+        }
+        if (static_cast<unsigned long long>(int_offset) / 8
+            >= max_string_size)
+        {
+            error_custom("bit offset is not an integer or out of range");
+            return;
+        }
+
+        int bit_value = boost::lexical_cast<int>(
+            vec_to_string(args[3])
+        );
+
+        if ((bit_value < 0) || (bit_value > 1))
+        {
+            error_syntax_error();
+            return;
+        }
+
+        auto& key = args[1];
+        if (!db_.key_exists(key))
+        {
+            db_.set(key, exostore::bstring());
+        }
+        auto& value = db_.get<exostore::bstring>(key);
+
+        // Strings stretched to a far offset may switch to a sparse bitmap.
+        const std::size_t old_size = value.size();
+        int return_value = value.set_bit(int_offset, bit_value == 1) ? 1 : 0;
+        const std::size_t changed = std::min<std::size_t>(old_size,
+            int_offset / 8);
+        db_.touch(key, changed, int_offset / 8 + 1 - changed);
+
+        write_integer(return_value);
+    }
+    catch (const exostore::key_error&)  // This shouldn't happen, I set the key earlier
+    {
+        error_key_does_not_exist();
+        return;
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+        return;
+    }
+    catch (const boost::bad_lexical_cast&)
+    {
+        error_syntax_error();
+        return;
+    }
+}
+
+bool db_session::parse_bitfield(const db_session::token_list& args,
+    std::vector<db_session::bitfield_op>& ops)
+{
+    auto overflow = field_overflow::wrap;
+    for (std::size_t i = 2; i < args.size();)
+    {
+        auto name = toupper_string(vec_to_string(args[i]));
+        if (name == "OVERFLOW")
+        {
+            if (i + 1 >= args.size())
+            {
+                error_syntax_error();
+                return false;
+            }
+            auto behaviour = toupper_string(vec_to_string(args[i + 1]));
+            if (behaviour == "WRAP")
+            {
+                overflow = field_overflow::wrap;
+            }
+            else if (behaviour == "SAT")
+            {
+                overflow = field_overflow::sat;
+            }
+            else if (behaviour == "FAIL")
+            {
+                overflow = field_overflow::fail;
+            }
+            else
+            {
+                error_custom("Invalid OVERFLOW type specified");
+                return false;
+            }
+            i += 2;
+            continue;
+        }
+
+        bitfield_op op;
+        std::size_t arity = 4;
+        if (name == "GET")
+        {
+            op.kind = bitfield_op::get;
+            arity = 3;
+        }
+        else if (name == "SET")
+        {
+            op.kind = bitfield_op::set;
+        }
+        else if (name == "INCRBY")
+        {
+            op.kind = bitfield_op::incrby;
+        }
+        else
+        {
+            error_syntax_error();
+            return false;
+        }
+        if (i + arity > args.size())
+        {
+            error_syntax_error();
+            return false;
+        }
+
+        // The type is i or u and a width.
+        const auto& type = args[i + 1];
+        long long bits = 0;
+        op.is_signed = !type.empty() && std::tolower(type[0]) == 'i';
+        if (type.empty() || (!op.is_signed && std::tolower(type[0]) != 'u')
+            || !parse_integer(std::vector<unsigned char>(type.begin() + 1,
+                type.end()), bits)
+            || bits < 1 || bits > (op.is_signed ? 64 : 63))
+        {
+            error_custom("Invalid bitfield type. Use something like i16 u8. "
+                "Note that u64 is not supported but i64 is.");
+            return false;
+        }
+        op.bits = bits;
+
+        // An offset of #n counts in fields rather than bits.
+        const auto& offset = args[i + 2];
+        bool in_fields = !offset.empty() && offset[0] == '#';
+        long long position;
+        if (!parse_integer(std::vector<unsigned char>(
+                offset.begin() + (in_fields ? 1 : 0), offset.end()), position)
+            || position < 0
+            || static_cast<std::uint64_t>(position)
+                > max_string_size * 8 / (in_fields ? bits : 1))
+        {
+            error_custom("bit offset is not an integer or out of range");
+            return false;
+        }
+        op.offset = in_fields ? position * bits : position;
+        if (op.offset + op.bits > max_string_size * 8)
+        {
+            error_custom("bit offset is not an integer or out of range");
+            return false;
+        }
+
+        op.value = 0;
+        if (arity == 4 && !parse_integer(args[i + 3], op.value))
+        {
+            error_not_integer();
+            return false;
+        }
+        op.overflow = overflow;
+        ops.push_back(op);
+        i += arity;
+    }
+    return true;
+}
+
+// BITFIELD key [GET type offset] [SET type offset value]
+//     [INCRBY type offset increment] [OVERFLOW WRAP|SAT|FAIL] ...
+// Types are i1 to i64 and u1 to u63. The subcommands are all checked before
+// any of them runs, and the string is grown once to hold the furthest field
+// written, so they apply together. Replies with the value of each GET, the
+// old value of each SET and the new value of each INCRBY, or a null for a
+// SET or INCRBY that fails with OVERFLOW FAIL.
+void db_session::bitfield_command(const db_session::token_list& args)
+{
+    if (args.size() < 2)
+    {
+        error_incorrect_number_of_args("BITFIELD");
+        return;
+    }
+
+    std::vector<bitfield_op> ops;
+    if (!parse_bitfield(args, ops))
+    {
+        return;
+    }
+    std::uint64_t written_bits = 0;
+    for (const auto& op: ops)
+    {
+        if (op.kind != bitfield_op::get)
+        {
+            written_bits = std::max(written_bits, op.offset + op.bits);
+        }
+    }
+
+    auto& key = args[1];
+    exostore::bstring missing;
+    exostore::bstring* value = &missing;
+    try
+    {
+        if (written_bits != 0)
+        {
+            if (!db_.key_exists(key))
+            {
+                db_.set(key, exostore::bstring());
+            }
+            value = &db_.get<exostore::bstring>(key);
+            // Grown the way SETBIT grows it, so that a far offset may leave
+            // it sparse.
+            if (value->size() * 8 < written_bits)
+            {
+                value->set_bit(written_bits - 1,
+                    value->get_bit(written_bits - 1));
+            }
+            // An integer is written to as bytes.
+            if (!value->is_sparse())
+            {
+                value->bdata();
+            }
+        }
+        else if (db_.key_exists(key))
+        {
+            value = &db_.get<exostore::bstring>(key);
+        }
+    }
+    catch (const exostore::key_error&)
+    {
+        error_key_does_not_exist();
+        return;
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+        return;
+    }
+
+    // Fields of a sparse string are read and written a bit at a time.
+    // Reading an integer shouldn't turn it into bytes.
+    const exostore::bstring& current = *value;
+    auto digits = current.is_integer() ? current.bytes()
+        : std::vector<unsigned char>();
+    auto read_field = [&](const bitfield_op& op)
+    {
+        std::uint64_t raw = 0;
+        if (current.is_sparse())
+        {
+            for (auto bit = op.offset; bit < op.offset + op.bits; bit++)
+            {
+                raw = (raw << 1) | (current.get_bit(bit) ? 1 : 0);
+            }
+        }
+        else
+        {
+            const auto& bdata = current.has_bytes() ? current.bdata() : digits;
+            raw = get_field(bdata.data(), bdata.size(), op.offset, op.bits);
+        }
+        return op.is_signed ? sign_extend(raw, op.bits)
+            : static_cast<long long>(raw);
+    };
+    auto write_field = [&](const bitfield_op& op, long long field)
+    {
+        if (value->is_sparse())
+        {
+            for (unsigned i = 0; i < op.bits; i++)
+            {
+                value->set_bit(op.offset + i,
+                    (field >> (op.bits - 1 - i)) & 1);
+            }
+        }
+        else
+        {
+            set_field(value->bdata().data(), op.offset, op.bits, field);
+        }
+    };
+
+    std::vector<std::pair<bool, long long>> results;
+    for (const auto& op: ops)
+    {
+        auto old = read_field(op);
+        if (op.kind == bitfield_op::get)
+        {
+            results.emplace_back(true, old);
+            continue;
+        }
+
+        long long field;
+        bool fits = op.kind == bitfield_op::set
+            ? add_to_field(op.value, 0, op.is_signed, op.bits, op.overflow,
+                field)
+            : add_to_field(old, op.value, op.is_signed, op.bits, op.overflow,
+                field);
+        if (!fits)
+        {
+            results.emplace_back(false, 0);
+            continue;
+        }
+        write_field(op, field);
+        results.emplace_back(true, op.kind == bitfield_op::set ? old : field);
+    }
+    if (written_bits != 0)
+    {
+        db_.touch(key);
+    }
+    write_integers(results);
+}
+
+hyperloglog db_session::read_hyperloglog(
+    const std::vector<unsigned char>& key)
+{
+    const auto& value = db_.get<exostore::bstring>(key);
+    // Integers and sparse bitmaps can't be HyperLogLogs.
+    if (!value.has_bytes())
+    {
+        throw hyperloglog::format_error();
+    }
+    return hyperloglog(value.bdata());
+}
+
+// PFADD key [element ...]
+// A dense HyperLogLog is updated in place. A sparse one is decoded, updated
+// and encoded again, and turns dense once it is too big to stay sparse.
+void db_session::pfadd_command(const db_session::token_list& args)
+{
+    if (args.size() < 2)
+    {
+        error_incorrect_number_of_args("PFADD");
+        return;
+    }
+
+    auto& key = args[1];
+    try
+    {
+        if (!db_.key_exists(key))
+        {
+            hyperloglog hll;
+            for (auto it = args.begin() + 2; it != args.end(); it++)
+            {
+                hll.add(it->data(), it->size());
+            }
+            db_.set(key, exostore::bstring(hll.encode()));
+            write_integer(1);
+            return;
+        }
+
+        auto& value = db_.get<exostore::bstring>(key);
+        bool changed = false;
+        if (value.has_bytes() && hyperloglog::is_dense(value.bdata()))
+        {
+            auto& bytes = value.bdata();
+            for (auto it = args.begin() + 2; it != args.end(); it++)
+            {
+                changed |= hyperloglog::add_dense(bytes, it->data(),
+                    it->size());
+            }
+        }
+        else
+        {
+            auto hll = read_hyperloglog(key);
+            for (auto it = args.begin() + 2; it != args.end(); it++)
+            {
+                changed |= hll.add(it->data(), it->size());
+            }
+            if (changed)
+            {
+                value.set_bytes(hll.encode());
+            }
+        }
+        if (changed)
+        {
+            db_.touch(key);
+        }
+        write_integer(changed ? 1 : 0);
+    }
+    catch (const exostore::key_error&)
+    {
+        error_key_does_not_exist();
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+    catch (const hyperloglog::format_error& e)
+    {
+        error_custom(e.what());
+    }
+}
+
+// PFCOUNT key [key ...]
+// The estimate of a single key is cached in its string until it changes.
+// Several keys are merged into a temporary HyperLogLog, whose estimate is
+// the size of their union.
+void db_session::pfcount_command(const db_session::token_list& args)
+{
+    if (args.size() < 2)
+    {
+        error_incorrect_number_of_args("PFCOUNT");
+        return;
+    }
+
+    try
+    {
+        if (args.size() == 2)
+        {
+            auto& key = args[1];
+            if (!db_.key_exists(key))
+            {
+                write_integer(0);
+                return;
+            }
+            auto& value = db_.get<exostore::bstring>(key);
+            if (!value.has_bytes() || !hyperloglog::has_header(value.bdata()))
+            {
+                throw hyperloglog::format_error();
+            }
+            auto& bytes = value.bdata();
+            std::uint64_t count;
+            if (!hyperloglog::cached_count(bytes, count))
+            {
+                count = hyperloglog(bytes).count();
+                hyperloglog::set_cached_count(bytes, count);
+            }
+            write_integer(count);
+            return;
+        }
+
+        hyperloglog merged;
+        for (auto it = args.begin() + 1; it != args.end(); it++)
+        {
+            if (db_.key_exists(*it))
+            {
+                merged.merge(read_hyperloglog(*it));
+            }
+        }
+        write_integer(merged.count());
+    }
+    catch (const exostore::key_error&)
+    {
+        error_key_does_not_exist();
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+    catch (const hyperloglog::format_error& e)
+    {
+        error_custom(e.what());
+    }
+}
+
+// PFMERGE destkey [sourcekey ...]
+// The destination keeps its own elements and its expiry time, if it exists.
+void db_session::pfmerge_command(const db_session::token_list& args)
+{
+    if (args.size() < 2)
+    {
+        error_incorrect_number_of_args("PFMERGE");
+        return;
+    }
+
+    auto& dest_key = args[1];
+    try
+    {
+        hyperloglog merged;
+        for (auto it = args.begin() + 1; it != args.end(); it++)
+        {
+            if (db_.key_exists(*it))
+            {
+                merged.merge(read_hyperloglog(*it));
+            }
+        }
+
+        if (db_.key_exists(dest_key))
+        {
+            db_.get<exostore::bstring>(dest_key).set_bytes(merged.encode());
+            db_.touch(dest_key);
+        }
+        else
+        {
+            db_.set(dest_key, exostore::bstring(merged.encode()));
+        }
+        write_simple_string("OK");
+    }
+    catch (const exostore::key_error&)
+    {
+        error_key_does_not_exist();
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+    catch (const hyperloglog::format_error& e)
+    {
+        error_custom(e.what());
+    }
+}
+
+// HSET key field value [field value ...] replies with the number of fields
+// added, and HMSET with OK.
+void db_session::hset_command(const db_session::token_list& args)
+{
+    auto command_name = toupper_string(vec_to_string(args[0]));
+    if (args.size() < 4 || args.size() % 2 != 0)
+    {
+        error_incorrect_number_of_args(command_name);
+        return;
+    }
+
+    auto& key = args[1];
+    try
+    {
+        if (!db_.key_exists(key))
+        {
+            db_.set(key, exostore::hash());
+        }
+        auto& hash = db_.get<exostore::hash>(key);
+        long long added = 0;
+        for (std::size_t i = 2; i < args.size(); i += 2)
+        {
+            if (hash.set(args[i], args[i + 1]))
+            {
+                added++;
+            }
+        }
+        db_.touch(key);
+        if (command_name == "HMSET")
+        {
+            write_simple_string("OK");
+        }
+        else
+        {
+            write_integer(added);
+        }
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+void db_session::hget_command(const db_session::token_list& args)
+{
+    if (args.size() != 3)
+    {
+        error_incorrect_number_of_args("HGET");
+        return;
+    }
+
+    try
+    {
+        const auto& hash = db_.get<exostore::hash>(args[1]);
+        std::vector<unsigned char> value;
+        if (hash.get(args[2], value))
+        {
+            write_bstring(value);
+        }
+        else
+        {
+            write_nullbulk();
+        }
+    }
+    catch (const exostore::key_error&)
+    {
+        write_nullbulk();
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+void db_session::hmget_command(const db_session::token_list& args)
+{
+    if (args.size() < 3)
+    {
+        error_incorrect_number_of_args("HMGET");
+        return;
+    }
+
+    // A missing key is an empty hash.
+    std::vector<std::pair<bool, std::vector<unsigned char>>> values(
+        args.size() - 2);
+    try
+    {
+        const auto& hash = db_.get<exostore::hash>(args[1]);
+        for (std::size_t i = 2; i < args.size(); i++)
+        {
+            values[i - 2].first = hash.get(args[i], values[i - 2].second);
+        }
+    }
+    catch (const exostore::key_error&)
+    {
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+        return;
+    }
+    write_bstrings(values);
+}
+
+void db_session::hgetall_command(const db_session::token_list& args)
+{
+    if (args.size() != 2)
+    {
+        error_incorrect_number_of_args("HGETALL");
+        return;
+    }
+
+    std::vector<std::vector<unsigned char>> elements;
+    try
+    {
+        const auto& hash = db_.get<exostore::hash>(args[1]);
+        elements.reserve(hash.size() * 2);
+        hash.for_each([&elements](const exostore::hash::field_type& field,
+            const exostore::hash::field_type& value)
+        {
+            elements.push_back(field);
+            elements.push_back(value);
+        });
+    }
+    catch (const exostore::key_error&)
+    {
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+        return;
+    }
+    write_array(elements);
+}
+
+void db_session::hincrby_command(const db_session::token_list& args)
+{
+    if (args.size() != 4)
+    {
+        error_incorrect_number_of_args("HINCRBY");
+        return;
+    }
+
+    long long increment = 0;
+    if (!parse_integer(args[3], increment))
+    {
+        error_not_integer();
+        return;
+    }
+
+    auto& key = args[1];
+    try
+    {
+        exostore::hash* hash = nullptr;
+        long long value = 0;
+        if (db_.key_exists(key))
+        {
+            hash = &db_.get<exostore::hash>(key);
+            std::vector<unsigned char> current;
+            if (hash->get(args[2], current) && !parse_integer(current, value))
+            {
+                error_custom("hash value is not an integer");
+                return;
+            }
+        }
+
+        if ((increment > 0
+                && value > std::numeric_limits<long long>::max() - increment)
+            || (increment < 0
+                && value < std::numeric_limits<long long>::min() - increment))
+        {
+            error_custom("increment or decrement would overflow");
             return;
         }
+        value += increment;
 
-        int bit_value = boost::lexical_cast<int>(
+        if (hash == nullptr)
+        {
+            db_.set(key, exostore::hash());
+            hash = &db_.get<exostore::hash>(key);
+        }
+        hash->set(args[2], string_to_vec(std::to_string(value)));
+        db_.touch(key);
+        write_integer(value);
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+}
+
+void db_session::zadd_command(const db_session::token_list& args)
+{
+    if (args.size() < 4)
+    {
+        error_incorrect_number_of_args("ZADD");
+        return;
+    }
+
+    bool nx_set = false;
+    bool xx_set = false;
+    bool ch_set = false;
+    bool incr_set = false;
+    // With CAP, the lowest ranked members are removed once the set has more
+    // than cap of them.
+    long long cap = 0;
+
+    // Parse the command and set flags.
+    if (args.size() > 4)    // There aren't any flags otherwise
+    {
+        for (auto it = args.begin() + 2; it != args.end() - 2; it++)
+        {
+            auto option = toupper_string(vec_to_string(*it));
+            if (option == "NX")
+            {
+                nx_set = true;
+            }
+            else if (option == "XX")
+            {
+                xx_set = true;
+            }
+            else if (option == "CH")
+            {
+                ch_set = true;
+            }
+            else if (option == "INCR")
+            {
+                incr_set = true;
+            }
+            else if (option == "CAP" && it + 1 != args.end() - 2)
+            {
+                if (!parse_integer(*++it, cap) || cap < 1)
+                {
+                    error_custom("cap must be a positive integer");
+                    return;
+                }
+            }
+            else
+            {
+                error_syntax_error();
+                return;
+            }
+        }
+    }
+
+    if (nx_set && xx_set)
+    {
+        error_syntax_error();
+        return;
+    }
+
+    // Get the score/member pair.
+    auto it = args.end() - 2;
+    auto score_bstring = *it;
+    it++;
+    auto& member = *it;
+
+    double score = 0.0;
+    try
+    {
+        score = boost::lexical_cast<double>(
+            vec_to_string(score_bstring)
+        );
+    }
+    catch (const boost::bad_lexical_cast&)
+    {
+        error_syntax_error();
+        return;
+    }
+
+    int return_value = 0;
+    auto& key = args[1];
+
+    // Create the sorted set if key doesn't exist.
+    if (!db_.key_exists(key))
+    {
+        if (xx_set)
+        {
+            // Nothing to do here. Bail out early without creating a set.
+            write_integer(0);
+            return;
+        }
+        db_.set(key, exostore::zset());
+    }
+
+    try
+    {
+        auto& accessed_set = db_.get<exostore::zset>(key);
+        auto add_and_trim = [&](double new_score)
+        {
+            accessed_set.add(member, new_score);
+            if (cap > 0)
+            {
+                accessed_set.trim(cap);
+            }
+            db_.touch(key);
+        };
+
+        if (nx_set && accessed_set.contains(member)
+            || xx_set && !accessed_set.contains(member))
+        {
+            write_integer(0);
+            return;
+        }
+
+        if (incr_set)
+        {
+            // Doesn't matter if ch is set or not in this case.
+            double current_score = accessed_set.get_score(member);
+            double new_score = current_score + score;
+            add_and_trim(new_score);
+            write_bstring(boost::lexical_cast<std::string>(new_score));
+            return;
+        }
+        else
+        {
+            if (accessed_set.contains_element_score(member, score))
+            {
+                // Nothing added or changed.
+                write_integer(0);
+                return;
+            }
+
+            if (accessed_set.contains(member) && !ch_set)
+            {
+                add_and_trim(score);
+                write_integer(0);
+                return;
+            }
+            else
+            {
+                /*
+                Either the member is contained and ch is set (write 1),
+                or the member is not contained (write 1 regardless
+                of ch).
+                */
+                add_and_trim(score);
+                write_integer(1);
+                return;
+            }
+        }
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+        return;
+    }
+}
+
+void db_session::zcard_command(const db_session::token_list& args)
+{
+    if (args.size() != 2)
+    {
+        error_incorrect_number_of_args("ZCARD");
+        return;
+    }
+
+    try
+    {
+        auto& accessed_set = db_.get<exostore::zset>(args[1]);
+        write_integer(accessed_set.size());
+    }
+    catch (const exostore::key_error& )
+    {
+        write_integer(0);
+    }
+    catch (const exostore::type_error& )
+    {
+        error_incorrect_type();
+    }
+}
+
+void db_session::zcount_command(const db_session::token_list& args)
+{
+    if (args.size() != 4)
+    {
+        error_incorrect_number_of_args("ZCOUNT");
+        return;
+    }
+
+    auto& key = args[1];
+    try
+    {
+        double min = boost::lexical_cast<double>(
+            vec_to_string(args[2])
+        );
+        double max = boost::lexical_cast<double>(
             vec_to_string(args[3])
         );
+        auto& accessed_set = db_.get<exostore::zset>(key);
+        write_integer(accessed_set.count(min, max));
+    }
+    catch (const boost::bad_lexical_cast& )
+    {
+        error_syntax_error();
+    }
+    catch (const exostore::type_error& )
+    {
+        error_incorrect_type();
+    }
+}
 
-        if ((bit_value < 0) || (bit_value > 1))
+// ZUNIONSTORE and ZINTERSTORE destination numkeys key... [WEIGHTS weight...]
+// [AGGREGATE SUM|MIN|MAX], and ZDIFFSTORE destination numkeys key... Missing
+// keys are empty sets. Replies with the size of the result, which replaces
+// the destination.
+void db_session::zstore_command(const db_session::token_list& args)
+{
+    auto command_name = toupper_string(vec_to_string(args[0]));
+    if (args.size() < 4)
+    {
+        error_incorrect_number_of_args(command_name);
+        return;
+    }
+
+    long long num_keys = 0;
+    if (!parse_integer(args[2], num_keys))
+    {
+        error_not_integer();
+        return;
+    }
+    if (num_keys < 1)
+    {
+        error_custom("at least 1 input key is needed for " + command_name);
+        return;
+    }
+    if (static_cast<std::size_t>(num_keys) > args.size() - 3)
+    {
+        error_syntax_error();
+        return;
+    }
+
+    bool difference = command_name == "ZDIFFSTORE";
+    std::vector<double> weights(num_keys, 1.0);
+    auto aggregate = sorted_set::aggregate_type::sum;
+    for (auto i = 3 + num_keys; i < static_cast<long long>(args.size()); i++)
+    {
+        auto option = toupper_string(vec_to_string(args[i]));
+        if (!difference && option == "WEIGHTS"
+            && i + num_keys < static_cast<long long>(args.size()))
+        {
+            for (long long j = 0; j < num_keys; j++)
+            {
+                try
+                {
+                    weights[j] = boost::lexical_cast<double>(
+                        vec_to_string(args[++i]));
+                }
+                catch (const boost::bad_lexical_cast&)
+                {
+                    error_custom("weight value is not a float");
+                    return;
+                }
+            }
+        }
+        else if (!difference && option == "AGGREGATE"
+            && i + 1 < static_cast<long long>(args.size()))
+        {
+            auto name = toupper_string(vec_to_string(args[++i]));
+            if (name == "SUM")
+            {
+                aggregate = sorted_set::aggregate_type::sum;
+            }
+            else if (name == "MIN")
+            {
+                aggregate = sorted_set::aggregate_type::min;
+            }
+            else if (name == "MAX")
+            {
+                aggregate = sorted_set::aggregate_type::max;
+            }
+            else
+            {
+                error_syntax_error();
+                return;
+            }
+        }
+        else
         {
             error_syntax_error();
             return;
         }
+    }
 
-        auto& key = args[1];
-        if (!db_.key_exists(key))
+    static const exostore::zset empty;
+    std::vector<const exostore::zset*> sets;
+    for (long long i = 0; i < num_keys; i++)
+    {
+        try
         {
-            db_.set(key, exostore::bstring());
+            sets.push_back(&db_.get<exostore::zset>(args[3 + i]));
+        }
+        catch (const exostore::key_error&)
+        {
+            sets.push_back(&empty);
         }
-        auto& value = db_.get<exostore::bstring>(key);
-
-        auto byte_offset = int_offset / 8;
-        int bit_offset_from_right = 7 - (int_offset % 8);
-
-        if (byte_offset >= value.bdata().size())
+        catch (const exostore::type_error&)
         {
-            value.bdata().resize(byte_offset + 1, static_cast<unsigned char>(0));
+            error_incorrect_type();
+            return;
         }
+    }
 
-        unsigned char byte_in_question = value.bdata()[byte_offset];
-        int return_value = (byte_in_question << (7 - bit_offset_from_right))
-            & static_cast<unsigned char>(0x80u);
+    auto result = difference ? exostore::zset::set_difference(sets)
+        : command_name == "ZUNIONSTORE"
+            ? exostore::zset::set_union(sets, weights, aggregate)
+            : exostore::zset::set_intersection(sets, weights, aggregate);
+    auto size = result.size();
+    if (size == 0)
+    {
+        db_.remove(args[1]);
+    }
+    else
+    {
+        db_.set(args[1], std::move(result));
+    }
+    write_integer(size);
+}
 
-        if (return_value != 0)
-        {
-            return_value = 1;
-        }
+// ZREMRANGEBYRANK key start stop, where negative ranks count back from the
+// end, and ZREMRANGEBYSCORE key min max. Reply with the number of members
+// removed. The key is removed along with its last member.
+void db_session::zremrange_command(const db_session::token_list& args)
+{
+    auto command_name = toupper_string(vec_to_string(args[0]));
+    if (args.size() != 4)
+    {
+        error_incorrect_number_of_args(command_name);
+        return;
+    }
 
-        if (bit_value == 1)
+    auto& key = args[1];
+    try
+    {
+        auto& accessed_set = db_.get<exostore::zset>(key);
+        std::size_t removed = 0;
+        if (command_name == "ZREMRANGEBYRANK")
         {
-            byte_in_question |= static_cast<unsigned char>(1u) << bit_offset_from_right;
+            long long start = 0;
+            long long end = 0;
+            if (!parse_integer(args[2], start) || !parse_integer(args[3], end))
+            {
+                error_not_integer();
+                return;
+            }
+            long long size = accessed_set.size();
+            if (start < 0)
+            {
+                start = std::max(size + start, 0LL);
+            }
+            if (end < 0)
+            {
+                end = size + end;
+            }
+            end = std::min(end, size - 1);
+            if (start <= end)
+            {
+                removed = accessed_set.remove_range_by_rank(start, end);
+            }
         }
         else
         {
-            byte_in_question &= ~(static_cast<unsigned char>(1u) << bit_offset_from_right);
+            auto min = boost::lexical_cast<double>(vec_to_string(args[2]));
+            auto max = boost::lexical_cast<double>(vec_to_string(args[3]));
+            if (min <= max)
+            {
+                removed = accessed_set.remove_range_by_score(min, max);
+            }
         }
 
-        value.bdata()[byte_offset] = byte_in_question;
-
-        write_integer(return_value);
+        if (removed > 0)
+        {
+            if (accessed_set.size() == 0)
+            {
+                db_.remove(key);
+            }
+            else
+            {
+                db_.touch(key);
+            }
+        }
+        write_integer(removed);
     }
-    catch (const exostore::key_error&)  // This shouldn't happen, I set the key earlier
+    catch (const exostore::key_error& )
     {
-        error_key_does_not_exist();
-        return;
+        write_integer(0);
     }
-    catch (const exostore::type_error&)
+    catch (const exostore::type_error& )
     {
         error_incorrect_type();
-        return;
     }
-    catch (const boost::bad_lexical_cast&)
+    catch (const boost::bad_lexical_cast& )
     {
         error_syntax_error();
-        return;
     }
 }
 
-void db_session::zadd_command(const db_session::token_list& args)
+// ZHISTOGRAM key min max buckets [STATS] splits [min, max] into equal
+// buckets, and ZHISTOGRAM key BOUNDARIES b0 b1 ... [STATS] into the buckets
+// between the boundaries given. Replies with the count of each bucket,
+// followed with STATS by the total count and the sum, min and max of the
+// scores counted.
+void db_session::zhistogram_command(const db_session::token_list& args)
 {
+    // Keeps a mistyped bucket count from allocating too much.
+    const long long max_buckets = 65536;
+
     if (args.size() < 4)
     {
-        error_incorrect_number_of_args("ZADD");
+        error_incorrect_number_of_args("ZHISTOGRAM");
         return;
     }
 
-    bool nx_set = false;
-    bool xx_set = false;
-    bool ch_set = false;
-    bool incr_set = false;
-
-    // Parse the command and set flags.
-    if (args.size() > 4)    // There aren't any flags otherwise
+    bool stats = toupper_string(vec_to_string(args.back())) == "STATS";
+    auto args_end = args.end() - (stats ? 1 : 0);
+    std::vector<double> boundaries;
+    try
     {
-        for (auto it = args.begin() + 2; it != args.end() - 2; it++)
+        if (toupper_string(vec_to_string(args[2])) == "BOUNDARIES")
         {
-            auto option = toupper_string(vec_to_string(*it));
-            if (option == "NX")
+            for (auto it = args.begin() + 3; it != args_end; it++)
             {
-                nx_set = true;
+                boundaries.push_back(boost::lexical_cast<double>(
+                    vec_to_string(*it)));
             }
-            else if (option == "XX")
+            if (boundaries.size() < 2
+                || boundaries.size() > static_cast<std::size_t>(max_buckets))
             {
-                xx_set = true;
+                error_custom("need between 2 and "
+                    + std::to_string(max_buckets) + " boundaries");
+                return;
             }
-            else if (option == "CH")
+        }
+        else
+        {
+            if (args_end - args.begin() != 5)
             {
-                ch_set = true;
+                error_syntax_error();
+                return;
             }
-            else if (option == "INCR")
+            auto min = boost::lexical_cast<double>(vec_to_string(args[2]));
+            auto max = boost::lexical_cast<double>(vec_to_string(args[3]));
+            auto buckets = boost::lexical_cast<long long>(
+                vec_to_string(args[4]));
+            if (buckets < 1 || buckets > max_buckets)
             {
-                incr_set = true;
+                error_custom("bucket count out of range");
+                return;
             }
-            else
+            if (!std::isfinite(min) || !std::isfinite(max))
             {
-                error_syntax_error();
+                error_custom("min and max must be finite");
+                return;
             }
+            for (long long i = 0; i < buckets; i++)
+            {
+                boundaries.push_back(min + (max - min) * i / buckets);
+            }
+            boundaries.push_back(max);
         }
     }
-
-    if (nx_set && xx_set)
+    catch (const boost::bad_lexical_cast& )
     {
         error_syntax_error();
         return;
     }
+    for (std::size_t i = 0; i + 1 < boundaries.size(); i++)
+    {
+        if (std::isnan(boundaries[i]) || !(boundaries[i] <= boundaries[i + 1]))
+        {
+            error_custom("boundaries must be in increasing order");
+            return;
+        }
+    }
 
-    // Get the score/member pair.
-    auto it = args.end() - 2;
-    auto score_bstring = *it;
-    it++;
-    auto& member = *it;
-
-    double score = 0.0;
+    sorted_set::score_histogram histogram;
     try
     {
-        score = boost::lexical_cast<double>(
-            vec_to_string(score_bstring)
-        );
+        histogram = db_.get<exostore::zset>(args[1]).histogram(boundaries);
     }
-    catch (const boost::bad_lexical_cast&)
+    catch (const exostore::key_error& )
     {
-        error_syntax_error();
+        // An empty set.
+        histogram.counts.assign(boundaries.size() - 1, 0);
+        histogram.total = 0;
+        histogram.sum = 0;
+    }
+    catch (const exostore::type_error& )
+    {
+        error_incorrect_type();
         return;
     }
 
-    int return_value = 0;
-    auto& key = args[1];
-
-    // Create the sorted set if key doesn't exist.
-    if (!db_.key_exists(key))
+    out_stream_ << "*" << histogram.counts.size() + (stats ? 4 : 0)
+        << "\r\n";
+    for (auto count: histogram.counts)
     {
-        if (xx_set)
+        out_stream_ << ":" << count << "\r\n";
+    }
+    if (stats)
+    {
+        out_stream_ << ":" << histogram.total << "\r\n";
+        auto sum = boost::lexical_cast<std::string>(histogram.sum);
+        out_stream_ << "$" << sum.size() << "\r\n" << sum << "\r\n";
+        for (auto score: {histogram.min, histogram.max})
         {
-            // Nothing to do here. Bail out early without creating a set.
-            write_integer(0);
-            return;
+            if (histogram.total == 0)
+            {
+                out_stream_ << "$-1\r\n";
+                continue;
+            }
+            auto score_string = boost::lexical_cast<std::string>(score);
+            out_stream_ << "$" << score_string.size() << "\r\n"
+                << score_string << "\r\n";
         }
-        db_.set(key, exostore::zset());
+    }
+    out_stream_ << std::flush;
+    do_write();
+}
+
+void db_session::zrange_command(const db_session::token_list& args)
+{
+    if (args.size() < 4 || args.size() > 5)
+    {
+        error_incorrect_number_of_args("ZRANGE");
+        return;
+    }
+
+    bool withscores = false;
+    if (args.size() == 5
+        && toupper_string(vec_to_string(args[4])) == "WITHSCORES")
+    {
+        withscores = true;
+    }
+
+    auto& key = args[1];
+    if (!db_.key_exists(key))
+    {
+        // Write an empty array.
+        write_array(std::vector<std::vector<unsigned char>>());
+        return;
     }
 
     try
     {
         auto& accessed_set = db_.get<exostore::zset>(key);
+        auto start = boost::lexical_cast<long long>(
+            vec_to_string(args[2])
+        );
+        auto end = boost::lexical_cast<long long>(
+            vec_to_string(args[3])
+        );
 
-        if (nx_set && accessed_set.contains(member)
-            || xx_set && !accessed_set.contains(member))
+        // Convert negative args to zero-based offsets from the start.
+        auto set_length = accessed_set.size();
+        if (start < 0)
         {
-            write_integer(0);
-            return;
+            start = set_length + start;
         }
 
-        if (incr_set)
+        if (end < 0)
         {
-            // Doesn't matter if ch is set or not in this case.
-            double current_score = accessed_set.get_score(member);
-            double new_score = current_score + score;
-            accessed_set.add(member, new_score);
-            write_bstring(boost::lexical_cast<std::string>(new_score));
+            end = set_length + end;
+        }
+
+        // Clamp both.
+        start = boost::algorithm::clamp(start, 0, set_length - 1);
+        end = boost::algorithm::clamp(end, 0, set_length - 1);
+
+        if (start > end)
+        {
+            write_array(std::vector<std::vector<unsigned char>>());
             return;
         }
-        else
+
+        auto iterators = accessed_set.element_range(start, end);
+        std::vector<std::vector<unsigned char>> array_output;
+
+        for (auto it = iterators.first; it != iterators.second;
+            it++)
         {
-            if (accessed_set.contains_element_score(member, score))
+            array_output.emplace_back(it->member());
+            if (withscores)
             {
-                // Nothing added or changed.
-                write_integer(0);
-                return;
+                array_output.emplace_back(string_to_vec(
+                    boost::lexical_cast<std::string>(it->score())));
             }
+        }
 
-            if (accessed_set.contains(member) && !ch_set)
+        write_array(array_output);
+    }
+    catch (const exostore::type_error&)
+    {
+        error_incorrect_type();
+    }
+    catch (const boost::bad_lexical_cast&)
+    {
+        error_syntax_error();
+    }
+}
+
+bool db_session::parse_scan_options(const db_session::token_list& args,
+    std::size_t cursor_index, bool allow_type,
+    db_session::scan_options& options)
+{
+    options.count = 10;
+    options.has_pattern = false;
+    options.has_type = false;
+
+    // lexical_cast wraps negative numbers around, so reject them first.
+    auto cursor = vec_to_string(args[cursor_index]);
+    try
+    {
+        if (cursor.empty() || cursor[0] == '-')
+        {
+            throw boost::bad_lexical_cast();
+        }
+        options.cursor = boost::lexical_cast<std::uint64_t>(cursor);
+    }
+    catch (const boost::bad_lexical_cast& )
+    {
+        error_custom("invalid cursor");
+        return false;
+    }
+
+    for (auto i = cursor_index + 1; i < args.size(); i += 2)
+    {
+        auto option = toupper_string(vec_to_string(args[i]));
+        if (i + 1 == args.size())
+        {
+            error_syntax_error();
+            return false;
+        }
+
+        if (option == "MATCH")
+        {
+            options.has_pattern = true;
+            options.pattern = args[i + 1];
+        }
+        else if (option == "COUNT")
+        {
+            try
             {
-                accessed_set.add(member, score);
-                write_integer(0);
-                return;
+                auto count = boost::lexical_cast<long long>(
+                    vec_to_string(args[i + 1]));
+                if (count < 1)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+                options.count = count;
             }
-            else
+            catch (const boost::bad_lexical_cast& )
             {
-                /*
-                Either the member is contained and ch is set (write 1),
-                or the member is not contained (write 1 regardless
-                of ch).
-                */
-                accessed_set.add(member, score);
-                write_integer(1);
-                return;
+                error_syntax_error();
+                return false;
             }
         }
+        else if (option == "TYPE" && allow_type)
+        {
+            options.has_type = true;
+            options.type = vec_to_string(args[i + 1]);
+        }
+        else
+        {
+            error_syntax_error();
+            return false;
+        }
     }
-    catch (const exostore::type_error&)
+    return true;
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]. Each call does a
+// bounded amount of work, so the whole keyspace can be walked without holding
+// up other clients.
+void db_session::scan_command(const db_session::token_list& args)
+{
+    if (args.size() < 2)
+    {
+        error_incorrect_number_of_args("SCAN");
+        return;
+    }
+
+    scan_options options;
+    if (!parse_scan_options(args, 1, true, options))
     {
-        error_incorrect_type();
         return;
     }
+
+    std::vector<std::vector<unsigned char>> keys;
+    auto cursor = db_.scan(options.cursor, options.count,
+        [&keys, &options](const std::vector<unsigned char>& key,
+            const std::string& type)
+        {
+            if ((!options.has_pattern || glob_match(options.pattern, key))
+                && (!options.has_type || options.type == type))
+            {
+                keys.push_back(key);
+            }
+        });
+    write_scan_result(cursor, keys);
 }
 
-void db_session::zcard_command(const db_session::token_list& args)
+// ZSCAN key cursor [MATCH pattern] [COUNT count]. Replies with members and
+// their scores.
+void db_session::zscan_command(const db_session::token_list& args)
 {
-    if (args.size() != 2)
+    if (args.size() < 3)
+    {
+        error_incorrect_number_of_args("ZSCAN");
+        return;
+    }
+
+    scan_options options;
+    if (!parse_scan_options(args, 2, false, options))
     {
-        error_incorrect_number_of_args("ZCARD");
         return;
     }
 
     try
     {
         auto& accessed_set = db_.get<exostore::zset>(args[1]);
-        write_integer(accessed_set.size());
+        std::vector<std::vector<unsigned char>> elements;
+        auto cursor = accessed_set.scan(options.cursor, options.count,
+            [&elements, &options](const exostore::zset::member_type& member,
+                double score)
+            {
+                if (!options.has_pattern
+                    || glob_match(options.pattern, member))
+                {
+                    elements.push_back(member);
+                    elements.push_back(string_to_vec(
+                        boost::lexical_cast<std::string>(score)));
+                }
+            });
+        write_scan_result(cursor, elements);
     }
     catch (const exostore::key_error& )
     {
-        write_integer(0);
+        write_scan_result(0, std::vector<std::vector<unsigned char>>());
     }
     catch (const exostore::type_error& )
     {
@@ -588,126 +2950,374 @@ void db_session::zcard_command(const db_session::token_list& args)
     }
 }
 
-void db_session::zcount_command(const db_session::token_list& args)
+void db_session::save_command(const db_session::token_list& args)
 {
-    if (args.size() != 4)
+    if (args.size() != 1)
     {
-        error_incorrect_number_of_args("ZCOUNT");
+        error_incorrect_number_of_args("SAVE");
         return;
     }
 
-    auto& key = args[1];
     try
     {
-        double min = boost::lexical_cast<double>(
-            vec_to_string(args[2])
-        );
-        double max = boost::lexical_cast<double>(
-            vec_to_string(args[3])
-        );
-        auto& accessed_set = db_.get<exostore::zset>(key);
-        write_integer(accessed_set.count(min, max));
+        db_.save();
     }
-    catch (const boost::bad_lexical_cast& )
+    catch (const std::runtime_error& e)
     {
-        error_syntax_error();
+        error_custom(e.what());
+        return;
     }
-    catch (const exostore::type_error& )
+    write_simple_string("OK");
+}
+
+void db_session::bgsave_command(const db_session::token_list& args)
+{
+    if (args.size() != 1)
     {
-        error_incorrect_type();
+        error_incorrect_number_of_args("BGSAVE");
+        return;
+    }
+
+    if (!db_.save_in_background())
+    {
+        error_custom("Background job already in progress");
+        return;
     }
+
+    write_simple_string("Background saving started");
 }
 
-void db_session::zrange_command(const db_session::token_list& args)
+void db_session::bgrewriteaof_command(const db_session::token_list& args)
 {
-    if (args.size() < 4 || args.size() > 5)
+    if (args.size() != 1)
     {
-        error_incorrect_number_of_args("ZRANGE");
+        error_incorrect_number_of_args("BGREWRITEAOF");
         return;
     }
 
-    bool withscores = false;
-    if (args.size() == 5
-        && toupper_string(vec_to_string(args[4])) == "WITHSCORES")
+    if (!db_.log_enabled())
     {
-        withscores = true;
+        error_custom("Append-only log is disabled");
+        return;
     }
 
-    auto& key = args[1];
-    if (!db_.key_exists(key))
+    if (!db_.rewrite_log_in_background())
     {
-        // Write an empty array.
-        write_array(std::vector<std::vector<unsigned char>>());
+        error_custom("Background job already in progress");
         return;
     }
 
-    try
+    write_simple_string("Background append-only log rewriting started");
+}
+
+// Writes out information about the server as lines of the form field:value.
+void db_session::info_command(const db_session::token_list& args)
+{
+    if (args.size() != 1)
     {
-        auto& accessed_set = db_.get<exostore::zset>(key);
-        auto start = boost::lexical_cast<long long>(
-            vec_to_string(args[2])
-        );
-        auto end = boost::lexical_cast<long long>(
-            vec_to_string(args[3])
-        );
+        error_incorrect_number_of_args("INFO");
+        return;
+    }
 
-        // Convert negative args to zero-based offsets from the start.
-        auto set_length = accessed_set.size();
-        if (start < 0)
+    std::ostringstream info;
+    info << "# Memory\r\n";
+    info << "used_memory:" << db_.used_memory() << "\r\n";
+    info << "maxmemory:" << db_.memory_limit() << "\r\n";
+    info << "maxmemory_policy:"
+        << exostore::eviction_policy_name(db_.memory_policy()) << "\r\n";
+    info << "evicted_keys:" << db_.evicted_keys() << "\r\n";
+    info << "lazyfree_pending_objects:" << db_.lazy_free_pending() << "\r\n";
+    info << "lazyfreed_objects:" << db_.lazy_freed() << "\r\n";
+    info << "active_defrag_running:" << (db_.defrag_running() ? 1 : 0)
+        << "\r\n";
+    info << "active_defrag_hits:" << db_.defrag_moved() << "\r\n";
+    info << "active_defrag_cycles:" << db_.defrag_cycles() << "\r\n";
+
+    info << "\r\n# Persistence\r\n";
+    info << "loading:" << (db_.loading() ? 1 : 0) << "\r\n";
+    if (db_.loading())
+    {
+        auto progress = db_.loading_progress();
+        info << "loading_total_bytes:" << progress.total_bytes << "\r\n";
+        info << "loading_loaded_bytes:" << progress.loaded_bytes << "\r\n";
+        info << "loading_loaded_keys:" << progress.loaded_keys << "\r\n";
+        double fraction = progress.total_bytes > 0
+            ? static_cast<double>(progress.loaded_bytes) / progress.total_bytes
+            : 0.0;
+        info << "loading_loaded_perc:" << 100 * fraction << "\r\n";
+        // Estimated from the rate so far.
+        long long eta = -1;
+        if (fraction > 0)
         {
-            start = set_length + start;
+            eta = static_cast<long long>(
+                progress.elapsed_seconds * (1 - fraction) / fraction);
         }
+        info << "loading_eta_seconds:" << eta << "\r\n";
+    }
+    else
+    {
+        info << "changes_since_last_save:" << db_.dirty() << "\r\n";
+        info << "last_save_time:" << chrono::duration_cast<chrono::seconds>(
+            db_.last_save_time().time_since_epoch()).count() << "\r\n";
+    }
+    info << "background_job_in_progress:"
+        << (db_.background_job_running() ? 1 : 0) << "\r\n";
+    info << "aof_enabled:" << (db_.log_enabled() ? 1 : 0) << "\r\n";
+    auto store = db_.store();
+    info << "mapped_enabled:" << (store != nullptr ? 1 : 0) << "\r\n";
+    if (store != nullptr)
+    {
+        info << "mapped_keys:" << store->size() << "\r\n";
+        info << "mapped_file_size:" << store->file_size() << "\r\n";
+        info << "mapped_garbage_bytes:" << store->garbage_bytes() << "\r\n";
+    }
 
-        if (end < 0)
+    info << "\r\n# Tiering\r\n";
+    auto spill = db_.spill();
+    info << "spill_enabled:" << (spill != nullptr ? 1 : 0) << "\r\n";
+    if (spill != nullptr)
+    {
+        info << "spilled_keys:" << db_.spilled_count() << "\r\n";
+        info << "spill_file_size:" << spill->file_size() << "\r\n";
+        info << "spill_live_bytes:" << spill->live_bytes() << "\r\n";
+        info << "spill_compacting:" << (spill->compacting() ? 1 : 0) << "\r\n";
+    }
+
+    write_bstring(info.str());
+}
+
+// MEMORY USAGE key [SAMPLES count] gives the bytes used by a key and its
+// value. The count is accepted for compatibility; the usage is always exact.
+// MEMORY STATS gives a breakdown of the used memory as field-value pairs.
+void db_session::memory_command(const db_session::token_list& args)
+{
+    if (args.size() < 2)
+    {
+        error_incorrect_number_of_args("MEMORY");
+        return;
+    }
+
+    auto subcommand = toupper_string(vec_to_string(args[1]));
+    if (subcommand == "USAGE")
+    {
+        if (args.size() != 3 && args.size() != 5)
         {
-            end = set_length + end;
+            error_incorrect_number_of_args("MEMORY");
+            return;
+        }
+        if (args.size() == 5)
+        {
+            try
+            {
+                if (toupper_string(vec_to_string(args[3])) != "SAMPLES"
+                    || boost::lexical_cast<long long>(
+                        vec_to_string(args[4])) < 0)
+                {
+                    error_syntax_error();
+                    return;
+                }
+            }
+            catch (const boost::bad_lexical_cast& )
+            {
+                error_syntax_error();
+                return;
+            }
         }
 
-        // Clamp both.
-        start = boost::algorithm::clamp(start, 0, set_length - 1);
-        end = boost::algorithm::clamp(end, 0, set_length - 1);
-
-        if (start > end)
+        try
         {
-            write_array(std::vector<std::vector<unsigned char>>());
+            write_integer(db_.memory_usage(args[2]));
+        }
+        catch (const exostore::key_error& )
+        {
+            write_nullbulk();
+        }
+    }
+    else if (subcommand == "STATS")
+    {
+        if (args.size() != 2)
+        {
+            error_incorrect_number_of_args("MEMORY");
             return;
         }
 
-        auto iterators = accessed_set.element_range(start, end);
-        std::vector<std::vector<unsigned char>> array_output;
+        auto stats = db_.memory_statistics();
+        // Fragmentation is measured against what the allocator has handed
+        // out, not against what is accounted for per key.
+        long long fragmentation_bytes =
+            static_cast<long long>(stats.allocator_active)
+            - static_cast<long long>(stats.allocator_allocated);
+        double fragmentation_ratio = stats.allocator_allocated > 0
+            ? static_cast<double>(stats.allocator_active)
+                / stats.allocator_allocated
+            : 0.0;
+        double slab_fragmentation_ratio = stats.slab_allocated > 0
+            ? static_cast<double>(stats.slab_active) / stats.slab_allocated
+            : 0.0;
+
+        std::vector<std::pair<std::string, std::string>> fields = {
+            {"used_memory", std::to_string(db_.used_memory())},
+            {"keys.count", std::to_string(stats.keys)},
+            {"overhead.hashtable", std::to_string(stats.keyspace_overhead)},
+            {"dataset.strings", std::to_string(stats.strings)},
+            {"dataset.zsets", std::to_string(stats.zsets)},
+            {"dataset.hashes", std::to_string(stats.hashes)},
+            {"dataset.spilled", std::to_string(stats.spilled_strings)},
+            {"allocator.allocated", std::to_string(stats.allocator_allocated)},
+            {"allocator.active", std::to_string(stats.allocator_active)},
+            {"allocator.resident", std::to_string(stats.resident)},
+            {"allocator-fragmentation.ratio",
+                boost::lexical_cast<std::string>(fragmentation_ratio)},
+            {"allocator-fragmentation.bytes",
+                std::to_string(fragmentation_bytes)},
+            {"slab.active", std::to_string(stats.slab_active)},
+            {"slab.allocated", std::to_string(stats.slab_allocated)},
+            {"slab.requested", std::to_string(stats.slab_requested)},
+            {"slab-fragmentation.ratio",
+                boost::lexical_cast<std::string>(slab_fragmentation_ratio)},
+            {"slab-fragmentation.bytes",
+                std::to_string(stats.slab_active - stats.slab_allocated)}
+        };
+        std::vector<std::vector<unsigned char>> response;
+        for (const auto& field: fields)
+        {
+            response.push_back(string_to_vec(field.first));
+            response.push_back(string_to_vec(field.second));
+        }
+        write_array(response);
+    }
+    else
+    {
+        error_syntax_error();
+    }
+}
 
-        for (auto it = iterators.first; it != iterators.second;
-            it++)
+// SUBSCRIBE channel... and PSUBSCRIBE pattern... reply with an element for
+// each channel or pattern.
+void db_session::subscribe_command(const db_session::token_list& args)
+{
+    auto command_name = toupper_string(vec_to_string(args[0]));
+    if (args.size() < 2)
+    {
+        error_incorrect_number_of_args(command_name);
+        return;
+    }
+
+    bool patterns = command_name == "PSUBSCRIBE";
+    for (auto it = args.begin() + 1; it != args.end(); it++)
+    {
+        if (patterns && patterns_.insert(*it).second)
         {
-            array_output.emplace_back(it->member());
-            if (withscores)
+            pubsub_.psubscribe(*it, this);
+        }
+        else if (!patterns && channels_.insert(*it).second)
+        {
+            pubsub_.subscribe(*it, this);
+        }
+        append_subscription_reply(patterns ? "psubscribe" : "subscribe",
+            &*it);
+    }
+    do_write();
+}
+
+// UNSUBSCRIBE [channel...] and PUNSUBSCRIBE [pattern...]. Without arguments,
+// unsubscribe from every channel or pattern.
+void db_session::unsubscribe_command(const db_session::token_list& args)
+{
+    auto command_name = toupper_string(vec_to_string(args[0]));
+    bool patterns = command_name == "PUNSUBSCRIBE";
+    auto& subscribed = patterns ? patterns_ : channels_;
+    std::string kind = patterns ? "punsubscribe" : "unsubscribe";
+
+    token_list names(args.begin() + 1, args.end());
+    if (names.empty())
+    {
+        names.assign(subscribed.begin(), subscribed.end());
+    }
+    if (names.empty())
+    {
+        append_subscription_reply(kind, nullptr);
+    }
+    for (const auto& name: names)
+    {
+        if (subscribed.erase(name) != 0)
+        {
+            if (patterns)
             {
-                array_output.emplace_back(string_to_vec(
-                    boost::lexical_cast<std::string>(it->score())));
+                pubsub_.punsubscribe(name, this);
+            }
+            else
+            {
+                pubsub_.unsubscribe(name, this);
             }
         }
+        append_subscription_reply(kind, &name);
+    }
+    do_write();
+}
 
-        write_array(array_output);
+void db_session::publish_command(const db_session::token_list& args)
+{
+    if (args.size() != 3)
+    {
+        error_incorrect_number_of_args("PUBLISH");
+        return;
     }
-    catch (const exostore::type_error&)
+
+    write_integer(pubsub_.publish(args[1], args[2]));
+}
+
+// PUBSUB CHANNELS [pattern], PUBSUB NUMSUB [channel...] and PUBSUB NUMPAT.
+void db_session::pubsub_command(const db_session::token_list& args)
+{
+    if (args.size() < 2)
     {
-        error_incorrect_type();
+        error_incorrect_number_of_args("PUBSUB");
+        return;
     }
-    catch (const boost::bad_lexical_cast&)
+
+    auto subcommand = toupper_string(vec_to_string(args[1]));
+    if (subcommand == "CHANNELS" && args.size() <= 3)
+    {
+        write_array(args.size() == 3 ? pubsub_.channels(args[2])
+            : pubsub_.channels());
+    }
+    else if (subcommand == "NUMSUB")
+    {
+        out_stream_ << "*" << 2 * (args.size() - 2) << "\r\n";
+        for (auto it = args.begin() + 2; it != args.end(); it++)
+        {
+            out_stream_ << '$' << it->size() << "\r\n";
+            out_stream_.write(reinterpret_cast<const char*>(it->data()),
+                it->size());
+            out_stream_ << "\r\n:" << pubsub_.subscriber_count(*it)
+                << "\r\n";
+        }
+        out_stream_ << std::flush;
+        do_write();
+    }
+    else if (subcommand == "NUMPAT" && args.size() == 2)
+    {
+        write_integer(pubsub_.pattern_count());
+    }
+    else
     {
         error_syntax_error();
     }
 }
 
-void db_session::save_command(const db_session::token_list& args)
+void db_session::unsubscribe_all()
 {
-    if (args.size() != 1)
+    for (const auto& channel: channels_)
     {
-        error_incorrect_number_of_args("SAVE");
+        pubsub_.unsubscribe(channel, this);
     }
-
-    db_.save();
-    write_simple_string("OK");
+    for (const auto& pattern: patterns_)
+    {
+        pubsub_.punsubscribe(pattern, this);
+    }
+    channels_.clear();
+    patterns_.clear();
 }
 
 /******************
@@ -717,6 +3327,17 @@ void db_session::save_command(const db_session::token_list& args)
 // Writes out binary data as a bulk string.
 void db_session::write_bstring(const exostore::bstring& bstr)
 {
+    if (bstr.is_integer())
+    {
+        write_bstring(std::to_string(bstr.integer()));
+        return;
+    }
+    if (bstr.is_sparse())
+    {
+        // Read as bytes without converting the stored bitmap.
+        write_bstring(bstr.sparse().to_bytes(0, bstr.size()));
+        return;
+    }
     write_bstring(bstr.bdata());
 }
 
@@ -727,8 +3348,13 @@ void db_session::write_bstring(const std::string& str)
 
 void db_session::write_bstring(const std::vector<unsigned char>& bdata)
 {
-    out_stream_ << '$' << bdata.size() << "\r\n";
-    out_stream_.write(reinterpret_cast<const char*>(bdata.data()), bdata.size());
+    write_bstring(bdata.data(), bdata.size());
+}
+
+void db_session::write_bstring(const unsigned char* data, std::size_t size)
+{
+    out_stream_ << '$' << size << "\r\n";
+    out_stream_.write(reinterpret_cast<const char*>(data), size);
     out_stream_ << "\r\n" << std::flush;
     do_write();
 }
@@ -765,12 +3391,82 @@ void db_session::write_array(const std::vector<std::vector<unsigned char>>&
     do_write();
 }
 
+void db_session::write_integers(
+    const std::vector<std::pair<bool, long long>>& integers)
+{
+    out_stream_ << "*" << integers.size() << "\r\n";
+    for (const auto& integer: integers)
+    {
+        if (integer.first)
+        {
+            out_stream_ << ":" << integer.second << "\r\n";
+        }
+        else
+        {
+            out_stream_ << "$-1\r\n";
+        }
+    }
+    out_stream_ << std::flush;
+    do_write();
+}
+
+void db_session::write_bstrings(
+    const std::vector<std::pair<bool, std::vector<unsigned char>>>& bstrings)
+{
+    out_stream_ << "*" << bstrings.size() << "\r\n";
+    for (const auto& bstring: bstrings)
+    {
+        if (bstring.first)
+        {
+            out_stream_ << '$' << bstring.second.size() << "\r\n";
+            out_stream_.write(
+                reinterpret_cast<const char*>(bstring.second.data()),
+                bstring.second.size());
+            out_stream_ << "\r\n";
+        }
+        else
+        {
+            out_stream_ << "$-1\r\n";
+        }
+    }
+    out_stream_ << std::flush;
+    do_write();
+}
+
+void db_session::append_subscription_reply(const std::string& kind,
+    const std::vector<unsigned char>* channel)
+{
+    out_stream_ << "*3\r\n$" << kind.size() << "\r\n" << kind << "\r\n";
+    if (channel)
+    {
+        out_stream_ << '$' << channel->size() << "\r\n";
+        out_stream_.write(reinterpret_cast<const char*>(channel->data()),
+            channel->size());
+        out_stream_ << "\r\n";
+    }
+    else
+    {
+        out_stream_ << "$-1\r\n";
+    }
+    out_stream_ << ":" << channels_.size() + patterns_.size() << "\r\n";
+}
+
+void db_session::write_scan_result(std::uint64_t cursor,
+    const std::vector<std::vector<unsigned char>>& elements)
+{
+    auto cursor_string = std::to_string(cursor);
+    out_stream_ << "*2\r\n$" << cursor_string.size() << "\r\n"
+        << cursor_string << "\r\n";
+    write_array(elements);
+}
+
 /*****************
  * ERROR MESSAGES
  *****************/
 
 void db_session::error_unknown_command(std::string command_name)
 {
+    command_failed_ = true;
     out_stream_ << "-ERR Unknown command " << command_name << "\r\n"
         << std::flush;
     do_write();
@@ -778,6 +3474,7 @@ void db_session::error_unknown_command(std::string command_name)
 
 void db_session::error_incorrect_number_of_args(std::string command_name)
 {
+    command_failed_ = true;
     out_stream_ << "-ERR Incorrect number of args for " << command_name
         << "\r\n" << std::flush;
     do_write();
@@ -785,24 +3482,49 @@ void db_session::error_incorrect_number_of_args(std::string command_name)
 
 void db_session::error_key_does_not_exist()
 {
+    command_failed_ = true;
     out_stream_ << "-ERR Key does not exist\r\n";
     do_write();
 }
 
 void db_session::error_incorrect_type()
 {
+    command_failed_ = true;
     out_stream_ << "-ERR Incorrect type\r\n";
     do_write();
 }
 
 void db_session::error_syntax_error()
 {
+    command_failed_ = true;
     out_stream_ << "-ERR Syntax error\r\n";
     do_write();
 }
 
+void db_session::error_not_integer()
+{
+    command_failed_ = true;
+    out_stream_ << "-ERR value is not an integer or out of range\r\n";
+    do_write();
+}
+
 void db_session::error_custom(const std::string& msg)
 {
+    command_failed_ = true;
     out_stream_ << "-ERR " << msg << "\r\n";
     do_write();
 }
+
+void db_session::error_out_of_memory()
+{
+    command_failed_ = true;
+    out_stream_ << "-OOM command not allowed when used memory > 'maxmemory'\r\n";
+    do_write();
+}
+
+void db_session::error_loading()
+{
+    command_failed_ = true;
+    out_stream_ << "-LOADING ExoRedis is loading the dataset in memory\r\n";
+    do_write();
+}
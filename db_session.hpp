@@ -6,9 +6,13 @@
 #include <utility>
 #include <set>
 #include <vector>
+#include <deque>
+#include <chrono>
 #include <boost/asio.hpp>
 #include <cstddef>
 #include "exostore.hpp"
+#include "hyperloglog.hpp"
+#include "pubsub.hpp"
 
 namespace asio = boost::asio;
 using boost::asio::ip::tcp;
@@ -19,56 +23,181 @@ using boost::asio::ip::tcp;
  * Represents a connection to the database.
  * Responsible for reading commands, parsing them, calling the DB API to run
  * the commands and writing the response.
+ *
+ * A session subscribed to channels also writes the messages published to
+ * them. These are queued and written in between responses, one write at a
+ * time, and the client is disconnected if it falls too far behind.
  */
 class db_session
-    : public std::enable_shared_from_this<db_session>
+    : public std::enable_shared_from_this<db_session>,
+      public pubsub::subscriber
 {
 public:
     typedef std::shared_ptr<db_session> pointer;
 
-    db_session(tcp::socket socket, exostore& db,
+    db_session(tcp::socket socket, exostore& db, pubsub& pubsub,
         std::set<db_session::pointer>& session_set);
 
     // Starts reading data.
     void start();
 
-    // Shuts down and removes this session from the pool.
+    // Shuts down, unsubscribes from everything and removes this session from
+    // the pool.
     void stop();
 
-private:
+    void deliver(const pubsub::message& m) override;
+
     typedef std::vector<std::vector<unsigned char>> token_list;
 
+    // Runs a command read from the append-only log. The response is dropped.
+    void replay(const token_list& command_tokens);
+
+private:
     void handle_command_line(const boost::system::error_code& ec,
         std::size_t bytes_transferred);
 
     // Writes out the contents of the write buffer.
     void do_write();
     void handle_write(boost::system::error_code ec);
+    // Starts writing the response, if there is one, or else the queued
+    // messages, unless a write is already in flight.
+    void flush_output();
+    void handle_message_write(boost::system::error_code ec,
+        std::size_t count);
+    // Whether the queued messages are over the output limits.
+    bool over_output_limit();
 
     // Calls the appropriate command, given a list of tokens.
     void call(const token_list& command_tokens);
+    // Reads the spilled values of keys back, then calls the command.
+    void read_back_and_call(const token_list& command_tokens,
+        const token_list& keys);
+
+    // Returns the form of a command that is written to the append-only log.
+    token_list loggable_command(const token_list& command_tokens);
+
+    // Parses the start and end of a BITCOUNT or BITPOS range, and the BYTE or
+    // BIT unit after them, if present, into the bits they cover in a string
+    // of size bytes. Negative offsets count back from the end. Sets empty if
+    // the range covers nothing. Writes an error and returns false if they are
+    // invalid.
+    bool parse_bit_range(const token_list& args, std::size_t start_index,
+        std::size_t size, std::uint64_t& first_bit, std::uint64_t& last_bit,
+        bool& empty);
+
+    // A GET, SET or INCRBY of BITFIELD, with the OVERFLOW behaviour in force
+    // for it.
+    struct bitfield_op
+    {
+        enum kind_type {get, set, incrby};
+        kind_type kind;
+        bool is_signed;
+        unsigned bits;
+        std::uint64_t offset;
+        // The value of a SET or the increment of an INCRBY.
+        long long value;
+        field_overflow overflow;
+    };
+    // Parses the subcommands of BITFIELD. Writes an error and returns false
+    // if any of them is invalid.
+    bool parse_bitfield(const token_list& args, std::vector<bitfield_op>& ops);
+
+    // Decodes the HyperLogLog at key, which must exist. Throws
+    // exostore::type_error if the key doesn't hold a string and
+    // hyperloglog::format_error if the string isn't a HyperLogLog.
+    hyperloglog read_hyperloglog(const std::vector<unsigned char>& key);
+
+    // The cursor and options of SCAN and ZSCAN.
+    struct scan_options
+    {
+        std::uint64_t cursor;
+        std::size_t count;
+        bool has_pattern;
+        std::vector<unsigned char> pattern;
+        bool has_type;
+        std::string type;
+    };
+    // Parses the cursor at args[cursor_index] and the options after it. TYPE
+    // is only accepted if allow_type is set. Writes an error and returns false
+    // if they are invalid.
+    bool parse_scan_options(const token_list& args, std::size_t cursor_index,
+        bool allow_type, scan_options& options);
 
     // Responses
     void write_bstring(const exostore::bstring&);
     void write_bstring(const std::string&);
     void write_bstring(const std::vector<unsigned char>&);
+    // Writes part of a buffer as a bulk string.
+    void write_bstring(const unsigned char* data, std::size_t size);
     void write_nullbulk();
     void write_simple_string(const std::string&);
     void write_integer(const long long&);
     void write_array(const std::vector<std::vector<unsigned char>>&);
+    // Writes an array of integers. Elements whose first member is false are
+    // written as nulls.
+    void write_integers(const std::vector<std::pair<bool, long long>>&);
+    // Writes an array of bulk strings. Elements whose first member is false
+    // are written as nulls.
+    void write_bstrings(
+        const std::vector<std::pair<bool, std::vector<unsigned char>>>&);
+    // Writes the two element reply of SCAN and ZSCAN.
+    void write_scan_result(std::uint64_t cursor,
+        const std::vector<std::vector<unsigned char>>& elements);
 
 
     // Commands
     // A command is responsible for calling do_write to write the response.
     void get_command(const token_list& args);
     void set_command(const token_list& args);
+    void del_command(const token_list& args);
+    void flushall_command(const token_list& args);
+    void incrby_command(const token_list& args);
+    void incrbyfloat_command(const token_list& args);
+    void append_command(const token_list& args);
+    void getrange_command(const token_list& args);
+    void setrange_command(const token_list& args);
+    void strlen_command(const token_list& args);
     void getbit_command(const token_list& args);
+    void bitcount_command(const token_list& args);
+    void bitpos_command(const token_list& args);
+    void bitop_command(const token_list& args);
+    void bitop_sparse(bit_operation op,
+        const std::vector<unsigned char>& dest_key,
+        const std::vector<const exostore::bstring*>& values);
     void setbit_command(const token_list& args);
+    void bitfield_command(const token_list& args);
+    void pfadd_command(const token_list& args);
+    void pfcount_command(const token_list& args);
+    void pfmerge_command(const token_list& args);
+    void hset_command(const token_list& args);
+    void hget_command(const token_list& args);
+    void hmget_command(const token_list& args);
+    void hgetall_command(const token_list& args);
+    void hincrby_command(const token_list& args);
     void zadd_command(const token_list& args);
     void zcard_command(const token_list& args);
     void zcount_command(const token_list& args);
+    void zhistogram_command(const token_list& args);
+    void zstore_command(const token_list& args);
+    void zremrange_command(const token_list& args);
     void zrange_command(const token_list& args);
+    void scan_command(const token_list& args);
+    void zscan_command(const token_list& args);
     void save_command(const token_list& args);
+    void bgsave_command(const token_list& args);
+    void bgrewriteaof_command(const token_list& args);
+    void info_command(const token_list& args);
+    void memory_command(const token_list& args);
+    void subscribe_command(const token_list& args);
+    void unsubscribe_command(const token_list& args);
+    void publish_command(const token_list& args);
+    void pubsub_command(const token_list& args);
+
+    // Writes one element of the reply of the subscription commands, without
+    // writing out the write buffer. The channel may be null.
+    void append_subscription_reply(const std::string& kind,
+        const std::vector<unsigned char>* channel);
+    void unsubscribe_all();
 
     // Errors
     // Write error messages as responses
@@ -77,14 +206,38 @@ private:
     void error_key_does_not_exist();
     void error_incorrect_type();
     void error_syntax_error();
+    void error_not_integer();
     void error_custom(const std::string& msg);
+    void error_out_of_memory();
+    void error_loading();
 
     tcp::socket socket_;
     exostore& db_;
+    pubsub& pubsub_;
     std::set<db_session::pointer>& session_set_;
     asio::streambuf read_buffer_;
     asio::streambuf write_buffer_;
     std::ostream out_stream_;
+    // Set when the current command writes an error response.
+    bool command_failed_;
+    bool replaying_;
+
+    // Channels and patterns this session is subscribed to.
+    std::set<std::vector<unsigned char>> channels_;
+    std::set<std::vector<unsigned char>> patterns_;
+    // Messages waiting to be written, and their total size.
+    std::deque<pubsub::message> messages_;
+    std::size_t message_bytes_;
+    // Whether the messages waiting have been over the soft limit since
+    // over_soft_limit_since_.
+    bool over_soft_limit_;
+    std::chrono::steady_clock::time_point over_soft_limit_since_;
+    // Set while a write is in flight, and while the response is waiting to
+    // be written.
+    bool writing_;
+    bool response_ready_;
+    // Set once the session is being disconnected for falling behind.
+    bool closing_;
 };
 
 #endif
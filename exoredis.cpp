@@ -2,11 +2,17 @@
 #include <utility>
 #include <set>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
 #include <boost/asio.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/bind.hpp>
 #include "exostore.hpp"
 #include "db_session.hpp"
+#include "append_log.hpp"
+#include "config.hpp"
+#include "pubsub.hpp"
 
 namespace asio = boost::asio;
 using boost::asio::ip::tcp;
@@ -14,28 +20,47 @@ using boost::asio::ip::tcp;
 /*
  * The fundamental server class. OWns the database.
  * Responsible for accepting and managing new connections.
- * Also runs a timer to expire keys from the database.
+ * Also runs a timer to expire keys from the database and to look after the
+ * append-only log, and a faster one for active defragmentation.
  */
 class exoredis_server
 {
 public:
     exoredis_server(asio::io_service& io, const tcp::endpoint& endpoint,
-        std::string db_path)
-        : acceptor_(io, endpoint), socket_(io), db_(db_path),
-          expiry_timer_(io), signals_(io, SIGINT), io_(io)
+        const server_config& config)
+        : acceptor_(io, endpoint), socket_(io), db_(config.db_path),
+          expiry_timer_(io), defrag_timer_(io), signals_(io, SIGINT), io_(io),
+          config_(config)
     {
         std::cout << "Starting server..." << std::endl;
-        try
+        db_.set_load_threads(config.load_threads);
+        db_.set_memory_limit(config.max_memory,
+            exostore::eviction_policy_from_name(config.max_memory_policy),
+            config.max_memory_samples);
+        db_.set_active_defrag(config.active_defrag,
+            config.active_defrag_threshold, config.active_defrag_ignore_bytes);
+        pubsub::output_limits limits;
+        limits.hard_limit = config.pubsub_hard_limit;
+        limits.soft_limit = config.pubsub_soft_limit;
+        limits.soft_seconds = config.pubsub_soft_seconds;
+        pubsub_.set_limits(limits);
+        if (!config.mapped_path.empty())
         {
-            db_.load();
+            db_.open_mapped_store(config.mapped_path);
         }
-        catch (const exostore::load_error& e)
+        if (!config.spill_path.empty())
         {
-            std::cout << e.what() << std::endl;
+            db_.open_spill_log(config.spill_path, config.spill_idle_seconds,
+                config.spill_min_size);
         }
+        load();
         expiry_timer_.expires_from_now(boost::posix_time::seconds(2));
         expiry_timer_.async_wait(boost::bind(&exoredis_server::handle_timer,
             this, asio::placeholders::error));
+        if (config.active_defrag)
+        {
+            schedule_defrag();
+        }
         signals_.async_wait(boost::bind(&exoredis_server::handle_signal, this,
             asio::placeholders::error, asio::placeholders::signal_number));
         do_accept();
@@ -50,12 +75,23 @@ public:
     {
         std::cout << "\nStopping server..." << std::endl;
         expiry_timer_.cancel();
+        defrag_timer_.cancel();
         for (auto session: session_set_)
         {
             session->stop();
         }
         session_set_.clear();
-        db_.save();
+        db_.kill_background_job();
+        if (db_.loading())
+        {
+            // Saving now would overwrite the file with a partial database.
+            db_.cancel_loading();
+        }
+        else
+        {
+            db_.sync_log();
+            db_.save();
+        }
         acceptor_.close();
         socket_.close();
         signals_.cancel();
@@ -64,6 +100,71 @@ public:
     }
 
 private:
+    // Loads the database. If the append-only log is enabled and exists, it is
+    // replayed instead of loading the snapshot. Replaying always happens
+    // before the server starts, but the snapshot can be loaded in the
+    // background.
+    void load()
+    {
+        if (!config_.log_path.empty() && append_log::exists(config_.log_path))
+        {
+            std::cout << "Replaying append-only log..." << std::endl;
+            auto replayer = std::make_shared<db_session>(tcp::socket(io_), db_,
+                pubsub_, session_set_);
+            append_log::replay(config_.log_path,
+                [&replayer](const append_log::command& cmd)
+                {
+                    replayer->replay(cmd);
+                });
+        }
+        else if (config_.async_load)
+        {
+            std::cout << "Loading database in the background..." << std::endl;
+            db_.start_loading([this]()
+            {
+                io_.post(boost::bind(&exoredis_server::handle_loaded, this));
+            });
+            return;
+        }
+        else
+        {
+            try
+            {
+                db_.load();
+            }
+            catch (const exostore::load_error& e)
+            {
+                std::cout << e.what() << std::endl;
+            }
+        }
+
+        open_log();
+    }
+
+    // Called on the server's thread once background loading is done.
+    void handle_loaded()
+    {
+        try
+        {
+            db_.finish_loading();
+            std::cout << "Database loaded." << std::endl;
+        }
+        catch (const exostore::load_error& e)
+        {
+            std::cout << e.what() << std::endl;
+        }
+        open_log();
+    }
+
+    void open_log()
+    {
+        if (!config_.log_path.empty())
+        {
+            db_.open_log(config_.log_path, config_.log_rewrite_percentage,
+                config_.log_rewrite_min_size);
+        }
+    }
+
     // Accept a connection and start a session.
     void do_accept()
     {
@@ -73,7 +174,7 @@ private:
             if (!ec)
             {
                 auto new_session = std::make_shared<db_session>(
-                    std::move(socket_), db_, session_set_);
+                    std::move(socket_), db_, pubsub_, session_set_);
                 session_set_.insert(new_session);
                 new_session->start();
             }
@@ -82,15 +183,90 @@ private:
         });
     }
 
-    // Expires the database keys.
+    // Expires the database keys, flushes the append-only log or the mapped
+    // store and rewrites the log if it has grown too much. Evicts keys if
+    // memory use is over the limit, spills cold strings, and saves in the
+    // background if a save policy says so.
     void handle_timer(boost::system::error_code ec)
     {
         db_.expire_keys();
+        db_.make_room();
+        db_.sync_log();
+        db_.sync_store();
+        db_.spill_cold_values();
+        auto failed_job = db_.check_background_job();
+        if (failed_job == exostore::background_job::save)
+        {
+            std::cout << "Background save failed." << std::endl;
+        }
+        else if (failed_job == exostore::background_job::log_rewrite)
+        {
+            report_rewrite_failure();
+        }
+
+        if (save_due() && db_.save_in_background())
+        {
+            std::cout << "Saving in the background..." << std::endl;
+        }
+        else if (db_.log_rewrite_due())
+        {
+            if (db_.rewrite_log_in_background())
+            {
+                std::cout << "Rewriting append-only log in the background..."
+                    << std::endl;
+            }
+            else if (!db_.background_job_running())
+            {
+                // The fork failed.
+                report_rewrite_failure();
+            }
+        }
         expiry_timer_.expires_from_now(boost::posix_time::seconds(2));
         expiry_timer_.async_wait(boost::bind(&exoredis_server::handle_timer,
             this, asio::placeholders::error));
     }
 
+    void report_rewrite_failure()
+    {
+        std::cout << "Append-only log rewrite failed, retrying in "
+            << append_log::rewrite_retry_seconds << " seconds." << std::endl;
+    }
+
+    void schedule_defrag()
+    {
+        defrag_timer_.expires_from_now(boost::posix_time::milliseconds(100));
+        defrag_timer_.async_wait(boost::bind(
+            &exoredis_server::handle_defrag_timer, this,
+            asio::placeholders::error));
+    }
+
+    // Does a bounded step of active defragmentation, so that commands are
+    // never held up for long.
+    void handle_defrag_timer(boost::system::error_code ec)
+    {
+        if (ec == asio::error::operation_aborted)
+        {
+            return;
+        }
+        db_.defrag_step();
+        schedule_defrag();
+    }
+
+    bool save_due()
+    {
+        auto since_last_save = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now() - db_.last_save_time()).count();
+        for (const auto& policy: config_.save_policies)
+        {
+            if (db_.dirty() >= policy.changes && db_.dirty() > 0
+                && since_last_save >= policy.seconds)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void handle_signal(boost::system::error_code ec, int signal_number)
     {
         stop();
@@ -99,25 +275,34 @@ private:
     tcp::acceptor acceptor_;
     tcp::socket socket_;
     exostore db_;
+    pubsub pubsub_;
     std::set<db_session::pointer> session_set_;
     asio::deadline_timer expiry_timer_;
+    asio::deadline_timer defrag_timer_;
     asio::signal_set signals_;
     asio::io_service& io_;
+    server_config config_;
 };
 
 int main(int argc, char** argv)
 {
     try
     {
-        if (argc != 2)
+        server_config config;
+        try
+        {
+            config = server_config::from_args(
+                std::vector<std::string>(argv + 1, argv + argc));
+        }
+        catch (const server_config::config_error& e)
         {
-            std::cerr << "Usage: exoredis <db_path>" << std::endl;
+            std::cerr << e.what() << std::endl << server_config::usage();
             return 1;
         }
 
         asio::io_service io_service;
         exoredis_server server(io_service, tcp::endpoint(tcp::v4(), 15000),
-            argv[1]);
+            config);
         io_service.run();
     }
     catch (const std::exception& e)
@@ -5,213 +5,2323 @@
 #include <fstream>
 #include <iostream>
 #include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <utility>
+#include <algorithm>
+#include <limits>
+#include <iterator>
+#include <random>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <malloc.h>
+#include <boost/lexical_cast.hpp>
+
+namespace
+{
+    // New keys start with this LFU counter, so that they aren't evicted
+    // before they get a chance to be accessed.
+    const std::uint8_t lfu_initial_value = 5;
+    // The higher this is, the more accesses it takes to raise the counter.
+    const double lfu_log_factor = 10;
+    // The counter goes down by one for each period that passes without an
+    // access.
+    const unsigned int lfu_decay_minutes = 1;
+    // Eviction is spread out over calls to make_room(), so that no single
+    // command waits too long.
+    const std::size_t max_evictions_per_call = 64;
+    const std::size_t eviction_pool_size = 16;
+    // Sampling gives up after looking at this many buckets per sample.
+    const std::size_t max_buckets_per_sample = 16;
+    // Values that take more allocations than this to free are freed on the
+    // lazy free thread.
+    const std::size_t lazy_free_threshold = 64;
+    // Set in SCAN cursors that are past the hash table and into the mapped
+    // store.
+    const std::uint64_t store_scan_phase = std::uint64_t(1) << 63;
+    // Entries visited by each step of active defragmentation.
+    const std::size_t defrag_step_size = 1000;
+    // Sorted sets larger than this are defragmented over several steps.
+    const std::size_t defrag_zset_inline_size = 128;
+    // Keys looked at by each call to spill_cold_values(), which carries on
+    // from where the last call stopped.
+    const std::size_t spill_step_size = 10000;
+    // Records copied by each step of mapped store compaction.
+    const std::size_t store_compaction_step_size = 10000;
+}
 
 exostore::exostore(std::string file_path)
-    : db_path_(file_path)
+    : db_path_(file_path), load_threads_(0), loading_(false),
+      load_total_bytes_(0), load_loaded_bytes_(0), load_loaded_keys_(0),
+      cancel_loading_(false), dirty_(0),
+      last_save_time_(chrono::system_clock::now()), spill_idle_seconds_(0),
+      spill_min_size_(0), spilled_count_(0), spill_cursor_(0),
+      collecting_spilled_(false), collect_cursor_(0),
+      clock_start_(chrono::steady_clock::now()), key_memory_(0),
+      value_memory_(), max_memory_(0),
+      policy_(exostore::eviction_policy::noeviction), eviction_samples_(5),
+      evicted_keys_(0), random_(std::random_device()()),
+      defrag_enabled_(false), defrag_threshold_(0), defrag_ignore_bytes_(0),
+      defrag_running_(false), defrag_cursor_(0), defrag_keys_done_(false),
+      defrag_zset_cursor_(0), defrag_moved_(0), defrag_cycles_(0),
+      defrag_moved_at_start_(0), defrag_fruitless_slabs_(0),
+      child_pid_(0),
+      child_job_(exostore::background_job::none), changes_at_fork_(0)
+{
+}
+
+exostore::~exostore()
+{
+    cancel_loading();
+    kill_background_job();
+}
+
+exostore::entry::entry()
+    : memory(0), kind(exostore::no_value), access_time(0), lfu_time(0),
+      lfu_counter(lfu_initial_value)
+{
+}
+
+void exostore::touch(const std::vector<unsigned char>& key)
+{
+    auto it = map_.find(key);
+    if (it != map_.end())
+    {
+        record_access(it->second);
+        update_memory(it->second);
+    }
+    if (it == map_.end() || !write_through(key, it->second.value))
+    {
+        dirty_++;
+    }
+}
+
+void exostore::touch(const std::vector<unsigned char>& key,
+    std::size_t offset, std::size_t length)
 {
+    auto it = map_.find(key);
+    if (store_ && it != map_.end()
+        && it->second.value.type() == typeid(exostore::bstring))
+    {
+        const auto& bstring = boost::any_cast<const exostore::bstring&>(
+            it->second.value);
+        // Falls back to writing the whole value if the record has to move.
+        if (bstring.has_bytes() && offset + length <= bstring.size()
+            && store_->put_range(key, offset, bstring.bdata().data() + offset,
+                length, bstring.size()))
+        {
+            record_access(it->second);
+            update_memory(it->second);
+            return;
+        }
+    }
+    touch(key);
 }
 
 bool exostore::key_exists(const std::vector<unsigned char>& key)
 {
-    return map_.count(key) != 0 && !expire_if_needed(key);
+    fault_in(key);
+    auto it = map_.find(key);
+    if (it == map_.end() || expire_if_needed(key))
+    {
+        return false;
+    }
+    record_access(it->second);
+    return true;
+}
+
+bool exostore::remove(const std::vector<unsigned char>& key)
+{
+    auto it = map_.find(key);
+    if (it == map_.end())
+    {
+        // The key may only be in the mapped store. Strings there are
+        // persisted by the store, so removing them doesn't dirty the
+        // snapshot.
+        mapped_store::entry stored;
+        if (!store_ || !store_->find(key, stored))
+        {
+            return false;
+        }
+        store_->remove(key);
+        return !stored.has_expiry || chrono::system_clock::now()
+            < chrono::system_clock::time_point(
+                chrono::milliseconds(stored.expiry_ms));
+    }
+
+    if (expire_if_needed(key))
+    {
+        return false;
+    }
+    if (!store_ || it->second.value.type() != typeid(exostore::bstring))
+    {
+        dirty_++;
+    }
+    erase(it);
+    return true;
 }
 
 void exostore::expire_keys()
 {
     for (auto it = map_.begin(); it != map_.end(); )
     {
-        if (it->second.type() == typeid(exostore::bstring))
+        if (value_expired(it->second.value))
+        {
+            dirty_++;
+            it = erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+
+bool exostore::value_expired(const boost::any& value)
+{
+    if (value.type() == typeid(exostore::bstring))
+    {
+        return boost::any_cast<const exostore::bstring&>(value).has_expired();
+    }
+    else if (value.type() == typeid(exostore::spilled_string))
+    {
+        return boost::any_cast<const exostore::spilled_string&>(
+            value).has_expired();
+    }
+    return false;
+}
+
+std::uint64_t exostore::scan(std::uint64_t cursor, std::size_t count,
+    std::function<void(const std::vector<unsigned char>& key,
+        const std::string& type)> f) const
+{
+    if ((cursor & store_scan_phase) == 0)
+    {
+        // The cursor runs over bucket indexes.
+        const std::uint64_t mask = scan_mask(map_.bucket_count());
+        std::size_t seen = 0;
+        for (std::size_t buckets = 0; !map_.empty() && seen < count
+            && buckets < count * 10; buckets++)
         {
-            auto& val = boost::any_cast<exostore::bstring&>(it->second);
-            if (val.has_expired())
+            // Past the last bucket if the count isn't a power of two.
+            auto bucket = cursor & mask;
+            if (bucket < map_.bucket_count())
             {
-                it = map_.erase(it);
-                continue;
+                for (auto it = map_.begin(bucket); it != map_.end(bucket); it++)
+                {
+                    const auto& value = it->second.value;
+                    // With the mapped store, strings are scanned there.
+                    if ((store_ && value.type() == typeid(exostore::bstring))
+                        || value_expired(value))
+                    {
+                        continue;
+                    }
+                    f(it->first, value.type() == typeid(exostore::zset) ? "zset"
+                        : value.type() == typeid(exostore::hash) ? "hash"
+                        : "string");
+                    seen++;
+                }
+            }
+            cursor = next_scan_cursor(cursor, mask);
+            if (cursor == 0)
+            {
+                break;
+            }
+        }
+        if (!map_.empty() && cursor != 0)
+        {
+            return cursor;
+        }
+        return store_ ? store_scan_phase : 0;
+    }
+
+    const auto now = chrono::system_clock::now();
+    cursor = store_->scan(cursor & ~store_scan_phase, count,
+        [&f, now](const std::vector<unsigned char>& key,
+            const mapped_store::entry& entry)
+        {
+            if (!entry.has_expiry || now < chrono::system_clock::time_point(
+                chrono::milliseconds(entry.expiry_ms)))
+            {
+                f(key, "string");
             }
+        });
+    return cursor == 0 ? 0 : cursor | store_scan_phase;
+}
+
+exostore::map_type::iterator exostore::erase(exostore::map_type::iterator it)
+{
+    if (store_)
+    {
+        store_->remove(it->first);
+    }
+    release_spilled(it->second.value);
+    dispose(it->second.value);
+    key_memory_ -= key_memory(it->first);
+    value_memory_[it->second.kind] -= it->second.memory;
+    return map_.erase(it);
+}
+
+void exostore::clear(bool lazily)
+{
+    if (store_)
+    {
+        std::vector<std::vector<unsigned char>> stored_keys;
+        store_->for_each([&stored_keys](const std::vector<unsigned char>& key,
+            const mapped_store::entry&)
+        {
+            stored_keys.push_back(key);
+        });
+        for (const auto& key: stored_keys)
+        {
+            store_->remove(key);
         }
-        it++;
     }
+    std::size_t effort = 0;
+    for (const auto& pair: map_)
+    {
+        release_spilled(pair.second.value);
+        effort += 1 + free_effort(pair.second.value);
+    }
+
+    dirty_ += map_.size();
+    eviction_pool_.clear();
+    if (lazily || effort > lazy_free_threshold)
+    {
+        lazy_free_.free(std::move(map_));
+    }
+    map_type().swap(map_);
+    key_memory_ = 0;
+    std::fill(std::begin(value_memory_), std::end(value_memory_), 0);
+}
+
+std::size_t exostore::free_effort(const boost::any& value)
+{
+    // Freeing a sorted set or an unpacked hash frees every node, while a
+    // string or a packed hash is a single buffer.
+    if (value.type() == typeid(exostore::zset))
+    {
+        return boost::any_cast<const exostore::zset&>(value).size();
+    }
+    if (value.type() == typeid(exostore::hash))
+    {
+        const auto& hash = boost::any_cast<const exostore::hash&>(value);
+        return hash.is_packed() ? 1 : hash.size();
+    }
+    return 1;
+}
+
+void exostore::dispose(boost::any& value)
+{
+    if (free_effort(value) > lazy_free_threshold)
+    {
+        lazy_free_.free(std::move(value));
+    }
+    value = boost::any();
+}
+
+std::size_t exostore::lazy_free_pending() const
+{
+    return lazy_free_.pending();
+}
+
+std::size_t exostore::lazy_freed() const
+{
+    return lazy_free_.freed();
+}
+
+std::uint32_t exostore::access_clock() const
+{
+    return chrono::duration_cast<chrono::seconds>(
+        chrono::steady_clock::now() - clock_start_).count();
 }
 
 /*
- *  The file starts with the bytes EXODB.
- *  Then the number of key-value pairs which is an std::size_t.
- *  Then each key value pair. The key is preceded by the number of bytes,
- *  which is also a size_t.
+ *  The file starts with the bytes EXOD2, followed by segments of key-value
+ *  pairs. Each segment can be decoded on its own, so segments are loaded in
+ *  parallel. After the last segment comes the segment index: the number of
+ *  segments (std::size_t), then for each segment its offset in the file, its
+ *  size in bytes and the number of keys in it (all size_t). The file ends with
+ *  the offset of the index (size_t).
+ *
+ *  In a key value pair, the key is preceded by the number of bytes, which is
+ *  also a size_t.
  *  The value is preceded by either BSTR or ZSET, indicating the type of the
  *  value.
  *  A BSTR is represented as its size in bytes (size_t) followed by the contents.
  *  A ZSET is represented by the number of members, followed by score-member pairs
- *  in no defined order.
+ *  sorted by score and then by member, so that it can be rebuilt in linear time.
  *  A score-member pair is a 64-bit double, followed by the size of the member
  *  in bytes, then the contents of the member.
+ *
+ *  Older files start with the bytes EXODB, followed by the number of key-value
+ *  pairs (size_t) and then the pairs themselves, with no segments. They are
+ *  still loaded, on a single thread.
  */
 
-void exostore::save()
+namespace
 {
-    // Expire all keys first.
-    expire_keys();
+    const std::string segmented_header = "EXOD2";
+    const std::string sequential_header = "EXODB";
+    const std::string bstr_marker = "BSTR";
+    const std::string zset_marker = "ZSET";
+    const std::string hash_marker = "HASH";
+    // A string kept as a sparse bitmap, saved in its serialized form.
+    const std::string sbmp_marker = "SBMP";
+    // Segments are cut once they reach this many bytes.
+    const std::size_t segment_size = 4 * 1024 * 1024;
 
-    std::ofstream out(db_path_, std::ofstream::out|std::ofstream::binary);
-    auto header = string_to_vec("EXODB");
-    out.write(reinterpret_cast<const char*>(header.data()), header.size());
-    const auto bstr_marker = string_to_vec("BSTR");
-    const auto zset_marker = string_to_vec("ZSET");
-    // Write out the number of keys.
-    std::size_t num_keys =  map_.size();
-    out.write(reinterpret_cast<const char*>(&num_keys), sizeof(num_keys));
-    for (const auto& pair: map_)
+    struct segment_info
+    {
+        std::size_t offset;
+        std::size_t size;
+        std::size_t num_keys;
+    };
+
+    template <typename T>
+    void append_pod(std::vector<unsigned char>& out, const T& value)
+    {
+        auto bytes = reinterpret_cast<const unsigned char*>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(value));
+    }
+
+    void append_bytes(std::vector<unsigned char>& out,
+        const std::vector<unsigned char>& bytes)
+    {
+        append_pod(out, bytes.size());
+        out.insert(out.end(), bytes.begin(), bytes.end());
+    }
+
+    void append_marker(std::vector<unsigned char>& out, const std::string& marker)
+    {
+        out.insert(out.end(), marker.begin(), marker.end());
+    }
+
+    // Serializes a key-value pair. Returns false if the value is not saved:
+    // if its type can't be saved, if it has expired or if it's a string and
+    // strings are left out.
+    bool encode_pair(std::vector<unsigned char>& out,
+        const std::vector<unsigned char>& key, const boost::any& value,
+        bool include_strings)
     {
-        std::size_t key_size = pair.first.size();
-        out.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
-        out.write(reinterpret_cast<const char*>(pair.first.data()),
-            pair.first.size());
-        if (pair.second.type() == typeid(exostore::bstring))
+        if (value.type() == typeid(exostore::bstring))
         {
-            // Write marker.
-            out.write(reinterpret_cast<const char*>(bstr_marker.data()),
-                bstr_marker.size());
             const auto& bstring = boost::any_cast<const exostore::bstring&>(
-                pair.second);
-            // Write bstring length.
-            std::size_t bstring_size = bstring.bdata().size();
-            out.write(reinterpret_cast<const char*>(&bstring_size),
-                sizeof(bstring_size));
-            // Write out the bstring.
-            out.write(reinterpret_cast<const char*>(bstring.bdata().data()),
-                bstring.bdata().size());
-        }
-        else if (pair.second.type() == typeid(exostore::zset))
-        {
-            // Write marker.
-            out.write(reinterpret_cast<const char*>(zset_marker.data()),
-                zset_marker.size());
-            const auto& zset = boost::any_cast<const exostore::zset&>(pair.second);
-            // Write size of zset.
-            std::size_t zset_size = zset.size();
-            out.write(reinterpret_cast<const char*>(&zset_size),
-                sizeof(zset_size));
-            // Write out score-member pairs.
-            auto its =  zset.element_range(0, zset_size - 1);
+                value);
+            if (!include_strings || bstring.has_expired())
+            {
+                return false;
+            }
+            append_bytes(out, key);
+            if (bstring.is_sparse())
+            {
+                append_marker(out, sbmp_marker);
+                append_bytes(out, bstring.sparse().serialize());
+            }
+            else if (bstring.is_integer())
+            {
+                append_marker(out, bstr_marker);
+                append_bytes(out, bstring.bytes());
+            }
+            else
+            {
+                append_marker(out, bstr_marker);
+                append_bytes(out, bstring.bdata());
+            }
+        }
+        else if (value.type() == typeid(exostore::zset))
+        {
+            append_bytes(out, key);
+            append_marker(out, zset_marker);
+            const auto& zset = boost::any_cast<const exostore::zset&>(value);
+            append_pod(out, zset.size());
+            auto its = zset.element_range(0, zset.size() - 1);
             for (auto it = its.first; it != its.second; it++)
             {
-                // Write out score.
-                auto score = it->score();
-                out.write(reinterpret_cast<const char*>(&score), sizeof(score));
-                // Write member size.
-                std::size_t member_size = it->member().size();
-                out.write(reinterpret_cast<const char*>(&member_size),
-                    sizeof(member_size));
-                // Write member contents.
-                out.write(reinterpret_cast<const char*>(it->member().data()),
-                    member_size);
+                append_pod(out, it->score());
+                append_bytes(out, it->member());
             }
         }
+        else if (value.type() == typeid(exostore::hash))
+        {
+            append_bytes(out, key);
+            append_marker(out, hash_marker);
+            const auto& hash = boost::any_cast<const exostore::hash&>(value);
+            append_pod(out, hash.size());
+            hash.for_each([&out](const exostore::hash::field_type& field,
+                const exostore::hash::field_type& value)
+            {
+                append_bytes(out, field);
+                append_bytes(out, value);
+            });
+        }
+        else
+        {
+            return false;
+        }
+        return true;
     }
-}
 
-void exostore::load()
-{
-    std::ifstream in(db_path_, std::ifstream::binary);
-    if (!in.is_open())  // File doesn't exist
+    // Reads from a file. Throws std::ifstream::failure when the file ends
+    // early, or load_error when a length runs past the end of the file.
+    class stream_reader
     {
-        return;
-    }
-    in.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    public:
+        stream_reader(std::ifstream& in) : in_(in), pos_(in.tellg())
+        {
+            in_.seekg(0, std::ios::end);
+            end_ = in_.tellg();
+            in_.seekg(pos_);
+        }
 
-    // Add the keys to this map first, then copy only if there are no errors.
-    boost::unordered_map<std::vector<unsigned char>, boost::any> temp_map;
-    try
+        template <typename T>
+        T read_pod()
+        {
+            T value;
+            in_.read(reinterpret_cast<char*>(&value), sizeof(value));
+            pos_ += sizeof(value);
+            return value;
+        }
+
+        std::vector<unsigned char> read_vec(std::size_t size)
+        {
+            // Checked first, so that a corrupt length is never allocated.
+            if (size > remaining())
+            {
+                throw exostore::load_error("Bad file format");
+            }
+            pos_ += size;
+            return vec_from_file(in_, size);
+        }
+
+        std::size_t remaining() const
+        {
+            return pos_ < end_ ? end_ - pos_ : 0;
+        }
+
+        // Moves to an offset in the file.
+        void seek(std::size_t pos)
+        {
+            in_.seekg(pos);
+            pos_ = pos;
+        }
+
+    private:
+        std::ifstream& in_;
+        std::size_t pos_;
+        std::size_t end_;
+    };
+
+    // Reads from a segment in memory.
+    class buffer_reader
     {
-        // Read header.
-        std::vector<unsigned char> header = std::move(vec_from_file(in, 5));
-        if (vec_to_string(header) != "EXODB")
+    public:
+        buffer_reader(const std::vector<unsigned char>& buffer)
+            : buffer_(buffer), pos_(0) {}
+
+        template <typename T>
+        T read_pod()
         {
-            throw exostore::load_error("Incorrect file header");
+            check(sizeof(T));
+            T value;
+            std::memcpy(&value, buffer_.data() + pos_, sizeof(value));
+            pos_ += sizeof(value);
+            return value;
         }
 
-        // Read number of keys.
-        std::size_t num_keys;
-        in.read(reinterpret_cast<char*>(&num_keys), sizeof(num_keys));
-
-        for (std::size_t i = 0; i < num_keys; i++)
-        {
-            // Read the key size.
-            std::size_t key_size;
-            in.read(reinterpret_cast<char*>(&key_size), sizeof(key_size));
-            // Read the key.
-            auto key = std::move(vec_from_file(in, key_size));
-            // Read the value marker.
-            auto value_marker = std::move(vec_from_file(in, 4));
-            std::string marker_str = vec_to_string(value_marker);
-            if (marker_str == "BSTR")   // Binary string
-            {
-                // Read bstring length.
-                std::size_t bstring_size;
-                in.read(reinterpret_cast<char*>(&bstring_size),
-                    sizeof(bstring_size));
-                // Read bstring content.
-                auto bstring_content = std::move(vec_from_file(in,
-                    bstring_size));
-                // Add to database.
-                temp_map[key] = exostore::bstring(bstring_content);
-            }
-            else if(marker_str == "ZSET")   // Sorted set
-            {
-                // Read size of zset.
-                std::size_t zset_size;
-                in.read(reinterpret_cast<char*>(&zset_size), sizeof(zset_size));
-                // Read score-member pairs into zset.
-                exostore::zset zset;
-                for (std::size_t j = 0; j < zset_size; j++)
-                {
-                    // Read score.
-                    double score;
-                    in.read(reinterpret_cast<char*>(&score), sizeof(score));
-                    // Read member size.
-                    std::size_t member_size;
-                    in.read(reinterpret_cast<char*>(&member_size),
-                        sizeof(member_size));
-                    // Read member.
-                    auto member = std::move(vec_from_file(in, member_size));
-                    // Add to zset.
-                    zset.add(member, score);
-                }
-                // Add to database.
-                temp_map[key] = zset;
+        std::vector<unsigned char> read_vec(std::size_t size)
+        {
+            check(size);
+            std::vector<unsigned char> ret(buffer_.begin() + pos_,
+                buffer_.begin() + pos_ + size);
+            pos_ += size;
+            return ret;
+        }
+
+        bool at_end() const
+        {
+            return pos_ == buffer_.size();
+        }
+
+        std::size_t remaining() const
+        {
+            return buffer_.size() - pos_;
+        }
+
+    private:
+        void check(std::size_t size) const
+        {
+            if (size > buffer_.size() - pos_)
+            {
+                throw exostore::load_error("Bad file format");
             }
         }
-    }
-    catch (std::ifstream::failure e)
+
+        const std::vector<unsigned char>& buffer_;
+        std::size_t pos_;
+    };
+
+    // Reads a key-value pair and adds it to the map.
+    template <typename Reader, typename Map>
+    void decode_pair(Reader& reader, Map& map)
     {
-        throw exostore::load_error("Bad file format");
+        auto key = reader.read_vec(reader.template read_pod<std::size_t>());
+        std::string marker_str = vec_to_string(reader.read_vec(4));
+        if (marker_str == bstr_marker)   // Binary string
+        {
+            auto bstring_content = reader.read_vec(
+                reader.template read_pod<std::size_t>());
+            map[std::move(key)].value = exostore::bstring(bstring_content);
+        }
+        else if (marker_str == sbmp_marker)   // Sparse bitmap
+        {
+            auto serialized = reader.read_vec(
+                reader.template read_pod<std::size_t>());
+            exostore::bstring bstring;
+            try
+            {
+                bstring.set_sparse(sparse_bitmap::deserialize(serialized));
+            }
+            catch (const std::invalid_argument&)
+            {
+                throw exostore::load_error("Bad sparse bitmap");
+            }
+            map[std::move(key)].value = std::move(bstring);
+        }
+        else if (marker_str == zset_marker)   // Sorted set
+        {
+            auto zset_size = reader.template read_pod<std::size_t>();
+            // Each element takes at least a score and a member length.
+            if (zset_size > reader.remaining()
+                / (sizeof(double) + sizeof(std::size_t)))
+            {
+                throw exostore::load_error("Bad sorted set size");
+            }
+            // Read score-member pairs, which are in sorted order.
+            exostore::zset::element_list elements;
+            elements.reserve(zset_size);
+            for (std::size_t j = 0; j < zset_size; j++)
+            {
+                auto score = reader.template read_pod<double>();
+                auto member = reader.read_vec(
+                    reader.template read_pod<std::size_t>());
+                elements.emplace_back(score, std::move(member));
+            }
+            // Build the zset in one go and add it to the database.
+            try
+            {
+                map[std::move(key)].value = exostore::zset(std::move(elements));
+            }
+            catch (const std::invalid_argument&)
+            {
+                throw exostore::load_error("Duplicate member in sorted set");
+            }
+        }
+        else if (marker_str == hash_marker)   // Hash
+        {
+            auto hash_size = reader.template read_pod<std::size_t>();
+            exostore::hash hash;
+            for (std::size_t j = 0; j < hash_size; j++)
+            {
+                auto field = reader.read_vec(
+                    reader.template read_pod<std::size_t>());
+                auto value = reader.read_vec(
+                    reader.template read_pod<std::size_t>());
+                hash.set(field, value);
+            }
+            map[std::move(key)].value = std::move(hash);
+        }
+        else
+        {
+            throw exostore::load_error("Unknown value type " + marker_str);
+        }
     }
+}
+
+void exostore::save()
+{
+    // Expire all keys first.
+    expire_keys();
 
-    map_ = std::move(temp_map);
+    auto changes = dirty_;
+    write_snapshot();
+    saved(changes);
 }
 
-bool exostore::expire_if_needed(const std::vector<unsigned char>& key)
+bool exostore::save_in_background()
 {
-    if (map_.count(key) == 0)
+    if (background_job_running())
     {
         return false;
     }
 
-    auto& value = map_.at(key);
-    if (value.type() != typeid(exostore::bstring))
+    pid_t pid = ::fork();
+    if (pid == -1)
     {
         return false;
     }
 
-    auto& bstr = boost::any_cast<exostore::bstring&>(value);
-    if (bstr.has_expired())
+    if (pid == 0)
     {
-        map_.erase(key);
-        return true;
+        // In the child, which has its own copy of the keyspace.
+        // Expired keys are skipped rather than removed here, since removing
+        // them could touch the mapped store, which is shared with the parent.
+        int status = 0;
+        try
+        {
+            write_snapshot();
+        }
+        catch (const std::exception&)
+        {
+            status = 1;
+        }
+        ::_exit(status);
     }
-    else
+
+    child_pid_ = pid;
+    child_job_ = exostore::background_job::save;
+    changes_at_fork_ = dirty_;
+    return true;
+}
+
+std::size_t exostore::dirty() const
+{
+    return dirty_;
+}
+
+chrono::system_clock::time_point exostore::last_save_time() const
+{
+    return last_save_time_;
+}
+
+void exostore::saved(std::size_t changes)
+{
+    // Changes made since the save started still count.
+    dirty_ -= std::min(changes, dirty_);
+    last_save_time_ = chrono::system_clock::now();
+}
+
+void exostore::write_snapshot()
+{
+    // Write to a temporary file and swap it in, so that a failed save never
+    // leaves a half-written file behind.
+    const auto temp_path = db_path_ + ".tmp."
+        + boost::lexical_cast<std::string>(::getpid());
+    std::ofstream out(temp_path, std::ofstream::out|std::ofstream::binary);
+    if (!out.is_open())
     {
-        return false;
+        throw std::runtime_error("Could not open " + temp_path);
+    }
+    out.write(segmented_header.data(), segmented_header.size());
+    std::size_t offset = segmented_header.size();
+
+    std::vector<segment_info> index;
+    std::vector<unsigned char> segment;
+    std::size_t segment_keys = 0;
+    auto write_segment = [&]()
+    {
+        out.write(reinterpret_cast<const char*>(segment.data()), segment.size());
+        index.push_back(segment_info{offset, segment.size(), segment_keys});
+        offset += segment.size();
+        segment.clear();
+        segment_keys = 0;
+    };
+
+    for (const auto& pair: map_)
+    {
+        const boost::any* value = &pair.second.value;
+        boost::any unspilled;
+        if (value->type() == typeid(exostore::spilled_string))
+        {
+            unspilled = unspill(
+                boost::any_cast<const exostore::spilled_string&>(*value));
+            value = &unspilled;
+        }
+
+        // Strings in the mapped store are already on disk.
+        if (encode_pair(segment, pair.first, *value, !store_))
+        {
+            segment_keys++;
+        }
+        if (segment.size() >= segment_size)
+        {
+            write_segment();
+        }
+    }
+    if (segment_keys > 0)
+    {
+        write_segment();
+    }
+
+    // Write the index.
+    std::vector<unsigned char> footer;
+    append_pod(footer, index.size());
+    for (const auto& info: index)
+    {
+        append_pod(footer, info.offset);
+        append_pod(footer, info.size);
+        append_pod(footer, info.num_keys);
+    }
+    append_pod(footer, offset);
+    out.write(reinterpret_cast<const char*>(footer.data()), footer.size());
+    out.close();
+
+    if (!out || std::rename(temp_path.c_str(), db_path_.c_str()) != 0)
+    {
+        std::remove(temp_path.c_str());
+        throw std::runtime_error("Saving to " + db_path_ + " failed");
+    }
+}
+
+void exostore::load()
+{
+    exostore::map_type temp_map;
+    read_snapshot(temp_map);
+    install_loaded(temp_map);
+}
+
+void exostore::start_loading(std::function<void()> on_done)
+{
+    loading_ = true;
+    load_exception_ = nullptr;
+    cancel_loading_ = false;
+    // Set before the thread starts, as loading_progress() reads it.
+    load_start_time_ = chrono::steady_clock::now();
+    load_thread_ = std::thread([this, on_done]()
+    {
+        try
+        {
+            read_snapshot(loaded_map_);
+        }
+        catch (...)
+        {
+            load_exception_ = std::current_exception();
+        }
+        on_done();
+    });
+}
+
+void exostore::finish_loading()
+{
+    if (load_thread_.joinable())
+    {
+        load_thread_.join();
+    }
+    loading_ = false;
+
+    if (load_exception_)
+    {
+        exostore::map_type().swap(loaded_map_);
+        auto e = load_exception_;
+        load_exception_ = nullptr;
+        std::rethrow_exception(e);
+    }
+
+    // Nothing could be written while loading, so the keyspace is empty.
+    install_loaded(loaded_map_);
+    loaded_map_.clear();
+}
+
+void exostore::install_loaded(exostore::map_type& loaded_map)
+{
+    if (store_)
+    {
+        for (auto it = loaded_map.begin(); it != loaded_map.end(); )
+        {
+            if (it->second.value.type() != typeid(exostore::bstring))
+            {
+                it++;
+                continue;
+            }
+
+            mapped_store::entry entry;
+            if (!store_->find(it->first, entry))
+            {
+                write_through(it->first, it->second.value);
+            }
+            it = loaded_map.erase(it);
+        }
+    }
+
+    if (map_.size() > lazy_free_threshold)
+    {
+        lazy_free_.free(std::move(map_));
+    }
+    map_ = std::move(loaded_map);
+    dirty_ = 0;
+    eviction_pool_.clear();
+    key_memory_ = 0;
+    std::fill(std::begin(value_memory_), std::end(value_memory_), 0);
+    for (auto& pair: map_)
+    {
+        key_memory_ += key_memory(pair.first);
+        pair.second.memory = 0;
+        pair.second.kind = exostore::no_value;
+        update_memory(pair.second);
+    }
+}
+
+void exostore::cancel_loading()
+{
+    cancel_loading_ = true;
+    if (load_thread_.joinable())
+    {
+        load_thread_.join();
+    }
+    loading_ = false;
+    load_exception_ = nullptr;
+    exostore::map_type().swap(loaded_map_);
+}
+
+bool exostore::loading() const
+{
+    return loading_;
+}
+
+exostore::load_progress exostore::loading_progress() const
+{
+    exostore::load_progress progress;
+    progress.total_bytes = load_total_bytes_;
+    progress.loaded_bytes = load_loaded_bytes_;
+    progress.loaded_keys = load_loaded_keys_;
+    progress.elapsed_seconds = chrono::duration_cast<
+        chrono::duration<double>>(chrono::steady_clock::now()
+            - load_start_time_).count();
+    return progress;
+}
+
+void exostore::read_snapshot(exostore::map_type& temp_map)
+{
+    load_total_bytes_ = 0;
+    load_loaded_bytes_ = 0;
+    load_loaded_keys_ = 0;
+
+    std::ifstream in(db_path_, std::ifstream::binary);
+    if (!in.is_open())  // File doesn't exist
+    {
+        return;
+    }
+    in.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+
+    try
+    {
+        in.seekg(0, std::ios::end);
+        load_total_bytes_ = in.tellg();
+        in.seekg(0);
+
+        // Read header.
+        auto header = vec_to_string(vec_from_file(in, 5));
+        if (header == segmented_header)
+        {
+            load_segments(in, temp_map);
+        }
+        else if (header == sequential_header)
+        {
+            // Read number of keys.
+            stream_reader reader(in);
+            auto num_keys = reader.read_pod<std::size_t>();
+            for (std::size_t i = 0; i < num_keys; i++)
+            {
+                decode_pair(reader, temp_map);
+                if (i % 1024 == 1023)
+                {
+                    load_loaded_keys_ += 1024;
+                    load_loaded_bytes_ = in.tellg();
+                    check_load_cancelled();
+                }
+            }
+        }
+        else
+        {
+            throw exostore::load_error("Incorrect file header");
+        }
+    }
+    catch (const std::ifstream::failure&)
+    {
+        throw exostore::load_error("Bad file format");
+    }
+
+    load_loaded_keys_ = temp_map.size();
+    load_loaded_bytes_ = load_total_bytes_.load();
+}
+
+void exostore::check_load_cancelled() const
+{
+    if (cancel_loading_)
+    {
+        throw exostore::load_error("Loading cancelled");
+    }
+}
+
+void exostore::set_load_threads(std::size_t threads)
+{
+    load_threads_ = threads;
+}
+
+void exostore::load_segments(std::ifstream& in, exostore::map_type& map)
+{
+    // Read the index, whose offset is at the end of the file.
+    in.seekg(-static_cast<std::streamoff>(sizeof(std::size_t)), std::ios::end);
+    const std::size_t index_end = in.tellg();
+    stream_reader reader(in);
+    auto index_offset = reader.read_pod<std::size_t>();
+    if (index_offset < segmented_header.size() || index_offset >= index_end)
+    {
+        throw exostore::load_error("Bad segment index");
+    }
+    reader.seek(index_offset);
+    auto num_segments = reader.read_pod<std::size_t>();
+    if (num_segments > (index_end - index_offset) / sizeof(segment_info))
+    {
+        throw exostore::load_error("Bad segment index");
+    }
+    std::vector<segment_info> index;
+    std::size_t total_keys = 0;
+    for (std::size_t i = 0; i < num_segments; i++)
+    {
+        segment_info info;
+        info.offset = reader.read_pod<std::size_t>();
+        info.size = reader.read_pod<std::size_t>();
+        info.num_keys = reader.read_pod<std::size_t>();
+        // Every pair takes more than a byte, so a segment can't hold more
+        // pairs than it has bytes.
+        if (info.offset < segmented_header.size() || info.offset > index_offset
+            || info.size > index_offset - info.offset
+            || info.num_keys > info.size)
+        {
+            throw exostore::load_error("Bad segment index");
+        }
+        total_keys += info.num_keys;
+        index.push_back(info);
+    }
+
+    std::size_t num_threads = load_threads_ > 0 ? load_threads_
+        : std::thread::hardware_concurrency();
+    num_threads = std::max<std::size_t>(1,
+        std::min<std::size_t>(num_threads, index.size()));
+
+    // Each worker claims segments one by one and decodes them into its own
+    // map. The maps are merged once all workers are done.
+    std::vector<exostore::map_type> partial_maps(num_threads);
+    std::vector<std::exception_ptr> errors(num_threads);
+    std::atomic<std::size_t> next_segment(0);
+    auto worker = [&](std::size_t thread_index)
+    {
+        try
+        {
+            std::ifstream segment_in(db_path_, std::ifstream::binary);
+            segment_in.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+            std::vector<unsigned char> buffer;
+            auto& partial_map = partial_maps[thread_index];
+            for (auto i = next_segment++; i < index.size(); i = next_segment++)
+            {
+                const auto& info = index[i];
+                buffer.resize(info.size);
+                segment_in.seekg(info.offset);
+                segment_in.read(reinterpret_cast<char*>(buffer.data()),
+                    buffer.size());
+                partial_map.reserve(partial_map.size() + info.num_keys);
+                buffer_reader segment_reader(buffer);
+                while (!segment_reader.at_end())
+                {
+                    decode_pair(segment_reader, partial_map);
+                }
+                load_loaded_keys_ += info.num_keys;
+                load_loaded_bytes_ += info.size;
+                check_load_cancelled();
+            }
+        }
+        catch (...)
+        {
+            errors[thread_index] = std::current_exception();
+            // Make the other workers stop early.
+            next_segment = index.size();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < num_threads; i++)
+    {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+
+    for (auto& error: errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Merge. The nodes are moved across whole, so no key or value is copied
+    // or allocated again.
+    map = std::move(partial_maps[0]);
+    map.reserve(total_keys);
+    for (std::size_t i = 1; i < partial_maps.size(); i++)
+    {
+        auto& partial_map = partial_maps[i];
+        while (!partial_map.empty())
+        {
+            map.insert(partial_map.extract(partial_map.begin()));
+        }
+        exostore::map_type().swap(partial_map);
+    }
+}
+
+bool exostore::expire_if_needed(const std::vector<unsigned char>& key)
+{
+    auto it = map_.find(key);
+    if (it == map_.end())
+    {
+        return false;
+    }
+
+    bool expired = value_expired(it->second.value);
+    if (expired)
+    {
+        dirty_++;
+        erase(it);
+    }
+    return expired;
+}
+
+void exostore::open_mapped_store(const std::string& store_path)
+{
+    if (log_)
+    {
+        throw mapped_store::store_error(
+            "The mapped store can't be used with the append-only log");
+    }
+    if (spill_)
+    {
+        throw mapped_store::store_error(
+            "The mapped store can't be used with the spill log");
+    }
+    store_.reset(new mapped_store(store_path));
+    store_->open();
+}
+
+const mapped_store* exostore::store() const
+{
+    return store_.get();
+}
+
+void exostore::sync_store()
+{
+    if (store_)
+    {
+        // A compaction is spread over several calls, so that copying a large
+        // store doesn't hold up the event loop.
+        if (store_->compacting() || store_->compaction_due())
+        {
+            try
+            {
+                store_->compact_step(store_compaction_step_size);
+            }
+            catch (const mapped_store::store_error&)
+            {
+                // The store is left as it was.
+            }
+        }
+        store_->sync();
+    }
+}
+
+void exostore::fault_in(const std::vector<unsigned char>& key)
+{
+    if (spill_)
+    {
+        auto it = map_.find(key);
+        if (it != map_.end()
+            && it->second.value.type() == typeid(exostore::spilled_string))
+        {
+            auto spilled = boost::any_cast<const exostore::spilled_string&>(
+                it->second.value);
+            it->second.value = unspill(spilled);
+            release_spilled(spilled);
+            update_memory(it->second);
+        }
+        return;
+    }
+
+    if (!store_ || map_.count(key) != 0)
+    {
+        return;
+    }
+
+    mapped_store::entry entry;
+    if (!store_->find(key, entry))
+    {
+        return;
+    }
+
+    std::vector<unsigned char> bdata(entry.data, entry.data + entry.size);
+    auto& stored = insert_entry(key);
+    if (entry.has_expiry)
+    {
+        stored.value = exostore::bstring(bdata,
+            chrono::system_clock::time_point(
+                chrono::milliseconds(entry.expiry_ms)));
+    }
+    else
+    {
+        stored.value = exostore::bstring(bdata);
+    }
+    update_memory(stored);
+}
+
+bool exostore::write_through(const std::vector<unsigned char>& key,
+    const boost::any& value)
+{
+    if (!store_)
+    {
+        return false;
+    }
+
+    if (value.type() != typeid(exostore::bstring))
+    {
+        // The key may have held a string before.
+        store_->remove(key);
+        return false;
+    }
+
+    const auto& bstring = boost::any_cast<const exostore::bstring&>(value);
+    long long expiry_ms = 0;
+    if (bstring.has_expiry())
+    {
+        expiry_ms = chrono::duration_cast<chrono::milliseconds>(
+            bstring.expiry_time().time_since_epoch()).count();
+    }
+    if (!bstring.has_bytes())
+    {
+        store_->put(key, bstring.bytes(), bstring.has_expiry(), expiry_ms);
+    }
+    else
+    {
+        store_->put(key, bstring.bdata(), bstring.has_expiry(), expiry_ms);
+    }
+    return true;
+}
+
+bool exostore::spilled_string::has_expired() const
+{
+    return has_expiry && chrono::system_clock::now() >= expiry_time;
+}
+
+void exostore::open_spill_log(const std::string& spill_path,
+    unsigned int idle_seconds, std::size_t min_size)
+{
+    if (store_)
+    {
+        throw spill_log::spill_error(
+            "The spill log can't be used with the mapped store");
+    }
+    spill_.reset(new spill_log(spill_path));
+    spill_->open();
+    spill_idle_seconds_ = idle_seconds;
+    spill_min_size_ = min_size;
+}
+
+const spill_log* exostore::spill() const
+{
+    return spill_.get();
+}
+
+std::size_t exostore::spilled_count() const
+{
+    return spilled_count_;
+}
+
+void exostore::spill_cold_values()
+{
+    if (!spill_)
+    {
+        return;
+    }
+
+    finish_spill_compaction();
+    if (spill_->compacting())
+    {
+        return;
+    }
+
+    if (collecting_spilled_ || spill_->compaction_due())
+    {
+        // Gather the locations of all spilled values over several calls, and
+        // hand them over once the whole keyspace has been covered. Nothing
+        // is spilled until the compaction is done.
+        if (!collecting_spilled_)
+        {
+            collecting_spilled_ = true;
+            collect_cursor_ = 0;
+            compaction_entries_.clear();
+        }
+        if (collect_spilled())
+        {
+            collecting_spilled_ = false;
+            std::vector<spill_log::location> live;
+            live.reserve(compaction_entries_.size());
+            for (const auto& entry: compaction_entries_)
+            {
+                live.push_back(entry.second);
+            }
+            spill_->start_compaction(std::move(live));
+        }
+        return;
+    }
+
+    // Values are written out in one go before any stub replaces them, so
+    // nothing is lost if the write fails. Only part of the keyspace is looked
+    // at per call, so that a large one doesn't hold up commands.
+    const auto now = access_clock();
+    std::vector<std::pair<exostore::map_type::value_type*, spill_log::location>>
+        spilled;
+    const std::uint64_t mask = scan_mask(map_.bucket_count());
+    std::size_t visited = 0;
+    while (!map_.empty() && visited < spill_step_size)
+    {
+        // Past the last bucket if the count isn't a power of two.
+        auto bucket = spill_cursor_ & mask;
+        if (bucket < map_.bucket_count())
+        {
+            for (auto it = map_.begin(bucket); it != map_.end(bucket); it++)
+            {
+                visited++;
+                auto& stored = it->second;
+                if (stored.value.type() != typeid(exostore::bstring)
+                    || now - stored.access_time < spill_idle_seconds_)
+                {
+                    continue;
+                }
+                const auto& bstring = boost::any_cast<const exostore::bstring&>(
+                    stored.value);
+                // Integers are too small to be worth spilling, and sparse
+                // bitmaps are already compact.
+                if (!bstring.has_bytes() || bstring.size() < spill_min_size_
+                    || bstring.has_expired())
+                {
+                    continue;
+                }
+                spilled.emplace_back(&*it, spill_->append(bstring.bdata()));
+            }
+        }
+        visited++;
+        spill_cursor_ = next_scan_cursor(spill_cursor_, mask);
+        if (spill_cursor_ == 0)
+        {
+            break;
+        }
+    }
+    spill_->flush();
+
+    for (const auto& pair: spilled)
+    {
+        auto& value = pair.first->second.value;
+        const auto& bstring = boost::any_cast<const exostore::bstring&>(value);
+        exostore::spilled_string stub;
+        stub.location = pair.second;
+        stub.has_expiry = bstring.has_expiry();
+        stub.expiry_time = bstring.expiry_time();
+        value = stub;
+        update_memory(pair.first->second);
+    }
+    spilled_count_ += spilled.size();
+}
+
+bool exostore::collect_spilled()
+{
+    if (map_.empty())
+    {
+        return true;
+    }
+    const std::uint64_t mask = scan_mask(map_.bucket_count());
+    std::size_t visited = 0;
+    while (visited < spill_step_size)
+    {
+        // Past the last bucket if the count isn't a power of two.
+        auto bucket = collect_cursor_ & mask;
+        if (bucket < map_.bucket_count())
+        {
+            for (auto it = map_.begin(bucket); it != map_.end(bucket); it++)
+            {
+                visited++;
+                const auto& value = it->second.value;
+                if (value.type() == typeid(exostore::spilled_string))
+                {
+                    compaction_entries_.emplace_back(it->first,
+                        boost::any_cast<const exostore::spilled_string&>(
+                            value).location);
+                }
+            }
+        }
+        visited++;
+        collect_cursor_ = next_scan_cursor(collect_cursor_, mask);
+        if (collect_cursor_ == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::vector<unsigned char>> exostore::spilled_keys(
+    const std::vector<std::vector<unsigned char>>& candidates)
+{
+    std::vector<std::vector<unsigned char>> keys;
+    if (!spill_ || spilled_count_ == 0)
+    {
+        return keys;
+    }
+
+    for (const auto& candidate: candidates)
+    {
+        auto it = map_.find(candidate);
+        if (it != map_.end()
+            && it->second.value.type() == typeid(exostore::spilled_string))
+        {
+            keys.push_back(candidate);
+        }
+    }
+    return keys;
+}
+
+void exostore::read_back(const std::vector<std::vector<unsigned char>>& keys,
+    std::function<void()> on_done)
+{
+    std::vector<spill_log::read_request> requests;
+    for (const auto& key: keys)
+    {
+        auto it = map_.find(key);
+        if (it != map_.end()
+            && it->second.value.type() == typeid(exostore::spilled_string))
+        {
+            requests.push_back(spill_log::read_request{key,
+                boost::any_cast<const exostore::spilled_string&>(
+                    it->second.value).location});
+        }
+    }
+    spill_->read_async(std::move(requests), on_done);
+}
+
+void exostore::finish_read_back()
+{
+    if (!spill_)
+    {
+        return;
+    }
+
+    for (auto& result: spill_->take_results())
+    {
+        // The key may have changed while it was being read.
+        auto it = map_.find(result.key);
+        if (!result.ok || it == map_.end()
+            || it->second.value.type() != typeid(exostore::spilled_string))
+        {
+            continue;
+        }
+        auto spilled = boost::any_cast<const exostore::spilled_string&>(
+            it->second.value);
+        if (!(spilled.location == result.where))
+        {
+            continue;
+        }
+
+        if (spilled.has_expiry)
+        {
+            it->second.value = exostore::bstring(result.data,
+                spilled.expiry_time);
+        }
+        else
+        {
+            it->second.value = exostore::bstring(result.data);
+        }
+        release_spilled(spilled);
+        update_memory(it->second);
+    }
+}
+
+exostore::bstring exostore::unspill(
+    const exostore::spilled_string& spilled) const
+{
+    auto data = spill_->read(spilled.location);
+    if (spilled.has_expiry)
+    {
+        return exostore::bstring(data, spilled.expiry_time);
+    }
+    return exostore::bstring(data);
+}
+
+void exostore::release_spilled(const boost::any& value)
+{
+    if (spill_ && value.type() == typeid(exostore::spilled_string))
+    {
+        spill_->release(boost::any_cast<const exostore::spilled_string&>(
+            value).location);
+        spilled_count_--;
+    }
+}
+
+void exostore::finish_spill_compaction()
+{
+    std::vector<spill_log::location> new_locations;
+    if (!spill_->finish_compaction(new_locations))
+    {
+        return;
+    }
+
+    // Values that were read back or removed during the compaction were
+    // copied anyway, so they are released from the new file.
+    for (std::size_t i = 0; i < new_locations.size(); i++)
+    {
+        const auto& compacted = compaction_entries_[i];
+        auto it = map_.find(compacted.first);
+        if (it != map_.end()
+            && it->second.value.type() == typeid(exostore::spilled_string))
+        {
+            auto& spilled = boost::any_cast<exostore::spilled_string&>(
+                it->second.value);
+            if (spilled.location == compacted.second)
+            {
+                spilled.location = new_locations[i];
+                continue;
+            }
+        }
+        spill_->release(new_locations[i]);
+    }
+    compaction_entries_.clear();
+}
+
+exostore::eviction_policy exostore::eviction_policy_from_name(
+    const std::string& name)
+{
+    if (name == "noeviction")
+    {
+        return exostore::eviction_policy::noeviction;
+    }
+    else if (name == "allkeys-lru")
+    {
+        return exostore::eviction_policy::allkeys_lru;
+    }
+    else if (name == "volatile-lru")
+    {
+        return exostore::eviction_policy::volatile_lru;
+    }
+    else if (name == "allkeys-lfu")
+    {
+        return exostore::eviction_policy::allkeys_lfu;
+    }
+    else if (name == "volatile-ttl")
+    {
+        return exostore::eviction_policy::volatile_ttl;
+    }
+    throw std::invalid_argument("Unknown eviction policy " + name);
+}
+
+std::string exostore::eviction_policy_name(exostore::eviction_policy policy)
+{
+    switch (policy)
+    {
+    case exostore::eviction_policy::allkeys_lru:
+        return "allkeys-lru";
+    case exostore::eviction_policy::volatile_lru:
+        return "volatile-lru";
+    case exostore::eviction_policy::allkeys_lfu:
+        return "allkeys-lfu";
+    case exostore::eviction_policy::volatile_ttl:
+        return "volatile-ttl";
+    default:
+        return "noeviction";
+    }
+}
+
+void exostore::set_memory_limit(std::size_t max_memory,
+    exostore::eviction_policy policy, std::size_t samples)
+{
+    max_memory_ = max_memory;
+    policy_ = policy;
+    eviction_samples_ = std::max<std::size_t>(1, samples);
+    eviction_pool_.clear();
+}
+
+bool exostore::make_room()
+{
+    if (max_memory_ == 0 || used_memory() <= max_memory_)
+    {
+        return true;
+    }
+    if (policy_ == exostore::eviction_policy::noeviction)
+    {
+        return false;
+    }
+
+    for (std::size_t evicted = 0; used_memory() > max_memory_; evicted++)
+    {
+        if (evicted == max_evictions_per_call)
+        {
+            // The rest is evicted by later calls.
+            return true;
+        }
+        if (!evict_one())
+        {
+            return evicted > 0;
+        }
+    }
+    return true;
+}
+
+std::size_t exostore::used_memory() const
+{
+    std::size_t total = key_memory_ + bucket_memory();
+    for (auto memory: value_memory_)
+    {
+        total += memory;
+    }
+    return total;
+}
+
+std::size_t exostore::memory_usage(const std::vector<unsigned char>& key)
+{
+    if (!key_exists(key))
+    {
+        throw exostore::key_error();
+    }
+    return key_memory(key) + map_.at(key).memory;
+}
+
+exostore::memory_stats exostore::memory_statistics() const
+{
+    exostore::memory_stats stats;
+    stats.keys = map_.size();
+    stats.keyspace_overhead = key_memory_ + bucket_memory();
+    stats.strings = value_memory_[exostore::string_value];
+    stats.zsets = value_memory_[exostore::zset_value];
+    stats.hashes = value_memory_[exostore::hash_value];
+    stats.spilled_strings = value_memory_[exostore::spilled_value];
+    stats.allocator_allocated = 0;
+    stats.allocator_active = 0;
+    stats.resident = 0;
+    auto slabs = slab_pool::instance().statistics();
+    stats.slab_active = slabs.slab_bytes;
+    stats.slab_allocated = slabs.used_bytes;
+    stats.slab_requested = slabs.requested_bytes;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    // Memory mapped chunks count as both allocated and active.
+    auto info = ::mallinfo2();
+    stats.allocator_allocated = info.uordblks + info.hblkhd;
+    stats.allocator_active = info.arena + info.hblkhd;
+#endif
+    std::ifstream statm("/proc/self/statm");
+    std::size_t total_pages, resident_pages;
+    if (statm >> total_pages >> resident_pages)
+    {
+        stats.resident = resident_pages * ::sysconf(_SC_PAGESIZE);
+    }
+    return stats;
+}
+
+std::size_t exostore::memory_limit() const
+{
+    return max_memory_;
+}
+
+exostore::eviction_policy exostore::memory_policy() const
+{
+    return policy_;
+}
+
+std::size_t exostore::evicted_keys() const
+{
+    return evicted_keys_;
+}
+
+void exostore::record_access(exostore::entry& e)
+{
+    e.access_time = access_clock();
+    if (policy_ != exostore::eviction_policy::allkeys_lfu)
+    {
+        return;
+    }
+
+    // The counter grows logarithmically: the higher it is, the less likely
+    // an access is to raise it.
+    auto counter = decayed_lfu_counter(e);
+    e.lfu_time = static_cast<std::uint16_t>(e.access_time / 60);
+    if (counter < 255)
+    {
+        double base = std::max(0, counter - lfu_initial_value);
+        double p = 1.0 / (base * lfu_log_factor + 1);
+        if (std::uniform_real_distribution<double>(0, 1)(random_) < p)
+        {
+            counter++;
+        }
+    }
+    e.lfu_counter = counter;
+}
+
+std::uint8_t exostore::decayed_lfu_counter(const exostore::entry& e) const
+{
+    // Minutes wrap around, which is fine as long as keys are accessed more
+    // often than every 45 days.
+    const auto now = static_cast<std::uint16_t>(access_clock() / 60);
+    const std::uint16_t elapsed = now - e.lfu_time;
+    const auto periods = elapsed / lfu_decay_minutes;
+    return periods >= e.lfu_counter ? 0 : e.lfu_counter - periods;
+}
+
+std::size_t exostore::key_memory(const std::vector<unsigned char>& key)
+{
+    // A node holds a link, the bucket index and the key-entry pair.
+    return slab_pool::allocation_size(
+            2 * sizeof(void*) + sizeof(map_type::value_type))
+        + allocation_size(key.capacity());
+}
+
+std::size_t exostore::value_memory(const boost::any& value,
+    exostore::value_kind& kind)
+{
+    // boost::any allocates a holder with a vtable pointer and the value.
+    if (value.type() == typeid(exostore::bstring))
+    {
+        kind = exostore::string_value;
+        return allocation_size(sizeof(void*) + sizeof(exostore::bstring))
+            + allocation_size(boost::any_cast<const exostore::bstring&>(
+                value).capacity());
+    }
+    else if (value.type() == typeid(exostore::spilled_string))
+    {
+        kind = exostore::spilled_value;
+        return allocation_size(sizeof(void*)
+            + sizeof(exostore::spilled_string));
+    }
+    else if (value.type() == typeid(exostore::zset))
+    {
+        kind = exostore::zset_value;
+        return allocation_size(sizeof(void*) + sizeof(exostore::zset))
+            + boost::any_cast<const exostore::zset&>(value).memory_usage();
+    }
+    else if (value.type() == typeid(exostore::hash))
+    {
+        kind = exostore::hash_value;
+        return allocation_size(sizeof(void*) + sizeof(exostore::hash))
+            + boost::any_cast<const exostore::hash&>(value).memory_usage();
+    }
+    kind = exostore::no_value;
+    return 0;
+}
+
+std::size_t exostore::bucket_memory() const
+{
+    return map_.bucket_count() == 0 ? 0
+        : allocation_size((map_.bucket_count() + 1) * sizeof(void*));
+}
+
+exostore::entry& exostore::insert_entry(const std::vector<unsigned char>& key)
+{
+    auto inserted = map_.try_emplace(key);
+    if (inserted.second)
+    {
+        key_memory_ += key_memory(key);
+    }
+    return inserted.first->second;
+}
+
+void exostore::update_memory(exostore::entry& e)
+{
+    value_memory_[e.kind] -= e.memory;
+    e.memory = value_memory(e.value, e.kind);
+    value_memory_[e.kind] += e.memory;
+}
+
+void exostore::set_active_defrag(bool enabled, unsigned int threshold_percent,
+    std::size_t ignore_bytes)
+{
+    defrag_enabled_ = enabled;
+    defrag_threshold_ = threshold_percent;
+    defrag_ignore_bytes_ = ignore_bytes;
+}
+
+bool exostore::defrag_step()
+{
+    // Moving nodes while a child is saving would make the kernel copy the
+    // pages they are on.
+    if (!defrag_enabled_ || background_job_running())
+    {
+        return defrag_running_;
+    }
+
+    if (!defrag_running_)
+    {
+        auto slabs = slab_pool::instance().statistics();
+        auto wasted = slabs.slab_bytes - slabs.used_bytes;
+        if (wasted <= defrag_ignore_bytes_
+            || wasted * 100 <= slabs.used_bytes * defrag_threshold_
+            || slabs.slabs == defrag_fruitless_slabs_)
+        {
+            return false;
+        }
+        defrag_running_ = true;
+        defrag_moved_at_start_ = defrag_moved_;
+        defrag_cursor_ = 0;
+        defrag_keys_done_ = false;
+        defrag_zsets_.clear();
+        defrag_zset_cursor_ = 0;
+    }
+
+    std::size_t visited = 0;
+    while (visited < defrag_step_size)
+    {
+        if (!defrag_zsets_.empty())
+        {
+            visited += defrag_queued_zset(defrag_step_size - visited);
+        }
+        else if (!defrag_keys_done_)
+        {
+            visited += defrag_bucket();
+        }
+        else
+        {
+            defrag_running_ = false;
+            defrag_cycles_++;
+            defrag_fruitless_slabs_ = defrag_moved_ == defrag_moved_at_start_
+                ? slab_pool::instance().statistics().slabs : 0;
+            break;
+        }
+    }
+    return defrag_running_;
+}
+
+std::size_t exostore::defrag_bucket()
+{
+    if (map_.empty())
+    {
+        defrag_keys_done_ = true;
+        return 1;
+    }
+
+    const auto& pool = slab_pool::instance();
+    const std::uint64_t mask = scan_mask(map_.bucket_count());
+    const auto bucket = defrag_cursor_ & mask;
+    if (bucket >= map_.bucket_count())
+    {
+        // Past the last bucket, as the count isn't a power of two.
+        defrag_cursor_ = next_scan_cursor(defrag_cursor_, mask);
+        defrag_keys_done_ = defrag_cursor_ == 0;
+        return 1;
+    }
+    std::vector<std::vector<unsigned char>> to_move;
+    std::size_t visited = 1;
+    for (auto it = map_.begin(bucket); it != map_.end(bucket); it++)
+    {
+        visited++;
+        if (pool.should_move(&*it))
+        {
+            to_move.push_back(it->first);
+        }
+        if (it->second.value.type() != typeid(exostore::zset))
+        {
+            continue;
+        }
+
+        auto& zset = boost::any_cast<exostore::zset&>(it->second.value);
+        if (zset.size() > defrag_zset_inline_size)
+        {
+            defrag_zsets_.push_back(it->first);
+            continue;
+        }
+        std::size_t moved = 0;
+        std::uint64_t cursor = 0;
+        do
+        {
+            cursor = zset.defrag(cursor, defrag_zset_inline_size, moved);
+        } while (cursor != 0);
+        visited += zset.size();
+        if (moved > 0)
+        {
+            defrag_moved_ += moved;
+            update_memory(it->second);
+        }
+    }
+
+    // Moved keys go back to the same bucket, so the table isn't resized.
+    for (const auto& key: to_move)
+    {
+        move_entry(key);
+    }
+    defrag_moved_ += to_move.size();
+
+    defrag_cursor_ = next_scan_cursor(defrag_cursor_, mask);
+    defrag_keys_done_ = defrag_cursor_ == 0;
+    return visited;
+}
+
+std::size_t exostore::defrag_queued_zset(std::size_t count)
+{
+    auto it = map_.find(defrag_zsets_.front());
+    if (it == map_.end() || it->second.value.type() != typeid(exostore::zset))
+    {
+        // Removed or replaced since it was queued.
+        defrag_zsets_.pop_front();
+        defrag_zset_cursor_ = 0;
+        return 1;
+    }
+
+    auto& zset = boost::any_cast<exostore::zset&>(it->second.value);
+    std::size_t moved = 0;
+    defrag_zset_cursor_ = zset.defrag(defrag_zset_cursor_, count, moved);
+    if (moved > 0)
+    {
+        defrag_moved_ += moved;
+        update_memory(it->second);
+    }
+    if (defrag_zset_cursor_ == 0)
+    {
+        defrag_zsets_.pop_front();
+    }
+    return count;
+}
+
+void exostore::move_entry(const std::vector<unsigned char>& key)
+{
+    auto it = map_.find(key);
+    auto moved_entry = std::move(it->second);
+    // Copying the key gives it a new buffer as well.
+    auto new_key = it->first;
+    key_memory_ -= key_memory(it->first);
+    map_.erase(it);
+    key_memory_ += key_memory(new_key);
+    map_.emplace(std::move(new_key), std::move(moved_entry));
+}
+
+bool exostore::defrag_running() const
+{
+    return defrag_running_;
+}
+
+std::size_t exostore::defrag_moved() const
+{
+    return defrag_moved_;
+}
+
+std::size_t exostore::defrag_cycles() const
+{
+    return defrag_cycles_;
+}
+
+void exostore::sample_eviction_candidates()
+{
+    if (map_.empty())
+    {
+        return;
+    }
+
+    const bool volatile_only = policy_ == exostore::eviction_policy::volatile_lru
+        || policy_ == exostore::eviction_policy::volatile_ttl;
+    const auto now = access_clock();
+    const auto bucket_count = map_.bucket_count();
+    auto bucket = std::uniform_int_distribution<std::size_t>(
+        0, bucket_count - 1)(random_);
+
+    // Walk the buckets from a random one, looking at each key on the way.
+    std::size_t sampled = 0;
+    const auto max_buckets = std::min(bucket_count,
+        eviction_samples_ * max_buckets_per_sample);
+    for (std::size_t i = 0; i < max_buckets && sampled < eviction_samples_;
+        i++, bucket = (bucket + 1) % bucket_count)
+    {
+        for (auto it = map_.begin(bucket); it != map_.end(bucket)
+            && sampled < eviction_samples_; it++)
+        {
+            const auto& value = it->second.value;
+            bool has_expiry = false;
+            chrono::system_clock::time_point expiry_time;
+            if (value.type() == typeid(exostore::bstring))
+            {
+                const auto& bstring = boost::any_cast<const exostore::bstring&>(
+                    value);
+                has_expiry = bstring.has_expiry();
+                expiry_time = bstring.expiry_time();
+            }
+            else if (value.type() == typeid(exostore::spilled_string))
+            {
+                const auto& spilled = boost::any_cast<
+                    const exostore::spilled_string&>(value);
+                has_expiry = spilled.has_expiry;
+                expiry_time = spilled.expiry_time;
+            }
+            if (volatile_only && !has_expiry)
+            {
+                continue;
+            }
+            sampled++;
+
+            std::uint64_t score;
+            switch (policy_)
+            {
+            case exostore::eviction_policy::allkeys_lfu:
+                score = 255 - decayed_lfu_counter(it->second);
+                break;
+            case exostore::eviction_policy::volatile_ttl:
+                // The sooner it expires, the better.
+                score = std::numeric_limits<std::uint64_t>::max()
+                    - chrono::duration_cast<chrono::milliseconds>(
+                        expiry_time.time_since_epoch()).count();
+                break;
+            default:
+                score = now - it->second.access_time;
+                break;
+            }
+
+            // Keep the pool sorted, dropping the worst candidate if it's
+            // full.
+            auto in_pool = std::find_if(eviction_pool_.begin(),
+                eviction_pool_.end(),
+                [&it](const exostore::eviction_candidate& candidate)
+                {
+                    return candidate.key == it->first;
+                });
+            if (in_pool != eviction_pool_.end())
+            {
+                continue;
+            }
+            if (eviction_pool_.size() == eviction_pool_size
+                && score <= eviction_pool_.front().score)
+            {
+                continue;
+            }
+            auto pos = std::upper_bound(eviction_pool_.begin(),
+                eviction_pool_.end(), score,
+                [](std::uint64_t s, const exostore::eviction_candidate& c)
+                {
+                    return s < c.score;
+                });
+            eviction_pool_.insert(pos, exostore::eviction_candidate{score,
+                it->first});
+            if (eviction_pool_.size() > eviction_pool_size)
+            {
+                eviction_pool_.erase(eviction_pool_.begin());
+            }
+        }
+    }
+}
+
+bool exostore::evict_one()
+{
+    static const auto del_command = string_to_vec("DEL");
+
+    sample_eviction_candidates();
+    while (!eviction_pool_.empty())
+    {
+        auto candidate = std::move(eviction_pool_.back());
+        eviction_pool_.pop_back();
+        // The key may have gone away since it was sampled.
+        auto it = map_.find(candidate.key);
+        if (it == map_.end())
+        {
+            continue;
+        }
+
+        // Evictions are logged, otherwise replaying the log would bring the
+        // keys back.
+        if (log_)
+        {
+            log_->append({del_command, candidate.key});
+        }
+        dirty_++;
+        evicted_keys_++;
+        erase(it);
+        return true;
+    }
+    return false;
+}
+
+void exostore::open_log(const std::string& log_path,
+    unsigned int rewrite_percentage, std::size_t rewrite_min_size)
+{
+    if (store_)
+    {
+        throw append_log::log_error(
+            "The append-only log can't be used with the mapped store");
+    }
+    log_.reset(new append_log(log_path, rewrite_percentage, rewrite_min_size));
+    if (!append_log::exists(log_path))
+    {
+        // Start from the current keyspace, otherwise it would be lost the
+        // next time the log is replayed.
+        write_log(log_->rewrite_path());
+        if (std::rename(log_->rewrite_path().c_str(), log_path.c_str()) != 0)
+        {
+            throw append_log::log_error("Could not create " + log_path);
+        }
+    }
+    log_->open();
+}
+
+bool exostore::log_enabled() const
+{
+    return static_cast<bool>(log_);
+}
+
+void exostore::log_command(const append_log::command& cmd)
+{
+    if (log_)
+    {
+        log_->append(cmd);
+    }
+}
+
+void exostore::sync_log()
+{
+    if (log_)
+    {
+        log_->sync();
+    }
+}
+
+/*
+ *  A rewritten log holds a SET for each binary string (with a PXAT option if
+ *  it expires), and a ZADD for each member of each sorted set. Expired keys
+ *  are left out. A sparse bitmap is written as a SET of an empty string, a
+ *  SETBIT that stretches it to its length, and a SETBIT for each set bit, so
+ *  that it is never expanded.
+ */
+
+void exostore::write_log(const std::string& path) const
+{
+    std::ofstream out(path, std::ofstream::out|std::ofstream::binary);
+    if (!out.is_open())
+    {
+        throw append_log::log_error("Could not open " + path);
+    }
+
+    const auto set_command = string_to_vec("SET");
+    const auto pxat_option = string_to_vec("PXAT");
+    const auto zadd_command = string_to_vec("ZADD");
+    const auto hset_command = string_to_vec("HSET");
+    const auto setbit_command = string_to_vec("SETBIT");
+    const auto zero = string_to_vec("0");
+    const auto one = string_to_vec("1");
+    // Commands are encoded into a buffer which is written out in chunks.
+    const std::size_t chunk_size = 1 << 16;
+    std::vector<unsigned char> buffer;
+    append_log::write_header(buffer);
+    append_log::command cmd;
+
+    auto write_buffer = [&out, &buffer]()
+    {
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        buffer.clear();
+    };
+
+    for (const auto& pair: map_)
+    {
+        const boost::any* value = &pair.second.value;
+        boost::any unspilled;
+        if (value->type() == typeid(exostore::spilled_string))
+        {
+            unspilled = unspill(
+                boost::any_cast<const exostore::spilled_string&>(*value));
+            value = &unspilled;
+        }
+
+        if (value->type() == typeid(exostore::bstring))
+        {
+            const auto& bstring = boost::any_cast<const exostore::bstring&>(
+                *value);
+            if (bstring.has_expired())
+            {
+                continue;
+            }
+            cmd = {set_command, pair.first, bstring.is_sparse()
+                ? std::vector<unsigned char>() : bstring.bytes()};
+            if (bstring.has_expiry())
+            {
+                auto expiry_ms = chrono::duration_cast<chrono::milliseconds>(
+                    bstring.expiry_time().time_since_epoch()).count();
+                cmd.push_back(pxat_option);
+                cmd.push_back(string_to_vec(
+                    boost::lexical_cast<std::string>(expiry_ms)));
+            }
+            append_log::write_command(buffer, cmd);
+            if (bstring.is_sparse())
+            {
+                const auto& bitmap = bstring.sparse();
+                cmd = {setbit_command, pair.first, string_to_vec(
+                    std::to_string(bitmap.size() * 8 - 1)), zero};
+                append_log::write_command(buffer, cmd);
+                bitmap.for_each([&](std::uint64_t bit)
+                {
+                    cmd = {setbit_command, pair.first,
+                        string_to_vec(std::to_string(bit)), one};
+                    append_log::write_command(buffer, cmd);
+                    if (buffer.size() >= chunk_size)
+                    {
+                        write_buffer();
+                    }
+                });
+            }
+        }
+        else if (value->type() == typeid(exostore::zset))
+        {
+            const auto& zset = boost::any_cast<const exostore::zset&>(*value);
+            auto its = zset.element_range(0, zset.size() - 1);
+            for (auto it = its.first; it != its.second; it++)
+            {
+                cmd = {zadd_command, pair.first,
+                    string_to_vec(boost::lexical_cast<std::string>(it->score())),
+                    it->member()};
+                append_log::write_command(buffer, cmd);
+                if (buffer.size() >= chunk_size)
+                {
+                    write_buffer();
+                }
+            }
+        }
+        else if (value->type() == typeid(exostore::hash))
+        {
+            const auto& hash = boost::any_cast<const exostore::hash&>(*value);
+            hash.for_each([&](const exostore::hash::field_type& field,
+                const exostore::hash::field_type& field_value)
+            {
+                cmd = {hset_command, pair.first, field, field_value};
+                append_log::write_command(buffer, cmd);
+                if (buffer.size() >= chunk_size)
+                {
+                    write_buffer();
+                }
+            });
+        }
+
+        if (buffer.size() >= chunk_size)
+        {
+            write_buffer();
+        }
+    }
+    write_buffer();
+    out.close();
+    if (!out)
+    {
+        throw append_log::log_error("Writing " + path + " failed");
+    }
+
+    // Make sure the log is on disk before it replaces the old one.
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd != -1)
+    {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+bool exostore::rewrite_log_in_background()
+{
+    if (!log_ || background_job_running())
+    {
+        return false;
+    }
+
+    // Start buffering before the fork so that no command is missed.
+    log_->begin_rewrite();
+    pid_t pid = ::fork();
+    if (pid == -1)
+    {
+        log_->end_rewrite(false);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        // In the child. It has its own copy of the keyspace, so it can take
+        // its time writing it out.
+        int status = 0;
+        try
+        {
+            write_log(log_->rewrite_path());
+        }
+        catch (const std::exception&)
+        {
+            status = 1;
+        }
+        ::_exit(status);
+    }
+
+    child_pid_ = pid;
+    child_job_ = exostore::background_job::log_rewrite;
+    return true;
+}
+
+bool exostore::log_rewrite_due() const
+{
+    return log_ && log_->rewrite_due();
+}
+
+bool exostore::background_job_running() const
+{
+    return child_pid_ != 0;
+}
+
+exostore::background_job exostore::check_background_job()
+{
+    if (!background_job_running())
+    {
+        return exostore::background_job::none;
+    }
+
+    auto job = child_job_;
+    bool success = true;
+    int status;
+    pid_t result = ::waitpid(child_pid_, &status, WNOHANG);
+    if (result == child_pid_)
+    {
+        success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        finish_background_job(success);
+    }
+    else if (result == -1)
+    {
+        success = false;
+        finish_background_job(false);
+    }
+    return success ? exostore::background_job::none : job;
+}
+
+void exostore::kill_background_job()
+{
+    if (!background_job_running())
+    {
+        return;
+    }
+
+    ::kill(child_pid_, SIGKILL);
+    int status;
+    ::waitpid(child_pid_, &status, 0);
+    finish_background_job(false);
+}
+
+void exostore::finish_background_job(bool success)
+{
+    switch (child_job_)
+    {
+    case exostore::background_job::log_rewrite:
+        log_->end_rewrite(success);
+        break;
+    case exostore::background_job::save:
+        if (success)
+        {
+            saved(changes_at_fork_);
+        }
+        break;
+    case exostore::background_job::none:
+        break;
     }
+    child_pid_ = 0;
+    child_job_ = exostore::background_job::none;
 }
@@ -3,12 +3,30 @@
 
 #include <string>
 #include <vector>
+#include <fstream>
 #include <stdexcept>
 #include <typeinfo>
+#include <memory>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <random>
+#include <cstdint>
+#include <utility>
+#include <deque>
+#include <sys/types.h>
 #include <boost/unordered_map.hpp>
 #include <boost/any.hpp>
 #include "binary_string.hpp"
 #include "sorted_set.hpp"
+#include "hash_map.hpp"
+#include "append_log.hpp"
+#include "mapped_store.hpp"
+#include "spill_log.hpp"
+#include "lazy_free.hpp"
+#include "slab_allocator.hpp"
 
 
 /*
@@ -21,6 +39,7 @@ class exostore
 public:
     typedef binary_string bstring;
     typedef sorted_set zset;
+    typedef hash_map hash;
 
     class key_error: public std::runtime_error
     {
@@ -42,6 +61,7 @@ public:
     };
 
     exostore(std::string file_path);
+    ~exostore();
 
     // Should expire a key if needed.
     bool key_exists(const std::vector<unsigned char>& key);
@@ -56,24 +76,422 @@ public:
     template <typename T>
     T& get(const std::vector<unsigned char>& key);
 
-    // Sets the given key to the given value.
+    // Sets the given key to the given value. Pass an rvalue to move the value
+    // in instead of copying it.
     template <typename T>
-    void set(const std::vector<unsigned char>& key, const T& value);
+    void set(const std::vector<unsigned char>& key, T value);
+
+    // Must be called after a value returned by get() is modified in place.
+    void touch(const std::vector<unsigned char>& key);
+    // Like touch(), for a string of which only length bytes from offset
+    // changed, along with its size. The mapped store only copies those.
+    void touch(const std::vector<unsigned char>& key, std::size_t offset,
+        std::size_t length);
+
+    // Removes a key. Returns false if it did not exist.
+    bool remove(const std::vector<unsigned char>& key);
+
+    // Calls f with keys and their types ("string", "zset" or "hash"),
+    // starting from cursor and stopping once count keys have been seen or ten
+    // times as many hash table buckets visited. Returns the cursor to
+    // continue from, or 0 once every key has been seen. Keys present for the whole scan are seen
+    // at least once, even if the hash table is resized in between. Expired
+    // keys are skipped, and spilled strings are not read back.
+    std::uint64_t scan(std::uint64_t cursor, std::size_t count,
+        std::function<void(const std::vector<unsigned char>& key,
+            const std::string& type)> f) const;
+
+    // Removes every key. If lazily is set, the old keyspace is destroyed on
+    // the lazy free thread whatever its size.
+    void clear(bool lazily);
+    // Values waiting to be destroyed on the lazy free thread, and values
+    // destroyed there so far. Large values are freed there when they are
+    // removed, overwritten or expire.
+    std::size_t lazy_free_pending() const;
+    std::size_t lazy_freed() const;
 
     // Removes all expired keys from the hash table/
     void expire_keys();
 
     // Save to disk.
     void save();
-    // Load from disk.
+    // Saves in a forked child. Returns false if the save could not be
+    // started.
+    bool save_in_background();
+    // Number of changes since the last successful save.
+    std::size_t dirty() const;
+    chrono::system_clock::time_point last_save_time() const;
+    // Load from disk. Files in the segmented format are loaded on several
+    // threads.
     void load();
+    // Number of threads used to load segments. Zero means one per core.
+    void set_load_threads(std::size_t threads);
+
+    // Asynchronous loading. The database must not be used between
+    // start_loading() and finish_loading(), except to check progress.
+    struct load_progress
+    {
+        std::size_t total_bytes;
+        std::size_t loaded_bytes;
+        std::size_t loaded_keys;
+        double elapsed_seconds;
+    };
+
+    // Loads from disk on a worker thread, which calls on_done when finished.
+    void start_loading(std::function<void()> on_done);
+    // Installs the loaded data once on_done has been called. Throws
+    // load_error if loading failed.
+    void finish_loading();
+    // Stops loading and throws away whatever was loaded.
+    void cancel_loading();
+    bool loading() const;
+    load_progress loading_progress() const;
+
+    // Starts appending commands to the append-only log at log_path. If there
+    // is no log there yet, one is first written from the current keyspace.
+    void open_log(const std::string& log_path,
+        unsigned int rewrite_percentage, std::size_t rewrite_min_size);
+    bool log_enabled() const;
+    // Appends a command that modified the database to the log.
+    void log_command(const append_log::command& cmd);
+    void sync_log();
+    // Writes a log that recreates the current keyspace with as few commands
+    // as possible.
+    void write_log(const std::string& path) const;
+    // Rewrites the log in a forked child. Returns false if the rewrite could
+    // not be started.
+    bool rewrite_log_in_background();
+    bool log_rewrite_due() const;
+
+    // Keeps binary strings in the memory-mapped store at store_path instead
+    // of the snapshot. A string is read from the store the first time it is
+    // accessed, and written through to it whenever it changes. Can't be used
+    // together with the append-only log.
+    void open_mapped_store(const std::string& store_path);
+    // Null unless the mapped store is in use.
+    const mapped_store* store() const;
+    // Flushes the mapped store. If it has too much garbage, also takes the
+    // next step of compacting it.
+    void sync_store();
+
+    // Moves strings that haven't been accessed for idle_seconds to the spill
+    // log at spill_path, leaving only a small stub in memory. Strings smaller
+    // than min_size are not worth moving. Can't be used together with the
+    // mapped store.
+    void open_spill_log(const std::string& spill_path,
+        unsigned int idle_seconds, std::size_t min_size);
+    // Null unless strings are being spilled.
+    const spill_log* spill() const;
+    // Number of strings that are currently spilled.
+    std::size_t spilled_count() const;
+    // Spills cold strings, and compacts the spill log if it has too much
+    // garbage. Should be called periodically. Each call looks at a bounded
+    // part of the keyspace, carrying on from where the last one stopped.
+    void spill_cold_values();
+    // Returns the keys in candidates whose values are spilled.
+    std::vector<std::vector<unsigned char>> spilled_keys(
+        const std::vector<std::vector<unsigned char>>& candidates);
+    // Reads spilled values back on the spill log's worker thread, which calls
+    // on_done when it is finished. finish_read_back() must then be called to
+    // bring the values back into memory.
+    void read_back(const std::vector<std::vector<unsigned char>>& keys,
+        std::function<void()> on_done);
+    void finish_read_back();
+
+    // What to evict once memory use goes over the limit. The volatile
+    // policies only evict keys that have an expiry time.
+    enum class eviction_policy
+    {
+        noeviction,
+        allkeys_lru,
+        volatile_lru,
+        allkeys_lfu,
+        volatile_ttl
+    };
+
+    // Throws std::invalid_argument for unknown names.
+    static eviction_policy eviction_policy_from_name(const std::string& name);
+    static std::string eviction_policy_name(eviction_policy policy);
+
+    // Limits memory use to max_memory bytes, or removes the limit if it is
+    // zero. Keys are evicted according to policy, picking the best of
+    // samples randomly chosen keys.
+    void set_memory_limit(std::size_t max_memory, eviction_policy policy,
+        std::size_t samples);
+    // Evicts keys while memory use is over the limit, a limited number at a
+    // time. Returns false if memory use is over the limit and nothing could
+    // be evicted, in which case commands that add data should be refused.
+    // Should be called before such commands, and periodically.
+    bool make_room();
+    // Bytes of heap used by the keyspace. Kept up to date as values change,
+    // so this is constant time.
+    std::size_t used_memory() const;
+    std::size_t memory_limit() const;
+    eviction_policy memory_policy() const;
+    std::size_t evicted_keys() const;
+
+    // Bytes used by a key and its value. Throws key_error if the key does
+    // not exist.
+    std::size_t memory_usage(const std::vector<unsigned char>& key);
+
+    // Where memory goes. The keyspace figures are kept up to date as values
+    // change, the allocator figures are for the whole process.
+    struct memory_stats
+    {
+        std::size_t keys;
+        // The hash table: buckets, nodes and the keys themselves.
+        std::size_t keyspace_overhead;
+        std::size_t strings;
+        std::size_t zsets;
+        std::size_t hashes;
+        // Stubs of strings in the spill log.
+        std::size_t spilled_strings;
+        // Bytes handed out by the allocator.
+        std::size_t allocator_allocated;
+        // Bytes the allocator got from the OS, including free chunks it
+        // holds on to.
+        std::size_t allocator_active;
+        std::size_t resident;
+        // Bytes mapped for slabs, bytes of slab chunks in use and bytes
+        // asked for from the slabs. Slabs hold the hash table and tree nodes.
+        std::size_t slab_active;
+        std::size_t slab_allocated;
+        std::size_t slab_requested;
+    };
+    memory_stats memory_statistics() const;
+
+    // Active defragmentation. A cycle starts once the slabs waste more than
+    // ignore_bytes and more than threshold_percent of the bytes in use, and
+    // walks the keyspace moving keys and sorted set elements off sparsely
+    // used slabs, so that the slabs empty out and are given back to the OS.
+    void set_active_defrag(bool enabled, unsigned int threshold_percent,
+        std::size_t ignore_bytes);
+    // Does a bounded amount of defragmentation, starting a cycle if one is
+    // due. Should be called often. Returns true while a cycle is running.
+    bool defrag_step();
+    bool defrag_running() const;
+    // Keys and sorted set elements moved so far.
+    std::size_t defrag_moved() const;
+    std::size_t defrag_cycles() const;
+
+    enum class background_job
+    {
+        none,
+        log_rewrite,
+        save
+    };
+
+    // Only one background job (a forked child) runs at a time.
+    bool background_job_running() const;
+    // Reaps the background job if it has finished. Should be called
+    // periodically. Returns the job if it failed, or none.
+    background_job check_background_job();
+    void kill_background_job();
 
 private:
+    // What memory is accounted as.
+    enum value_kind : std::uint8_t
+    {
+        no_value,
+        string_value,
+        zset_value,
+        hash_value,
+        spilled_value,
+        value_kind_count
+    };
+
+    // A value in the hash table, along with what eviction needs to know
+    // about it. The small fields fit in what would otherwise be padding.
+    struct entry
+    {
+        entry();
+
+        boost::any value;
+        // Bytes used by the value. See value_memory().
+        std::size_t memory;
+        value_kind kind;
+        // Seconds on the access clock. See access_clock().
+        std::uint32_t access_time;
+        // Minutes on the access clock when lfu_counter was last decayed.
+        std::uint16_t lfu_time;
+        // Logarithmic access frequency counter.
+        std::uint8_t lfu_counter;
+    };
+
+    // A key that may be evicted, and how good a choice it is. Higher scores
+    // are evicted first.
+    struct eviction_candidate
+    {
+        std::uint64_t score;
+        std::vector<unsigned char> key;
+    };
+
+    // Nodes come from the slab pool.
+    typedef boost::unordered_map<std::vector<unsigned char>, entry,
+        boost::hash<std::vector<unsigned char>>,
+        std::equal_to<std::vector<unsigned char>>,
+        slab_allocator<std::pair<const std::vector<unsigned char>, entry>>>
+        map_type;
+
+    // Stands in for a binary string whose contents are in the spill log. The
+    // expiry time is kept in memory so that it can expire without being read
+    // back.
+    struct spilled_string
+    {
+        spill_log::location location;
+        bool has_expiry;
+        chrono::system_clock::time_point expiry_time;
+
+        bool has_expired() const;
+    };
+
+    // Reads the file into map.
+    void read_snapshot(map_type& map);
+    // Loads the segments of a segmented file into map in parallel.
+    void load_segments(std::ifstream& in, map_type& map);
+    // Throws load_error if loading has been cancelled.
+    void check_load_cancelled() const;
+
+    // Called once the background job has exited.
+    void finish_background_job(bool success);
+
+    // Writes the snapshot file.
+    void write_snapshot();
+    // Records a successful save that included the given number of changes.
+    void saved(std::size_t changes);
+
     // Returns true if the key was expired.
     bool expire_if_needed(const std::vector<unsigned char>& key);
+    // True for strings past their expiry time.
+    static bool value_expired(const boost::any& value);
+    // Removes a key, along with its copy in the mapped store or spill log.
+    map_type::iterator erase(map_type::iterator it);
+
+    // Seconds since the store was created.
+    std::uint32_t access_clock() const;
+    // Updates the access time and, with the LFU policy, the access counter.
+    void record_access(entry& e);
+    // The LFU counter after decaying it for the time since it was last
+    // decayed.
+    std::uint8_t decayed_lfu_counter(const entry& e) const;
+
+    // Bytes used by the hash table node of a key, including the key.
+    static std::size_t key_memory(const std::vector<unsigned char>& key);
+    // Bytes used by a value, including its boost::any holder.
+    static std::size_t value_memory(const boost::any& value, value_kind& kind);
+    // Bytes used by the bucket array of the hash table.
+    std::size_t bucket_memory() const;
+    // Returns the entry for a key, adding an empty one if there is none.
+    entry& insert_entry(const std::vector<unsigned char>& key);
+    // Must be called whenever the value of an entry changes.
+    void update_memory(entry& e);
+
+    // Defragments the keys in the bucket the defrag cursor points to and
+    // small sorted sets in it, queueing large ones. Returns the number of
+    // entries visited.
+    std::size_t defrag_bucket();
+    // Continues with the first queued sorted set, visiting up to count
+    // elements. Returns the number visited.
+    std::size_t defrag_queued_zset(std::size_t count);
+    // Gives a key a new hash table node.
+    void move_entry(const std::vector<unsigned char>& key);
+
+    // Adds randomly sampled keys to the eviction pool.
+    void sample_eviction_candidates();
+    // Evicts the best candidate in the pool. Returns false if there is none.
+    bool evict_one();
+
+    // Brings a string that isn't in memory in from the mapped store or the
+    // spill log. Strings in the spill log are normally read back before a
+    // command runs, this is a fallback that blocks on the disk.
+    void fault_in(const std::vector<unsigned char>& key);
+    // Reads a spilled string.
+    bstring unspill(const spilled_string& spilled) const;
+    // Must be called before a value is replaced or removed, in case it was
+    // spilled.
+    void release_spilled(const boost::any& value);
+    // Roughly the number of allocations freed along with a value.
+    static std::size_t free_effort(const boost::any& value);
+    // Must be called before a value is replaced or removed. Hands large
+    // values over to the lazy free thread, leaving value empty.
+    void dispose(boost::any& value);
+    // Adds the spilled values in the next part of the keyspace to
+    // compaction_entries_. Returns true once the whole keyspace is covered.
+    bool collect_spilled();
+    // Swaps the compacted spill log in, once the compaction has finished.
+    void finish_spill_compaction();
+    // With the mapped store, writes a string through to the store. Returns
+    // true if the store took care of persisting the value.
+    bool write_through(const std::vector<unsigned char>& key,
+        const boost::any& value);
+    // Installs a freshly loaded keyspace. With the mapped store, strings from
+    // the snapshot are moved into the store unless it already has them.
+    void install_loaded(map_type& loaded_map);
 
     std::string db_path_;
-    boost::unordered_map<std::vector<unsigned char>, boost::any> map_;
+    map_type map_;
+    std::size_t load_threads_;
+    bool loading_;
+    std::thread load_thread_;
+    map_type loaded_map_;
+    std::exception_ptr load_exception_;
+    std::atomic<std::size_t> load_total_bytes_;
+    std::atomic<std::size_t> load_loaded_bytes_;
+    std::atomic<std::size_t> load_loaded_keys_;
+    std::atomic<bool> cancel_loading_;
+    chrono::steady_clock::time_point load_start_time_;
+    std::size_t dirty_;
+    chrono::system_clock::time_point last_save_time_;
+    std::unique_ptr<append_log> log_;
+    std::unique_ptr<mapped_store> store_;
+    std::unique_ptr<spill_log> spill_;
+    unsigned int spill_idle_seconds_;
+    std::size_t spill_min_size_;
+    std::size_t spilled_count_;
+    // Bucket cursor over the keyspace for finding cold strings.
+    std::uint64_t spill_cursor_;
+    // Whether the spilled values are being gathered for a compaction, and
+    // the bucket cursor for doing so.
+    bool collecting_spilled_;
+    std::uint64_t collect_cursor_;
+    // Spilled values being copied by the spill log compaction, in the order
+    // their locations were handed to it.
+    std::vector<std::pair<std::vector<unsigned char>, spill_log::location>>
+        compaction_entries_;
+    chrono::steady_clock::time_point clock_start_;
+    // Memory accounting. See used_memory().
+    std::size_t key_memory_;
+    std::size_t value_memory_[value_kind_count];
+    std::size_t max_memory_;
+    eviction_policy policy_;
+    std::size_t eviction_samples_;
+    std::size_t evicted_keys_;
+    // The best candidates seen so far, sorted by increasing score.
+    std::vector<eviction_candidate> eviction_pool_;
+    std::minstd_rand random_;
+    lazy_free lazy_free_;
+    bool defrag_enabled_;
+    unsigned int defrag_threshold_;
+    std::size_t defrag_ignore_bytes_;
+    bool defrag_running_;
+    // Bucket cursor over the keyspace, and whether it has wrapped around.
+    std::uint64_t defrag_cursor_;
+    bool defrag_keys_done_;
+    // Sorted sets too large to defragment in one go, and the cursor into
+    // the first one.
+    std::deque<std::vector<unsigned char>> defrag_zsets_;
+    std::uint64_t defrag_zset_cursor_;
+    std::size_t defrag_moved_;
+    std::size_t defrag_cycles_;
+    // defrag_moved_ when the current cycle started, and the number of slabs
+    // when the last cycle ended without moving anything. Another cycle would
+    // do no better until that changes.
+    std::size_t defrag_moved_at_start_;
+    std::size_t defrag_fruitless_slabs_;
+    pid_t child_pid_;
+    background_job child_job_;
+    // Value of dirty_ when the background save started.
+    std::size_t changes_at_fork_;
 };
 
 template <typename T>
@@ -83,18 +501,21 @@ bool exostore::is_type(const std::vector<unsigned char>& key)
     {
         return false;
     }
-    return map_[key].type() == typeid(T);
+    return map_[key].value.type() == typeid(T);
 }
 
 template <typename T>
 T& exostore::get(const std::vector<unsigned char>& key)
 {
+    fault_in(key);
     if (map_.count(key) == 0 || expire_if_needed(key))
     {
         throw exostore::key_error();
     }
 
-    auto& value = map_.at(key);
+    auto& stored = map_.at(key);
+    record_access(stored);
+    auto& value = stored.value;
     if (value.type() != typeid(T))
     {
         throw exostore::type_error();
@@ -111,9 +532,18 @@ T& exostore::get(const std::vector<unsigned char>& key)
 }
 
 template <typename T>
-void exostore::set(const std::vector<unsigned char>& key, const T& value)
+void exostore::set(const std::vector<unsigned char>& key, T value)
 {
-    map_[key] = value;
+    auto& stored = insert_entry(key);
+    release_spilled(stored.value);
+    dispose(stored.value);
+    stored.value = std::move(value);
+    record_access(stored);
+    update_memory(stored);
+    if (!write_through(key, stored.value))
+    {
+        dirty_++;
+    }
 }
 
 #endif
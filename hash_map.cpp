@@ -0,0 +1,180 @@
+#include "hash_map.hpp"
+#include "util.hpp"
+#include <algorithm>
+
+static_assert(hash_map::max_packed_length < 256,
+    "Packed lengths must fit in a byte");
+
+hash_map::hash_map() : packed_count_(0), table_bytes_(0)
+{
+}
+
+std::size_t hash_map::size() const
+{
+    return is_packed() ? packed_count_ : table_.size();
+}
+
+bool hash_map::is_packed() const
+{
+    // Fields are never removed, so the table is only empty while packed.
+    return table_.empty();
+}
+
+bool hash_map::get(const hash_map::field_type& field,
+    hash_map::field_type& value) const
+{
+    if (!is_packed())
+    {
+        auto it = table_.find(field);
+        if (it == table_.end())
+        {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+    auto offset = find_packed(field);
+    if (offset == packed_.size())
+    {
+        return false;
+    }
+    auto value_offset = offset + 1 + field.size();
+    auto value_begin = packed_.begin() + value_offset + 1;
+    value.assign(value_begin, value_begin + packed_[value_offset]);
+    return true;
+}
+
+bool hash_map::set(const hash_map::field_type& field,
+    const hash_map::field_type& value)
+{
+    if (is_packed())
+    {
+        if (field.size() > max_packed_length
+            || value.size() > max_packed_length)
+        {
+            unpack();
+        }
+        else
+        {
+            auto offset = find_packed(field);
+            if (offset != packed_.size())
+            {
+                // Replace the old value, shifting the rest of the buffer
+                // only if the length changed.
+                auto value_offset = offset + 1 + field.size();
+                std::size_t old_size = packed_[value_offset];
+                auto value_begin = packed_.begin() + value_offset + 1;
+                if (old_size == value.size())
+                {
+                    std::copy(value.begin(), value.end(), value_begin);
+                }
+                else
+                {
+                    value_begin = packed_.erase(value_begin,
+                        value_begin + old_size);
+                    packed_.insert(value_begin, value.begin(), value.end());
+                    packed_[value_offset]
+                        = static_cast<unsigned char>(value.size());
+                }
+                return false;
+            }
+            if (packed_count_ < max_packed_entries)
+            {
+                packed_.push_back(static_cast<unsigned char>(field.size()));
+                packed_.insert(packed_.end(), field.begin(), field.end());
+                packed_.push_back(static_cast<unsigned char>(value.size()));
+                packed_.insert(packed_.end(), value.begin(), value.end());
+                packed_count_++;
+                return true;
+            }
+            unpack();
+        }
+    }
+
+    auto it = table_.find(field);
+    if (it != table_.end())
+    {
+        table_bytes_ -= allocation_size(it->second.capacity());
+        it->second = value;
+        table_bytes_ += allocation_size(it->second.capacity());
+        return false;
+    }
+    it = table_.emplace(field, value).first;
+    table_bytes_ += allocation_size(it->first.capacity())
+        + allocation_size(it->second.capacity());
+    return true;
+}
+
+void hash_map::for_each(
+    std::function<void(const field_type&, const field_type&)> f) const
+{
+    if (!is_packed())
+    {
+        for (const auto& pair: table_)
+        {
+            f(pair.first, pair.second);
+        }
+        return;
+    }
+
+    field_type field;
+    field_type value;
+    std::size_t offset = 0;
+    while (offset < packed_.size())
+    {
+        auto begin = packed_.begin() + offset + 1;
+        field.assign(begin, begin + packed_[offset]);
+        offset += 1 + field.size();
+        begin = packed_.begin() + offset + 1;
+        value.assign(begin, begin + packed_[offset]);
+        offset += 1 + value.size();
+        f(field, value);
+    }
+}
+
+std::size_t hash_map::memory_usage() const
+{
+    if (is_packed())
+    {
+        return allocation_size(packed_.capacity());
+    }
+    // Each element has a node holding a link, the bucket index and the
+    // field-value pair. The table also has an array of buckets.
+    const std::size_t node_size = allocation_size(
+        2 * sizeof(void*) + sizeof(table_type::value_type));
+    const std::size_t bucket_array_size = table_.bucket_count() == 0 ? 0
+        : allocation_size((table_.bucket_count() + 1) * sizeof(void*));
+    return bucket_array_size + table_bytes_ + table_.size() * node_size;
+}
+
+std::size_t hash_map::find_packed(const hash_map::field_type& field) const
+{
+    std::size_t offset = 0;
+    while (offset < packed_.size())
+    {
+        std::size_t field_size = packed_[offset];
+        auto field_begin = packed_.begin() + offset + 1;
+        if (field_size == field.size()
+            && std::equal(field.begin(), field.end(), field_begin))
+        {
+            return offset;
+        }
+        auto value_offset = offset + 1 + field_size;
+        offset = value_offset + 1 + packed_[value_offset];
+    }
+    return packed_.size();
+}
+
+void hash_map::unpack()
+{
+    table_.reserve(packed_count_ + 1);
+    for_each([this](const field_type& field, const field_type& value)
+    {
+        auto it = table_.emplace(field, value).first;
+        table_bytes_ += allocation_size(it->first.capacity())
+            + allocation_size(it->second.capacity());
+    });
+    std::vector<unsigned char>().swap(packed_);
+    packed_count_ = 0;
+}
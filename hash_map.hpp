@@ -0,0 +1,71 @@
+#ifndef __EXOREDIS_HASH_MAP_HPP__
+#define __EXOREDIS_HASH_MAP_HPP__
+
+#include <vector>
+#include <cstddef>
+#include <functional>
+#include <boost/unordered_map.hpp>
+
+
+/*
+ * Represents a hash (a map of fields to values) in the database.
+ *
+ * A small hash is packed into a single buffer of field-value pairs, each
+ * prefixed with its length in one byte, and is searched linearly. This costs
+ * a few bytes per field rather than two heap allocations and a hash table
+ * node, which is what makes a hash of a few fields far cheaper than as many
+ * keys. Once a hash has more than max_packed_entries fields, or a field or
+ * value longer than max_packed_length bytes, it is moved to a hash table for
+ * good.
+ */
+class hash_map
+{
+public:
+    typedef std::vector<unsigned char> field_type;
+    typedef boost::unordered_map<field_type, field_type,
+        boost::hash<field_type>> table_type;
+
+    static const std::size_t max_packed_entries = 128;
+    // Must fit in the one byte length prefix.
+    static const std::size_t max_packed_length = 64;
+
+    hash_map();
+
+    std::size_t size() const;
+
+    // Whether the hash is still in the packed form.
+    bool is_packed() const;
+
+    // Sets value to the value of a field. Returns false if the field is not
+    // present.
+    bool get(const field_type& field, field_type& value) const;
+
+    // Sets a field, adding it if it is not present. Returns true if it was
+    // added.
+    bool set(const field_type& field, const field_type& value);
+
+    // Calls f with every field and its value. In the packed form they come
+    // in the order they were added.
+    void for_each(
+        std::function<void(const field_type&, const field_type&)> f) const;
+
+    // Bytes allocated on the heap by the hash, not counting the hash_map
+    // object itself. Computed in constant time.
+    std::size_t memory_usage() const;
+
+private:
+    // Returns the offset of the entry holding field in packed_, or
+    // packed_.size() if there is none.
+    std::size_t find_packed(const field_type& field) const;
+
+    // Moves the packed entries to the hash table.
+    void unpack();
+
+    std::vector<unsigned char> packed_;
+    std::size_t packed_count_;
+    table_type table_;
+    // Heap bytes taken by the fields and values in the hash table.
+    std::size_t table_bytes_;
+};
+
+#endif
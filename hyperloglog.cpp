@@ -0,0 +1,525 @@
+#include "hyperloglog.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define EXOREDIS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+const unsigned hyperloglog::precision;
+const std::size_t hyperloglog::register_count;
+const std::size_t hyperloglog::header_size;
+const std::size_t hyperloglog::dense_size;
+const std::size_t hyperloglog::sparse_max_size;
+
+namespace
+{
+    const char magic[] = {'H', 'Y', 'L', 'L'};
+    const unsigned char dense_encoding = 0;
+    const unsigned char sparse_encoding = 1;
+
+    // Bits of the hash left after the register index. A register holds one
+    // more than the number of trailing zeros in them, so up to this plus one.
+    const unsigned hash_bits = 64 - hyperloglog::precision;
+
+    // Sparse opcodes. ZERO is 00xxxxxx, a run of 1 to 64 zeros. XZERO is
+    // 01xxxxxx yyyyyyyy, a run of 1 to 16384 zeros. VAL is 1vvvvvxx, a run
+    // of 1 to 4 registers holding 1 to 32.
+    const unsigned char xzero_flag = 0x40;
+    const unsigned char val_flag = 0x80;
+    const unsigned zero_max_run = 64;
+    const unsigned xzero_max_run = 16384;
+    const unsigned val_max_run = 4;
+    const unsigned val_max_value = 32;
+
+    // The register an element goes to, and the value it offers it.
+    void hash_element(const unsigned char* data, std::size_t size,
+        std::size_t& index, unsigned char& rank)
+    {
+        auto hash = murmur_hash64(data, size);
+        index = hash & (hyperloglog::register_count - 1);
+        hash = (hash >> hyperloglog::precision) | (1ULL << hash_bits);
+        rank = __builtin_ctzll(hash) + 1;
+    }
+
+    // Six bit registers, packed from the least significant bit of each byte.
+    unsigned char get_dense(const unsigned char* registers, std::size_t size,
+        std::size_t index)
+    {
+        auto byte = index * 6 / 8;
+        auto shift = index * 6 % 8;
+        unsigned value = registers[byte] >> shift;
+        if (byte + 1 < size)
+        {
+            value |= registers[byte + 1] << (8 - shift);
+        }
+        return value & 63;
+    }
+
+    void set_dense(unsigned char* registers, std::size_t size,
+        std::size_t index, unsigned char value)
+    {
+        auto byte = index * 6 / 8;
+        auto shift = index * 6 % 8;
+        registers[byte] &= ~(63 << shift);
+        registers[byte] |= value << shift;
+        if (byte + 1 < size)
+        {
+            registers[byte + 1] &= ~(63 >> (8 - shift));
+            registers[byte + 1] |= value >> (8 - shift);
+        }
+    }
+
+    std::vector<unsigned char> make_header(unsigned char encoding)
+    {
+        std::vector<unsigned char> bytes(magic, magic + sizeof(magic));
+        bytes.push_back(encoding);
+        bytes.resize(hyperloglog::header_size, 0);
+        // The cached estimate starts out stale.
+        bytes[hyperloglog::header_size - 1] = 0x80;
+        return bytes;
+    }
+
+    // Ertl's corrections for registers that are zero and registers that are
+    // at their maximum, from "New cardinality estimation algorithms for
+    // HyperLogLog sketches", as Redis uses them.
+    double sigma(double x)
+    {
+        if (x == 1.0)
+        {
+            return INFINITY;
+        }
+        double previous;
+        double y = 1;
+        double z = x;
+        do
+        {
+            x *= x;
+            previous = z;
+            z += x * y;
+            y += y;
+        } while (previous != z);
+        return z;
+    }
+
+    double tau(double x)
+    {
+        if (x == 0.0 || x == 1.0)
+        {
+            return 0.0;
+        }
+        double previous;
+        double y = 1.0;
+        double z = 1 - x;
+        do
+        {
+            x = std::sqrt(x);
+            previous = z;
+            y *= 0.5;
+            z -= (1 - x) * (1 - x) * y;
+        } while (previous != z);
+        return z / 3;
+    }
+
+    void max_registers_portable(unsigned char* dest, const unsigned char* src,
+        std::size_t size)
+    {
+        for (std::size_t i = 0; i < size; i++)
+        {
+            dest[i] = std::max(dest[i], src[i]);
+        }
+    }
+
+    double harmonic_sum_portable(const unsigned char* registers,
+        std::size_t size, std::size_t& zeros)
+    {
+        // 2^-r for each value a register can hold.
+        static const auto powers = []()
+        {
+            std::vector<double> table(64);
+            for (int r = 0; r < 64; r++)
+            {
+                table[r] = std::ldexp(1.0, -r);
+            }
+            return table;
+        }();
+        double sum = 0;
+        for (std::size_t i = 0; i < size; i++)
+        {
+            sum += powers[registers[i]];
+            zeros += registers[i] == 0;
+        }
+        return sum;
+    }
+
+#ifdef EXOREDIS_X86_KERNELS
+    __attribute__((target("sse4.2")))
+    void max_registers_sse42(unsigned char* dest, const unsigned char* src,
+        std::size_t size)
+    {
+        std::size_t i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                dest + i));
+            auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i),
+                _mm_max_epu8(a, b));
+        }
+        max_registers_portable(dest + i, src + i, size - i);
+    }
+
+    __attribute__((target("avx2")))
+    void max_registers_avx2(unsigned char* dest, const unsigned char* src,
+        std::size_t size)
+    {
+        std::size_t i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                dest + i));
+            auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                src + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i),
+                _mm256_max_epu8(a, b));
+        }
+        max_registers_sse42(dest + i, src + i, size - i);
+    }
+
+    // The vector versions build 2^-r as a float whose exponent is 127 - r,
+    // and add up a block at a time in floats before moving the total to a
+    // double, which keeps the rounding error well below the estimate's.
+    __attribute__((target("sse4.2,popcnt")))
+    double harmonic_sum_sse42(const unsigned char* registers,
+        std::size_t size, std::size_t& zeros)
+    {
+        const auto bias = _mm_set1_epi32(127);
+        const auto zero = _mm_setzero_si128();
+        double sum = 0;
+        std::size_t i = 0;
+        while (i + 16 <= size)
+        {
+            auto total = _mm_setzero_ps();
+            for (std::size_t block = 0; block < 128 && i + 16 <= size;
+                block++, i += 16)
+            {
+                auto bytes = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(registers + i));
+                zeros += __builtin_popcount(_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(bytes, zero)));
+                for (int j = 0; j < 4; j++)
+                {
+                    auto values = _mm_cvtepu8_epi32(bytes);
+                    total = _mm_add_ps(total, _mm_castsi128_ps(_mm_slli_epi32(
+                        _mm_sub_epi32(bias, values), 23)));
+                    bytes = _mm_srli_si128(bytes, 4);
+                }
+            }
+            float lanes[4];
+            _mm_storeu_ps(lanes, total);
+            sum += double(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        }
+        return sum + harmonic_sum_portable(registers + i, size - i, zeros);
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    double harmonic_sum_avx2(const unsigned char* registers,
+        std::size_t size, std::size_t& zeros)
+    {
+        const auto bias = _mm256_set1_epi32(127);
+        const auto zero = _mm256_setzero_si256();
+        double sum = 0;
+        std::size_t i = 0;
+        while (i + 32 <= size)
+        {
+            auto total = _mm256_setzero_ps();
+            for (std::size_t block = 0; block < 64 && i + 32 <= size;
+                block++, i += 32)
+            {
+                auto bytes = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(registers + i));
+                zeros += __builtin_popcount(_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(bytes, zero)));
+                for (int j = 0; j < 4; j++)
+                {
+                    auto values = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+                        reinterpret_cast<const __m128i*>(
+                            registers + i + 8 * j)));
+                    total = _mm256_add_ps(total, _mm256_castsi256_ps(
+                        _mm256_slli_epi32(_mm256_sub_epi32(bias, values),
+                            23)));
+                }
+            }
+            float lanes[8];
+            _mm256_storeu_ps(lanes, total);
+            for (auto lane: lanes)
+            {
+                sum += lane;
+            }
+        }
+        return sum + harmonic_sum_sse42(registers + i, size - i, zeros);
+    }
+#endif
+}
+
+hyperloglog::hyperloglog()
+    : registers_(register_count, 0)
+{
+}
+
+hyperloglog::hyperloglog(const std::vector<unsigned char>& bytes)
+    : registers_(register_count, 0)
+{
+    if (!has_header(bytes))
+    {
+        throw format_error();
+    }
+
+    const auto data = bytes.data() + header_size;
+    const auto size = bytes.size() - header_size;
+    if (bytes[4] == dense_encoding)
+    {
+        for (std::size_t i = 0; i < register_count; i++)
+        {
+            registers_[i] = get_dense(data, size, i);
+        }
+        return;
+    }
+
+    std::size_t index = 0;
+    for (std::size_t i = 0; i < size; i++)
+    {
+        std::size_t run;
+        unsigned char value = 0;
+        if (data[i] & val_flag)
+        {
+            value = ((data[i] >> 2) & 31) + 1;
+            run = (data[i] & 3) + 1;
+        }
+        else if (data[i] & xzero_flag)
+        {
+            if (i + 1 == size)
+            {
+                throw format_error();
+            }
+            run = (((data[i] & 63) << 8) | data[i + 1]) + 1;
+            i++;
+        }
+        else
+        {
+            run = (data[i] & 63) + 1;
+        }
+        if (run > register_count - index)
+        {
+            throw format_error();
+        }
+        std::fill_n(registers_.begin() + index, run, value);
+        index += run;
+    }
+    if (index != register_count)
+    {
+        throw format_error();
+    }
+}
+
+bool hyperloglog::add(const unsigned char* data, std::size_t size)
+{
+    std::size_t index;
+    unsigned char rank;
+    hash_element(data, size, index, rank);
+    if (rank <= registers_[index])
+    {
+        return false;
+    }
+    registers_[index] = rank;
+    return true;
+}
+
+void hyperloglog::merge(const hyperloglog& other, simd_level level)
+{
+    max_registers(registers_.data(), other.registers_.data(), register_count,
+        level);
+}
+
+std::uint64_t hyperloglog::count(simd_level level) const
+{
+    const double m = register_count;
+    std::size_t zeros = 0;
+    auto sum = harmonic_sum(registers_.data(), register_count, zeros, level);
+    if (zeros == register_count)
+    {
+        return 0;
+    }
+    const auto top = std::count(registers_.begin(), registers_.end(),
+        hash_bits + 1);
+
+    // The sum without the zero and maxed out registers, which Ertl's
+    // estimator replaces with its corrections.
+    double z = sum - zeros - top * std::ldexp(1.0, -int(hash_bits + 1));
+    z += m * tau((m - top) / m) * std::ldexp(1.0, -int(hash_bits));
+    z += m * sigma(zeros / m);
+    const double alpha = 0.5 / std::log(2.0);
+    return std::llround(alpha * m * m / z);
+}
+
+std::vector<unsigned char> hyperloglog::encode() const
+{
+    auto bytes = make_header(sparse_encoding);
+    for (std::size_t i = 0; i < register_count;)
+    {
+        auto value = registers_[i];
+        std::size_t run = 1;
+        while (i + run < register_count && registers_[i + run] == value)
+        {
+            run++;
+        }
+        i += run;
+
+        if (value > val_max_value)
+        {
+            bytes.clear();
+            break;
+        }
+        while (run > 0)
+        {
+            if (value != 0)
+            {
+                auto length = std::min<std::size_t>(run, val_max_run);
+                bytes.push_back(val_flag | ((value - 1) << 2) | (length - 1));
+                run -= length;
+            }
+            else if (run > zero_max_run)
+            {
+                auto length = std::min<std::size_t>(run, xzero_max_run);
+                bytes.push_back(xzero_flag | ((length - 1) >> 8));
+                bytes.push_back((length - 1) & 0xff);
+                run -= length;
+            }
+            else
+            {
+                bytes.push_back(run - 1);
+                run = 0;
+            }
+        }
+        if (bytes.size() > sparse_max_size)
+        {
+            bytes.clear();
+            break;
+        }
+    }
+    if (!bytes.empty())
+    {
+        return bytes;
+    }
+
+    bytes = make_header(dense_encoding);
+    bytes.resize(dense_size, 0);
+    for (std::size_t i = 0; i < register_count; i++)
+    {
+        set_dense(bytes.data() + header_size, dense_size - header_size, i,
+            registers_[i]);
+    }
+    return bytes;
+}
+
+const std::vector<unsigned char>& hyperloglog::registers() const
+{
+    return registers_;
+}
+
+bool hyperloglog::add_dense(std::vector<unsigned char>& bytes,
+    const unsigned char* data, std::size_t size)
+{
+    std::size_t index;
+    unsigned char rank;
+    hash_element(data, size, index, rank);
+    auto registers = bytes.data() + header_size;
+    if (rank <= get_dense(registers, dense_size - header_size, index))
+    {
+        return false;
+    }
+    set_dense(registers, dense_size - header_size, index, rank);
+    bytes[header_size - 1] |= 0x80;
+    return true;
+}
+
+bool hyperloglog::has_header(const std::vector<unsigned char>& bytes)
+{
+    if (bytes.size() < header_size
+        || !std::equal(magic, magic + sizeof(magic), bytes.begin()))
+    {
+        return false;
+    }
+    return bytes[4] == sparse_encoding
+        || (bytes[4] == dense_encoding && bytes.size() == dense_size);
+}
+
+bool hyperloglog::is_dense(const std::vector<unsigned char>& bytes)
+{
+    return has_header(bytes) && bytes[4] == dense_encoding;
+}
+
+bool hyperloglog::cached_count(const std::vector<unsigned char>& bytes,
+    std::uint64_t& count)
+{
+    if (bytes[header_size - 1] & 0x80)
+    {
+        return false;
+    }
+    count = 0;
+    for (std::size_t i = 0; i < 8; i++)
+    {
+        count |= std::uint64_t(bytes[8 + i]) << (8 * i);
+    }
+    return true;
+}
+
+void hyperloglog::set_cached_count(std::vector<unsigned char>& bytes,
+    std::uint64_t count)
+{
+    for (std::size_t i = 0; i < 8; i++)
+    {
+        bytes[8 + i] = count >> (8 * i);
+    }
+}
+
+void max_registers(unsigned char* dest, const unsigned char* src,
+    std::size_t size, simd_level level)
+{
+    switch (std::min(level, detected_simd_level()))
+    {
+#ifdef EXOREDIS_X86_KERNELS
+    case simd_level::avx2:
+        max_registers_avx2(dest, src, size);
+        break;
+    case simd_level::sse42:
+        max_registers_sse42(dest, src, size);
+        break;
+#endif
+    default:
+        max_registers_portable(dest, src, size);
+        break;
+    }
+}
+
+double harmonic_sum(const unsigned char* registers, std::size_t size,
+    std::size_t& zeros, simd_level level)
+{
+    zeros = 0;
+    switch (std::min(level, detected_simd_level()))
+    {
+#ifdef EXOREDIS_X86_KERNELS
+    case simd_level::avx2:
+        return harmonic_sum_avx2(registers, size, zeros);
+    case simd_level::sse42:
+        return harmonic_sum_sse42(registers, size, zeros);
+#endif
+    default:
+        return harmonic_sum_portable(registers, size, zeros);
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef __EXOREDIS_HYPERLOGLOG_HPP__
+#define __EXOREDIS_HYPERLOGLOG_HPP__
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include "bitops.hpp"
+
+
+/*
+ * A HyperLogLog, which estimates the number of distinct elements added to it
+ * with a standard error of 0.81%, in at most 12KB.
+ *
+ * It is kept in a string, laid out as Redis lays it out, so that it is saved,
+ * logged and rewritten like any other string. A 16 byte header holds "HYLL",
+ * the encoding, three unused bytes and a cached estimate, whose top bit is
+ * set when it is stale. It is followed by the 16384 registers, either
+ * - dense: six bits each, 12KB in all, or
+ * - sparse: runs of equal registers, for HyperLogLogs with few elements. A
+ *   run of zeros takes one or two bytes, and a run of up to four registers
+ *   of a value up to 32 one byte. A sparse HyperLogLog turns dense once it
+ *   passes sparse_max_size bytes or a register passes 32.
+ *
+ * A hyperloglog object holds the registers unpacked, one per byte, which is
+ * the form the merge and estimate kernels work on.
+ */
+class hyperloglog
+{
+public:
+    // Bits of the hash that pick a register, and the number of registers.
+    static const unsigned precision = 14;
+    static const std::size_t register_count = 1 << precision;
+    // Sizes of the header and of a dense HyperLogLog.
+    static const std::size_t header_size = 16;
+    static const std::size_t dense_size = header_size
+        + register_count * 6 / 8;
+    // A sparse HyperLogLog that would grow past this is made dense.
+    static const std::size_t sparse_max_size = 3000;
+
+    class format_error: public std::runtime_error
+    {
+    public:
+        format_error() : runtime_error(
+            "Key is not a valid HyperLogLog string value") {}
+    };
+
+    // An empty HyperLogLog.
+    hyperloglog();
+    // Decodes a HyperLogLog string. Throws format_error if it isn't one.
+    explicit hyperloglog(const std::vector<unsigned char>& bytes);
+
+    // Adds an element. Returns true if a register changed.
+    bool add(const unsigned char* data, std::size_t size);
+    // Makes this the union of itself and other.
+    void merge(const hyperloglog& other,
+        simd_level level=detected_simd_level());
+    // The estimated number of distinct elements.
+    std::uint64_t count(simd_level level=detected_simd_level()) const;
+
+    // Encodes as a string, sparse if it fits, with a stale cached estimate.
+    std::vector<unsigned char> encode() const;
+
+    const std::vector<unsigned char>& registers() const;
+
+    // Whether a string starts with a valid header, and is the right size if
+    // it is dense. The registers of a sparse string are only checked when it
+    // is decoded.
+    static bool has_header(const std::vector<unsigned char>& bytes);
+    // Whether a string is a dense HyperLogLog.
+    static bool is_dense(const std::vector<unsigned char>& bytes);
+    // Adds an element to a dense HyperLogLog string in place, marking the
+    // cached estimate stale if a register changes. Returns true if a
+    // register changed.
+    static bool add_dense(std::vector<unsigned char>& bytes,
+        const unsigned char* data, std::size_t size);
+
+    // Reads the cached estimate of a string with a valid header. Returns
+    // false if it is stale.
+    static bool cached_count(const std::vector<unsigned char>& bytes,
+        std::uint64_t& count);
+    static void set_cached_count(std::vector<unsigned char>& bytes,
+        std::uint64_t count);
+
+private:
+    std::vector<unsigned char> registers_;
+};
+
+// Sets each of size bytes of dest to the larger of it and the byte of src.
+void max_registers(unsigned char* dest, const unsigned char* src,
+    std::size_t size, simd_level level=detected_simd_level());
+
+// Returns the sum of 2^-r over size registers r, which must be below 64, and
+// sets zeros to the number that are zero.
+double harmonic_sum(const unsigned char* registers, std::size_t size,
+    std::size_t& zeros, simd_level level=detected_simd_level());
+
+#endif
@@ -5,39 +5,37 @@ import pytest
 pytestmark = pytest.mark.usefixtures('run_server')
 
 
+async def read_response(reader):
+    ''' Reads a response and parses it into a Python object.'''
+    marker = await reader.read(1)
+    if marker == b'+' or marker == b'-':
+        response_string = await reader.readline()
+        return marker.decode() + response_string[:-2].decode()
+    elif marker == b'$':
+        response_length = await reader.readline()
+        response_length = int(response_length[:-2])
+        if response_length == -1:
+            return None         # Nullbulk
+        response_string = await reader.readexactly(response_length)
+        await reader.read(2)    # Discard \r\n
+        return response_string
+    elif marker == b':':
+        integer = await reader.readline()
+        return int(integer[:-2])
+    elif marker == b'*':
+        array_length = await reader.readline()
+        array_length = int(array_length[:-2])
+        ret_array = []
+        for _ in range(array_length):
+            ret_array.append(await read_response(reader))
+        return ret_array
+
+
 def run_command(cmd_list, reader, writer, loop):
     ''' Runs a command and reads and parses the response into a Python object.
         command should be a sequence of bytes.
     '''
 
-    async def read_response(reader):
-        marker = await reader.read(1)
-        if marker == b'+' or marker == b'-':
-            response_string = await reader.readline()
-            return marker.decode() + response_string[:-2].decode()
-        elif marker == b'$':
-            response_length = await reader.readline()
-            response_length = int(response_length[:-2])
-            if response_length == -1:
-                return None         # Nullbulk
-            response_string = await reader.readexactly(response_length)
-            await reader.read(2)    # Discard \r\n
-            return response_string
-        elif marker == b':':
-            integer = await reader.readline()
-            return int(integer[:-2])
-        elif marker == b'*':
-            array_length = await reader.readline()
-            array_length = int(array_length[:-2])
-            ret_array = []
-            for _ in range(array_length):
-                bstr_length = await reader.readline()
-                bstr_length = int(bstr_length[1:-2])
-                response_string = await reader.readexactly(bstr_length)
-                await reader.read(2)
-                ret_array.append(response_string)
-            return ret_array
-
     async def exo_client(cmd_list, reader, writer):
         writer.write(b' '.join(cmd_list) + b'\r\n')
         return await read_response(reader)
@@ -75,6 +73,217 @@ def test_get_set(connection, bstr_size):
     assert response == None
 
 
+def test_del(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    other_key = random_bytes(bstr_size)
+    response = run_command([b'SET', key, random_bytes(bstr_size)], reader,
+                           writer, loop)
+    assert response == '+OK'
+    response = run_command([b'ZADD', other_key, b'1', random_bytes(bstr_size)],
+                           reader, writer, loop)
+    assert response == 1
+
+    response = run_command([b'DEL', key, other_key, random_bytes(bstr_size)],
+                           reader, writer, loop)
+    assert response == 2
+    response = run_command([b'GET', key], reader, writer, loop)
+    assert response == None
+    response = run_command([b'ZCARD', other_key], reader, writer, loop)
+    assert response == 0
+
+
+def test_unlink_flushall(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    other_key = random_bytes(bstr_size)
+    response = run_command([b'SET', key, random_bytes(bstr_size)], reader,
+                           writer, loop)
+    assert response == '+OK'
+    response = run_command([b'UNLINK', key, random_bytes(bstr_size)], reader,
+                           writer, loop)
+    assert response == 1
+    response = run_command([b'GET', key], reader, writer, loop)
+    assert response == None
+
+    for mode in [[b'ASYNC'], [b'SYNC'], []]:
+        response = run_command([b'SET', key, random_bytes(bstr_size)], reader,
+                               writer, loop)
+        assert response == '+OK'
+        response = run_command([b'ZADD', other_key, b'1',
+                                random_bytes(bstr_size)], reader, writer, loop)
+        assert response == 1
+        response = run_command([b'FLUSHALL'] + mode, reader, writer, loop)
+        assert response == '+OK'
+        response = run_command([b'GET', key], reader, writer, loop)
+        assert response == None
+        response = run_command([b'ZCARD', other_key], reader, writer, loop)
+        assert response == 0
+
+
+def test_scan(connection, bstr_size):
+    reader, writer, loop = connection
+    prefix = random_bytes(bstr_size)
+    keys = set(prefix + b':' + str(i).encode() for i in range(100))
+    for key in keys:
+        response = run_command([b'SET', key, b'value'], reader, writer, loop)
+        assert response == '+OK'
+    zset_key = prefix + b':zset'
+    response = run_command([b'ZADD', zset_key, b'1', b'member'], reader,
+                           writer, loop)
+    assert response == 1
+
+    # The prefix is random, so escape any glob characters in it. The server
+    # unescapes the doubled backslash to one.
+    pattern = b''.join(b'\\\\' + bytes([c]) if c in b'*?[]' else bytes([c])
+                       for c in prefix) + b':*'
+    seen = set()
+    cursor = b'0'
+    while True:
+        cursor, batch = run_command([b'SCAN', cursor, b'MATCH', pattern,
+                                     b'COUNT', b'7', b'TYPE', b'string'],
+                                    reader, writer, loop)
+        seen.update(batch)
+        if cursor == b'0':
+            break
+    assert seen == keys
+
+    response = run_command([b'SCAN', b'-1'], reader, writer, loop)
+    assert response == '-ERR invalid cursor'
+    response = run_command([b'SCAN', b'0', b'COUNT', b'0'], reader, writer,
+                           loop)
+    assert response.startswith('-')
+
+
+def test_zscan(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    members = {}
+    for i in range(50):
+        member = b'member' + str(i).encode()
+        members[member] = str(i).encode()
+        response = run_command([b'ZADD', key, str(i).encode(), member],
+                               reader, writer, loop)
+        assert response == 1
+
+    seen = {}
+    cursor = b'0'
+    while True:
+        cursor, batch = run_command([b'ZSCAN', key, cursor, b'COUNT', b'5'],
+                                    reader, writer, loop)
+        seen.update(zip(batch[::2], batch[1::2]))
+        if cursor == b'0':
+            break
+    assert seen == members
+
+    response = run_command([b'ZSCAN', key, b'0', b'MATCH', b'member1?',
+                            b'COUNT', b'1000'], reader, writer, loop)
+    assert response[0] == b'0'
+    assert sorted(response[1][::2]) == sorted(
+        b'member1' + str(i).encode() for i in range(10))
+    response = run_command([b'ZSCAN', random_bytes(bstr_size), b'0'], reader,
+                           writer, loop)
+    assert response == [b'0', []]
+
+
+def test_memory(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    response = run_command([b'SET', key, random_bytes(bstr_size)], reader,
+                           writer, loop)
+    assert response == '+OK'
+
+    response = run_command([b'MEMORY', b'USAGE', key], reader, writer, loop)
+    assert response >= bstr_size
+    response = run_command([b'MEMORY', b'USAGE', key, b'SAMPLES', b'5'],
+                           reader, writer, loop)
+    assert response >= bstr_size
+    response = run_command([b'MEMORY', b'USAGE', random_bytes(bstr_size)],
+                           reader, writer, loop)
+    assert response == None
+
+    response = run_command([b'MEMORY', b'STATS'], reader, writer, loop)
+    stats = dict(zip(response[::2], response[1::2]))
+    assert int(stats[b'keys.count']) >= 1
+    assert int(stats[b'dataset.strings']) >= bstr_size
+
+
+def test_incr_decr(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    response = run_command([b'INCR', key], reader, writer, loop)
+    assert response == 1
+    response = run_command([b'INCRBY', key, b'41'], reader, writer, loop)
+    assert response == 42
+    response = run_command([b'DECR', key], reader, writer, loop)
+    assert response == 41
+    response = run_command([b'DECRBY', key, b'-9'], reader, writer, loop)
+    assert response == 50
+    response = run_command([b'GET', key], reader, writer, loop)
+    assert response == b'50'
+
+    response = run_command([b'INCRBYFLOAT', key, b'0.5'], reader, writer,
+                           loop)
+    assert response == b'50.5'
+    response = run_command([b'INCRBY', key, b'1'], reader, writer, loop)
+    assert response.startswith('-ERR')
+    response = run_command([b'INCRBYFLOAT', key, b'-0.5'], reader, writer,
+                           loop)
+    assert response == b'50'
+    response = run_command([b'INCR', key], reader, writer, loop)
+    assert response == 51
+
+    response = run_command([b'SET', key, b'9223372036854775807'], reader,
+                           writer, loop)
+    assert response == '+OK'
+    response = run_command([b'INCR', key], reader, writer, loop)
+    assert response.startswith('-ERR')
+    response = run_command([b'INCRBY', key, b'one'], reader, writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_append_getrange_setrange(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    value = random_bytes(bstr_size)
+    response = run_command([b'APPEND', key, value], reader, writer, loop)
+    assert response == len(value)
+    response = run_command([b'APPEND', key, b'tail'], reader, writer, loop)
+    assert response == len(value) + 4
+    response = run_command([b'STRLEN', key], reader, writer, loop)
+    assert response == len(value) + 4
+    value += b'tail'
+
+    response = run_command([b'GETRANGE', key, b'0', b'-1'], reader, writer,
+                           loop)
+    assert response == value
+    response = run_command([b'GETRANGE', key, b'-4', b'1000000'], reader,
+                           writer, loop)
+    assert response == b'tail'
+    response = run_command([b'GETRANGE', key, b'5', b'2'], reader, writer,
+                           loop)
+    assert response == b''
+
+    response = run_command([b'SETRANGE', key, b'1', b'xy'], reader, writer,
+                           loop)
+    assert response == len(value)
+    response = run_command([b'GET', key], reader, writer, loop)
+    assert response == value[:1] + b'xy' + value[3:]
+
+    other = random_bytes(bstr_size)
+    response = run_command([b'SETRANGE', other, b'3', b'ab'], reader, writer,
+                           loop)
+    assert response == 5
+    response = run_command([b'GET', other], reader, writer, loop)
+    assert response == b'\0\0\0ab'
+    response = run_command([b'STRLEN', random_bytes(bstr_size)], reader,
+                           writer, loop)
+    assert response == 0
+    response = run_command([b'SETRANGE', other, b'-1', b'ab'], reader, writer,
+                           loop)
+    assert response.startswith('-ERR')
+
+
 def test_getbit_setbit(connection, bstr_size):
     reader, writer, loop = connection
     key = random_bytes(bstr_size)
@@ -95,6 +304,476 @@ def test_getbit_setbit(connection, bstr_size):
     assert response == new_bit
 
 
+def test_bitcount_bitpos(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    value = bytes([0x00, 0xff, 0xf0]) * 20
+    response = run_command([b'SETRANGE', key, b'0', value], reader, writer,
+                           loop)
+    assert response == len(value)
+
+    response = run_command([b'BITCOUNT', key], reader, writer, loop)
+    assert response == 12 * 20
+    response = run_command([b'BITCOUNT', key, b'1', b'2'], reader, writer,
+                           loop)
+    assert response == 12
+    response = run_command([b'BITCOUNT', key, b'-3', b'-1'], reader, writer,
+                           loop)
+    assert response == 12
+    response = run_command([b'BITCOUNT', key, b'5', b'13', b'BIT'], reader,
+                           writer, loop)
+    assert response == 6
+
+    response = run_command([b'BITPOS', key, b'1'], reader, writer, loop)
+    assert response == 8
+    response = run_command([b'BITPOS', key, b'0', b'1'], reader, writer, loop)
+    assert response == 20
+    response = run_command([b'BITPOS', key, b'1', b'3', b'3'], reader, writer,
+                           loop)
+    assert response == -1
+    response = run_command([b'BITPOS', key, b'0', b'9', b'15', b'BIT'],
+                           reader, writer, loop)
+    assert response == -1
+    response = run_command([b'BITPOS', key, b'1', b'20', b'-1', b'BIT'],
+                           reader, writer, loop)
+    assert response == 32
+
+    missing = random_bytes(bstr_size)
+    response = run_command([b'BITCOUNT', missing], reader, writer, loop)
+    assert response == 0
+    response = run_command([b'BITPOS', missing, b'0'], reader, writer, loop)
+    assert response == 0
+    response = run_command([b'BITPOS', key, b'2'], reader, writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_bitop(connection, bstr_size):
+    reader, writer, loop = connection
+    day1 = random_bytes(bstr_size)
+    day2 = random_bytes(bstr_size)
+    dest = random_bytes(bstr_size)
+    for key, value in ((day1, b'\x0f\xf0\x3c'), (day2, b'\x3c\x3c')):
+        response = run_command([b'SETRANGE', key, b'0', value], reader,
+                               writer, loop)
+        assert response == len(value)
+
+    expected = {b'AND': b'\x0c\x30\x00', b'OR': b'\x3f\xfc\x3c',
+                b'XOR': b'\x33\xcc\x3c'}
+    for op, result in expected.items():
+        response = run_command([b'BITOP', op, dest, day1, day2], reader,
+                               writer, loop)
+        assert response == 3
+        response = run_command([b'GET', dest], reader, writer, loop)
+        assert response == result
+
+    # The destination can be a source.
+    response = run_command([b'BITOP', b'NOT', day2, day2], reader, writer,
+                           loop)
+    assert response == 2
+    response = run_command([b'GET', day2], reader, writer, loop)
+    assert response == b'\xc3\xc3'
+
+    response = run_command([b'BITOP', b'NOT', dest, day1, day2], reader,
+                           writer, loop)
+    assert response.startswith('-ERR')
+    response = run_command([b'BITOP', b'AND', dest, random_bytes(bstr_size)],
+                           reader, writer, loop)
+    assert response == 0
+    response = run_command([b'GET', dest], reader, writer, loop)
+    assert response == None
+
+
+def test_sparse_bitmap(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    other = random_bytes(bstr_size)
+    dest = random_bytes(bstr_size)
+    # A bit far past the end keeps the string small.
+    response = run_command([b'SETBIT', key, b'4000000000', b'1'], reader,
+                           writer, loop)
+    assert response == 0
+    response = run_command([b'SETBIT', key, b'7', b'1'], reader, writer, loop)
+    assert response == 0
+    response = run_command([b'MEMORY', b'USAGE', key], reader, writer, loop)
+    assert response < bstr_size + 10000
+    response = run_command([b'STRLEN', key], reader, writer, loop)
+    assert response == 500000001
+
+    response = run_command([b'GETBIT', key, b'4000000000'], reader, writer,
+                           loop)
+    assert response == 1
+    response = run_command([b'GETBIT', key, b'3999999999'], reader, writer,
+                           loop)
+    assert response == 0
+    response = run_command([b'BITCOUNT', key], reader, writer, loop)
+    assert response == 2
+    response = run_command([b'BITPOS', key, b'1', b'1'], reader, writer, loop)
+    assert response == 4000000000
+    response = run_command([b'GETRANGE', key, b'0', b'1'], reader, writer,
+                           loop)
+    assert response == b'\x01\x00'
+
+    # GET reads the bytes out without converting the bitmap.
+    small = random_bytes(bstr_size)
+    response = run_command([b'SETBIT', small, b'4000000', b'1'], reader,
+                           writer, loop)
+    assert response == 0
+    response = run_command([b'GET', small], reader, writer, loop)
+    assert len(response) == 500001
+    assert response[-1:] == b'\x80'
+    assert response[:-1] == bytes(500000)
+    response = run_command([b'MEMORY', b'USAGE', small], reader, writer, loop)
+    assert response < bstr_size + 10000
+
+    # BITOP with a sparse source stays sparse.
+    response = run_command([b'SETBIT', other, b'4000000000', b'1'], reader,
+                           writer, loop)
+    assert response == 0
+    response = run_command([b'BITOP', b'AND', dest, key, other], reader,
+                           writer, loop)
+    assert response == 500000001
+    response = run_command([b'BITCOUNT', dest], reader, writer, loop)
+    assert response == 1
+    response = run_command([b'MEMORY', b'USAGE', dest], reader, writer, loop)
+    assert response < bstr_size + 10000
+
+    response = run_command([b'SETBIT', key, b'4294967296', b'1'], reader,
+                           writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_bitfield(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    response = run_command([b'BITFIELD', key, b'GET', b'u8', b'0'], reader,
+                           writer, loop)
+    assert response == [0]
+    response = run_command([b'GET', key], reader, writer, loop)
+    assert response == None
+
+    # Counters packed side by side, addressed by index with #.
+    response = run_command([b'BITFIELD', key, b'SET', b'u4', b'#0', b'15',
+                            b'SET', b'i5', b'4', b'-3', b'INCRBY', b'u4',
+                            b'#0', b'2', b'GET', b'i5', b'4'], reader,
+                           writer, loop)
+    assert response == [0, 0, 1, -3]
+    response = run_command([b'GET', key], reader, writer, loop)
+    assert response == b'\x1e\x80'
+
+    response = run_command([b'BITFIELD', key, b'OVERFLOW', b'SAT', b'INCRBY',
+                            b'u4', b'0', b'100', b'OVERFLOW', b'FAIL',
+                            b'INCRBY', b'i5', b'4', b'-20', b'INCRBY', b'i5',
+                            b'4', b'-13'], reader, writer, loop)
+    assert response == [15, None, -16]
+
+    response = run_command([b'BITFIELD', key, b'GET', b'u64', b'0'], reader,
+                           writer, loop)
+    assert response.startswith('-ERR')
+    response = run_command([b'BITFIELD', key, b'OVERFLOW', b'BAD'], reader,
+                           writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_hyperloglog(connection, bstr_size):
+    reader, writer, loop = connection
+    first = random_bytes(bstr_size)
+    second = random_bytes(bstr_size)
+    dest = random_bytes(bstr_size)
+    response = run_command([b'PFADD', first, b'a', b'b', b'c'], reader,
+                           writer, loop)
+    assert response == 1
+    response = run_command([b'PFADD', first, b'a', b'b'], reader, writer,
+                           loop)
+    assert response == 0
+    response = run_command([b'PFCOUNT', first], reader, writer, loop)
+    assert response == 3
+
+    # Enough elements to turn it dense.
+    for i in range(0, 5000, 500):
+        elements = [b'e%d' % j for j in range(i, i + 500)]
+        run_command([b'PFADD', second] + elements, reader, writer, loop)
+    response = run_command([b'PFCOUNT', second], reader, writer, loop)
+    assert abs(response - 5000) < 250
+    response = run_command([b'STRLEN', second], reader, writer, loop)
+    assert response == 12304
+
+    response = run_command([b'PFCOUNT', first, second,
+                            random_bytes(bstr_size)], reader, writer, loop)
+    assert abs(response - 5003) < 250
+    response = run_command([b'PFMERGE', dest, first, second], reader, writer,
+                           loop)
+    assert response == '+OK'
+    response = run_command([b'PFCOUNT', dest], reader, writer, loop)
+    assert abs(response - 5003) < 250
+
+    response = run_command([b'SET', dest, b'plain'], reader, writer, loop)
+    response = run_command([b'PFADD', dest, b'a'], reader, writer, loop)
+    assert response.startswith('-ERR')
+    response = run_command([b'PFCOUNT', dest], reader, writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_hash(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    fields = [random_bytes(bstr_size) for _ in range(10)]
+    values = [random_bytes(bstr_size) for _ in range(10)]
+    args = [x for pair in zip(fields, values) for x in pair]
+    response = run_command([b'HSET', key] + args, reader, writer, loop)
+    assert response == 10
+    response = run_command([b'HSET', key, fields[0], b'new', b'extra', b'1'],
+                           reader, writer, loop)
+    assert response == 1
+    response = run_command([b'HGET', key, fields[0]], reader, writer, loop)
+    assert response == b'new'
+    response = run_command([b'HGET', key, b'missing'], reader, writer, loop)
+    assert response is None
+    response = run_command([b'HMGET', key, fields[1], b'missing', fields[2]],
+                           reader, writer, loop)
+    assert response == [values[1], None, values[2]]
+
+    # Enough fields to move it to a hash table.
+    response = run_command([b'HMSET', key] + [b'f%d 1' % i
+                                              for i in range(200)],
+                           reader, writer, loop)
+    assert response == '+OK'
+    response = run_command([b'HGETALL', key], reader, writer, loop)
+    pairs = dict(zip(response[::2], response[1::2]))
+    assert len(pairs) == 211
+    assert pairs[fields[0]] == b'new'
+    assert pairs[fields[9]] == values[9]
+    assert pairs[b'f199'] == b'1'
+
+    response = run_command([b'HINCRBY', key, b'f0', b'41'], reader, writer,
+                           loop)
+    assert response == 42
+    response = run_command([b'HINCRBY', key, b'counter', b'-5'], reader,
+                           writer, loop)
+    assert response == -5
+    response = run_command([b'HINCRBY', key, fields[0], b'1'], reader, writer,
+                           loop)
+    assert response.startswith('-ERR')
+
+    # Missing keys are empty hashes, and other types are refused.
+    other = random_bytes(bstr_size)
+    response = run_command([b'HGETALL', other], reader, writer, loop)
+    assert response == []
+    response = run_command([b'HMGET', other, b'a'], reader, writer, loop)
+    assert response == [None]
+    run_command([b'SET', other, b'plain'], reader, writer, loop)
+    response = run_command([b'HSET', other, b'a', b'b'], reader, writer, loop)
+    assert response.startswith('-ERR')
+    response = run_command([b'HGET', key], reader, writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_pubsub(connection, bstr_size):
+    reader, writer, loop = connection
+    sub_reader, sub_writer = loop.run_until_complete(
+        asyncio.open_connection('127.0.0.1', 15000))
+    channel = random_bytes(bstr_size)
+    response = run_command([b'SUBSCRIBE', channel], sub_reader, sub_writer,
+                           loop)
+    assert response == [b'subscribe', channel, 1]
+    response = run_command([b'PSUBSCRIBE', b'news.*'], sub_reader,
+                           sub_writer, loop)
+    assert response == [b'psubscribe', b'news.*', 2]
+    response = run_command([b'GET', channel], sub_reader, sub_writer, loop)
+    assert response.startswith('-ERR')
+
+    response = run_command([b'PUBSUB', b'NUMSUB', channel], reader, writer,
+                           loop)
+    assert response == [channel, 1]
+    response = run_command([b'PUBLISH', channel, b'hello'], reader, writer,
+                           loop)
+    assert response == 1
+    response = run_command([b'PUBLISH', b'news.tech', b'launch'], reader,
+                           writer, loop)
+    assert response == 1
+    response = loop.run_until_complete(read_response(sub_reader))
+    assert response == [b'message', channel, b'hello']
+    response = loop.run_until_complete(read_response(sub_reader))
+    assert response == [b'pmessage', b'news.*', b'news.tech', b'launch']
+
+    response = run_command([b'UNSUBSCRIBE', channel], sub_reader, sub_writer,
+                           loop)
+    assert response == [b'unsubscribe', channel, 1]
+    response = run_command([b'PUNSUBSCRIBE'], sub_reader, sub_writer, loop)
+    assert response == [b'punsubscribe', b'news.*', 0]
+    response = run_command([b'PUBLISH', channel, b'hello'], reader, writer,
+                           loop)
+    assert response == 0
+    response = run_command([b'GET', channel], sub_reader, sub_writer, loop)
+    assert response is None
+    sub_writer.close()
+
+
+def test_zhistogram(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    for i in range(100):
+        run_command([b'ZADD', key, str(i).encode(), b'm%d' % i], reader,
+                    writer, loop)
+    response = run_command([b'ZHISTOGRAM', key, b'0', b'100', b'4'], reader,
+                           writer, loop)
+    assert response == [25, 25, 25, 25]
+    response = run_command([b'ZHISTOGRAM', key, b'BOUNDARIES', b'10', b'20',
+                            b'60', b'STATS'], reader, writer, loop)
+    assert response[:3] == [10, 41, 51]
+    assert float(response[3]) == sum(range(10, 61))
+    assert float(response[4]) == 10 and float(response[5]) == 60
+
+    # Every bucket agrees with ZCOUNT.
+    bounds = [b'-5', b'3.5', b'50', b'99']
+    response = run_command([b'ZHISTOGRAM', key, b'BOUNDARIES'] + bounds,
+                           reader, writer, loop)
+    assert response[-1] == run_command([b'ZCOUNT', key, b'50', b'99'],
+                                       reader, writer, loop)
+    assert sum(response) == run_command([b'ZCOUNT', key, b'-5', b'99'],
+                                        reader, writer, loop)
+
+    response = run_command([b'ZHISTOGRAM', random_bytes(bstr_size), b'0',
+                            b'1', b'2', b'STATS'], reader, writer, loop)
+    assert response == [0, 0, 0, b'0', None, None]
+    response = run_command([b'ZHISTOGRAM', key, b'BOUNDARIES', b'5', b'1'],
+                           reader, writer, loop)
+    assert response.startswith('-ERR')
+    response = run_command([b'ZHISTOGRAM', key, b'0', b'1', b'0'], reader,
+                           writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_zunionstore_zinterstore(connection, bstr_size):
+    reader, writer, loop = connection
+    weekly = random_bytes(bstr_size)
+    daily = random_bytes(bstr_size)
+    dest = random_bytes(bstr_size)
+    for i in range(10):
+        run_command([b'ZADD', weekly, str(i).encode(), b'p%d' % i], reader,
+                    writer, loop)
+    for i in range(5, 15):
+        run_command([b'ZADD', daily, str(10 * i).encode(), b'p%d' % i],
+                    reader, writer, loop)
+
+    response = run_command([b'ZUNIONSTORE', dest, b'2', weekly, daily,
+                            b'WEIGHTS', b'2', b'1'], reader, writer, loop)
+    assert response == 15
+    response = run_command([b'ZRANGE', dest, b'0', b'-1', b'WITHSCORES'],
+                           reader, writer, loop)
+    scores = dict(zip(response[::2], response[1::2]))
+    assert float(scores[b'p3']) == 6
+    assert float(scores[b'p7']) == 84
+    assert float(scores[b'p14']) == 140
+
+    response = run_command([b'ZINTERSTORE', dest, b'2', weekly, daily,
+                            b'AGGREGATE', b'MIN'], reader, writer, loop)
+    assert response == 5
+    response = run_command([b'ZRANGE', dest, b'0', b'-1'], reader, writer,
+                           loop)
+    assert response == [b'p5', b'p6', b'p7', b'p8', b'p9']
+
+    response = run_command([b'ZDIFFSTORE', dest, b'2', weekly, daily],
+                           reader, writer, loop)
+    assert response == 5
+    response = run_command([b'ZRANGE', dest, b'0', b'-1'], reader, writer,
+                           loop)
+    assert response == [b'p0', b'p1', b'p2', b'p3', b'p4']
+
+    # An empty result removes the destination.
+    response = run_command([b'ZINTERSTORE', dest, b'2', weekly,
+                            random_bytes(bstr_size)], reader, writer, loop)
+    assert response == 0
+    response = run_command([b'ZCARD', dest], reader, writer, loop)
+    assert response == 0
+
+    response = run_command([b'ZUNIONSTORE', dest, b'3', weekly, daily],
+                           reader, writer, loop)
+    assert response.startswith('-ERR')
+    response = run_command([b'ZUNIONSTORE', dest, b'1', weekly, b'WEIGHTS',
+                            b'x'], reader, writer, loop)
+    assert response.startswith('-ERR')
+    run_command([b'SET', dest, b'plain'], reader, writer, loop)
+    response = run_command([b'ZUNIONSTORE', weekly, b'2', weekly, dest],
+                           reader, writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_zremrange_cap(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    for i in range(20):
+        run_command([b'ZADD', key, str(i).encode(), b'm%d' % i], reader,
+                    writer, loop)
+
+    response = run_command([b'ZREMRANGEBYRANK', key, b'0', b'4'], reader,
+                           writer, loop)
+    assert response == 5
+    response = run_command([b'ZREMRANGEBYRANK', key, b'-3', b'-1'], reader,
+                           writer, loop)
+    assert response == 3
+    response = run_command([b'ZREMRANGEBYRANK', key, b'20', b'30'], reader,
+                           writer, loop)
+    assert response == 0
+    response = run_command([b'ZREMRANGEBYSCORE', key, b'8', b'10.5'],
+                           reader, writer, loop)
+    assert response == 3
+    response = run_command([b'ZRANGE', key, b'0', b'-1'], reader, writer,
+                           loop)
+    assert response == [b'm5', b'm6', b'm7', b'm11', b'm12', b'm13', b'm14',
+                        b'm15', b'm16']
+
+    # A capped add drops the lowest scores.
+    response = run_command([b'ZADD', key, b'CAP', b'4', b'100', b'top'],
+                           reader, writer, loop)
+    assert response == 1
+    response = run_command([b'ZRANGE', key, b'0', b'-1'], reader, writer,
+                           loop)
+    assert response == [b'm14', b'm15', b'm16', b'top']
+    response = run_command([b'ZADD', key, b'CAP', b'0', b'1', b'a'], reader,
+                           writer, loop)
+    assert response.startswith('-ERR')
+
+    # Removing every member removes the key.
+    response = run_command([b'ZREMRANGEBYSCORE', key, b'-inf', b'inf'],
+                           reader, writer, loop)
+    assert response == 4
+    response = run_command([b'ZCARD', key], reader, writer, loop)
+    assert response == 0
+    response = run_command([b'ZREMRANGEBYRANK', key, b'0', b'-1'], reader,
+                           writer, loop)
+    assert response == 0
+
+    run_command([b'SET', key, b'plain'], reader, writer, loop)
+    response = run_command([b'ZREMRANGEBYRANK', key, b'0', b'-1'], reader,
+                           writer, loop)
+    assert response.startswith('-ERR')
+
+
+def test_zremrangebyrank_middle(connection, bstr_size):
+    reader, writer, loop = connection
+    key = random_bytes(bstr_size)
+    for i in range(101):
+        run_command([b'ZADD', key, str(i).encode(), b'm%d' % i], reader,
+                    writer, loop)
+
+    response = run_command([b'ZREMRANGEBYRANK', key, b'40', b'60'], reader,
+                           writer, loop)
+    assert response == 21
+    response = run_command([b'ZRANGE', key, b'38', b'41'], reader, writer,
+                           loop)
+    assert response == [b'm38', b'm39', b'm61', b'm62']
+
+    # Negative ranks either side of the middle.
+    response = run_command([b'ZREMRANGEBYRANK', key, b'-41', b'-40'], reader,
+                           writer, loop)
+    assert response == 2
+    response = run_command([b'ZRANGE', key, b'37', b'40'], reader, writer,
+                           loop)
+    assert response == [b'm37', b'm38', b'm62', b'm63']
+    response = run_command([b'ZCARD', key], reader, writer, loop)
+    assert response == 78
+
+
 def test_zadd_zcard_zrange(connection, bstr_size):
     reader, writer, loop = connection
     key = random_bytes(bstr_size)
@@ -0,0 +1,88 @@
+#include "lazy_free.hpp"
+
+#include <utility>
+
+lazy_free::lazy_free()
+    : pending_(0), freed_(0), stopping_(false)
+{
+}
+
+lazy_free::~lazy_free()
+{
+    if (worker_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        values_ready_.notify_one();
+        worker_.join();
+    }
+}
+
+void lazy_free::free(boost::any value)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        values_.push_back(std::move(value));
+        pending_++;
+    }
+    if (!worker_.joinable())
+    {
+        worker_ = std::thread(&lazy_free::run_worker, this);
+    }
+    values_ready_.notify_one();
+}
+
+void lazy_free::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    drained_.wait(lock, [this]()
+    {
+        return pending_ == 0;
+    });
+}
+
+std::size_t lazy_free::pending() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_;
+}
+
+std::size_t lazy_free::freed() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return freed_;
+}
+
+void lazy_free::run_worker()
+{
+    for (;;)
+    {
+        std::deque<boost::any> values;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            values_ready_.wait(lock, [this]()
+            {
+                return stopping_ || !values_.empty();
+            });
+            if (values_.empty())
+            {
+                // Only reached once stopping, after everything is freed.
+                return;
+            }
+            values.swap(values_);
+        }
+
+        // The values are destroyed without holding the lock.
+        auto count = values.size();
+        values.clear();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_ -= count;
+            freed_ += count;
+        }
+        drained_.notify_all();
+    }
+}
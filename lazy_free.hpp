@@ -0,0 +1,51 @@
+#ifndef __EXOREDIS_LAZY_FREE_HPP__
+#define __EXOREDIS_LAZY_FREE_HPP__
+
+#include <boost/any.hpp>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+
+/*
+ * Destroys values on a worker thread, so that freeing a large value doesn't
+ * hold up the event loop. A value handed over must not share anything with
+ * values still in use, since it is destroyed while other threads run.
+ */
+class lazy_free
+{
+public:
+    lazy_free();
+    // Destroys whatever is still pending before returning.
+    ~lazy_free();
+
+    lazy_free(const lazy_free&) = delete;
+    lazy_free& operator=(const lazy_free&) = delete;
+
+    // Takes ownership of a value and destroys it on the worker thread. The
+    // thread is started the first time this is called.
+    void free(boost::any value);
+    // Blocks until every value handed over so far has been destroyed.
+    void wait();
+
+    // Values handed over that haven't been destroyed yet.
+    std::size_t pending() const;
+    // Values destroyed so far.
+    std::size_t freed() const;
+
+private:
+    void run_worker();
+
+    std::thread worker_;
+    mutable std::mutex mutex_;
+    std::condition_variable values_ready_;
+    std::condition_variable drained_;
+    std::deque<boost::any> values_;
+    std::size_t pending_;
+    std::size_t freed_;
+    bool stopping_;
+};
+
+#endif
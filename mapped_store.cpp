@@ -0,0 +1,630 @@
+#include "mapped_store.hpp"
+#include "util.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace
+{
+    const char store_magic[8] = {'E', 'X', 'O', 'M', 'A', 'P', '0', '1'};
+    const std::uint64_t initial_bucket_count = 1024;
+    // The file grows in steps of at least this many bytes.
+    const std::size_t growth_step = 1 << 20;
+    // Index slots that hold no record.
+    const std::uint64_t empty_slot = 0;
+    const std::uint64_t deleted_slot = 1;
+    const std::uint32_t expiry_flag = 1;
+    // Values that outgrow their record get twice the room they need, up to
+    // this much extra, so that a run of appends moves a value only a few
+    // times.
+    const std::size_t max_spare_capacity = 1 << 20;
+    // Compaction is due once garbage makes up this share of the data, and
+    // there is at least this much of it.
+    const std::size_t compaction_garbage_percent = 50;
+    const std::size_t compaction_min_garbage = 4 * growth_step;
+
+    std::size_t align8(std::size_t size)
+    {
+        return (size + 7) & ~static_cast<std::size_t>(7);
+    }
+
+    std::string errno_string(const std::string& what)
+    {
+        return what + ": " + std::strerror(errno);
+    }
+}
+
+struct mapped_store::header
+{
+    char magic[8];
+    std::uint64_t index_offset;
+    std::uint64_t bucket_count;
+    std::uint64_t data_end;
+    std::uint64_t live_count;
+    // Slots that are either live or deleted.
+    std::uint64_t used_slots;
+    std::uint64_t garbage_bytes;
+    std::uint64_t reserved;
+};
+
+// Followed by the key and then capacity bytes for the value.
+struct mapped_store::record
+{
+    std::uint32_t key_size;
+    std::uint32_t flags;
+    std::uint64_t value_size;
+    std::uint64_t capacity;
+    std::int64_t expiry_ms;
+
+    unsigned char* key()
+    {
+        return reinterpret_cast<unsigned char*>(this + 1);
+    }
+
+    unsigned char* value()
+    {
+        return key() + key_size;
+    }
+
+    std::size_t total_size() const
+    {
+        return sizeof(record) + key_size + capacity;
+    }
+};
+
+mapped_store::mapped_store(std::string file_path)
+    : file_path_(file_path), fd_(-1), base_(nullptr), mapped_size_(0),
+      compact_cursor_(0)
+{
+}
+
+mapped_store::~mapped_store()
+{
+    close();
+}
+
+void mapped_store::open()
+{
+    open(initial_bucket_count);
+}
+
+void mapped_store::open(std::uint64_t new_bucket_count)
+{
+    fd_ = ::open(file_path_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ == -1)
+    {
+        throw store_error(errno_string("Could not open " + file_path_));
+    }
+
+    struct stat st;
+    if (::fstat(fd_, &st) != 0)
+    {
+        throw store_error(errno_string("Could not stat " + file_path_));
+    }
+
+    if (st.st_size == 0)
+    {
+        // New file. The index comes right after the header.
+        const std::size_t index_size = new_bucket_count * sizeof(std::uint64_t);
+        const std::size_t size = std::max(growth_step,
+            sizeof(header) + index_size);
+        if (::ftruncate(fd_, size) != 0)
+        {
+            throw store_error(errno_string("Could not resize " + file_path_));
+        }
+        map_file(size);
+        auto h = get_header();
+        std::memcpy(h->magic, store_magic, sizeof(store_magic));
+        h->index_offset = sizeof(header);
+        h->bucket_count = new_bucket_count;
+        h->data_end = sizeof(header) + index_size;
+        h->live_count = 0;
+        h->used_slots = 0;
+        h->garbage_bytes = 0;
+        return;
+    }
+
+    if (static_cast<std::size_t>(st.st_size) < sizeof(header))
+    {
+        throw store_error("Mapped file is too small: " + file_path_);
+    }
+    map_file(st.st_size);
+    auto h = get_header();
+    if (std::memcmp(h->magic, store_magic, sizeof(store_magic)) != 0
+        || h->data_end > mapped_size_
+        || h->index_offset + h->bucket_count * sizeof(std::uint64_t) > h->data_end
+        || h->bucket_count == 0
+        || (h->bucket_count & (h->bucket_count - 1)) != 0)
+    {
+        close();
+        throw store_error("Mapped file is corrupt: " + file_path_);
+    }
+}
+
+void mapped_store::close()
+{
+    if (compacted_)
+    {
+        abandon_compaction();
+    }
+    if (base_ != nullptr)
+    {
+        ::msync(base_, mapped_size_, MS_SYNC);
+        ::munmap(base_, mapped_size_);
+        base_ = nullptr;
+        mapped_size_ = 0;
+    }
+    if (fd_ != -1)
+    {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool mapped_store::find(const std::vector<unsigned char>& key,
+    mapped_store::entry& result) const
+{
+    bool found;
+    auto slot = find_slot(key, found);
+    if (!found)
+    {
+        return false;
+    }
+
+    auto rec = record_at(*slot);
+    result.data = rec->value();
+    result.size = rec->value_size;
+    result.has_expiry = (rec->flags & expiry_flag) != 0;
+    result.expiry_ms = rec->expiry_ms;
+    return true;
+}
+
+void mapped_store::put(const std::vector<unsigned char>& key,
+    const std::vector<unsigned char>& value, bool has_expiry,
+    long long expiry_ms)
+{
+    put(key, value.data(), value.size(), has_expiry, expiry_ms);
+}
+
+void mapped_store::put(const std::vector<unsigned char>& key,
+    const unsigned char* value, std::size_t value_size, bool has_expiry,
+    long long expiry_ms)
+{
+    bool found;
+    auto slot = find_slot(key, found);
+    std::size_t capacity = value_size;
+    if (found)
+    {
+        auto rec = record_at(*slot);
+        if (rec->capacity >= value_size)
+        {
+            // Overwrite in place.
+            std::memcpy(rec->value(), value, value_size);
+            rec->value_size = value_size;
+            rec->flags = has_expiry ? expiry_flag : 0;
+            rec->expiry_ms = expiry_ms;
+            put_compacted(key, value, value_size, has_expiry, expiry_ms);
+            return;
+        }
+        get_header()->garbage_bytes += rec->total_size();
+        // A value that grew once is likely to grow again.
+        capacity += std::min(value_size, max_spare_capacity);
+    }
+    else if ((get_header()->used_slots + 1) * 10 > get_header()->bucket_count * 7)
+    {
+        grow_index();
+        slot = find_slot(key, found);
+    }
+
+    // Allocating may remap the file, so remember the slot by position.
+    const auto slot_index = slot - index();
+    const bool reused_slot = found || *slot == deleted_slot;
+    const std::size_t size = align8(sizeof(record) + key.size() + capacity);
+    auto offset = allocate(size);
+
+    auto rec = record_at(offset);
+    rec->key_size = key.size();
+    rec->flags = has_expiry ? expiry_flag : 0;
+    rec->value_size = value_size;
+    // Padding is used as room for the value to grow into.
+    rec->capacity = size - sizeof(record) - key.size();
+    rec->expiry_ms = expiry_ms;
+    std::memcpy(rec->key(), key.data(), key.size());
+    std::memcpy(rec->value(), value, value_size);
+
+    // The record is complete before it becomes reachable from the index.
+    index()[slot_index] = offset;
+    auto h = get_header();
+    if (!found)
+    {
+        h->live_count++;
+        if (!reused_slot)
+        {
+            h->used_slots++;
+        }
+    }
+    put_compacted(key, value, value_size, has_expiry, expiry_ms);
+}
+
+bool mapped_store::put_range(const std::vector<unsigned char>& key,
+    std::size_t offset, const unsigned char* data, std::size_t size,
+    std::size_t value_size)
+{
+    bool found;
+    auto slot = find_slot(key, found);
+    if (!found)
+    {
+        return false;
+    }
+
+    auto rec = record_at(*slot);
+    if (rec->capacity < value_size || offset > rec->value_size
+        || value_size > std::max<std::size_t>(rec->value_size, offset + size))
+    {
+        return false;
+    }
+    std::memcpy(rec->value() + offset, data, size);
+    rec->value_size = value_size;
+
+    if (compacted_
+        && !compacted_->put_range(key, offset, data, size, value_size))
+    {
+        put_compacted(key, rec->value(), value_size,
+            (rec->flags & expiry_flag) != 0, rec->expiry_ms);
+    }
+    return true;
+}
+
+bool mapped_store::remove(const std::vector<unsigned char>& key)
+{
+    bool found;
+    auto slot = find_slot(key, found);
+    if (!found)
+    {
+        return false;
+    }
+
+    auto h = get_header();
+    h->garbage_bytes += record_at(*slot)->total_size();
+    h->live_count--;
+    *slot = deleted_slot;
+    if (compacted_)
+    {
+        compacted_->remove(key);
+    }
+    return true;
+}
+
+void mapped_store::for_each(std::function<void(
+    const std::vector<unsigned char>& key, const mapped_store::entry&)> f) const
+{
+    auto h = get_header();
+    std::vector<unsigned char> key;
+    for (std::uint64_t i = 0; i < h->bucket_count; i++)
+    {
+        auto offset = index()[i];
+        if (offset == empty_slot || offset == deleted_slot)
+        {
+            continue;
+        }
+
+        auto rec = record_at(offset);
+        key.assign(rec->key(), rec->key() + rec->key_size);
+        entry e;
+        e.data = rec->value();
+        e.size = rec->value_size;
+        e.has_expiry = (rec->flags & expiry_flag) != 0;
+        e.expiry_ms = rec->expiry_ms;
+        f(key, e);
+    }
+}
+
+std::uint64_t mapped_store::scan(std::uint64_t cursor, std::size_t count,
+    std::function<void(const std::vector<unsigned char>& key,
+        const mapped_store::entry&)> f) const
+{
+    auto h = get_header();
+    auto slots = index();
+    const std::uint64_t mask = h->bucket_count - 1;
+    std::vector<unsigned char> key;
+    std::size_t seen = 0;
+    for (std::size_t visited = 0; seen < count && visited < count * 10;
+        visited++)
+    {
+        // Keys whose home is this slot are in the probe run starting here.
+        const auto home = cursor & mask;
+        for (auto i = home; slots[i] != empty_slot; i = (i + 1) & mask)
+        {
+            if (slots[i] == deleted_slot)
+            {
+                continue;
+            }
+            auto rec = record_at(slots[i]);
+            if ((murmur_hash64(rec->key(), rec->key_size) & mask) != home)
+            {
+                continue;
+            }
+            key.assign(rec->key(), rec->key() + rec->key_size);
+            entry e;
+            e.data = rec->value();
+            e.size = rec->value_size;
+            e.has_expiry = (rec->flags & expiry_flag) != 0;
+            e.expiry_ms = rec->expiry_ms;
+            f(key, e);
+            seen++;
+        }
+        cursor = next_scan_cursor(cursor, mask);
+        if (cursor == 0)
+        {
+            break;
+        }
+    }
+    return cursor;
+}
+
+void mapped_store::sync()
+{
+    if (base_ != nullptr)
+    {
+        ::msync(base_, mapped_size_, MS_ASYNC);
+    }
+}
+
+bool mapped_store::compaction_due() const
+{
+    auto h = get_header();
+    return h->garbage_bytes >= compaction_min_garbage
+        && h->garbage_bytes * 100 >= h->data_end * compaction_garbage_percent;
+}
+
+void mapped_store::compact()
+{
+    while (!compact_step(size() + 1))
+    {
+    }
+}
+
+bool mapped_store::compact_step(std::size_t count)
+{
+    // The old file is only replaced once the new one is complete, so a
+    // crash part way through leaves the old one intact.
+    const auto temp_path = file_path_ + ".compact";
+    if (!compacted_)
+    {
+        // Leave the index a third full or so, so that it doesn't need to
+        // grow right away.
+        std::uint64_t bucket_count = initial_bucket_count;
+        while (size() * 3 > bucket_count)
+        {
+            bucket_count *= 2;
+        }
+
+        std::remove(temp_path.c_str());
+        compacted_.reset(new mapped_store(temp_path));
+        compact_cursor_ = 0;
+        try
+        {
+            compacted_->open(bucket_count);
+        }
+        catch (...)
+        {
+            abandon_compaction();
+            throw;
+        }
+    }
+
+    try
+    {
+        // The scan sees every record that is live throughout, even if the
+        // index grows in between steps.
+        auto compacted = compacted_.get();
+        compact_cursor_ = scan(compact_cursor_, count,
+            [compacted](const std::vector<unsigned char>& key,
+                const mapped_store::entry& e)
+            {
+                compacted->put(key, e.data, e.size, e.has_expiry, e.expiry_ms);
+            });
+        if (compact_cursor_ != 0)
+        {
+            return false;
+        }
+
+        compacted_->close();
+        if (std::rename(temp_path.c_str(), file_path_.c_str()) != 0)
+        {
+            throw store_error(errno_string("Could not replace " + file_path_));
+        }
+    }
+    catch (...)
+    {
+        abandon_compaction();
+        throw;
+    }
+
+    compacted_.reset();
+    close();
+    open();
+    return true;
+}
+
+bool mapped_store::compacting() const
+{
+    return compacted_ != nullptr;
+}
+
+std::size_t mapped_store::size() const
+{
+    return get_header()->live_count;
+}
+
+std::size_t mapped_store::file_size() const
+{
+    return mapped_size_;
+}
+
+std::size_t mapped_store::garbage_bytes() const
+{
+    return get_header()->garbage_bytes;
+}
+
+mapped_store::header* mapped_store::get_header() const
+{
+    return reinterpret_cast<header*>(base_);
+}
+
+std::uint64_t* mapped_store::index() const
+{
+    return reinterpret_cast<std::uint64_t*>(base_ + get_header()->index_offset);
+}
+
+mapped_store::record* mapped_store::record_at(std::uint64_t offset) const
+{
+    return reinterpret_cast<record*>(base_ + offset);
+}
+
+std::uint64_t* mapped_store::find_slot(const std::vector<unsigned char>& key,
+    bool& found) const
+{
+    auto h = get_header();
+    auto slots = index();
+    const std::uint64_t mask = h->bucket_count - 1;
+    std::uint64_t* first_deleted = nullptr;
+
+    // Linear probing. The index is never more than 70% full, so this ends.
+    for (auto i = murmur_hash64(key.data(), key.size()) & mask; ;
+        i = (i + 1) & mask)
+    {
+        auto slot = &slots[i];
+        if (*slot == empty_slot)
+        {
+            found = false;
+            return first_deleted != nullptr ? first_deleted : slot;
+        }
+        else if (*slot == deleted_slot)
+        {
+            if (first_deleted == nullptr)
+            {
+                first_deleted = slot;
+            }
+        }
+        else
+        {
+            auto rec = record_at(*slot);
+            if (rec->key_size == key.size()
+                && std::memcmp(rec->key(), key.data(), key.size()) == 0)
+            {
+                found = true;
+                return slot;
+            }
+        }
+    }
+}
+
+std::uint64_t mapped_store::allocate(std::size_t size)
+{
+    auto offset = get_header()->data_end;
+    reserve(offset + size);
+    get_header()->data_end = offset + size;
+    return offset;
+}
+
+void mapped_store::reserve(std::size_t size)
+{
+    if (size <= mapped_size_)
+    {
+        return;
+    }
+
+    std::size_t new_size = std::max(size, mapped_size_ * 2);
+    new_size = (new_size + growth_step - 1) / growth_step * growth_step;
+    if (::ftruncate(fd_, new_size) != 0)
+    {
+        throw store_error(errno_string("Could not resize " + file_path_));
+    }
+    // Map the new size before giving up the old mapping, so that the store
+    // is still usable if mapping fails.
+    auto old_base = base_;
+    auto old_size = mapped_size_;
+    map_file(new_size);
+    ::munmap(old_base, old_size);
+}
+
+void mapped_store::grow_index()
+{
+    const std::uint64_t old_count = get_header()->bucket_count;
+    const std::uint64_t new_count = old_count * 2;
+    const std::size_t index_size = new_count * sizeof(std::uint64_t);
+    auto new_offset = allocate(index_size);
+    auto new_index = reinterpret_cast<std::uint64_t*>(base_ + new_offset);
+    std::memset(new_index, 0, index_size);
+
+    // Rehash the live records. Deleted slots are dropped.
+    auto old_index = index();
+    for (std::uint64_t i = 0; i < old_count; i++)
+    {
+        auto offset = old_index[i];
+        if (offset == empty_slot || offset == deleted_slot)
+        {
+            continue;
+        }
+        auto rec = record_at(offset);
+        auto j = murmur_hash64(rec->key(), rec->key_size) & (new_count - 1);
+        while (new_index[j] != empty_slot)
+        {
+            j = (j + 1) & (new_count - 1);
+        }
+        new_index[j] = offset;
+    }
+
+    auto h = get_header();
+    h->garbage_bytes += old_count * sizeof(std::uint64_t);
+    h->index_offset = new_offset;
+    h->bucket_count = new_count;
+    h->used_slots = h->live_count;
+}
+
+void mapped_store::put_compacted(const std::vector<unsigned char>& key,
+    const unsigned char* value, std::size_t value_size, bool has_expiry,
+    long long expiry_ms)
+{
+    if (!compacted_)
+    {
+        return;
+    }
+
+    try
+    {
+        compacted_->put(key, value, value_size, has_expiry, expiry_ms);
+    }
+    catch (const store_error&)
+    {
+        // The write itself went through, so only the compaction is lost.
+        abandon_compaction();
+    }
+}
+
+void mapped_store::abandon_compaction()
+{
+    const auto temp_path = compacted_->file_path_;
+    compacted_.reset();
+    std::remove(temp_path.c_str());
+}
+
+void mapped_store::map_file(std::size_t size)
+{
+    void* addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd_, 0);
+    if (addr == MAP_FAILED)
+    {
+        throw store_error(errno_string("Could not map " + file_path_));
+    }
+    base_ = static_cast<unsigned char*>(addr);
+    mapped_size_ = size;
+}
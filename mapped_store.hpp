@@ -0,0 +1,153 @@
+#ifndef __EXOREDIS_MAPPED_STORE_HPP__
+#define __EXOREDIS_MAPPED_STORE_HPP__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+
+
+/*
+ * A persistent table of binary strings that lives in a memory-mapped file.
+ * Keys, values and a hash index over the keys are all stored in the file, so
+ * opening it is instant no matter how much data it holds: the file is mapped
+ * and pages are faulted in by the OS as they are accessed. Since the data is
+ * in the page cache, it also survives a restart of the process.
+ *
+ * The file starts with a header, followed by records and the index. Records
+ * are appended at the end of the data. A record that is overwritten with a
+ * value that doesn't fit in it is left behind as garbage, and the new record
+ * gets spare room for the value to grow into. The index is an open
+ * addressing hash table of record offsets. When it fills up, a larger index
+ * is built at the end of the data and the old one becomes garbage. Garbage
+ * is reclaimed by compacting the live records into a new file.
+ */
+class mapped_store
+{
+public:
+    class store_error: public std::runtime_error
+    {
+    public:
+        store_error(std::string msg) : runtime_error(msg) {}
+    };
+
+    // A value in the store. The pointer points into the mapping, so it is
+    // only valid until the store is next modified.
+    struct entry
+    {
+        const unsigned char* data;
+        std::size_t size;
+        bool has_expiry;
+        // Milliseconds since the epoch.
+        long long expiry_ms;
+    };
+
+    mapped_store(std::string file_path);
+    ~mapped_store();
+
+    mapped_store(const mapped_store&) = delete;
+    mapped_store& operator=(const mapped_store&) = delete;
+
+    // Maps the file, creating it if it doesn't exist.
+    void open();
+    void close();
+
+    // Returns false if the key is not in the store.
+    bool find(const std::vector<unsigned char>& key, entry& result) const;
+    // Adds the key or replaces its value.
+    void put(const std::vector<unsigned char>& key,
+        const std::vector<unsigned char>& value, bool has_expiry,
+        long long expiry_ms);
+    // Writes size bytes at offset into the value of key, which becomes
+    // value_size bytes long, leaving the other bytes as they were. Every byte
+    // past the old end must be written. Returns false, changing nothing, if
+    // the key isn't in the store or its record has no room for value_size
+    // bytes.
+    bool put_range(const std::vector<unsigned char>& key, std::size_t offset,
+        const unsigned char* data, std::size_t size, std::size_t value_size);
+    // Returns false if the key was not in the store.
+    bool remove(const std::vector<unsigned char>& key);
+
+    // Calls f for every key in the store.
+    void for_each(std::function<void(const std::vector<unsigned char>& key,
+        const entry&)> f) const;
+
+    // Calls f for the keys whose home slot in the index is at or after
+    // cursor, in the order of next_scan_cursor(), stopping once count keys
+    // have been seen or ten times as many slots visited. Returns the cursor
+    // to continue from, or 0 once every slot has been visited. The store
+    // must not be modified by f.
+    std::uint64_t scan(std::uint64_t cursor, std::size_t count,
+        std::function<void(const std::vector<unsigned char>& key,
+            const entry&)> f) const;
+
+    // Asks the OS to write dirty pages out to disk.
+    void sync();
+
+    // Number of keys in the store.
+    std::size_t size() const;
+    std::size_t file_size() const;
+    // Bytes in the file taken up by overwritten records and old indexes.
+    std::size_t garbage_bytes() const;
+
+    // Whether enough of the file is garbage for compact() to be worthwhile.
+    bool compaction_due() const;
+    // Copies the live records to a new file that replaces this one, leaving
+    // no garbage. Takes time in proportion to the live data.
+    void compact();
+    // Does the same as compact() a step at a time, copying about count
+    // records per call. Writes made between steps are copied to the new file
+    // as they happen. Returns true once the new file has replaced this one.
+    // If a step fails, the compaction is abandoned and the store is left as
+    // it was.
+    bool compact_step(std::size_t count);
+    // Whether a compaction is part way through.
+    bool compacting() const;
+
+private:
+    struct header;
+    struct record;
+
+    // Creates the file with an index of new_bucket_count buckets if it
+    // doesn't exist.
+    void open(std::uint64_t new_bucket_count);
+    void put(const std::vector<unsigned char>& key, const unsigned char* value,
+        std::size_t value_size, bool has_expiry, long long expiry_ms);
+
+    header* get_header() const;
+    std::uint64_t* index() const;
+    record* record_at(std::uint64_t offset) const;
+    // Returns the index slot holding key, or the slot where it should be
+    // inserted if it isn't there (found is set accordingly).
+    std::uint64_t* find_slot(const std::vector<unsigned char>& key,
+        bool& found) const;
+    // Returns the offset of a new block of size bytes at the end of the data.
+    std::uint64_t allocate(std::size_t size);
+    // Makes the file at least size bytes long.
+    void reserve(std::size_t size);
+    // Builds an index with twice the number of buckets.
+    void grow_index();
+    // Maps size bytes of the file. Leaves the current mapping alone if it
+    // fails.
+    void map_file(std::size_t size);
+    // Copies a write to the file being compacted into, if there is one.
+    void put_compacted(const std::vector<unsigned char>& key,
+        const unsigned char* value, std::size_t value_size, bool has_expiry,
+        long long expiry_ms);
+    // Throws away the new file of a compaction that is part way through.
+    void abandon_compaction();
+
+    std::string file_path_;
+    int fd_;
+    unsigned char* base_;
+    std::size_t mapped_size_;
+    // The file being compacted into, and the scan cursor over the records
+    // still to be copied to it.
+    std::unique_ptr<mapped_store> compacted_;
+    std::uint64_t compact_cursor_;
+};
+
+#endif
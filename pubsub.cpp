@@ -0,0 +1,178 @@
+#include "pubsub.hpp"
+#include "util.hpp"
+#include <string>
+#include <algorithm>
+
+namespace
+{
+    void append_bulk(std::vector<unsigned char>& out,
+        const std::vector<unsigned char>& bytes)
+    {
+        auto header = "$" + std::to_string(bytes.size()) + "\r\n";
+        out.insert(out.end(), header.begin(), header.end());
+        out.insert(out.end(), bytes.begin(), bytes.end());
+        out.push_back('\r');
+        out.push_back('\n');
+    }
+
+    // Serializes the reply a subscriber is sent: ["message", channel,
+    // payload], or ["pmessage", pattern, channel, payload] if pattern isn't
+    // null.
+    pubsub::message encode_message(const pubsub::channel_type* pattern,
+        const pubsub::channel_type& channel,
+        const std::vector<unsigned char>& payload)
+    {
+        std::vector<unsigned char> out;
+        // Room for the headers, which are short.
+        out.reserve(64 + channel.size() + payload.size()
+            + (pattern ? pattern->size() : 0));
+        std::string header = pattern ? "*4\r\n$8\r\npmessage\r\n"
+            : "*3\r\n$7\r\nmessage\r\n";
+        out.insert(out.end(), header.begin(), header.end());
+        if (pattern)
+        {
+            append_bulk(out, *pattern);
+        }
+        append_bulk(out, channel);
+        append_bulk(out, payload);
+        return std::make_shared<const std::vector<unsigned char>>(
+            std::move(out));
+    }
+}
+
+pubsub::pubsub()
+{
+    limits_.hard_limit = 32 * 1024 * 1024;
+    limits_.soft_limit = 8 * 1024 * 1024;
+    limits_.soft_seconds = 60;
+}
+
+void pubsub::subscribe(const pubsub::channel_type& channel,
+    pubsub::subscriber* s)
+{
+    add(channels_, channel, s);
+}
+
+void pubsub::unsubscribe(const pubsub::channel_type& channel,
+    pubsub::subscriber* s)
+{
+    remove(channels_, channel, s);
+}
+
+void pubsub::psubscribe(const pubsub::channel_type& pattern,
+    pubsub::subscriber* s)
+{
+    add(patterns_, pattern, s);
+}
+
+void pubsub::punsubscribe(const pubsub::channel_type& pattern,
+    pubsub::subscriber* s)
+{
+    remove(patterns_, pattern, s);
+}
+
+std::size_t pubsub::publish(const pubsub::channel_type& channel,
+    const std::vector<unsigned char>& payload)
+{
+    std::size_t deliveries = 0;
+    auto it = channels_.find(channel);
+    if (it != channels_.end())
+    {
+        auto m = encode_message(nullptr, channel, payload);
+        for (auto s: it->second)
+        {
+            s->deliver(m);
+        }
+        deliveries += it->second.size();
+    }
+
+    for (const auto& pair: patterns_)
+    {
+        if (!glob_match(pair.first, channel))
+        {
+            continue;
+        }
+        auto m = encode_message(&pair.first, channel, payload);
+        for (auto s: pair.second)
+        {
+            s->deliver(m);
+        }
+        deliveries += pair.second.size();
+    }
+    return deliveries;
+}
+
+std::vector<pubsub::channel_type> pubsub::channels() const
+{
+    std::vector<pubsub::channel_type> result;
+    result.reserve(channels_.size());
+    for (const auto& pair: channels_)
+    {
+        result.push_back(pair.first);
+    }
+    return result;
+}
+
+std::vector<pubsub::channel_type> pubsub::channels(
+    const pubsub::channel_type& pattern) const
+{
+    std::vector<pubsub::channel_type> result;
+    for (const auto& pair: channels_)
+    {
+        if (glob_match(pattern, pair.first))
+        {
+            result.push_back(pair.first);
+        }
+    }
+    return result;
+}
+
+std::size_t pubsub::subscriber_count(const pubsub::channel_type& channel) const
+{
+    auto it = channels_.find(channel);
+    return it == channels_.end() ? 0 : it->second.size();
+}
+
+std::size_t pubsub::pattern_count() const
+{
+    return patterns_.size();
+}
+
+const pubsub::output_limits& pubsub::limits() const
+{
+    return limits_;
+}
+
+void pubsub::set_limits(const pubsub::output_limits& limits)
+{
+    limits_ = limits;
+}
+
+void pubsub::add(pubsub::subscriber_map& map, const pubsub::channel_type& name,
+    pubsub::subscriber* s)
+{
+    map[name].push_back(s);
+}
+
+void pubsub::remove(pubsub::subscriber_map& map,
+    const pubsub::channel_type& name, pubsub::subscriber* s)
+{
+    auto it = map.find(name);
+    if (it == map.end())
+    {
+        return;
+    }
+    // Order doesn't matter, so the last subscriber takes the removed one's
+    // place.
+    auto& subscribers = it->second;
+    auto found = std::find(subscribers.begin(), subscribers.end(), s);
+    if (found != subscribers.end())
+    {
+        *found = subscribers.back();
+        subscribers.pop_back();
+    }
+    if (subscribers.empty())
+    {
+        map.erase(it);
+    }
+}
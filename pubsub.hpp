@@ -0,0 +1,87 @@
+#ifndef __EXOREDIS_PUBSUB_HPP__
+#define __EXOREDIS_PUBSUB_HPP__
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <boost/unordered_map.hpp>
+
+
+/*
+ * The channels and patterns clients are subscribed to.
+ *
+ * A published message is serialized once, as the reply subscribers are sent,
+ * into a buffer shared by every subscriber it is delivered to, so fanning
+ * out to thousands of subscribers queues as many pointers rather than
+ * copies. Subscribers of a pattern share one buffer per matching pattern,
+ * since the pattern is part of the reply.
+ *
+ * Subscribers are not owned, and must unsubscribe from everything before
+ * they are destroyed.
+ */
+class pubsub
+{
+public:
+    typedef std::vector<unsigned char> channel_type;
+    // A serialized message.
+    typedef std::shared_ptr<const std::vector<unsigned char>> message;
+
+    class subscriber
+    {
+    public:
+        virtual ~subscriber() {}
+        // Queues a message to be sent. Must not subscribe or unsubscribe.
+        virtual void deliver(const message& m) = 0;
+    };
+
+    // Subscribers with more than hard_limit bytes of messages waiting to be
+    // sent, or more than soft_limit bytes for soft_seconds, are disconnected.
+    // Zero disables a limit.
+    struct output_limits
+    {
+        std::size_t hard_limit;
+        std::size_t soft_limit;
+        unsigned int soft_seconds;
+    };
+
+    pubsub();
+
+    // A subscriber must not subscribe to a channel or pattern twice, nor
+    // unsubscribe from one it isn't subscribed to.
+    void subscribe(const channel_type& channel, subscriber* s);
+    void unsubscribe(const channel_type& channel, subscriber* s);
+    void psubscribe(const channel_type& pattern, subscriber* s);
+    void punsubscribe(const channel_type& pattern, subscriber* s);
+
+    // Delivers a message to the subscribers of a channel and of the
+    // patterns matching it. Returns the number of deliveries.
+    std::size_t publish(const channel_type& channel,
+        const std::vector<unsigned char>& payload);
+
+    // Channels with at least one subscriber, optionally only those matching
+    // a pattern.
+    std::vector<channel_type> channels() const;
+    std::vector<channel_type> channels(const channel_type& pattern) const;
+    // Subscribers of a channel, not counting pattern subscribers.
+    std::size_t subscriber_count(const channel_type& channel) const;
+    // Patterns with at least one subscriber.
+    std::size_t pattern_count() const;
+
+    const output_limits& limits() const;
+    void set_limits(const output_limits& limits);
+
+private:
+    typedef boost::unordered_map<channel_type, std::vector<subscriber*>,
+        boost::hash<channel_type>> subscriber_map;
+
+    static void add(subscriber_map& map, const channel_type& name,
+        subscriber* s);
+    static void remove(subscriber_map& map, const channel_type& name,
+        subscriber* s);
+
+    subscriber_map channels_;
+    subscriber_map patterns_;
+    output_limits limits_;
+};
+
+#endif
@@ -0,0 +1,293 @@
+#include "slab_allocator.hpp"
+#include "util.hpp"
+
+#include <cstdint>
+#include <sys/mman.h>
+#include <pthread.h>
+
+const std::size_t slab_pool::slab_size;
+const std::size_t slab_pool::chunk_alignment;
+const std::size_t slab_pool::max_chunk_size;
+const std::size_t slab_pool::class_count;
+
+// Sits at the start of each slab, followed by the chunks.
+struct slab_pool::slab
+{
+    std::size_t class_index;
+    std::size_t used;
+    std::size_t capacity;
+    // Chunks that were freed. The first bytes of a free chunk point to the
+    // next one.
+    void* free_list;
+    // Chunks past this have never been handed out.
+    unsigned char* next_unused;
+    slab* prev;
+    slab* next;
+};
+
+slab_pool& slab_pool::instance()
+{
+    // Never destroyed, since objects in static storage may free their nodes
+    // after it would have been.
+    static slab_pool* pool = new slab_pool();
+    return *pool;
+}
+
+slab_pool::slab_pool()
+{
+    for (std::size_t i = 0; i < class_count; i++)
+    {
+        auto& c = classes_[i];
+        c.chunk_size = (i + 1) * chunk_alignment;
+        c.partial = nullptr;
+        c.slabs = 0;
+        c.empty_slabs = 0;
+        c.used_chunks = 0;
+        c.requested_bytes = 0;
+    }
+    ::pthread_atfork(&slab_pool::lock_all, &slab_pool::unlock_all,
+        &slab_pool::unlock_all);
+}
+
+void* slab_pool::allocate(std::size_t size)
+{
+    const auto index = class_index(size);
+    auto& c = classes_[index];
+    std::lock_guard<std::mutex> lock(c.mutex);
+
+    auto s = c.partial;
+    if (s == nullptr)
+    {
+        s = map_slab(c, index);
+    }
+
+    void* chunk;
+    if (s->free_list != nullptr)
+    {
+        chunk = s->free_list;
+        s->free_list = *static_cast<void**>(chunk);
+    }
+    else
+    {
+        chunk = s->next_unused;
+        s->next_unused += c.chunk_size;
+    }
+
+    if (s->used == 0)
+    {
+        c.empty_slabs--;
+    }
+    s->used++;
+    if (s->used == s->capacity)
+    {
+        unlink(c, s);
+        pick_head(c);
+    }
+    c.used_chunks++;
+    c.requested_bytes += size;
+    return chunk;
+}
+
+void slab_pool::deallocate(void* chunk, std::size_t size)
+{
+    auto s = slab_of(chunk);
+    auto& c = classes_[s->class_index];
+    std::lock_guard<std::mutex> lock(c.mutex);
+
+    *static_cast<void**>(chunk) = s->free_list;
+    s->free_list = chunk;
+    if (s->used == s->capacity)
+    {
+        link(c, s);
+    }
+    s->used--;
+    c.used_chunks--;
+    c.requested_bytes -= size;
+
+    if (s->used == 0)
+    {
+        if (c.empty_slabs > 0)
+        {
+            unlink(c, s);
+            unmap_slab(s);
+            c.slabs--;
+        }
+        else
+        {
+            c.empty_slabs++;
+        }
+    }
+}
+
+bool slab_pool::should_move(const void* address) const
+{
+    auto s = slab_of(const_cast<void*>(address));
+    {
+        std::lock_guard<std::mutex> lock(slabs_mutex_);
+        if (slab_addresses_.count(reinterpret_cast<std::uintptr_t>(s)) == 0)
+        {
+            return false;
+        }
+    }
+
+    // The slab can't go away meanwhile, since the caller owns a chunk on it.
+    const auto& c = classes_[s->class_index];
+    std::lock_guard<std::mutex> lock(c.mutex);
+    return s != c.partial && s->used < s->capacity
+        && s->used * c.slabs < c.used_chunks;
+}
+
+std::size_t slab_pool::allocation_size(std::size_t size)
+{
+    if (size == 0 || size > max_chunk_size)
+    {
+        return ::allocation_size(size);
+    }
+    return (class_index(size) + 1) * chunk_alignment;
+}
+
+slab_pool::stats slab_pool::statistics() const
+{
+    stats result{0, 0, 0, 0};
+    for (const auto& c: classes_)
+    {
+        std::lock_guard<std::mutex> lock(c.mutex);
+        result.slabs += c.slabs;
+        result.used_bytes += c.used_chunks * c.chunk_size;
+        result.requested_bytes += c.requested_bytes;
+    }
+    result.slab_bytes = result.slabs * slab_size;
+    return result;
+}
+
+std::size_t slab_pool::class_index(std::size_t size)
+{
+    return (size + chunk_alignment - 1) / chunk_alignment - 1;
+}
+
+slab_pool::slab* slab_pool::slab_of(void* chunk)
+{
+    return reinterpret_cast<slab*>(reinterpret_cast<std::uintptr_t>(chunk)
+        & ~static_cast<std::uintptr_t>(slab_size - 1));
+}
+
+slab_pool::slab* slab_pool::map_slab(slab_pool::size_class& c,
+    std::size_t index)
+{
+    // Map twice the size, then trim it down to an aligned slab, so that the
+    // slab of a chunk can be found by masking its address.
+    void* mapped = ::mmap(nullptr, 2 * slab_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+    auto start = reinterpret_cast<std::uintptr_t>(mapped);
+    auto aligned = (start + slab_size - 1) & ~(slab_size - 1);
+    if (aligned > start)
+    {
+        ::munmap(mapped, aligned - start);
+    }
+    ::munmap(reinterpret_cast<void*>(aligned + slab_size),
+        start + slab_size - aligned);
+
+    // The chunks follow the header, aligned.
+    const std::size_t header_size = (sizeof(slab) + chunk_alignment - 1)
+        & ~(chunk_alignment - 1);
+    auto s = reinterpret_cast<slab*>(aligned);
+    s->class_index = index;
+    s->used = 0;
+    s->capacity = (slab_size - header_size) / c.chunk_size;
+    s->free_list = nullptr;
+    s->next_unused = reinterpret_cast<unsigned char*>(aligned)
+        + header_size;
+    s->prev = nullptr;
+    s->next = nullptr;
+    link(c, s);
+    c.slabs++;
+    c.empty_slabs++;
+    {
+        std::lock_guard<std::mutex> lock(slabs_mutex_);
+        slab_addresses_.insert(aligned);
+    }
+    return s;
+}
+
+void slab_pool::unmap_slab(slab_pool::slab* s)
+{
+    {
+        std::lock_guard<std::mutex> lock(slabs_mutex_);
+        slab_addresses_.erase(reinterpret_cast<std::uintptr_t>(s));
+    }
+    ::munmap(s, slab_size);
+}
+
+void slab_pool::link(slab_pool::size_class& c, slab_pool::slab* s)
+{
+    s->prev = nullptr;
+    s->next = c.partial;
+    if (c.partial != nullptr)
+    {
+        c.partial->prev = s;
+    }
+    c.partial = s;
+}
+
+void slab_pool::unlink(slab_pool::size_class& c, slab_pool::slab* s)
+{
+    if (s->prev != nullptr)
+    {
+        s->prev->next = s->next;
+    }
+    else
+    {
+        c.partial = s->next;
+    }
+    if (s->next != nullptr)
+    {
+        s->next->prev = s->prev;
+    }
+    s->prev = nullptr;
+    s->next = nullptr;
+}
+
+void slab_pool::pick_head(slab_pool::size_class& c)
+{
+    // Only a few slabs are looked at, to keep this cheap.
+    const int max_candidates = 16;
+    slab* fullest = c.partial;
+    int looked_at = 0;
+    for (auto s = c.partial; s != nullptr && looked_at < max_candidates;
+        s = s->next, looked_at++)
+    {
+        if (s->used > fullest->used)
+        {
+            fullest = s;
+        }
+    }
+    if (fullest != nullptr && fullest != c.partial)
+    {
+        unlink(c, fullest);
+        link(c, fullest);
+    }
+}
+
+void slab_pool::lock_all()
+{
+    auto& pool = instance();
+    for (auto& c: pool.classes_)
+    {
+        c.mutex.lock();
+    }
+    pool.slabs_mutex_.lock();
+}
+
+void slab_pool::unlock_all()
+{
+    auto& pool = instance();
+    pool.slabs_mutex_.unlock();
+    for (auto& c: pool.classes_)
+    {
+        c.mutex.unlock();
+    }
+}
@@ -0,0 +1,176 @@
+#ifndef __EXOREDIS_SLAB_ALLOCATOR_HPP__
+#define __EXOREDIS_SLAB_ALLOCATOR_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_set>
+#include <new>
+
+
+/*
+ * A pool of fixed-size chunks for small objects, such as the nodes of the
+ * hash tables and trees that hold the keyspace and sorted sets.
+ *
+ * Requests are rounded up to a size class (a multiple of 16 bytes, up to
+ * max_chunk_size). Each class carves its chunks out of slabs: aligned blocks
+ * of slab_size bytes mapped straight from the OS. Chunks of a class are
+ * handed out from the slab at the head of its list of partly used slabs,
+ * which is kept to one of the fuller ones, and a
+ * slab that becomes empty is unmapped (apart from one per class, kept to
+ * avoid mapping and unmapping over and over). This keeps objects of the same
+ * size together and gives memory back to the OS as data is removed, instead
+ * of leaving holes all over the malloc heap.
+ *
+ * The pool is shared by every thread, each size class having its own lock.
+ *
+ * Churn can still leave many slabs sparsely used. Active defragmentation
+ * asks should_move() about each chunk it comes across, and moves the ones it
+ * says yes to by allocating a new chunk and freeing the old one. New chunks
+ * come from the slab at the head of the class's list, so sparse slabs drain
+ * until they can be unmapped.
+ */
+class slab_pool
+{
+public:
+    static const std::size_t slab_size = 64 * 1024;
+    static const std::size_t chunk_alignment = 16;
+    static const std::size_t max_chunk_size = 256;
+    static const std::size_t class_count = max_chunk_size / chunk_alignment;
+
+    struct stats
+    {
+        std::size_t slabs;
+        // Bytes mapped for slabs.
+        std::size_t slab_bytes;
+        // Bytes of chunks in use.
+        std::size_t used_bytes;
+        // Bytes asked for, before rounding up to the size class.
+        std::size_t requested_bytes;
+    };
+
+    static slab_pool& instance();
+
+    // Returns a chunk of at least size bytes, which must be between 1 and
+    // max_chunk_size. Throws std::bad_alloc if no slab could be mapped.
+    void* allocate(std::size_t size);
+    // Returns a chunk to the pool. size must be what it was allocated with.
+    void deallocate(void* chunk, std::size_t size);
+
+    // True if the chunk holding the given address is on a slab that is less
+    // used than the average slab of its class, other than the slab new
+    // chunks are taken from. Moving such a chunk helps empty its slab. False
+    // for addresses that don't belong to the pool.
+    bool should_move(const void* address) const;
+
+    // Bytes a request really takes: the size of its size class if it comes
+    // from the pool, otherwise the size of the malloc chunk.
+    static std::size_t allocation_size(std::size_t size);
+
+    stats statistics() const;
+
+private:
+    struct slab;
+
+    struct size_class
+    {
+        mutable std::mutex mutex;
+        std::size_t chunk_size;
+        // Slabs with free chunks, most recently used first.
+        slab* partial;
+        std::size_t slabs;
+        std::size_t empty_slabs;
+        std::size_t used_chunks;
+        std::size_t requested_bytes;
+    };
+
+    slab_pool();
+
+    slab_pool(const slab_pool&) = delete;
+    slab_pool& operator=(const slab_pool&) = delete;
+
+    static std::size_t class_index(std::size_t size);
+    static slab* slab_of(void* chunk);
+    // Maps a new slab for a class. Called with the class locked.
+    slab* map_slab(size_class& c, std::size_t index);
+    void unmap_slab(slab* s);
+    static void link(size_class& c, slab* s);
+    static void unlink(size_class& c, slab* s);
+    // Moves the fullest of the first few partly used slabs to the head of
+    // the list, so that new chunks fill it up.
+    static void pick_head(size_class& c);
+
+    // Taken around fork(), so that the child doesn't inherit a lock held by
+    // another thread.
+    static void lock_all();
+    static void unlock_all();
+
+    size_class classes_[class_count];
+    // Start addresses of all slabs, to tell pool chunks from others.
+    mutable std::mutex slabs_mutex_;
+    std::unordered_set<std::uintptr_t> slab_addresses_;
+};
+
+/*
+ * A standard allocator that takes single objects of up to
+ * slab_pool::max_chunk_size bytes from the slab pool. Arrays and larger
+ * objects, such as the bucket arrays of hash tables, come from operator new.
+ */
+template <typename T>
+class slab_allocator
+{
+public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef slab_allocator<U> other;
+    };
+
+    slab_allocator() noexcept {}
+    template <typename U>
+    slab_allocator(const slab_allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n)
+    {
+        if (pooled(n))
+        {
+            return static_cast<T*>(slab_pool::instance().allocate(sizeof(T)));
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (pooled(n))
+        {
+            slab_pool::instance().deallocate(p, sizeof(T));
+        }
+        else
+        {
+            ::operator delete(p);
+        }
+    }
+
+private:
+    static bool pooled(std::size_t n)
+    {
+        return n == 1 && sizeof(T) <= slab_pool::max_chunk_size
+            && alignof(T) <= slab_pool::chunk_alignment;
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const slab_allocator<T>&, const slab_allocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const slab_allocator<T>&, const slab_allocator<U>&)
+{
+    return false;
+}
+
+#endif
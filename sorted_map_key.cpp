@@ -1,6 +1,8 @@
 #include "sorted_map_key.hpp"
 
+#include <utility>
 #include <boost/functional/hash.hpp>
+#include "slab_allocator.hpp"
 
 
 bool sorted_map_key::equal_to::operator()(const sorted_map_key& left,
@@ -19,14 +21,27 @@ sorted_map_key sorted_map_key::create_owned(const std::vector<unsigned char>& v)
     return sorted_map_key(v);
 }
 
+sorted_map_key sorted_map_key::create_owned(std::vector<unsigned char>&& v)
+{
+    return sorted_map_key(std::move(v));
+}
+
 sorted_map_key sorted_map_key::create_unowned(const std::vector<unsigned char>* v)
 {
     return sorted_map_key(v);
 }
 
 sorted_map_key::sorted_map_key(const std::vector<unsigned char>& v)
-    : member_ptr_(new std::vector<unsigned char>(v)),
-        unowned_member_ptr_(nullptr)
+    : unowned_member_ptr_(nullptr),
+    member_ptr_(std::allocate_shared<std::vector<unsigned char>>(
+        slab_allocator<std::vector<unsigned char>>(), v))
+{
+}
+
+sorted_map_key::sorted_map_key(std::vector<unsigned char>&& v)
+    : unowned_member_ptr_(nullptr),
+    member_ptr_(std::allocate_shared<std::vector<unsigned char>>(
+        slab_allocator<std::vector<unsigned char>>(), std::move(v)))
 {
 }
 
@@ -25,6 +25,7 @@ public:
     };
 
     static sorted_map_key create_owned(const std::vector<unsigned char>&);
+    static sorted_map_key create_owned(std::vector<unsigned char>&&);
     static sorted_map_key create_unowned(const std::vector<unsigned char>*);
 
     const std::vector<unsigned char>& member() const;
@@ -35,6 +36,7 @@ public:
 private:
     sorted_map_key(const std::vector<unsigned char>*);
     sorted_map_key(const std::vector<unsigned char>&);
+    sorted_map_key(std::vector<unsigned char>&&);
 
 
     const std::vector<unsigned char>* unowned_member_ptr_;
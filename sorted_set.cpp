@@ -1,12 +1,64 @@
 #include "sorted_set.hpp"
+#include "util.hpp"
 
 #include <iterator>
 #include <stdexcept>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+namespace
+{
+    // Multiplying infinity by zero gives 0 rather than NaN, as in Redis.
+    double weigh(double score, double weight)
+    {
+        double result = score * weight;
+        return std::isnan(result) ? 0 : result;
+    }
+
+    double aggregate_scores(sorted_set::aggregate_type aggregate, double left,
+        double right)
+    {
+        switch (aggregate)
+        {
+        case sorted_set::aggregate_type::min:
+            return std::min(left, right);
+        case sorted_set::aggregate_type::max:
+            return std::max(left, right);
+        default:
+        {
+            // Adding infinities of opposite signs gives 0 rather than NaN.
+            double sum = left + right;
+            return std::isnan(sum) ? 0 : sum;
+        }
+        }
+    }
+}
 
 sorted_set::sorted_set()
+    : member_bytes_(0)
 {
 }
 
+sorted_set::sorted_set(sorted_set::element_list&& sorted_elements)
+    : member_bytes_(0)
+{
+    map_.reserve(sorted_elements.size());
+    for (auto& element: sorted_elements)
+    {
+        member_bytes_ += allocation_size(element.second.capacity());
+        auto new_map_key = sorted_set::map_key_type::create_owned(
+            std::move(element.second));
+        if (!map_.emplace(new_map_key, element.first).second)
+        {
+            throw std::invalid_argument("Duplicate member in sorted set");
+        }
+        // Every element goes after the previous one, so hinting at the end
+        // makes each insertion amortized constant time.
+        set_.emplace_hint(set_.end(), new_map_key.make_set_key(element.first));
+    }
+}
+
 bool sorted_set::contains(const sorted_set::member_type& m) const
 {
     auto temp_key = sorted_set::map_key_type::create_unowned(&m);
@@ -34,6 +86,18 @@ double sorted_set::get_score(const sorted_set::member_type& m) const
     }
 }
 
+bool sorted_set::find_score(const sorted_set::member_type& m,
+    double& score) const
+{
+    auto it = map_.find(sorted_set::map_key_type::create_unowned(&m));
+    if (it == map_.end())
+    {
+        return false;
+    }
+    score = it->second;
+    return true;
+}
+
 std::size_t sorted_set::size() const
 {
     return map_.size();
@@ -64,6 +128,7 @@ void sorted_set::add(const sorted_set::member_type& m,
     {
         // Make new keys.
         auto new_map_key = sorted_set::map_key_type::create_owned(m);
+        member_bytes_ += allocation_size(new_map_key.member().capacity());
         auto new_set_key = new_map_key.make_set_key(score);
         map_[new_map_key] = score;
         set_.insert(new_set_key);
@@ -81,14 +146,336 @@ std::size_t sorted_set::count(double min, double max) const
     return std::distance(lb, ub);
 }
 
+sorted_set::score_histogram sorted_set::histogram(
+    const std::vector<double>& boundaries) const
+{
+    score_histogram result;
+    result.counts.assign(boundaries.size() - 1, 0);
+    result.total = 0;
+    result.sum = 0;
+    result.min = 0;
+    result.max = 0;
+
+    auto it = set_.lower_bound(sorted_set::set_key_type(boundaries.front()));
+    auto end = set_.upper_bound(
+        sorted_set::set_key_type(boundaries.back(), true));
+    std::size_t bucket = 0;
+    for (; it != end; it++)
+    {
+        auto score = it->score();
+        // Scores come in order, so the bucket only ever moves forward.
+        while (bucket + 1 < result.counts.size()
+            && score >= boundaries[bucket + 1])
+        {
+            bucket++;
+        }
+        result.counts[bucket]++;
+        if (result.total == 0)
+        {
+            result.min = score;
+        }
+        result.max = score;
+        result.sum += score;
+        result.total++;
+    }
+    return result;
+}
+
 std::pair<sorted_set::set_type::const_iterator, sorted_set::set_type::const_iterator>
     sorted_set::element_range(std::size_t start, std::size_t end) const
 {
-    auto first = set_.cbegin();
-    std::advance(first, start);
-    auto second = set_.cbegin();
-    std::advance(second, end + 1);
+    auto first = element_at(start);
+    auto second = std::next(first, end + 1 - start);
     return std::pair<set_type::const_iterator, set_type::const_iterator>(
         first, second
     );
 }
+
+std::size_t sorted_set::remove_range_by_rank(std::size_t start,
+    std::size_t end)
+{
+    auto first = element_at(start);
+    return remove_range(first, std::next(first, end + 1 - start));
+}
+
+std::size_t sorted_set::remove_range_by_score(double min, double max)
+{
+    return remove_range(set_.lower_bound(sorted_set::set_key_type(min)),
+        set_.upper_bound(sorted_set::set_key_type(max, true)));
+}
+
+std::size_t sorted_set::trim(std::size_t max_size)
+{
+    if (size() <= max_size)
+    {
+        return 0;
+    }
+    auto first = set_.cbegin();
+    return remove_range(first, std::next(first, size() - max_size));
+}
+
+sorted_set::set_type::const_iterator sorted_set::element_at(
+    std::size_t rank) const
+{
+    if (rank <= size() / 2)
+    {
+        return std::next(set_.cbegin(), rank);
+    }
+    return std::prev(set_.cend(), size() - rank);
+}
+
+std::size_t sorted_set::remove_range(sorted_set::set_type::const_iterator first,
+    sorted_set::set_type::const_iterator last)
+{
+    // The members belong to the map keys, so the tree nodes, which only
+    // point at them, can go after them.
+    std::size_t removed = 0;
+    for (auto it = first; it != last; it++)
+    {
+        auto map_it = map_.find(
+            sorted_set::map_key_type::create_unowned(&it->member()));
+        member_bytes_ -= allocation_size(map_it->first.member().capacity());
+        map_.erase(map_it);
+        removed++;
+    }
+    set_.erase(first, last);
+    return removed;
+}
+
+std::uint64_t sorted_set::scan(std::uint64_t cursor, std::size_t count,
+    std::function<void(const sorted_set::member_type&, double)> f) const
+{
+    if (map_.empty())
+    {
+        return 0;
+    }
+    const std::uint64_t mask = scan_mask(map_.bucket_count());
+    std::size_t seen = 0;
+    for (std::size_t buckets = 0; seen < count && buckets < count * 10;
+        buckets++)
+    {
+        // Past the last bucket if the count isn't a power of two.
+        auto bucket = cursor & mask;
+        if (bucket < map_.bucket_count())
+        {
+            for (auto it = map_.begin(bucket); it != map_.end(bucket); it++)
+            {
+                f(it->first.member(), it->second);
+                seen++;
+            }
+        }
+        cursor = next_scan_cursor(cursor, mask);
+        if (cursor == 0)
+        {
+            break;
+        }
+    }
+    return cursor;
+}
+
+std::uint64_t sorted_set::defrag(std::uint64_t cursor, std::size_t count,
+    std::size_t& moved)
+{
+    if (map_.empty())
+    {
+        return 0;
+    }
+    const auto& pool = slab_pool::instance();
+    const std::uint64_t mask = scan_mask(map_.bucket_count());
+    std::vector<member_type> to_move;
+    std::size_t seen = 0;
+    for (std::size_t buckets = 0; seen < count && buckets < count * 10;
+        buckets++)
+    {
+        // Past the last bucket if the count isn't a power of two.
+        auto bucket = cursor & mask;
+        if (bucket < map_.bucket_count())
+        {
+            for (auto it = map_.begin(bucket); it != map_.end(bucket); it++)
+            {
+                // An element has a hash table node, a tree node and the holder
+                // of its member.
+                auto set_it = set_.find(it->first.make_set_key(it->second));
+                if (pool.should_move(&*it) || pool.should_move(&*set_it)
+                    || pool.should_move(&it->first.member()))
+                {
+                    to_move.push_back(it->first.member());
+                }
+                seen++;
+            }
+        }
+        cursor = next_scan_cursor(cursor, mask);
+        if (cursor == 0)
+        {
+            break;
+        }
+    }
+
+    // Moved elements go back to the same buckets, so the table isn't
+    // resized.
+    for (const auto& member: to_move)
+    {
+        reinsert(member);
+    }
+    moved += to_move.size();
+    return cursor;
+}
+
+void sorted_set::reinsert(const sorted_set::member_type& m)
+{
+    auto temp_key = sorted_set::map_key_type::create_unowned(&m);
+    auto it = map_.find(temp_key);
+    auto score = it->second;
+    set_.erase(it->first.make_set_key(score));
+    member_bytes_ -= allocation_size(it->first.member().capacity());
+    map_.erase(it);
+    add(m, score);
+}
+
+std::size_t sorted_set::memory_usage() const
+{
+    // Each element has a tree node holding its set key (the node has a
+    // color and three links), a hash table node holding its map key and
+    // score (with a link and the bucket index), and the member vector, which
+    // is allocated along with its shared_ptr control block (a vtable and two
+    // counts). These all come from the slab pool. The hash table also has
+    // an array of buckets.
+    const std::size_t set_node_size = slab_pool::allocation_size(
+        4 * sizeof(void*) + sizeof(set_type::value_type));
+    const std::size_t map_node_size = slab_pool::allocation_size(
+        2 * sizeof(void*) + sizeof(map_type::value_type));
+    const std::size_t member_holder_size = slab_pool::allocation_size(
+        sizeof(void*) + 2 * sizeof(int) + sizeof(member_type));
+    const std::size_t bucket_array_size = map_.bucket_count() == 0 ? 0
+        : allocation_size((map_.bucket_count() + 1) * sizeof(void*));
+    return bucket_array_size + member_bytes_
+        + size() * (set_node_size + map_node_size + member_holder_size);
+}
+
+sorted_set sorted_set::set_union(const std::vector<const sorted_set*>& sets,
+    const std::vector<double>& weights, sorted_set::aggregate_type aggregate)
+{
+    // Keys point at the members of the sets, which outlive the result.
+    boost::unordered_map<map_key_type, double, map_key_type::hash,
+        map_key_type::equal_to> scores;
+    std::size_t largest = 0;
+    for (auto set: sets)
+    {
+        largest = std::max(largest, set->size());
+    }
+    scores.reserve(largest);
+
+    for (std::size_t i = 0; i < sets.size(); i++)
+    {
+        for (const auto& pair: sets[i]->map_)
+        {
+            double score = weigh(pair.second, weights[i]);
+            auto inserted = scores.emplace(
+                map_key_type::create_unowned(&pair.first.member()), score);
+            if (!inserted.second)
+            {
+                inserted.first->second = aggregate_scores(aggregate,
+                    inserted.first->second, score);
+            }
+        }
+    }
+
+    std::vector<std::pair<double, const member_type*>> elements;
+    elements.reserve(scores.size());
+    for (const auto& pair: scores)
+    {
+        elements.emplace_back(pair.second, &pair.first.member());
+    }
+    return from_elements(elements);
+}
+
+sorted_set sorted_set::set_intersection(
+    const std::vector<const sorted_set*>& sets,
+    const std::vector<double>& weights, sorted_set::aggregate_type aggregate)
+{
+    if (sets.empty())
+    {
+        return sorted_set();
+    }
+
+    // Visit the sets from the smallest up, so that the fewest members are
+    // walked and misses are found early.
+    std::vector<std::size_t> order(sets.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+        [&sets](std::size_t left, std::size_t right)
+        {
+            return sets[left]->size() < sets[right]->size();
+        });
+
+    std::vector<std::pair<double, const member_type*>> elements;
+    const auto& smallest = *sets[order[0]];
+    for (const auto& pair: smallest.map_)
+    {
+        const auto& member = pair.first.member();
+        double score = weigh(pair.second, weights[order[0]]);
+        bool everywhere = true;
+        for (std::size_t i = 1; i < order.size() && everywhere; i++)
+        {
+            auto it = sets[order[i]]->map_.find(pair.first);
+            if (it == sets[order[i]]->map_.end())
+            {
+                everywhere = false;
+                continue;
+            }
+            score = aggregate_scores(aggregate, score,
+                weigh(it->second, weights[order[i]]));
+        }
+        if (everywhere)
+        {
+            elements.emplace_back(score, &member);
+        }
+    }
+    return from_elements(elements);
+}
+
+sorted_set sorted_set::set_difference(
+    const std::vector<const sorted_set*>& sets)
+{
+    if (sets.empty())
+    {
+        return sorted_set();
+    }
+    std::vector<std::pair<double, const member_type*>> elements;
+    for (const auto& pair: sets[0]->map_)
+    {
+        bool elsewhere = false;
+        for (std::size_t i = 1; i < sets.size() && !elsewhere; i++)
+        {
+            elsewhere = sets[i]->map_.count(pair.first) != 0;
+        }
+        if (!elsewhere)
+        {
+            elements.emplace_back(pair.second, &pair.first.member());
+        }
+    }
+    return from_elements(elements);
+}
+
+sorted_set sorted_set::from_elements(
+    std::vector<std::pair<double, const member_type*>>& elements)
+{
+    std::sort(elements.begin(), elements.end(),
+        [](const std::pair<double, const member_type*>& left,
+            const std::pair<double, const member_type*>& right)
+        {
+            if (left.first != right.first)
+            {
+                return left.first < right.first;
+            }
+            return *left.second < *right.second;
+        });
+
+    element_list sorted_elements;
+    sorted_elements.reserve(elements.size());
+    for (const auto& element: elements)
+    {
+        sorted_elements.emplace_back(element.first, *element.second);
+    }
+    return sorted_set(std::move(sorted_elements));
+}
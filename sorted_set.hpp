@@ -5,9 +5,12 @@
 #include <cstddef>
 #include <utility>
 #include <set>
+#include <cstdint>
+#include <functional>
 #include <boost/unordered_map.hpp>
 #include "sorted_set_key.hpp"
 #include "sorted_map_key.hpp"
+#include "slab_allocator.hpp"
 
 
 /*
@@ -34,12 +37,36 @@ public:
     typedef std::vector<unsigned char> member_type;
     typedef sorted_set_key set_key_type;
     typedef sorted_map_key map_key_type;
-    typedef std::set<set_key_type, set_key_type::compare> set_type;
+    // The nodes of both come from the slab pool.
+    typedef std::set<set_key_type, set_key_type::compare,
+        slab_allocator<set_key_type>> set_type;
     typedef boost::unordered_map<map_key_type, double,
-        map_key_type::hash, map_key_type::equal_to> map_type;
+        map_key_type::hash, map_key_type::equal_to,
+        slab_allocator<std::pair<const map_key_type, double>>> map_type;
+    typedef std::vector<std::pair<double, member_type>> element_list;
+
+    // What histogram() finds. The sum, min and max are those of the scores
+    // counted, and are 0 if none are.
+    struct score_histogram
+    {
+        std::vector<std::size_t> counts;
+        std::size_t total;
+        double sum;
+        double min;
+        double max;
+    };
+
+    // How ZUNIONSTORE and ZINTERSTORE combine the scores of a member.
+    enum class aggregate_type {sum, min, max};
 
     sorted_set();
 
+    // Builds a sorted set from score-member pairs sorted by score and then
+    // member, in linear time. The members are moved out of the list.
+    // Unsorted input still gives a correct set, only slower.
+    // Throws std::invalid_argument if a member appears more than once.
+    explicit sorted_set(element_list&& sorted_elements);
+
     // Returns true if a member is present, regardless of its score.
     bool contains(const member_type&) const;
 
@@ -50,6 +77,10 @@ public:
     // Returns 0 if member is not present.
     double get_score(const member_type&) const;
 
+    // Sets score to the score of a member. Returns false if it is not
+    // present.
+    bool find_score(const member_type& m, double& score) const;
+
     // Note that the size of the unordered_map and the size of the set
     // should be the same.
     std::size_t size() const;
@@ -60,14 +91,86 @@ public:
     // Number of elements with min <= score <= max.
     std::size_t count(double min, double max) const;
 
+    // Counts the elements in each bucket between consecutive boundaries,
+    // which must be sorted, in one pass over the elements from the first
+    // boundary to the last. Bucket i holds the scores in [boundaries[i],
+    // boundaries[i + 1]), and the last bucket also holds the last boundary.
+    // There must be at least two boundaries.
+    score_histogram histogram(const std::vector<double>& boundaries) const;
+
     // Returns iterators to the input indices. Both indices are inclusive.
     // The end iterator returned is exclusive.
     std::pair<set_type::const_iterator, set_type::const_iterator>
         element_range(std::size_t start, std::size_t end) const;
 
+    // Remove the elements with start <= rank <= end, which must be valid
+    // ranks, or with min <= score <= max. Return the number removed. The
+    // tree has no rank index, so a rank is found by walking from the nearer
+    // end of the set, which is linear in the middle of a large set.
+    std::size_t remove_range_by_rank(std::size_t start, std::size_t end);
+    std::size_t remove_range_by_score(double min, double max);
+    // Removes the lowest ranked elements until at most max_size are left,
+    // stepping only over the ones removed. Returns the number removed.
+    std::size_t trim(std::size_t max_size);
+
+    // Calls f for the elements in the hash table buckets from cursor on,
+    // stopping once count elements have been seen or ten times as many
+    // buckets visited. Returns the cursor to continue from, or 0 once every
+    // bucket has been visited. Elements present for the whole scan are seen
+    // at least once, even if the table is resized between calls.
+    std::uint64_t scan(std::uint64_t cursor, std::size_t count,
+        std::function<void(const member_type&, double)> f) const;
+
+    // Moves elements whose nodes are on sparsely used slabs (see
+    // slab_pool::should_move()) to new nodes, visiting the buckets from
+    // cursor on as scan() does. Returns the cursor to continue from, or 0
+    // once every bucket has been visited, and adds the number of elements
+    // moved to moved. References to members are invalidated.
+    std::uint64_t defrag(std::uint64_t cursor, std::size_t count,
+        std::size_t& moved);
+
+    // Bytes allocated on the heap by the set, not counting the sorted_set
+    // object itself. Computed in constant time.
+    std::size_t memory_usage() const;
+
+    // Combine sets as ZUNIONSTORE and ZINTERSTORE do. A member's score in
+    // each set is multiplied by that set's weight, and the results are
+    // aggregated. The members of every set are visited once for a union,
+    // while an intersection walks the smallest set and looks its members up
+    // in the others, from the next smallest on. The result is built in one
+    // go, as the element list constructor does.
+    static sorted_set set_union(const std::vector<const sorted_set*>& sets,
+        const std::vector<double>& weights, aggregate_type aggregate);
+    static sorted_set set_intersection(
+        const std::vector<const sorted_set*>& sets,
+        const std::vector<double>& weights, aggregate_type aggregate);
+    // The members of the first set that are in none of the others, with their
+    // scores, as ZDIFFSTORE gives.
+    static sorted_set set_difference(
+        const std::vector<const sorted_set*>& sets);
+
 private:
+    // The element of a rank, or end() for size(), found by walking from
+    // whichever end of the tree is nearer.
+    set_type::const_iterator element_at(std::size_t rank) const;
+
+    // Removes the elements in [first, last). The tree nodes are freed in a
+    // single range erase.
+    std::size_t remove_range(set_type::const_iterator first,
+        set_type::const_iterator last);
+
+    // Builds a set from score-member pairs in any order, copying the
+    // members.
+    static sorted_set from_elements(
+        std::vector<std::pair<double, const member_type*>>& elements);
+
+    // Removes an element and adds it back, which allocates new nodes for it.
+    void reinsert(const member_type& m);
+
     set_type set_;
     map_type map_;
+    // Heap bytes taken by the contents of the members.
+    std::size_t member_bytes_;
 };
 
 #endif
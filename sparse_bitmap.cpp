@@ -0,0 +1,839 @@
+#include "sparse_bitmap.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+const std::uint64_t sparse_bitmap::chunk_bits;
+const std::size_t sparse_bitmap::container_words;
+const std::size_t sparse_bitmap::max_array_size;
+
+namespace
+{
+    const std::uint64_t chunk_bytes = sparse_bitmap::chunk_bits / 8;
+
+    // The bit of a word that holds a position. Positions run from the top
+    // bit down.
+    std::uint64_t bit_mask(std::uint32_t position)
+    {
+        return std::uint64_t(1) << (63 - position % 64);
+    }
+
+    // Bits of a word from the given position on, and up to it.
+    std::uint64_t mask_from(std::uint32_t position)
+    {
+        return ~std::uint64_t(0) >> (position % 64);
+    }
+
+    std::uint64_t mask_to(std::uint32_t position)
+    {
+        return ~std::uint64_t(0) << (63 - position % 64);
+    }
+
+    template <typename T>
+    void append_pod(std::vector<unsigned char>& out, const T& value)
+    {
+        auto bytes = reinterpret_cast<const unsigned char*>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(value));
+    }
+
+    template <typename T>
+    T read_pod(const std::vector<unsigned char>& data, std::size_t& pos)
+    {
+        if (sizeof(T) > data.size() - pos)
+        {
+            throw std::invalid_argument("Truncated sparse bitmap");
+        }
+        T value;
+        std::memcpy(&value, data.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+
+    // Index of the last run starting at or before position, or -1. Runs are
+    // stored as pairs of first and last positions.
+    long run_index(const std::vector<std::uint16_t>& runs,
+        std::uint32_t position)
+    {
+        long low = 0;
+        long high = static_cast<long>(runs.size() / 2) - 1;
+        long found = -1;
+        while (low <= high)
+        {
+            auto middle = (low + high) / 2;
+            if (runs[2 * middle] <= position)
+            {
+                found = middle;
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle - 1;
+            }
+        }
+        return found;
+    }
+}
+
+sparse_bitmap::sparse_bitmap()
+    : size_(0), container_bytes_(0)
+{
+}
+
+sparse_bitmap::sparse_bitmap(const std::vector<unsigned char>& bytes)
+    : size_(bytes.size()), container_bytes_(0)
+{
+    for (std::uint64_t start = 0; start < bytes.size(); start += chunk_bytes)
+    {
+        auto length = std::min<std::uint64_t>(chunk_bytes,
+            bytes.size() - start);
+        if (find_byte_not(bytes.data() + start, length, 0) == length)
+        {
+            continue;
+        }
+        word_block words = {};
+        for (std::uint64_t i = 0; i < length; i++)
+        {
+            words[i / 8] |= std::uint64_t(bytes[start + i])
+                << (56 - 8 * (i % 8));
+        }
+        containers_.push_back(from_words(start / chunk_bytes, words));
+        container_bytes_ += container_memory(containers_.back());
+    }
+}
+
+std::uint64_t sparse_bitmap::size() const
+{
+    return size_;
+}
+
+bool sparse_bitmap::get(std::uint64_t bit) const
+{
+    auto c = find_container(bit / chunk_bits);
+    return c != nullptr && container_get(*c, bit % chunk_bits);
+}
+
+bool sparse_bitmap::set(std::uint64_t bit, bool value)
+{
+    size_ = std::max(size_, bit / 8 + 1);
+    auto key = bit / chunk_bits;
+    auto index = lower_bound(key);
+    if (index < containers_.size() && containers_[index].key == key)
+    {
+        auto& c = containers_[index];
+        container_bytes_ -= container_memory(c);
+        auto old = container_set(c, bit % chunk_bits, value);
+        container_bytes_ += container_memory(c);
+        if (c.cardinality == 0)
+        {
+            containers_.erase(containers_.begin() + index);
+        }
+        return old;
+    }
+
+    if (value)
+    {
+        container c;
+        c.key = key;
+        c.kind = container_kind::array;
+        c.cardinality = 1;
+        c.values.push_back(bit % chunk_bits);
+        container_bytes_ += container_memory(c);
+        containers_.insert(containers_.begin() + index, std::move(c));
+    }
+    return false;
+}
+
+std::uint64_t sparse_bitmap::count(std::uint64_t first_bit,
+    std::uint64_t last_bit) const
+{
+    const auto first_key = first_bit / chunk_bits;
+    const auto last_key = last_bit / chunk_bits;
+    std::uint64_t total = 0;
+    for (auto i = lower_bound(first_key);
+        i < containers_.size() && containers_[i].key <= last_key; i++)
+    {
+        const auto& c = containers_[i];
+        std::uint32_t first = c.key == first_key ? first_bit % chunk_bits : 0;
+        std::uint32_t last = c.key == last_key ? last_bit % chunk_bits
+            : chunk_bits - 1;
+        total += first == 0 && last == chunk_bits - 1 ? c.cardinality
+            : container_count(c, first, last);
+    }
+    return total;
+}
+
+long long sparse_bitmap::find(std::uint64_t first_bit, std::uint64_t last_bit,
+    bool bit) const
+{
+    const auto last_key = last_bit / chunk_bits;
+    auto local_last = [&](std::uint64_t key) -> std::uint32_t
+    {
+        return key == last_key ? last_bit % chunk_bits : chunk_bits - 1;
+    };
+
+    if (bit)
+    {
+        const auto first_key = first_bit / chunk_bits;
+        for (auto i = lower_bound(first_key);
+            i < containers_.size() && containers_[i].key <= last_key; i++)
+        {
+            const auto& c = containers_[i];
+            std::uint32_t first = c.key == first_key
+                ? first_bit % chunk_bits : 0;
+            auto found = container_find(c, first, local_last(c.key), true);
+            if (found >= 0)
+            {
+                return c.key * chunk_bits + found;
+            }
+        }
+        return -1;
+    }
+
+    // A chunk without a container is all clear bits.
+    for (auto position = first_bit; position <= last_bit;
+        position = (position / chunk_bits + 1) * chunk_bits)
+    {
+        auto key = position / chunk_bits;
+        auto c = find_container(key);
+        if (c == nullptr)
+        {
+            return position;
+        }
+        auto found = container_find(*c, position % chunk_bits,
+            local_last(key), false);
+        if (found >= 0)
+        {
+            return key * chunk_bits + found;
+        }
+    }
+    return -1;
+}
+
+void sparse_bitmap::for_each(std::function<void(std::uint64_t)> f) const
+{
+    for (const auto& c: containers_)
+    {
+        const auto base = c.key * chunk_bits;
+        switch (c.kind)
+        {
+        case container_kind::array:
+            for (auto position: c.values)
+            {
+                f(base + position);
+            }
+            break;
+        case container_kind::bitmap:
+            for (std::size_t i = 0; i < container_words; i++)
+            {
+                for (auto word = c.words[i]; word != 0;
+                    word &= ~bit_mask(__builtin_clzll(word)))
+                {
+                    f(base + i * 64 + __builtin_clzll(word));
+                }
+            }
+            break;
+        case container_kind::run:
+            for (std::size_t i = 0; i < c.values.size(); i += 2)
+            {
+                for (std::uint32_t position = c.values[i];
+                    position <= c.values[i + 1]; position++)
+                {
+                    f(base + position);
+                }
+            }
+            break;
+        }
+    }
+}
+
+std::vector<unsigned char> sparse_bitmap::to_bytes(std::uint64_t start,
+    std::uint64_t end) const
+{
+    end = std::min(end, size_);
+    if (start >= end)
+    {
+        return std::vector<unsigned char>();
+    }
+
+    std::vector<unsigned char> bytes(end - start);
+    for (auto i = lower_bound(start / chunk_bytes);
+        i < containers_.size() && containers_[i].key * chunk_bytes < end; i++)
+    {
+        word_block words;
+        to_words(containers_[i], words);
+        auto chunk_start = containers_[i].key * chunk_bytes;
+        auto from = std::max(start, chunk_start);
+        auto to = std::min(end, chunk_start + chunk_bytes);
+        for (auto byte = from; byte < to; byte++)
+        {
+            auto offset = byte - chunk_start;
+            bytes[byte - start] = words[offset / 8] >> (56 - 8 * (offset % 8));
+        }
+    }
+    return bytes;
+}
+
+std::vector<unsigned char> sparse_bitmap::to_bytes() const
+{
+    return to_bytes(0, size_);
+}
+
+sparse_bitmap sparse_bitmap::combine(bit_operation op,
+    const std::vector<const sparse_bitmap*>& sources)
+{
+    sparse_bitmap result;
+    std::vector<std::uint64_t> keys;
+    for (auto source: sources)
+    {
+        result.size_ = std::max(result.size_, source->size_);
+        for (const auto& c: source->containers_)
+        {
+            keys.push_back(c.key);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    for (auto key: keys)
+    {
+        word_block combined;
+        word_block words;
+        bool first = true;
+        bool missing = false;
+        for (auto source: sources)
+        {
+            auto c = source->find_container(key);
+            if (c == nullptr)
+            {
+                missing = true;
+                std::fill(std::begin(words), std::end(words), 0);
+            }
+            else
+            {
+                to_words(*c, words);
+            }
+            for (std::size_t i = 0; i < container_words; i++)
+            {
+                if (first)
+                {
+                    combined[i] = words[i];
+                }
+                else if (op == bit_operation::bitwise_and)
+                {
+                    combined[i] &= words[i];
+                }
+                else if (op == bit_operation::bitwise_or)
+                {
+                    combined[i] |= words[i];
+                }
+                else
+                {
+                    combined[i] ^= words[i];
+                }
+            }
+            first = false;
+        }
+
+        // A chunk missing from any source is clear in an AND.
+        if (missing && op == bit_operation::bitwise_and)
+        {
+            continue;
+        }
+        auto c = from_words(key, combined);
+        if (c.cardinality != 0)
+        {
+            result.containers_.push_back(std::move(c));
+        }
+    }
+    result.optimize();
+    return result;
+}
+
+void sparse_bitmap::optimize()
+{
+    for (auto& c: containers_)
+    {
+        word_block words;
+        to_words(c, words);
+        auto runs = count_runs(words);
+        // Bytes each encoding takes.
+        std::size_t run_size = runs * 4;
+        std::size_t best_size = c.cardinality <= max_array_size
+            ? c.cardinality * 2 : container_words * 8;
+        if (run_size >= best_size)
+        {
+            if (c.kind == container_kind::run)
+            {
+                c = from_words(c.key, words);
+            }
+            continue;
+        }
+
+        container run_container;
+        run_container.key = c.key;
+        run_container.kind = container_kind::run;
+        run_container.cardinality = c.cardinality;
+        run_container.values.reserve(runs * 2);
+        bool in_run = false;
+        for (std::uint32_t position = 0; position < chunk_bits; position++)
+        {
+            bool set = (words[position / 64] & bit_mask(position)) != 0;
+            if (set && !in_run)
+            {
+                run_container.values.push_back(position);
+            }
+            else if (!set && in_run)
+            {
+                run_container.values.push_back(position - 1);
+            }
+            in_run = set;
+        }
+        if (in_run)
+        {
+            run_container.values.push_back(chunk_bits - 1);
+        }
+        c = std::move(run_container);
+    }
+    recount_memory();
+}
+
+std::size_t sparse_bitmap::memory_usage() const
+{
+    return allocation_size(containers_.capacity() * sizeof(container))
+        + container_bytes_;
+}
+
+std::vector<unsigned char> sparse_bitmap::serialize() const
+{
+    std::vector<unsigned char> out;
+    append_pod(out, size_);
+    append_pod(out, static_cast<std::uint64_t>(containers_.size()));
+    for (const auto& c: containers_)
+    {
+        append_pod(out, c.key);
+        append_pod(out, static_cast<std::uint8_t>(c.kind));
+        append_pod(out, c.cardinality);
+        append_pod(out, static_cast<std::uint32_t>(c.values.size()));
+        for (auto value: c.values)
+        {
+            append_pod(out, value);
+        }
+        append_pod(out, static_cast<std::uint32_t>(c.words.size()));
+        for (auto word: c.words)
+        {
+            append_pod(out, word);
+        }
+    }
+    return out;
+}
+
+sparse_bitmap sparse_bitmap::deserialize(const std::vector<unsigned char>& data)
+{
+    sparse_bitmap result;
+    std::size_t pos = 0;
+    result.size_ = read_pod<std::uint64_t>(data, pos);
+    auto count = read_pod<std::uint64_t>(data, pos);
+    for (std::uint64_t i = 0; i < count; i++)
+    {
+        container c;
+        c.key = read_pod<std::uint64_t>(data, pos);
+        auto kind = read_pod<std::uint8_t>(data, pos);
+        if (kind > static_cast<std::uint8_t>(container_kind::run)
+            || (!result.containers_.empty()
+                && c.key <= result.containers_.back().key)
+            || c.key * chunk_bytes >= result.size_)
+        {
+            throw std::invalid_argument("Bad sparse bitmap container");
+        }
+        c.kind = static_cast<container_kind>(kind);
+        c.cardinality = read_pod<std::uint32_t>(data, pos);
+        auto value_count = read_pod<std::uint32_t>(data, pos);
+        if (value_count * sizeof(std::uint16_t) > data.size() - pos)
+        {
+            throw std::invalid_argument("Truncated sparse bitmap");
+        }
+        c.values.resize(value_count);
+        for (auto& value: c.values)
+        {
+            value = read_pod<std::uint16_t>(data, pos);
+        }
+        auto word_count = read_pod<std::uint32_t>(data, pos);
+        bool words_expected = c.kind == container_kind::bitmap;
+        if (word_count != (words_expected ? container_words : 0)
+            || (c.kind == container_kind::run && value_count % 2 != 0))
+        {
+            throw std::invalid_argument("Bad sparse bitmap container");
+        }
+        c.words.resize(word_count);
+        for (auto& word: c.words)
+        {
+            word = read_pod<std::uint64_t>(data, pos);
+        }
+        result.containers_.push_back(std::move(c));
+    }
+    if (pos != data.size())
+    {
+        throw std::invalid_argument("Trailing bytes after sparse bitmap");
+    }
+    result.recount_memory();
+    return result;
+}
+
+const sparse_bitmap::container* sparse_bitmap::find_container(
+    std::uint64_t key) const
+{
+    auto index = lower_bound(key);
+    if (index < containers_.size() && containers_[index].key == key)
+    {
+        return &containers_[index];
+    }
+    return nullptr;
+}
+
+std::size_t sparse_bitmap::lower_bound(std::uint64_t key) const
+{
+    return std::lower_bound(containers_.begin(), containers_.end(), key,
+        [](const container& c, std::uint64_t key)
+        {
+            return c.key < key;
+        }) - containers_.begin();
+}
+
+bool sparse_bitmap::container_get(const sparse_bitmap::container& c,
+    std::uint16_t position)
+{
+    switch (c.kind)
+    {
+    case container_kind::array:
+        return std::binary_search(c.values.begin(), c.values.end(), position);
+    case container_kind::bitmap:
+        return (c.words[position / 64] & bit_mask(position)) != 0;
+    default:
+    {
+        auto run = run_index(c.values, position);
+        return run >= 0 && position <= c.values[2 * run + 1];
+    }
+    }
+}
+
+bool sparse_bitmap::container_set(sparse_bitmap::container& c,
+    std::uint16_t position, bool value)
+{
+    bool old = container_get(c, position);
+    if (old == value)
+    {
+        return old;
+    }
+
+    switch (c.kind)
+    {
+    case container_kind::array:
+    {
+        auto it = std::lower_bound(c.values.begin(), c.values.end(),
+            position);
+        if (value)
+        {
+            c.values.insert(it, position);
+        }
+        else
+        {
+            c.values.erase(it);
+        }
+        break;
+    }
+    case container_kind::bitmap:
+        c.words[position / 64] ^= bit_mask(position);
+        break;
+    case container_kind::run:
+    {
+        auto& runs = c.values;
+        auto run = run_index(runs, position);
+        if (value)
+        {
+            // Joins the runs either side if the bit fills the gap between
+            // them, extends one of them if it touches it, or starts a run.
+            bool extends_previous = run >= 0
+                && runs[2 * run + 1] + 1 == position;
+            std::size_t next = run + 1;
+            bool extends_next = 2 * next < runs.size()
+                && runs[2 * next] == position + 1;
+            if (extends_previous && extends_next)
+            {
+                runs[2 * run + 1] = runs[2 * next + 1];
+                runs.erase(runs.begin() + 2 * next,
+                    runs.begin() + 2 * next + 2);
+            }
+            else if (extends_previous)
+            {
+                runs[2 * run + 1] = position;
+            }
+            else if (extends_next)
+            {
+                runs[2 * next] = position;
+            }
+            else
+            {
+                runs.insert(runs.begin() + 2 * next, {position, position});
+            }
+        }
+        else
+        {
+            auto& first = runs[2 * run];
+            auto& last = runs[2 * run + 1];
+            if (first == last)
+            {
+                runs.erase(runs.begin() + 2 * run, runs.begin() + 2 * run + 2);
+            }
+            else if (position == first)
+            {
+                first++;
+            }
+            else if (position == last)
+            {
+                last--;
+            }
+            else
+            {
+                // Split in two.
+                std::uint16_t old_last = last;
+                last = position - 1;
+                runs.insert(runs.begin() + 2 * run + 2,
+                    {static_cast<std::uint16_t>(position + 1), old_last});
+            }
+        }
+        break;
+    }
+    }
+
+    c.cardinality += value ? 1 : -1;
+    rebalance(c);
+    return old;
+}
+
+std::uint32_t sparse_bitmap::container_count(
+    const sparse_bitmap::container& c, std::uint32_t first,
+    std::uint32_t last)
+{
+    switch (c.kind)
+    {
+    case container_kind::array:
+        return std::upper_bound(c.values.begin(), c.values.end(), last)
+            - std::lower_bound(c.values.begin(), c.values.end(), first);
+    case container_kind::bitmap:
+    {
+        auto first_word = first / 64;
+        auto last_word = last / 64;
+        if (first_word == last_word)
+        {
+            return __builtin_popcountll(c.words[first_word]
+                & mask_from(first) & mask_to(last));
+        }
+        std::uint32_t total = __builtin_popcountll(
+            c.words[first_word] & mask_from(first))
+            + __builtin_popcountll(c.words[last_word] & mask_to(last));
+        // The whole words in between go through the vectorized kernel.
+        total += popcount(reinterpret_cast<const unsigned char*>(
+            c.words.data() + first_word + 1),
+            (last_word - first_word - 1) * sizeof(std::uint64_t));
+        return total;
+    }
+    default:
+    {
+        std::uint32_t total = 0;
+        for (std::size_t i = 0; i < c.values.size(); i += 2)
+        {
+            std::uint32_t from = std::max<std::uint32_t>(first, c.values[i]);
+            std::uint32_t to = std::min<std::uint32_t>(last, c.values[i + 1]);
+            if (from <= to)
+            {
+                total += to - from + 1;
+            }
+        }
+        return total;
+    }
+    }
+}
+
+long sparse_bitmap::container_find(const sparse_bitmap::container& c,
+    std::uint32_t first, std::uint32_t last, bool bit)
+{
+    std::uint32_t found = chunk_bits;
+    switch (c.kind)
+    {
+    case container_kind::array:
+    {
+        auto it = std::lower_bound(c.values.begin(), c.values.end(), first);
+        if (bit)
+        {
+            found = it == c.values.end() ? chunk_bits : *it;
+        }
+        else
+        {
+            // Step over the set bits that follow on from first.
+            found = first;
+            for (; it != c.values.end() && *it == found; it++)
+            {
+                found++;
+            }
+        }
+        break;
+    }
+    case container_kind::bitmap:
+    {
+        const std::uint64_t flip = bit ? 0 : ~std::uint64_t(0);
+        for (auto i = first / 64; i <= last / 64; i++)
+        {
+            auto word = c.words[i] ^ flip;
+            if (i == first / 64)
+            {
+                word &= mask_from(first);
+            }
+            if (word != 0)
+            {
+                found = i * 64 + __builtin_clzll(word);
+                break;
+            }
+        }
+        break;
+    }
+    case container_kind::run:
+    {
+        auto run = run_index(c.values, first);
+        bool inside = run >= 0 && first <= c.values[2 * run + 1];
+        if (bit)
+        {
+            std::size_t next = run + 1;
+            found = inside ? first : 2 * next < c.values.size()
+                ? c.values[2 * next] : chunk_bits;
+        }
+        else
+        {
+            // Runs never touch, so the bit after one is clear.
+            found = inside ? c.values[2 * run + 1] + 1 : first;
+        }
+        break;
+    }
+    }
+    return found <= last ? static_cast<long>(found) : -1;
+}
+
+void sparse_bitmap::to_words(const sparse_bitmap::container& c,
+    sparse_bitmap::word_block& words)
+{
+    if (c.kind == container_kind::bitmap)
+    {
+        std::copy(c.words.begin(), c.words.end(), words);
+        return;
+    }
+    std::fill(std::begin(words), std::end(words), 0);
+    if (c.kind == container_kind::array)
+    {
+        for (auto position: c.values)
+        {
+            words[position / 64] |= bit_mask(position);
+        }
+        return;
+    }
+    for (std::size_t i = 0; i < c.values.size(); i += 2)
+    {
+        std::uint32_t first = c.values[i];
+        std::uint32_t last = c.values[i + 1];
+        for (auto word = first / 64; word <= last / 64; word++)
+        {
+            auto mask = ~std::uint64_t(0);
+            if (word == first / 64)
+            {
+                mask &= mask_from(first);
+            }
+            if (word == last / 64)
+            {
+                mask &= mask_to(last);
+            }
+            words[word] |= mask;
+        }
+    }
+}
+
+sparse_bitmap::container sparse_bitmap::from_words(std::uint64_t key,
+    const sparse_bitmap::word_block& words)
+{
+    container c;
+    c.key = key;
+    c.cardinality = popcount(reinterpret_cast<const unsigned char*>(words),
+        sizeof(word_block));
+    if (c.cardinality > max_array_size)
+    {
+        c.kind = container_kind::bitmap;
+        c.words.assign(std::begin(words), std::end(words));
+        return c;
+    }
+
+    c.kind = container_kind::array;
+    c.values.reserve(c.cardinality);
+    for (std::size_t i = 0; i < container_words; i++)
+    {
+        for (auto word = words[i]; word != 0;
+            word &= ~bit_mask(__builtin_clzll(word)))
+        {
+            c.values.push_back(i * 64 + __builtin_clzll(word));
+        }
+    }
+    return c;
+}
+
+std::uint32_t sparse_bitmap::count_runs(
+    const sparse_bitmap::word_block& words)
+{
+    // A run starts at each set bit whose predecessor is clear. The bit
+    // before the top one of a word is the bottom one of the word before.
+    std::uint32_t runs = 0;
+    std::uint64_t carry = 0;
+    for (auto word: words)
+    {
+        runs += __builtin_popcountll(word & ~((word >> 1) | (carry << 63)));
+        carry = word & 1;
+    }
+    return runs;
+}
+
+void sparse_bitmap::rebalance(sparse_bitmap::container& c)
+{
+    bool convert = false;
+    switch (c.kind)
+    {
+    case container_kind::array:
+        convert = c.cardinality > max_array_size;
+        break;
+    case container_kind::bitmap:
+        convert = c.cardinality <= max_array_size;
+        break;
+    case container_kind::run:
+        // Two positions per run, against one per bit in an array.
+        convert = c.values.size() > std::min<std::size_t>(c.cardinality,
+            container_words * 4);
+        break;
+    }
+    if (convert && c.cardinality != 0)
+    {
+        word_block words;
+        to_words(c, words);
+        c = from_words(c.key, words);
+    }
+}
+
+std::size_t sparse_bitmap::container_memory(const sparse_bitmap::container& c)
+{
+    return allocation_size(c.values.capacity() * sizeof(std::uint16_t))
+        + allocation_size(c.words.capacity() * sizeof(std::uint64_t));
+}
+
+void sparse_bitmap::recount_memory()
+{
+    container_bytes_ = 0;
+    for (const auto& c: containers_)
+    {
+        container_bytes_ += container_memory(c);
+    }
+}
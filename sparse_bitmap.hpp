@@ -0,0 +1,141 @@
+#ifndef __EXOREDIS_SPARSE_BITMAP_HPP__
+#define __EXOREDIS_SPARSE_BITMAP_HPP__
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include "bitops.hpp"
+
+
+/*
+ * A compressed form of a string used as a bitmap, for strings whose bits are
+ * mostly clear. Bits are numbered as with GETBIT and SETBIT.
+ *
+ * The bits are split into chunks of 65536, and only chunks with set bits are
+ * stored, each in a container picked by how its bits are laid out (as in
+ * Roaring bitmaps):
+ * - an array container holds the sorted positions of its set bits, when
+ *   there are at most 4096 of them,
+ * - a bitmap container holds all 65536 bits, when there are more,
+ * - a run container holds runs of consecutive set bits, when that is smaller
+ *   than either. Runs are only looked for by optimize(), which is called
+ *   after bitmaps are built in bulk.
+ *
+ * The bitmap also remembers the length of the string it stands for, which
+ * may end in clear bits.
+ */
+class sparse_bitmap
+{
+public:
+    // Bits in each chunk.
+    static const std::uint64_t chunk_bits = 65536;
+
+    sparse_bitmap();
+    // Builds the bitmap of a string.
+    explicit sparse_bitmap(const std::vector<unsigned char>& bytes);
+
+    // Length in bytes of the string the bitmap stands for.
+    std::uint64_t size() const;
+
+    bool get(std::uint64_t bit) const;
+    // Sets or clears a bit, lengthening the string to include it if needed.
+    // Returns the old value of the bit.
+    bool set(std::uint64_t bit, bool value);
+
+    // Returns the number of set bits from first_bit to last_bit, inclusive.
+    std::uint64_t count(std::uint64_t first_bit, std::uint64_t last_bit) const;
+    // Returns the position of the first bit equal to bit from first_bit to
+    // last_bit, inclusive, or -1 if there is none.
+    long long find(std::uint64_t first_bit, std::uint64_t last_bit,
+        bool bit) const;
+    // Calls f with the position of each set bit, in order.
+    void for_each(std::function<void(std::uint64_t)> f) const;
+
+    // Returns the bytes of the string from start up to end.
+    std::vector<unsigned char> to_bytes(std::uint64_t start,
+        std::uint64_t end) const;
+    std::vector<unsigned char> to_bytes() const;
+
+    // Combines bitmaps with AND, OR or XOR, a chunk at a time. Missing
+    // chunks and the ends of shorter bitmaps count as clear bits. The result
+    // is as long as the longest bitmap.
+    static sparse_bitmap combine(bit_operation op,
+        const std::vector<const sparse_bitmap*>& sources);
+
+    // Switches containers to runs where that saves memory.
+    void optimize();
+
+    // Bytes allocated for the bitmap. Takes constant time.
+    std::size_t memory_usage() const;
+
+    // A compact serialization, for the snapshot. deserialize() throws
+    // std::invalid_argument if the data is malformed.
+    std::vector<unsigned char> serialize() const;
+    static sparse_bitmap deserialize(const std::vector<unsigned char>& data);
+
+private:
+    // Words of a bitmap container.
+    static const std::size_t container_words = chunk_bits / 64;
+    // Array containers hold at most this many positions.
+    static const std::size_t max_array_size = 4096;
+
+    enum class container_kind : std::uint8_t
+    {
+        array,
+        bitmap,
+        run
+    };
+
+    struct container
+    {
+        // Index of the chunk.
+        std::uint64_t key;
+        container_kind kind;
+        std::uint32_t cardinality;
+        // Sorted positions for an array, or the first and last position of
+        // each run for a run container.
+        std::vector<std::uint16_t> values;
+        // Bits of a bitmap container. The first bit of the chunk is the top
+        // bit of the first word, so that the words read as the bytes of the
+        // string once put in big-endian order.
+        std::vector<std::uint64_t> words;
+    };
+
+    typedef std::uint64_t word_block[container_words];
+
+    // The container of a chunk, or nullptr.
+    const container* find_container(std::uint64_t key) const;
+    // The index of the first container whose key isn't less than key.
+    std::size_t lower_bound(std::uint64_t key) const;
+
+    static bool container_get(const container& c, std::uint16_t position);
+    // Returns the old value of the bit.
+    static bool container_set(container& c, std::uint16_t position,
+        bool value);
+    static std::uint32_t container_count(const container& c,
+        std::uint32_t first, std::uint32_t last);
+    // The first position from first to last whose bit is bit, or -1.
+    static long container_find(const container& c, std::uint32_t first,
+        std::uint32_t last, bool bit);
+
+    static void to_words(const container& c, word_block& words);
+    // Builds a container from its bits, picking an array or a bitmap by how
+    // many are set. The cardinality is 0 if there are none.
+    static container from_words(std::uint64_t key, const word_block& words);
+    static std::uint32_t count_runs(const word_block& words);
+    // Switches an array or run container whose cardinality has crossed a
+    // threshold to the better encoding.
+    static void rebalance(container& c);
+    // Bytes allocated for the contents of a container.
+    static std::size_t container_memory(const container& c);
+    // Recomputes container_bytes_ after containers are rebuilt.
+    void recount_memory();
+
+    std::vector<container> containers_;
+    std::uint64_t size_;
+    // Sum of container_memory() over the containers.
+    std::size_t container_bytes_;
+};
+
+#endif
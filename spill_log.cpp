@@ -0,0 +1,405 @@
+#include "spill_log.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    // Compaction copies values in chunks of about this size.
+    const std::size_t copy_chunk_size = 1 << 20;
+    // Files with less garbage than this are not worth compacting.
+    const std::size_t min_compaction_garbage = 1 << 20;
+
+    std::string errno_string(const std::string& what)
+    {
+        return what + ": " + std::strerror(errno);
+    }
+
+    void write_all(int fd, const unsigned char* data, std::size_t size,
+        std::uint64_t offset)
+    {
+        while (size > 0)
+        {
+            auto written = ::pwrite(fd, data, size, offset);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw spill_log::spill_error(
+                    errno_string("Writing to the spill log failed"));
+            }
+            data += written;
+            size -= written;
+            offset += written;
+        }
+    }
+
+    void read_all(int fd, unsigned char* data, std::size_t size,
+        std::uint64_t offset)
+    {
+        while (size > 0)
+        {
+            auto got = ::pread(fd, data, size, offset);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                throw spill_log::spill_error(
+                    errno_string("Reading from the spill log failed"));
+            }
+            data += got;
+            size -= got;
+            offset += got;
+        }
+    }
+}
+
+// An open file. Reads on the worker thread hold on to the file they read
+// from, so it stays open even if compaction replaces it in the meantime.
+struct spill_log::file
+{
+    file(int fd) : fd(fd) {}
+
+    ~file()
+    {
+        ::close(fd);
+    }
+
+    int fd;
+};
+
+bool spill_log::location::operator==(const spill_log::location& other) const
+{
+    return generation == other.generation && offset == other.offset
+        && size == other.size;
+}
+
+spill_log::spill_log(std::string file_path)
+    : file_path_(file_path), generation_(0), flushed_size_(0), live_bytes_(0),
+      compacting_(false), stopping_(false), compaction_done_(false)
+{
+}
+
+spill_log::~spill_log()
+{
+    close();
+}
+
+void spill_log::open()
+{
+    int fd = ::open(file_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        throw spill_error(errno_string("Could not open " + file_path_));
+    }
+    file_ = std::make_shared<file>(fd);
+    generation_++;
+    flushed_size_ = 0;
+    live_bytes_ = 0;
+    pending_.clear();
+
+    stopping_ = false;
+    worker_ = std::thread(&spill_log::run_worker, this);
+}
+
+void spill_log::close()
+{
+    if (worker_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            jobs_.clear();
+        }
+        jobs_ready_.notify_one();
+        worker_.join();
+    }
+    compacting_ = false;
+    compaction_done_ = false;
+    compacted_file_.reset();
+    file_.reset();
+}
+
+spill_log::location spill_log::append(const std::vector<unsigned char>& value)
+{
+    if (compacting_)
+    {
+        throw spill_error("Can't append to the spill log while compacting");
+    }
+
+    location where{generation_, flushed_size_ + pending_.size(), value.size()};
+    pending_.insert(pending_.end(), value.begin(), value.end());
+    live_bytes_ += value.size();
+    return where;
+}
+
+void spill_log::flush()
+{
+    if (pending_.empty())
+    {
+        return;
+    }
+
+    try
+    {
+        write_all(file_->fd, pending_.data(), pending_.size(), flushed_size_);
+    }
+    catch (const spill_error&)
+    {
+        live_bytes_ -= pending_.size();
+        pending_.clear();
+        throw;
+    }
+    flushed_size_ += pending_.size();
+    pending_.clear();
+}
+
+std::vector<unsigned char> spill_log::read(
+    const spill_log::location& where) const
+{
+    if (where.generation != generation_
+        || where.offset + where.size > flushed_size_)
+    {
+        throw spill_error("Value is not in the spill log");
+    }
+
+    std::vector<unsigned char> data(where.size);
+    read_all(file_->fd, data.data(), data.size(), where.offset);
+    return data;
+}
+
+void spill_log::release(const spill_log::location& where)
+{
+    if (where.generation == generation_)
+    {
+        live_bytes_ -= where.size;
+    }
+}
+
+void spill_log::read_async(std::vector<spill_log::read_request> requests,
+    std::function<void()> on_done)
+{
+    auto from = file_;
+    auto generation = generation_;
+    auto limit = flushed_size_;
+    // The requests are moved into a shared pointer, since std::function
+    // needs a copyable job.
+    auto shared_requests = std::make_shared<std::vector<read_request>>(
+        std::move(requests));
+    submit([this, from, generation, limit, shared_requests, on_done]()
+    {
+        std::vector<read_result> results;
+        for (auto& request: *shared_requests)
+        {
+            read_result result;
+            result.key = std::move(request.key);
+            result.where = request.where;
+            result.ok = request.where.generation == generation
+                && request.where.offset + request.where.size <= limit;
+            if (result.ok)
+            {
+                try
+                {
+                    result.data.resize(request.where.size);
+                    read_all(from->fd, result.data.data(), result.data.size(),
+                        request.where.offset);
+                }
+                catch (const spill_error&)
+                {
+                    result.ok = false;
+                    result.data.clear();
+                }
+            }
+            results.push_back(std::move(result));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& result: results)
+            {
+                results_.push_back(std::move(result));
+            }
+        }
+        on_done();
+    });
+}
+
+std::vector<spill_log::read_result> spill_log::take_results()
+{
+    std::vector<read_result> results;
+    std::lock_guard<std::mutex> lock(mutex_);
+    results.swap(results_);
+    return results;
+}
+
+bool spill_log::compaction_due() const
+{
+    if (!file_ || compacting_)
+    {
+        return false;
+    }
+    auto garbage = flushed_size_ - live_bytes_;
+    return garbage >= min_compaction_garbage && garbage >= live_bytes_;
+}
+
+void spill_log::start_compaction(std::vector<spill_log::location> live)
+{
+    flush();
+    compacting_ = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        compaction_done_ = false;
+        compacted_file_.reset();
+        compacted_locations_.clear();
+    }
+
+    auto from = file_;
+    auto generation = generation_ + 1;
+    auto shared_live = std::make_shared<std::vector<location>>(
+        std::move(live));
+    submit([this, from, shared_live, generation]()
+    {
+        compact(from, std::move(*shared_live), generation);
+    });
+}
+
+void spill_log::compact(std::shared_ptr<spill_log::file> from,
+    std::vector<spill_log::location> live, std::uint64_t generation)
+{
+    const auto new_path = file_path_ + ".compact";
+    std::shared_ptr<file> to;
+    std::vector<location> new_locations;
+    try
+    {
+        int fd = ::open(new_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+        {
+            throw spill_error(errno_string("Could not open " + new_path));
+        }
+        to = std::make_shared<file>(fd);
+
+        std::vector<unsigned char> buffer;
+        std::uint64_t written = 0;
+        new_locations.reserve(live.size());
+        for (const auto& where: live)
+        {
+            if (where.generation != generation - 1)
+            {
+                throw spill_error("Value is not in the spill log");
+            }
+            new_locations.push_back(location{generation,
+                written + buffer.size(), where.size});
+            auto start = buffer.size();
+            buffer.resize(start + where.size);
+            read_all(from->fd, buffer.data() + start, where.size, where.offset);
+            if (buffer.size() >= copy_chunk_size)
+            {
+                write_all(to->fd, buffer.data(), buffer.size(), written);
+                written += buffer.size();
+                buffer.clear();
+            }
+        }
+        write_all(to->fd, buffer.data(), buffer.size(), written);
+    }
+    catch (const spill_error&)
+    {
+        to.reset();
+        new_locations.clear();
+        std::remove(new_path.c_str());
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    compacted_file_ = to;
+    compacted_locations_ = std::move(new_locations);
+    compaction_done_ = true;
+}
+
+bool spill_log::compacting() const
+{
+    return compacting_;
+}
+
+bool spill_log::finish_compaction(std::vector<spill_log::location>& new_locations)
+{
+    std::shared_ptr<file> compacted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!compacting_ || !compaction_done_)
+        {
+            return false;
+        }
+        compacted.swap(compacted_file_);
+        new_locations.swap(compacted_locations_);
+        compaction_done_ = false;
+    }
+    compacting_ = false;
+
+    const auto new_path = file_path_ + ".compact";
+    if (!compacted || std::rename(new_path.c_str(), file_path_.c_str()) != 0)
+    {
+        std::remove(new_path.c_str());
+        new_locations.clear();
+        return true;
+    }
+
+    // Reads still running against the old file keep it open.
+    file_ = compacted;
+    generation_++;
+    flushed_size_ = 0;
+    live_bytes_ = 0;
+    for (const auto& where: new_locations)
+    {
+        flushed_size_ += where.size;
+        live_bytes_ += where.size;
+    }
+    return true;
+}
+
+std::size_t spill_log::file_size() const
+{
+    return flushed_size_;
+}
+
+std::size_t spill_log::live_bytes() const
+{
+    return live_bytes_;
+}
+
+void spill_log::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    jobs_ready_.notify_one();
+}
+
+void spill_log::run_worker()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            jobs_ready_.wait(lock, [this]()
+            {
+                return stopping_ || !jobs_.empty();
+            });
+            if (stopping_)
+            {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        job();
+    }
+}
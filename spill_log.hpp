@@ -0,0 +1,136 @@
+#ifndef __EXOREDIS_SPILL_LOG_HPP__
+#define __EXOREDIS_SPILL_LOG_HPP__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+
+
+/*
+ * An append-structured file that cold values are moved to, so that they don't
+ * take up memory. Values are appended to the end of the file and are never
+ * modified. A value that is no longer needed is released, which leaves it in
+ * the file as garbage until the file is compacted.
+ *
+ * The file only backs up memory while the server runs: it is emptied when it
+ * is opened, and snapshots and the append-only log still hold every value.
+ *
+ * Reads and compaction can be done on a worker thread, so that the event loop
+ * doesn't wait on the disk. Everything else must be called from the thread
+ * that owns the log.
+ */
+class spill_log
+{
+public:
+    class spill_error: public std::runtime_error
+    {
+    public:
+        spill_error(std::string msg) : runtime_error(msg) {}
+    };
+
+    // Where a value is in the log. The generation changes whenever the log
+    // is compacted, since compacting moves values around.
+    struct location
+    {
+        std::uint64_t generation;
+        std::uint64_t offset;
+        std::uint64_t size;
+
+        bool operator==(const location& other) const;
+    };
+
+    struct read_request
+    {
+        std::vector<unsigned char> key;
+        location where;
+    };
+
+    struct read_result
+    {
+        std::vector<unsigned char> key;
+        location where;
+        std::vector<unsigned char> data;
+        bool ok;
+    };
+
+    spill_log(std::string file_path);
+    ~spill_log();
+
+    spill_log(const spill_log&) = delete;
+    spill_log& operator=(const spill_log&) = delete;
+
+    // Creates or empties the file and starts the worker thread.
+    void open();
+    void close();
+
+    // Appends a value. Values are buffered until flush() is called, and can't
+    // be read before then.
+    location append(const std::vector<unsigned char>& value);
+    // Writes out buffered values. If this throws, they are dropped.
+    void flush();
+    // Reads a value on the calling thread.
+    std::vector<unsigned char> read(const location& where) const;
+    // Marks a value as garbage.
+    void release(const location& where);
+
+    // Reads values on the worker thread, then calls on_done from the worker
+    // thread. The values are then collected with take_results().
+    void read_async(std::vector<read_request> requests,
+        std::function<void()> on_done);
+    std::vector<read_result> take_results();
+
+    // True once at least half of the file is garbage.
+    bool compaction_due() const;
+    // Copies the given live values to a new file on the worker thread.
+    // Nothing can be appended until the compaction has finished.
+    void start_compaction(std::vector<location> live);
+    bool compacting() const;
+    // Returns false while the compaction is running. Otherwise, the new file
+    // is put in place and new_locations is filled with the new locations of
+    // the live values, in the order they were given. If the compaction
+    // failed, the old file stays in place and new_locations is left empty.
+    bool finish_compaction(std::vector<location>& new_locations);
+
+    std::size_t file_size() const;
+    // Bytes held by values that haven't been released.
+    std::size_t live_bytes() const;
+
+private:
+    struct file;
+
+    void run_worker();
+    void submit(std::function<void()> job);
+    // Runs on the worker thread.
+    void compact(std::shared_ptr<file> from, std::vector<location> live,
+        std::uint64_t generation);
+
+    std::string file_path_;
+    std::shared_ptr<file> file_;
+    std::uint64_t generation_;
+    // End of the values written to the file.
+    std::uint64_t flushed_size_;
+    std::vector<unsigned char> pending_;
+    std::size_t live_bytes_;
+    bool compacting_;
+
+    // Shared with the worker thread.
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable jobs_ready_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_;
+    std::vector<read_result> results_;
+    bool compaction_done_;
+    std::shared_ptr<file> compacted_file_;
+    std::vector<location> compacted_locations_;
+};
+
+#endif
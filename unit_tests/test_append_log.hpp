@@ -0,0 +1,205 @@
+#ifndef __TEST_APPEND_LOG_HPP__
+#define __TEST_APPEND_LOG_HPP__
+
+#include <vector>
+#include <cstdio>
+#include <fstream>
+
+#include "../append_log.hpp"
+#include "../exostore.hpp"
+#include "../util.hpp"
+
+struct log_fixture
+{
+public:
+    log_fixture() : path("test.aof")
+    {
+        std::remove(path.c_str());
+        c1 = {string_to_vec("SET"), string_to_vec("key"), string_to_vec("value")};
+        c2 = {string_to_vec("ZADD"), string_to_vec("zkey"), string_to_vec("1.5"),
+            string_to_vec("member")};
+    }
+
+    ~log_fixture()
+    {
+        std::remove(path.c_str());
+    }
+
+    std::vector<append_log::command> replay_all()
+    {
+        std::vector<append_log::command> commands;
+        append_log::replay(path, [&commands](const append_log::command& cmd)
+        {
+            commands.push_back(cmd);
+        });
+        return commands;
+    }
+
+    std::string path;
+    append_log::command c1, c2;
+};
+
+BOOST_FIXTURE_TEST_CASE(test_append_log_replay, log_fixture)
+{
+    {
+        append_log log(path, 100, 0);
+        log.open();
+        log.append(c1);
+        log.append(c2);
+    }
+
+    auto commands = replay_all();
+    BOOST_CHECK_EQUAL(commands.size(), 2);
+    BOOST_CHECK(commands[0] == c1);
+    BOOST_CHECK(commands[1] == c2);
+
+    // Reopening appends to the existing log.
+    append_log log(path, 100, 0);
+    log.open();
+    log.append(c1);
+    log.close();
+    BOOST_CHECK_EQUAL(replay_all().size(), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_append_log_truncated, log_fixture)
+{
+    {
+        append_log log(path, 100, 0);
+        log.open();
+        log.append(c1);
+    }
+
+    // Simulate a crash in the middle of writing a command.
+    std::vector<unsigned char> partial;
+    append_log::write_command(partial, c2);
+    partial.resize(partial.size() - 3);
+    {
+        std::ofstream out(path, std::ofstream::binary|std::ofstream::app);
+        out.write(reinterpret_cast<const char*>(partial.data()), partial.size());
+    }
+
+    auto commands = replay_all();
+    BOOST_CHECK_EQUAL(commands.size(), 1);
+    BOOST_CHECK(commands[0] == c1);
+
+    // The partial command has been cut off, so new commands are readable.
+    append_log log(path, 100, 0);
+    log.open();
+    log.append(c2);
+    log.close();
+    commands = replay_all();
+    BOOST_CHECK_EQUAL(commands.size(), 2);
+    BOOST_CHECK(commands[1] == c2);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_append_log_corrupt_count, log_fixture)
+{
+    {
+        append_log log(path, 100, 0);
+        log.open();
+        log.append(c1);
+    }
+
+    // A token count too big for the rest of the file, followed by a valid
+    // command, is rejected rather than cut off along with the command.
+    std::vector<unsigned char> garbage(sizeof(std::size_t), 0xff);
+    append_log::write_command(garbage, c2);
+    {
+        std::ofstream out(path, std::ofstream::binary|std::ofstream::app);
+        out.write(reinterpret_cast<const char*>(garbage.data()), garbage.size());
+    }
+    auto file_size = [this]()
+    {
+        std::ifstream in(path, std::ifstream::binary|std::ifstream::ate);
+        return static_cast<std::size_t>(in.tellg());
+    };
+    auto size_before = file_size();
+    BOOST_CHECK_THROW(replay_all(), append_log::log_error);
+    BOOST_CHECK_EQUAL(file_size(), size_before);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_append_log_rewrite, log_fixture)
+{
+    append_log log(path, 100, 0);
+    log.open();
+    for (int i = 0; i < 10; i++)
+    {
+        log.append(c1);
+    }
+    BOOST_CHECK(log.rewrite_due());
+
+    log.begin_rewrite();
+    BOOST_CHECK(!log.rewrite_due());
+    std::vector<unsigned char> rewritten;
+    append_log::write_header(rewritten);
+    append_log::write_command(rewritten, c1);
+    {
+        std::ofstream out(log.rewrite_path(), std::ofstream::binary);
+        out.write(reinterpret_cast<const char*>(rewritten.data()),
+            rewritten.size());
+    }
+    // Commands appended during the rewrite end up in the new log.
+    log.append(c2);
+    log.end_rewrite(true);
+    BOOST_CHECK(!append_log::exists(log.rewrite_path()));
+    BOOST_CHECK(!log.rewrite_due());
+
+    log.append(c1);
+    log.close();
+    auto commands = replay_all();
+    BOOST_CHECK_EQUAL(commands.size(), 3);
+    BOOST_CHECK(commands[0] == c1);
+    BOOST_CHECK(commands[1] == c2);
+    BOOST_CHECK(commands[2] == c1);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_append_log_rewrite_failure, log_fixture)
+{
+    append_log log(path, 100, 0);
+    log.open();
+    for (int i = 0; i < 10; i++)
+    {
+        log.append(c1);
+    }
+    BOOST_CHECK(log.rewrite_due());
+
+    // A failed rewrite isn't retried straight away, and leaves the log as it
+    // was.
+    log.begin_rewrite();
+    log.end_rewrite(false);
+    BOOST_CHECK(!log.rewrite_due());
+    log.close();
+    BOOST_CHECK_EQUAL(replay_all().size(), 10);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_write_log, log_fixture)
+{
+    exostore db("test.erdb");
+    db.set(string_to_vec("key"), exostore::bstring(string_to_vec("value")));
+    exostore::zset zset;
+    zset.add(string_to_vec("m1"), 1.0);
+    zset.add(string_to_vec("m2"), 2.0);
+    db.set(string_to_vec("zkey"), zset);
+    db.write_log(path);
+
+    auto commands = replay_all();
+    BOOST_CHECK_EQUAL(commands.size(), 3);
+    std::size_t sets = 0, zadds = 0;
+    for (const auto& cmd: commands)
+    {
+        if (vec_to_string(cmd[0]) == "SET")
+        {
+            sets++;
+            BOOST_CHECK(cmd == c1);
+        }
+        else if (vec_to_string(cmd[0]) == "ZADD")
+        {
+            zadds++;
+            BOOST_CHECK_EQUAL(cmd.size(), 4);
+        }
+    }
+    BOOST_CHECK_EQUAL(sets, 1);
+    BOOST_CHECK_EQUAL(zadds, 2);
+}
+
+#endif
@@ -28,4 +28,30 @@ BOOST_AUTO_TEST_CASE(test_bstring_with_expiry)
     BOOST_CHECK_EQUAL(contents, vec_to_string(bstr.bdata()));
 }
 
+BOOST_AUTO_TEST_CASE(test_bstring_integer)
+{
+    auto bstr = binary_string(string_to_vec("-1234"), 10000);
+    BOOST_CHECK(bstr.is_integer());
+    BOOST_CHECK_EQUAL(bstr.integer(), -1234);
+    BOOST_CHECK_EQUAL(bstr.capacity(), 0);
+    BOOST_CHECK_EQUAL(bstr.size(), 5);
+    BOOST_CHECK_EQUAL(vec_to_string(bstr.bytes()), "-1234");
+
+    bstr.set_integer(99);
+    BOOST_CHECK_EQUAL(vec_to_string(bstr.bytes()), "99");
+    BOOST_CHECK(bstr.has_expiry());
+
+    // Changing the bytes converts it for good.
+    bstr.bdata().push_back('9');
+    BOOST_CHECK(!bstr.is_integer());
+    BOOST_CHECK_EQUAL(vec_to_string(bstr.bytes()), "999");
+
+    bstr.set_bytes(string_to_vec("12"));
+    BOOST_CHECK(bstr.is_integer());
+    bstr.set_bytes(string_to_vec("012"));
+    BOOST_CHECK(!bstr.is_integer());
+    BOOST_CHECK_EQUAL(vec_to_string(bstr.bdata()), "012");
+    BOOST_CHECK(bstr.has_expiry());
+}
+
 #endif
@@ -0,0 +1,243 @@
+#ifndef __TEST_BITOPS_HPP__
+#define __TEST_BITOPS_HPP__
+
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <limits>
+
+#include "../bitops.hpp"
+
+namespace
+{
+    bool bit_at(const std::vector<unsigned char>& data, std::uint64_t i)
+    {
+        return (data[i / 8] >> (7 - i % 8)) & 1;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_bitops_kernels)
+{
+    std::mt19937 random(42);
+    std::vector<unsigned char> data(1000);
+    for (auto& byte: data)
+    {
+        byte = random();
+    }
+
+    // Every level agrees with a byte at a time count, at every length and
+    // alignment around the vector widths.
+    for (std::size_t offset = 0; offset < 33; offset++)
+    {
+        for (std::size_t size = 0; offset + size <= data.size(); size += 7)
+        {
+            std::uint64_t expected = 0;
+            for (std::size_t i = offset; i < offset + size; i++)
+            {
+                expected += __builtin_popcount(data[i]);
+            }
+            for (auto level: {simd_level::portable, simd_level::sse42,
+                simd_level::avx2})
+            {
+                BOOST_CHECK_EQUAL(popcount(data.data() + offset, size, level),
+                    expected);
+            }
+        }
+    }
+
+    // A run of skipped bytes is found to end at the first other byte.
+    std::vector<unsigned char> run(300, 0xff);
+    for (std::size_t end = 0; end <= run.size(); end++)
+    {
+        if (end < run.size())
+        {
+            run[end] = 0xfe;
+        }
+        for (auto level: {simd_level::portable, simd_level::sse42,
+            simd_level::avx2})
+        {
+            BOOST_CHECK_EQUAL(find_byte_not(run.data(), run.size(), 0xff,
+                level), end);
+        }
+        if (end < run.size())
+        {
+            run[end] = 0xff;
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_bitops_combine)
+{
+    std::mt19937 random(3);
+    // Lengths either side of the vector widths, so that every stretch of
+    // sources is worked on partly by the vector loops and partly a byte at a
+    // time.
+    std::vector<std::vector<unsigned char>> buffers;
+    for (auto size: {0, 5, 40, 100, 131})
+    {
+        std::vector<unsigned char> buffer(size);
+        for (auto& byte: buffer)
+        {
+            byte = random();
+        }
+        buffers.push_back(buffer);
+    }
+    std::vector<bit_source> sources;
+    for (const auto& buffer: buffers)
+    {
+        sources.push_back({buffer.data(), buffer.size()});
+    }
+
+    const std::size_t size = 131;
+    auto padded = [&](std::size_t j, std::size_t i)
+    {
+        return i < buffers[j].size() ? buffers[j][i] : 0;
+    };
+    for (auto op: {bit_operation::bitwise_and, bit_operation::bitwise_or,
+        bit_operation::bitwise_xor})
+    {
+        std::vector<unsigned char> expected(size);
+        for (std::size_t i = 0; i < size; i++)
+        {
+            // Leave out the empty source, which would make AND all zeros.
+            unsigned char byte = padded(1, i);
+            for (std::size_t j = 2; j < buffers.size(); j++)
+            {
+                byte = op == bit_operation::bitwise_and ? byte & padded(j, i)
+                    : op == bit_operation::bitwise_or ? byte | padded(j, i)
+                    : byte ^ padded(j, i);
+            }
+            expected[i] = byte;
+        }
+        std::vector<bit_source> nonempty(sources.begin() + 1, sources.end());
+        for (auto level: {simd_level::portable, simd_level::sse42,
+            simd_level::avx2})
+        {
+            std::vector<unsigned char> result(size, 0x55);
+            combine_bits(op, nonempty, result.data(), size, level);
+            BOOST_CHECK(result == expected);
+        }
+
+        std::vector<unsigned char> result(size, 0x55);
+        combine_bits(op, sources, result.data(), size);
+        if (op == bit_operation::bitwise_and)
+        {
+            BOOST_CHECK(result == std::vector<unsigned char>(size, 0));
+        }
+        else
+        {
+            BOOST_CHECK(result == expected);
+        }
+    }
+
+    // NOT, in place.
+    auto inverted = buffers[4];
+    for (auto& byte: inverted)
+    {
+        byte = ~byte;
+    }
+    for (auto level: {simd_level::portable, simd_level::sse42,
+        simd_level::avx2})
+    {
+        auto buffer = buffers[4];
+        combine_bits(bit_operation::bitwise_not, {{buffer.data(), size}},
+            buffer.data(), size, level);
+        BOOST_CHECK(buffer == inverted);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_bitops_ranges)
+{
+    std::mt19937 random(7);
+    std::vector<unsigned char> data(200);
+    for (auto& byte: data)
+    {
+        byte = random();
+    }
+    // Long runs of each bit, so that searches skip whole bytes.
+    std::fill(data.begin() + 20, data.begin() + 100, 0);
+    std::fill(data.begin() + 120, data.begin() + 190, 0xff);
+
+    const std::uint64_t bits = data.size() * 8;
+    for (int trial = 0; trial < 2000; trial++)
+    {
+        std::uint64_t first = random() % bits;
+        std::uint64_t last = first + random() % (bits - first);
+
+        std::uint64_t expected_count = 0;
+        long long expected_set = -1, expected_clear = -1;
+        for (auto i = first; i <= last; i++)
+        {
+            if (bit_at(data, i))
+            {
+                expected_count++;
+                if (expected_set == -1)
+                {
+                    expected_set = i;
+                }
+            }
+            else if (expected_clear == -1)
+            {
+                expected_clear = i;
+            }
+        }
+        BOOST_CHECK_EQUAL(count_bits(data.data(), first, last),
+            expected_count);
+        BOOST_CHECK_EQUAL(find_bit(data.data(), first, last, true),
+            expected_set);
+        BOOST_CHECK_EQUAL(find_bit(data.data(), first, last, false),
+            expected_clear);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_bitops_fields)
+{
+    // Fields straddle bytes and read past the end as zeros.
+    std::vector<unsigned char> data(4, 0);
+    set_field(data.data(), 5, 7, 0x55);
+    BOOST_CHECK_EQUAL(data[0], 0x05);
+    BOOST_CHECK_EQUAL(data[1], 0x50);
+    BOOST_CHECK_EQUAL(get_field(data.data(), data.size(), 5, 7), 0x55u);
+    BOOST_CHECK_EQUAL(get_field(data.data(), 1, 5, 7), 0x50u);
+    set_field(data.data(), 0, 32, 0xdeadbeef);
+    BOOST_CHECK_EQUAL(get_field(data.data(), data.size(), 0, 32),
+        0xdeadbeefu);
+    BOOST_CHECK_EQUAL(get_field(data.data(), data.size(), 0, 64),
+        0xdeadbeef00000000u);
+    BOOST_CHECK_EQUAL(sign_extend(0xf, 4), -1);
+    BOOST_CHECK_EQUAL(sign_extend(0x7, 4), 7);
+    BOOST_CHECK_EQUAL(sign_extend(0x8000000000000000u, 64),
+        std::numeric_limits<long long>::min());
+
+    long long result = 0;
+    BOOST_CHECK(add_to_field(250, 10, false, 8, field_overflow::wrap, result));
+    BOOST_CHECK_EQUAL(result, 4);
+    BOOST_CHECK(add_to_field(250, 10, false, 8, field_overflow::sat, result));
+    BOOST_CHECK_EQUAL(result, 255);
+    BOOST_CHECK(!add_to_field(250, 10, false, 8, field_overflow::fail,
+        result));
+    BOOST_CHECK(add_to_field(3, -5, false, 8, field_overflow::sat, result));
+    BOOST_CHECK_EQUAL(result, 0);
+    BOOST_CHECK(add_to_field(-100, 0, false, 8, field_overflow::wrap,
+        result));
+    BOOST_CHECK_EQUAL(result, 156);
+
+    BOOST_CHECK(add_to_field(7, 1, true, 4, field_overflow::wrap, result));
+    BOOST_CHECK_EQUAL(result, -8);
+    BOOST_CHECK(add_to_field(-8, -1, true, 4, field_overflow::sat, result));
+    BOOST_CHECK_EQUAL(result, -8);
+    BOOST_CHECK(add_to_field(-8, 15, true, 4, field_overflow::fail, result));
+    BOOST_CHECK_EQUAL(result, 7);
+
+    const auto max = std::numeric_limits<long long>::max();
+    BOOST_CHECK(add_to_field(max, 1, true, 64, field_overflow::wrap, result));
+    BOOST_CHECK_EQUAL(result, std::numeric_limits<long long>::min());
+    BOOST_CHECK(add_to_field(max, max, true, 64, field_overflow::sat,
+        result));
+    BOOST_CHECK_EQUAL(result, max);
+    BOOST_CHECK(add_to_field(max - 1, 5, false, 63, field_overflow::wrap,
+        result));
+    BOOST_CHECK_EQUAL(result, 3);
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef __TEST_CONFIG_HPP__
+#define __TEST_CONFIG_HPP__
+
+#include <vector>
+#include <string>
+
+#include "../config.hpp"
+
+BOOST_AUTO_TEST_CASE(test_config_defaults)
+{
+    auto config = server_config::from_args({"db.erdb"});
+    BOOST_CHECK_EQUAL(config.db_path, "db.erdb");
+    BOOST_CHECK(config.log_path.empty());
+    BOOST_CHECK_EQUAL(config.log_rewrite_percentage, 100);
+    BOOST_CHECK(config.save_policies.empty());
+    BOOST_CHECK(!config.async_load);
+    BOOST_CHECK(config.mapped_path.empty());
+    BOOST_CHECK_EQUAL(config.max_memory, 0);
+    BOOST_CHECK_EQUAL(config.max_memory_policy, "noeviction");
+    BOOST_CHECK(!config.active_defrag);
+    BOOST_CHECK_EQUAL(config.active_defrag_threshold, 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_config_options)
+{
+    auto config = server_config::from_args({"db.erdb", "--appendonly",
+        "db.aof", "--aof-rewrite-percentage", "50",
+        "--aof-rewrite-min-size", "1024", "--load-threads", "8",
+        "--async-load", "yes"});
+    BOOST_CHECK(config.async_load);
+    BOOST_CHECK_EQUAL(config.load_threads, 8);
+
+    BOOST_CHECK_EQUAL(config.log_path, "db.aof");
+    BOOST_CHECK_EQUAL(config.log_rewrite_percentage, 50);
+    BOOST_CHECK_EQUAL(config.log_rewrite_min_size, 1024);
+
+    config = server_config::from_args({"db.erdb", "--save", "900:1",
+        "--save", "60:10000"});
+    BOOST_CHECK_EQUAL(config.save_policies.size(), 2);
+    BOOST_CHECK_EQUAL(config.save_policies[0].seconds, 900);
+    BOOST_CHECK_EQUAL(config.save_policies[0].changes, 1);
+    BOOST_CHECK_EQUAL(config.save_policies[1].seconds, 60);
+    BOOST_CHECK_EQUAL(config.save_policies[1].changes, 10000);
+
+    config = server_config::from_args({"db.erdb", "--mapped-file", "db.map"});
+    BOOST_CHECK_EQUAL(config.mapped_path, "db.map");
+
+    config = server_config::from_args({"db.erdb", "--spill-file", "db.spill",
+        "--spill-after", "60", "--spill-min-size", "128"});
+    BOOST_CHECK_EQUAL(config.spill_path, "db.spill");
+    BOOST_CHECK_EQUAL(config.spill_idle_seconds, 60);
+    BOOST_CHECK_EQUAL(config.spill_min_size, 128);
+
+    config = server_config::from_args({"db.erdb", "--maxmemory", "1048576",
+        "--maxmemory-policy", "allkeys-lru", "--maxmemory-samples", "10"});
+    BOOST_CHECK_EQUAL(config.max_memory, 1048576);
+    BOOST_CHECK_EQUAL(config.max_memory_policy, "allkeys-lru");
+    BOOST_CHECK_EQUAL(config.max_memory_samples, 10);
+
+    config = server_config::from_args({"db.erdb", "--activedefrag", "yes",
+        "--active-defrag-threshold", "20",
+        "--active-defrag-ignore-bytes", "1048576"});
+    BOOST_CHECK(config.active_defrag);
+    BOOST_CHECK_EQUAL(config.active_defrag_threshold, 20);
+    BOOST_CHECK_EQUAL(config.active_defrag_ignore_bytes, 1048576);
+
+    config = server_config::from_args({"db.erdb", "--pubsub-output-limit",
+        "1000:500:10"});
+    BOOST_CHECK_EQUAL(config.pubsub_hard_limit, 1000);
+    BOOST_CHECK_EQUAL(config.pubsub_soft_limit, 500);
+    BOOST_CHECK_EQUAL(config.pubsub_soft_seconds, 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_config_errors)
+{
+    BOOST_CHECK_THROW(server_config::from_args({}),
+        server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb", "--appendonly"}),
+        server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb", "--nonsense", "1"}),
+        server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb",
+        "--aof-rewrite-percentage", "lots"}), server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb", "--save", "900"}),
+        server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb", "--async-load",
+        "maybe"}), server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb", "--appendonly",
+        "db.aof", "--mapped-file", "db.map"}), server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb", "--mapped-file",
+        "db.map", "--spill-file", "db.spill"}), server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb",
+        "--maxmemory-policy", "allkeys-random"}), server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb", "--activedefrag",
+        "1"}), server_config::config_error);
+    BOOST_CHECK_THROW(server_config::from_args({"db.erdb",
+        "--pubsub-output-limit", "1000:500"}), server_config::config_error);
+}
+
+#endif
@@ -4,6 +4,12 @@
 #include <vector>
 #include <thread>
 #include <chrono>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <atomic>
+#include <map>
+#include <limits>
 
 #include "../exostore.hpp"
 #include "../util.hpp"
@@ -111,4 +117,379 @@ BOOST_FIXTURE_TEST_CASE(test_exostore_load_save, exo_fixture)
     BOOST_CHECK(zset.contains_element_score(d3, 3.0));
 }
 
+BOOST_FIXTURE_TEST_CASE(test_exostore_dirty, exo_fixture)
+{
+    BOOST_CHECK_EQUAL(db.dirty(), 3);
+    db.save();
+    BOOST_CHECK_EQUAL(db.dirty(), 0);
+    db.get<exostore::zset>(k3).add(d1, 5.0);
+    db.touch(k3);
+    BOOST_CHECK_EQUAL(db.dirty(), 1);
+
+    BOOST_CHECK(db.save_in_background());
+    BOOST_CHECK(!db.save_in_background());
+    // Changes made during the save are not covered by it.
+    db.set(k1, exostore::bstring(d2));
+    while (db.background_job_running())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        db.check_background_job();
+    }
+    BOOST_CHECK_EQUAL(db.dirty(), 1);
+
+    exostore new_db("test.erdb");
+    new_db.load();
+    BOOST_CHECK(new_db.get<exostore::zset>(k3).contains_element_score(d1, 5.0));
+    BOOST_CHECK(new_db.get<exostore::bstring>(k1).bdata() == d1);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_remove, exo_fixture)
+{
+    BOOST_CHECK(db.remove(k1));
+    BOOST_CHECK(!db.remove(k1));
+    BOOST_CHECK(!db.key_exists(k1));
+    BOOST_CHECK(db.remove(k3));
+    BOOST_CHECK(!db.key_exists(k3));
+    BOOST_CHECK(db.key_exists(k2));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_used_memory, exo_fixture)
+{
+    const auto initial = db.used_memory();
+    BOOST_CHECK(initial > 0);
+
+    auto key = string_to_vec("big");
+    db.set(key, exostore::bstring(std::vector<unsigned char>(10000)));
+    BOOST_CHECK(db.used_memory() >= initial + 10000);
+
+    // Modifying a value in place is accounted for by touch().
+    auto& zset = db.get<exostore::zset>(k3);
+    const auto before_add = db.used_memory();
+    zset.add(std::vector<unsigned char>(1000, 'm'), 4.0);
+    db.touch(k3);
+    BOOST_CHECK(db.used_memory() >= before_add + 1000);
+
+    db.remove(key);
+    db.remove(k3);
+    db.remove(k1);
+    db.remove(k2);
+    auto stats = db.memory_statistics();
+    BOOST_CHECK_EQUAL(stats.keys, 0);
+    BOOST_CHECK_EQUAL(stats.strings, 0);
+    BOOST_CHECK_EQUAL(stats.zsets, 0);
+    // Only the bucket array is left.
+    BOOST_CHECK_EQUAL(db.used_memory(), stats.keyspace_overhead);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_memory_usage, exo_fixture)
+{
+    BOOST_CHECK_THROW(db.memory_usage(string_to_vec("missing")),
+        exostore::key_error);
+
+    BOOST_CHECK(db.memory_usage(k1) < 1000);
+    db.set(k1, exostore::bstring(std::vector<unsigned char>(10000)));
+    BOOST_CHECK(db.memory_usage(k1) > 10000);
+
+    // The per-type totals add up to the used memory.
+    auto stats = db.memory_statistics();
+    BOOST_CHECK_EQUAL(stats.keys, 3);
+    BOOST_CHECK_EQUAL(stats.keyspace_overhead + stats.strings + stats.zsets
+        + stats.hashes + stats.spilled_strings, db.used_memory());
+    BOOST_CHECK(stats.strings > 10000);
+    BOOST_CHECK(stats.zsets > 0);
+
+    auto& zset = db.get<exostore::zset>(k3);
+    auto zset_before = db.memory_usage(k3);
+    zset.add(std::vector<unsigned char>(1000, 'm'), 4.0);
+    db.touch(k3);
+    BOOST_CHECK(db.memory_usage(k3) >= zset_before + 1000);
+    BOOST_CHECK_EQUAL(db.memory_statistics().zsets - stats.zsets,
+        db.memory_usage(k3) - zset_before);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_eviction, exo_fixture)
+{
+    // Without eviction, writes are refused once over the limit.
+    db.set_memory_limit(1, exostore::eviction_policy::noeviction, 5);
+    BOOST_CHECK(!db.make_room());
+    BOOST_CHECK(db.key_exists(k1));
+
+    // The key that expires first goes first.
+    auto k4 = string_to_vec("expires later");
+    auto k5 = string_to_vec("expires sooner");
+    db.set(k4, exostore::bstring(d1, 100000));
+    db.set(k5, exostore::bstring(d1, 10000));
+    db.set_memory_limit(db.used_memory() - 1,
+        exostore::eviction_policy::volatile_ttl, 16);
+    BOOST_CHECK(db.make_room());
+    BOOST_CHECK(!db.key_exists(k5));
+    BOOST_CHECK(db.key_exists(k4));
+    BOOST_CHECK_EQUAL(db.evicted_keys(), 1);
+
+    // Only keys with an expiry time can be evicted.
+    db.set_memory_limit(1, exostore::eviction_policy::volatile_lru, 16);
+    BOOST_CHECK(db.make_room());
+    BOOST_CHECK(!db.key_exists(k4));
+    BOOST_CHECK(!db.make_room());
+    BOOST_CHECK(db.key_exists(k1));
+
+    // The least recently used key goes first.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    db.get<exostore::bstring>(k2);
+    db.get<exostore::zset>(k3);
+    db.set_memory_limit(db.used_memory() - 1,
+        exostore::eviction_policy::allkeys_lru, 16);
+    BOOST_CHECK(db.make_room());
+    BOOST_CHECK(!db.key_exists(k1));
+    BOOST_CHECK(db.key_exists(k2));
+    BOOST_CHECK(db.key_exists(k3));
+
+    db.set_memory_limit(1, exostore::eviction_policy::allkeys_lfu, 16);
+    BOOST_CHECK(db.make_room());
+    BOOST_CHECK_EQUAL(db.memory_statistics().keys, 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_scan, exo_fixture)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        db.set(string_to_vec("key" + std::to_string(i)),
+            exostore::bstring(d1));
+    }
+    db.set(string_to_vec("expired"), exostore::bstring(d1,
+        std::chrono::system_clock::now() - std::chrono::seconds(1)));
+
+    // Keys present throughout are seen even though the table grows part way
+    // through the scan.
+    std::map<std::string, std::string> seen;
+    std::uint64_t cursor = 0;
+    int calls = 0;
+    do
+    {
+        cursor = db.scan(cursor, 10, [&seen](
+            const std::vector<unsigned char>& key, const std::string& type)
+        {
+            seen[vec_to_string(key)] = type;
+        });
+        if (++calls == 10)
+        {
+            for (int i = 1000; i < 10000; i++)
+            {
+                db.set(string_to_vec("key" + std::to_string(i)),
+                    exostore::bstring(d1));
+            }
+        }
+    } while (cursor != 0);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        BOOST_CHECK(seen.count("key" + std::to_string(i)) == 1);
+    }
+    BOOST_CHECK_EQUAL(seen[vec_to_string(k1)], "string");
+    BOOST_CHECK_EQUAL(seen[vec_to_string(k3)], "zset");
+    BOOST_CHECK(seen.count("expired") == 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_defrag, exo_fixture)
+{
+    // Nothing happens until enabled, or while there is little waste.
+    BOOST_CHECK(!db.defrag_step());
+    db.set_active_defrag(true, 10, std::size_t(1) << 40);
+    BOOST_CHECK(!db.defrag_step());
+
+    // Keys and sorted sets created together, most of them then removed.
+    exostore::zset big;
+    for (int i = 0; i < 20000; i++)
+    {
+        db.set(string_to_vec("key" + std::to_string(i)),
+            exostore::bstring(d1));
+        big.add(string_to_vec(std::to_string(i)), i);
+    }
+    db.set(string_to_vec("big"), std::move(big));
+    for (int i = 0; i < 20000; i++)
+    {
+        if (i % 4 != 0)
+        {
+            db.remove(string_to_vec("key" + std::to_string(i)));
+        }
+    }
+    const auto memory = db.used_memory();
+
+    // A cycle runs a step at a time and then stops.
+    db.set_active_defrag(true, 0, 0);
+    int steps = 0;
+    while (db.defrag_step())
+    {
+        BOOST_CHECK(db.defrag_running());
+        steps++;
+    }
+    BOOST_CHECK(steps > 1);
+    BOOST_CHECK_EQUAL(db.defrag_cycles(), 1);
+    BOOST_CHECK(db.defrag_moved() > 0);
+    BOOST_CHECK_EQUAL(db.used_memory(), memory);
+
+    for (int i = 0; i < 20000; i += 4)
+    {
+        BOOST_CHECK(db.get<exostore::bstring>(
+            string_to_vec("key" + std::to_string(i))).bdata() == d1);
+    }
+    auto& zset = db.get<exostore::zset>(string_to_vec("big"));
+    BOOST_CHECK_EQUAL(zset.size(), 20000);
+    BOOST_CHECK(zset.contains_element_score(string_to_vec("19999"), 19999));
+    BOOST_CHECK(db.get<exostore::zset>(k3).contains_element_score(d3, 3.0));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_async_load, exo_fixture)
+{
+    db.save();
+    exostore new_db("test.erdb");
+    std::atomic<bool> done(false);
+    new_db.start_loading([&done]() { done = true; });
+    BOOST_CHECK(new_db.loading());
+    while (!done)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto progress = new_db.loading_progress();
+    BOOST_CHECK_EQUAL(progress.loaded_keys, 3);
+    BOOST_CHECK_EQUAL(progress.loaded_bytes, progress.total_bytes);
+    new_db.finish_loading();
+    BOOST_CHECK(!new_db.loading());
+    BOOST_CHECK(new_db.get<exostore::bstring>(k1).bdata() == d1);
+    BOOST_CHECK(new_db.get<exostore::zset>(k3).contains_element_score(d3, 3.0));
+}
+
+BOOST_AUTO_TEST_CASE(test_exostore_load_segments)
+{
+    // Enough data for several segments.
+    exostore db("test_segments.erdb");
+    std::vector<unsigned char> value(1024, 'x');
+    for (int i = 0; i < 10000; i++)
+    {
+        db.set(string_to_vec("key" + std::to_string(i)), exostore::bstring(value));
+    }
+    exostore::zset zset;
+    for (int i = 0; i < 1000; i++)
+    {
+        zset.add(string_to_vec("member" + std::to_string(i)), i);
+    }
+    db.set(string_to_vec("zset"), zset);
+    db.save();
+
+    for (std::size_t threads: {1, 4})
+    {
+        exostore new_db("test_segments.erdb");
+        new_db.set_load_threads(threads);
+        new_db.load();
+        for (int i = 0; i < 10000; i++)
+        {
+            auto key = string_to_vec("key" + std::to_string(i));
+            BOOST_REQUIRE(new_db.key_exists(key));
+            BOOST_CHECK(new_db.get<exostore::bstring>(key).bdata() == value);
+        }
+        auto& loaded_zset = new_db.get<exostore::zset>(string_to_vec("zset"));
+        BOOST_CHECK_EQUAL(loaded_zset.size(), 1000);
+        BOOST_CHECK(loaded_zset.contains_element_score(
+            string_to_vec("member999"), 999));
+    }
+    std::remove("test_segments.erdb");
+}
+
+BOOST_AUTO_TEST_CASE(test_exostore_load_sequential)
+{
+    // A file in the older format, with no segments.
+    std::vector<unsigned char> file = string_to_vec("EXODB");
+    auto append_size = [&file](std::size_t size)
+    {
+        auto bytes = reinterpret_cast<const unsigned char*>(&size);
+        file.insert(file.end(), bytes, bytes + sizeof(size));
+    };
+    auto append_string = [&file, &append_size](const std::string& s)
+    {
+        append_size(s.size());
+        file.insert(file.end(), s.begin(), s.end());
+    };
+    append_size(2);
+    append_string("key");
+    file.insert(file.end(), {'B', 'S', 'T', 'R'});
+    append_string("value");
+    append_string("zkey");
+    file.insert(file.end(), {'Z', 'S', 'E', 'T'});
+    append_size(1);
+    double score = 2.5;
+    auto score_bytes = reinterpret_cast<const unsigned char*>(&score);
+    file.insert(file.end(), score_bytes, score_bytes + sizeof(score));
+    append_string("member");
+    {
+        std::ofstream out("test_sequential.erdb", std::ofstream::binary);
+        out.write(reinterpret_cast<const char*>(file.data()), file.size());
+    }
+
+    exostore db("test_sequential.erdb");
+    db.load();
+    BOOST_CHECK(db.get<exostore::bstring>(string_to_vec("key")).bdata()
+        == string_to_vec("value"));
+    BOOST_CHECK(db.get<exostore::zset>(string_to_vec("zkey"))
+        .contains_element_score(string_to_vec("member"), 2.5));
+
+    // Truncated files are rejected.
+    file.resize(file.size() - 3);
+    {
+        std::ofstream out("test_sequential.erdb", std::ofstream::binary);
+        out.write(reinterpret_cast<const char*>(file.data()), file.size());
+    }
+    exostore bad_db("test_sequential.erdb");
+    BOOST_CHECK_THROW(bad_db.load(), exostore::load_error);
+
+    // So are lengths longer than the file, rather than allocated.
+    for (auto marker: {"BSTR", "ZSET"})
+    {
+        file = string_to_vec("EXODB");
+        append_size(1);
+        append_string("key");
+        file.insert(file.end(), marker, marker + 4);
+        append_size(std::numeric_limits<std::size_t>::max() / 2);
+        {
+            std::ofstream out("test_sequential.erdb", std::ofstream::binary);
+            out.write(reinterpret_cast<const char*>(file.data()), file.size());
+        }
+        exostore corrupt_db("test_sequential.erdb");
+        BOOST_CHECK_THROW(corrupt_db.load(), exostore::load_error);
+    }
+    std::remove("test_sequential.erdb");
+}
+
+BOOST_AUTO_TEST_CASE(test_exostore_load_corrupt_segment)
+{
+    auto append_size = [](std::vector<unsigned char>& file, std::size_t size)
+    {
+        auto bytes = reinterpret_cast<const unsigned char*>(&size);
+        file.insert(file.end(), bytes, bytes + sizeof(size));
+    };
+    // A segment holding a sorted set with an impossible size.
+    std::vector<unsigned char> segment;
+    append_size(segment, 4);
+    segment.insert(segment.end(), {'z', 'k', 'e', 'y', 'Z', 'S', 'E', 'T'});
+    append_size(segment, std::numeric_limits<std::size_t>::max() / 2);
+
+    // Also indexed as holding more keys than it has bytes.
+    for (auto num_keys: {std::size_t(1), segment.size() + 1})
+    {
+        auto file = string_to_vec("EXOD2");
+        file.insert(file.end(), segment.begin(), segment.end());
+        append_size(file, 1);
+        append_size(file, 5);
+        append_size(file, segment.size());
+        append_size(file, num_keys);
+        append_size(file, 5 + segment.size());
+        {
+            std::ofstream out("test_corrupt.erdb", std::ofstream::binary);
+            out.write(reinterpret_cast<const char*>(file.data()), file.size());
+        }
+        exostore db("test_corrupt.erdb");
+        BOOST_CHECK_THROW(db.load(), exostore::load_error);
+    }
+    std::remove("test_corrupt.erdb");
+}
+
 #endif
@@ -0,0 +1,164 @@
+#ifndef __TEST_HASH_MAP_HPP__
+#define __TEST_HASH_MAP_HPP__
+
+#include <vector>
+#include <string>
+#include <map>
+#include <cstdio>
+#include <cstdint>
+
+#include "../hash_map.hpp"
+#include "../exostore.hpp"
+#include "../util.hpp"
+
+namespace
+{
+    // Checks a hash against the map it should hold.
+    void check_hash_map(const hash_map& hash,
+        const std::map<std::string, std::string>& model)
+    {
+        BOOST_REQUIRE_EQUAL(hash.size(), model.size());
+        for (const auto& pair: model)
+        {
+            std::vector<unsigned char> value;
+            BOOST_REQUIRE(hash.get(string_to_vec(pair.first), value));
+            BOOST_CHECK_EQUAL(vec_to_string(value), pair.second);
+        }
+        std::map<std::string, std::string> seen;
+        hash.for_each([&seen](const hash_map::field_type& field,
+            const hash_map::field_type& value)
+        {
+            seen[vec_to_string(field)] = vec_to_string(value);
+        });
+        BOOST_CHECK(seen == model);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_hash_map_packed)
+{
+    hash_map hash;
+    std::map<std::string, std::string> model;
+    std::vector<unsigned char> value;
+    BOOST_CHECK(!hash.get(string_to_vec("missing"), value));
+    BOOST_CHECK_EQUAL(hash.memory_usage(), 0u);
+
+    for (int i = 0; i < 10; i++)
+    {
+        auto field = "field" + std::to_string(i);
+        BOOST_CHECK(hash.set(string_to_vec(field),
+            string_to_vec("value" + std::to_string(i))));
+        model[field] = "value" + std::to_string(i);
+    }
+    // Replacing values with shorter, equal and longer ones, and an empty
+    // field.
+    BOOST_CHECK(!hash.set(string_to_vec("field3"), string_to_vec("v")));
+    BOOST_CHECK(!hash.set(string_to_vec("field4"), string_to_vec("VALUE4")));
+    BOOST_CHECK(!hash.set(string_to_vec("field5"),
+        string_to_vec("a longer value")));
+    BOOST_CHECK(hash.set(std::vector<unsigned char>(), string_to_vec("")));
+    model["field3"] = "v";
+    model["field4"] = "VALUE4";
+    model["field5"] = "a longer value";
+    model[""] = "";
+    BOOST_CHECK(hash.is_packed());
+    check_hash_map(hash, model);
+    BOOST_CHECK_LT(hash.memory_usage(), 256u);
+}
+
+BOOST_AUTO_TEST_CASE(test_hash_map_unpack)
+{
+    // Too many fields.
+    hash_map many;
+    std::map<std::string, std::string> model;
+    for (std::size_t i = 0; i <= hash_map::max_packed_entries; i++)
+    {
+        BOOST_CHECK(many.is_packed());
+        auto field = "field" + std::to_string(i);
+        many.set(string_to_vec(field), string_to_vec(std::to_string(i)));
+        model[field] = std::to_string(i);
+    }
+    BOOST_CHECK(!many.is_packed());
+    check_hash_map(many, model);
+    many.set(string_to_vec("field7"), string_to_vec("seven"));
+    model["field7"] = "seven";
+    check_hash_map(many, model);
+
+    // A long value.
+    hash_map long_value;
+    long_value.set(string_to_vec("short"), string_to_vec("value"));
+    auto before = long_value.memory_usage();
+    std::string long_string(hash_map::max_packed_length + 1, 'x');
+    BOOST_CHECK(!long_value.set(string_to_vec("short"),
+        string_to_vec(long_string)));
+    BOOST_CHECK(!long_value.is_packed());
+    BOOST_CHECK_EQUAL(long_value.size(), 1u);
+    BOOST_CHECK_GT(long_value.memory_usage(), before + long_string.size());
+    check_hash_map(long_value, {{"short", long_string}});
+}
+
+BOOST_AUTO_TEST_CASE(test_hash_map_exostore)
+{
+    // A ten field record as a hash costs a fraction of ten keys.
+    exostore db("test_hash.erdb");
+    auto hash_key = string_to_vec("user:1");
+    exostore::hash hash;
+    for (int i = 0; i < 10; i++)
+    {
+        hash.set(string_to_vec("field" + std::to_string(i)),
+            string_to_vec("value" + std::to_string(i)));
+    }
+    db.set(hash_key, hash);
+    auto hash_memory = db.memory_usage(hash_key);
+    std::size_t keys_memory = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        auto key = string_to_vec("user:1:field" + std::to_string(i));
+        db.set(key, exostore::bstring(string_to_vec(
+            "value" + std::to_string(i))));
+        keys_memory += db.memory_usage(key);
+    }
+    BOOST_CHECK_LT(hash_memory * 3, keys_memory);
+    auto stats = db.memory_statistics();
+    BOOST_CHECK_GT(stats.hashes, 0u);
+    BOOST_CHECK_LT(stats.hashes, hash_memory);
+
+    // An unpacked hash is saved and loaded too.
+    auto big_key = string_to_vec("big");
+    exostore::hash big;
+    for (std::size_t i = 0; i < 2 * hash_map::max_packed_entries; i++)
+    {
+        big.set(string_to_vec(std::to_string(i)), string_to_vec("v"));
+    }
+    db.set(big_key, big);
+    db.save();
+    exostore loaded("test_hash.erdb");
+    loaded.load();
+    std::vector<unsigned char> value;
+    const auto& loaded_hash = loaded.get<exostore::hash>(hash_key);
+    BOOST_CHECK(loaded_hash.is_packed());
+    BOOST_CHECK_EQUAL(loaded_hash.size(), 10u);
+    BOOST_CHECK(loaded_hash.get(string_to_vec("field9"), value));
+    BOOST_CHECK_EQUAL(vec_to_string(value), "value9");
+    const auto& loaded_big = loaded.get<exostore::hash>(big_key);
+    BOOST_CHECK(!loaded_big.is_packed());
+    BOOST_CHECK_EQUAL(loaded_big.size(), big.size());
+    BOOST_CHECK_THROW(loaded.get<exostore::zset>(hash_key),
+        exostore::type_error);
+
+    std::map<std::string, std::string> types;
+    std::uint64_t cursor = 0;
+    do
+    {
+        cursor = loaded.scan(cursor, 100,
+            [&types](const std::vector<unsigned char>& key,
+                const std::string& type)
+            {
+                types[vec_to_string(key)] = type;
+            });
+    } while (cursor != 0);
+    BOOST_CHECK_EQUAL(types["user:1"], "hash");
+    BOOST_CHECK_EQUAL(types["user:1:field0"], "string");
+    std::remove("test_hash.erdb");
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef __TEST_HYPERLOGLOG_HPP__
+#define __TEST_HYPERLOGLOG_HPP__
+
+#include <vector>
+#include <random>
+#include <string>
+#include <cstdint>
+
+#include "../hyperloglog.hpp"
+#include "../util.hpp"
+
+namespace
+{
+    void add_numbers(hyperloglog& hll, std::uint64_t first, std::uint64_t last)
+    {
+        for (auto i = first; i < last; i++)
+        {
+            auto element = string_to_vec("element:" + std::to_string(i));
+            hll.add(element.data(), element.size());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_hyperloglog_estimate)
+{
+    hyperloglog hll;
+    BOOST_CHECK_EQUAL(hll.count(), 0u);
+
+    // Small counts are exact or nearly so, and large ones within a few
+    // standard errors.
+    add_numbers(hll, 0, 10);
+    BOOST_CHECK_EQUAL(hll.count(), 10u);
+    add_numbers(hll, 0, 10);
+    BOOST_CHECK_EQUAL(hll.count(), 10u);
+    std::uint64_t previous = 10;
+    for (std::uint64_t n: {1000, 20000, 200000})
+    {
+        add_numbers(hll, previous, n);
+        previous = n;
+        BOOST_CHECK_CLOSE(double(hll.count()), double(n), 3.0);
+    }
+
+    // Every level agrees.
+    for (auto level: {simd_level::portable, simd_level::sse42,
+        simd_level::avx2})
+    {
+        BOOST_CHECK_EQUAL(hll.count(level), hll.count());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_hyperloglog_encoding)
+{
+    // Few elements stay sparse and small.
+    hyperloglog hll;
+    add_numbers(hll, 0, 100);
+    auto bytes = hll.encode();
+    BOOST_CHECK(hyperloglog::has_header(bytes));
+    BOOST_CHECK(!hyperloglog::is_dense(bytes));
+    BOOST_CHECK_LT(bytes.size(), 1000u);
+    BOOST_CHECK(hyperloglog(bytes).registers() == hll.registers());
+
+    // Many turn it dense, and adding in place matches adding to the object.
+    add_numbers(hll, 100, 5000);
+    bytes = hll.encode();
+    BOOST_CHECK(hyperloglog::is_dense(bytes));
+    BOOST_CHECK_EQUAL(bytes.size(), hyperloglog::dense_size);
+    BOOST_CHECK(hyperloglog(bytes).registers() == hll.registers());
+    for (std::uint64_t i = 5000; i < 6000; i++)
+    {
+        auto element = string_to_vec("element:" + std::to_string(i));
+        BOOST_CHECK_EQUAL(hyperloglog::add_dense(bytes, element.data(),
+            element.size()), hll.add(element.data(), element.size()));
+    }
+    BOOST_CHECK(hyperloglog(bytes).registers() == hll.registers());
+
+    // The cached estimate.
+    std::uint64_t count;
+    BOOST_CHECK(!hyperloglog::cached_count(bytes, count));
+    hyperloglog::set_cached_count(bytes, 1234);
+    BOOST_CHECK(hyperloglog::cached_count(bytes, count));
+    BOOST_CHECK_EQUAL(count, 1234u);
+
+    // Strings that aren't HyperLogLogs.
+    BOOST_CHECK_THROW(hyperloglog{string_to_vec("HYLL")},
+        hyperloglog::format_error);
+    bytes.pop_back();
+    BOOST_CHECK_THROW(hyperloglog{bytes}, hyperloglog::format_error);
+    auto sparse = hyperloglog().encode();
+    sparse.push_back(0);
+    BOOST_CHECK_THROW(hyperloglog{sparse}, hyperloglog::format_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_hyperloglog_merge)
+{
+    hyperloglog first;
+    hyperloglog second;
+    hyperloglog both;
+    add_numbers(first, 0, 30000);
+    add_numbers(second, 20000, 50000);
+    add_numbers(both, 0, 50000);
+
+    for (auto level: {simd_level::portable, simd_level::sse42,
+        simd_level::avx2})
+    {
+        hyperloglog merged = first;
+        merged.merge(second, level);
+        BOOST_CHECK(merged.registers() == both.registers());
+    }
+
+    // The kernels agree at every length.
+    std::mt19937 random(5);
+    std::vector<unsigned char> registers(1000);
+    for (auto& r: registers)
+    {
+        r = random() % 52;
+    }
+    for (std::size_t size = 0; size < registers.size(); size += 37)
+    {
+        std::size_t expected_zeros;
+        auto expected = harmonic_sum(registers.data(), size, expected_zeros,
+            simd_level::portable);
+        for (auto level: {simd_level::sse42, simd_level::avx2})
+        {
+            std::size_t zeros;
+            BOOST_CHECK_CLOSE(harmonic_sum(registers.data(), size, zeros,
+                level), expected, 1e-4);
+            BOOST_CHECK_EQUAL(zeros, expected_zeros);
+        }
+    }
+}
+
+#endif
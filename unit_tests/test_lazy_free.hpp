@@ -0,0 +1,98 @@
+#ifndef __TEST_LAZY_FREE_HPP__
+#define __TEST_LAZY_FREE_HPP__
+
+#include <vector>
+#include <thread>
+#include <memory>
+
+#include "../lazy_free.hpp"
+#include "../exostore.hpp"
+#include "../util.hpp"
+
+namespace
+{
+    // Records the thread it is destroyed on.
+    struct destroy_recorder
+    {
+        destroy_recorder(std::shared_ptr<std::thread::id> destroyed_on)
+            : destroyed_on(destroyed_on) {}
+
+        ~destroy_recorder()
+        {
+            if (destroyed_on)
+            {
+                *destroyed_on = std::this_thread::get_id();
+            }
+        }
+
+        destroy_recorder(const destroy_recorder& other) = default;
+        destroy_recorder(destroy_recorder&& other)
+            : destroyed_on(std::move(other.destroyed_on)) {}
+
+        std::shared_ptr<std::thread::id> destroyed_on;
+    };
+}
+
+BOOST_AUTO_TEST_CASE(test_lazy_free)
+{
+    auto destroyed_on = std::make_shared<std::thread::id>();
+    {
+        lazy_free freer;
+        BOOST_CHECK_EQUAL(freer.pending(), 0);
+        freer.free(destroy_recorder(destroyed_on));
+        freer.free(std::vector<unsigned char>(1000));
+        freer.wait();
+        BOOST_CHECK_EQUAL(freer.pending(), 0);
+        BOOST_CHECK_EQUAL(freer.freed(), 2);
+        BOOST_CHECK(*destroyed_on != std::thread::id());
+        BOOST_CHECK(*destroyed_on != std::this_thread::get_id());
+
+        // Whatever is pending is freed on destruction.
+        freer.free(std::vector<unsigned char>(1000));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_exostore_lazy_free)
+{
+    exostore db("test_lazy_free.erdb");
+    auto small_key = string_to_vec("small");
+    auto big_key = string_to_vec("big");
+
+    exostore::zset small;
+    small.add(string_to_vec("member"), 1.0);
+    exostore::zset big;
+    for (int i = 0; i < 1000; i++)
+    {
+        big.add(string_to_vec(std::to_string(i)), i);
+    }
+
+    // Small values are freed inline.
+    db.set(small_key, small);
+    db.set(small_key, exostore::bstring(string_to_vec("value")));
+    db.remove(small_key);
+    BOOST_CHECK_EQUAL(db.lazy_freed() + db.lazy_free_pending(), 0);
+
+    // Large ones are freed in the background when overwritten or removed.
+    db.set(big_key, big);
+    db.set(big_key, big);
+    BOOST_CHECK_EQUAL(db.lazy_freed() + db.lazy_free_pending(), 1);
+    BOOST_CHECK_EQUAL(db.get<exostore::zset>(big_key).size(), 1000);
+    db.remove(big_key);
+    BOOST_CHECK_EQUAL(db.lazy_freed() + db.lazy_free_pending(), 2);
+    BOOST_CHECK(!db.key_exists(big_key));
+
+    // A lazy clear always hands the keyspace over.
+    db.set(small_key, small);
+    db.clear(true);
+    BOOST_CHECK_EQUAL(db.lazy_freed() + db.lazy_free_pending(), 3);
+    BOOST_CHECK(!db.key_exists(small_key));
+    BOOST_CHECK_EQUAL(db.memory_statistics().keys, 0);
+    BOOST_CHECK_EQUAL(db.memory_statistics().zsets, 0);
+
+    db.set(small_key, small);
+    db.clear(false);
+    BOOST_CHECK_EQUAL(db.lazy_freed() + db.lazy_free_pending(), 3);
+    BOOST_CHECK(!db.key_exists(small_key));
+}
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef __TEST_MAPPED_STORE_HPP__
+#define __TEST_MAPPED_STORE_HPP__
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <fstream>
+#include <set>
+
+#include "../mapped_store.hpp"
+#include "../exostore.hpp"
+#include "../util.hpp"
+
+struct mapped_store_fixture
+{
+public:
+    mapped_store_fixture() : path("test.map"), db_path("test_mapped.erdb")
+    {
+        std::remove(path.c_str());
+        std::remove(db_path.c_str());
+    }
+
+    ~mapped_store_fixture()
+    {
+        std::remove(path.c_str());
+        std::remove(db_path.c_str());
+    }
+
+    static std::string entry_string(const mapped_store::entry& e)
+    {
+        return std::string(e.data, e.data + e.size);
+    }
+
+    std::string path;
+    std::string db_path;
+};
+
+BOOST_FIXTURE_TEST_CASE(test_mapped_store_basic, mapped_store_fixture)
+{
+    mapped_store store(path);
+    store.open();
+    mapped_store::entry e;
+    BOOST_CHECK(!store.find(string_to_vec("key"), e));
+
+    store.put(string_to_vec("key"), string_to_vec("value"), false, 0);
+    BOOST_CHECK(store.find(string_to_vec("key"), e));
+    BOOST_CHECK_EQUAL(entry_string(e), "value");
+    BOOST_CHECK(!e.has_expiry);
+    BOOST_CHECK_EQUAL(store.size(), 1);
+
+    // Fits in place.
+    store.put(string_to_vec("key"), string_to_vec("val"), true, 1234);
+    BOOST_CHECK(store.find(string_to_vec("key"), e));
+    BOOST_CHECK_EQUAL(entry_string(e), "val");
+    BOOST_CHECK(e.has_expiry);
+    BOOST_CHECK_EQUAL(e.expiry_ms, 1234);
+    BOOST_CHECK_EQUAL(store.garbage_bytes(), 0);
+
+    // Doesn't fit, so the old record becomes garbage.
+    store.put(string_to_vec("key"), string_to_vec("a much longer value"),
+        false, 0);
+    BOOST_CHECK(store.find(string_to_vec("key"), e));
+    BOOST_CHECK_EQUAL(entry_string(e), "a much longer value");
+    BOOST_CHECK(store.garbage_bytes() > 0);
+    BOOST_CHECK_EQUAL(store.size(), 1);
+
+    BOOST_CHECK(store.remove(string_to_vec("key")));
+    BOOST_CHECK(!store.remove(string_to_vec("key")));
+    BOOST_CHECK(!store.find(string_to_vec("key"), e));
+    BOOST_CHECK_EQUAL(store.size(), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_mapped_store_put_range, mapped_store_fixture)
+{
+    mapped_store store(path);
+    store.open();
+    mapped_store::entry e;
+    BOOST_CHECK(!store.put_range(string_to_vec("key"), 0,
+        string_to_vec("x").data(), 1, 1));
+
+    // A value that grew once has spare room, so appends fit in place.
+    store.put(string_to_vec("key"), string_to_vec("ab"), true, 7);
+    store.put(string_to_vec("key"), string_to_vec("abcdefghij"), true, 7);
+    const auto garbage = store.garbage_bytes();
+    BOOST_CHECK(store.put_range(string_to_vec("key"), 10,
+        string_to_vec("kl").data(), 2, 12));
+    BOOST_CHECK(store.put_range(string_to_vec("key"), 1,
+        string_to_vec("B").data(), 1, 12));
+    BOOST_REQUIRE(store.find(string_to_vec("key"), e));
+    BOOST_CHECK_EQUAL(entry_string(e), "aBcdefghijkl");
+    BOOST_CHECK(e.has_expiry);
+    BOOST_CHECK_EQUAL(e.expiry_ms, 7);
+    BOOST_CHECK_EQUAL(store.garbage_bytes(), garbage);
+
+    // The bytes past the old end must all be written.
+    BOOST_CHECK(!store.put_range(string_to_vec("key"), 13,
+        string_to_vec("n").data(), 1, 14));
+    // No room left.
+    const std::vector<unsigned char> tail(100, 'z');
+    BOOST_CHECK(!store.put_range(string_to_vec("key"), 12, tail.data(),
+        tail.size(), 112));
+    BOOST_REQUIRE(store.find(string_to_vec("key"), e));
+    BOOST_CHECK_EQUAL(entry_string(e), "aBcdefghijkl");
+}
+
+BOOST_FIXTURE_TEST_CASE(test_mapped_store_grow_and_reopen, mapped_store_fixture)
+{
+    // Enough keys to grow both the index and the file.
+    const int num_keys = 20000;
+    {
+        mapped_store store(path);
+        store.open();
+        for (int i = 0; i < num_keys; i++)
+        {
+            store.put(string_to_vec("key" + std::to_string(i)),
+                std::vector<unsigned char>(64, i % 256), false, 0);
+        }
+        for (int i = 0; i < num_keys; i += 2)
+        {
+            store.remove(string_to_vec("key" + std::to_string(i)));
+        }
+        BOOST_CHECK_EQUAL(store.size(), num_keys / 2);
+    }
+
+    mapped_store store(path);
+    store.open();
+    BOOST_CHECK_EQUAL(store.size(), num_keys / 2);
+    mapped_store::entry e;
+    BOOST_CHECK(!store.find(string_to_vec("key0"), e));
+    BOOST_CHECK(store.find(string_to_vec("key19999"), e));
+    BOOST_CHECK(std::vector<unsigned char>(e.data, e.data + e.size)
+        == std::vector<unsigned char>(64, 19999 % 256));
+
+    std::size_t count = 0;
+    store.for_each([&count](const std::vector<unsigned char>&,
+        const mapped_store::entry&)
+    {
+        count++;
+    });
+    BOOST_CHECK_EQUAL(count, num_keys / 2);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_mapped_store_compact, mapped_store_fixture)
+{
+    {
+        mapped_store store(path);
+        store.open();
+
+        // Appending to a value moves it only a few times, so the file stays
+        // small. Without spare room the old copies would add up to 200MB.
+        std::vector<unsigned char> value;
+        for (int i = 0; i < 2000; i++)
+        {
+            value.insert(value.end(), 100, 'a' + i % 26);
+            store.put(string_to_vec("appended"), value, false, 0);
+        }
+        BOOST_CHECK_LT(store.file_size(), 4 * 1024 * 1024);
+        BOOST_CHECK(!store.compaction_due());
+
+        const int num_keys = 5000;
+        for (int i = 0; i < num_keys; i++)
+        {
+            store.put(string_to_vec("key" + std::to_string(i)),
+                std::vector<unsigned char>(1024, i % 256), i % 2 == 0, i);
+        }
+        for (int i = 0; i < num_keys; i++)
+        {
+            if (i % 5 != 0)
+            {
+                store.remove(string_to_vec("key" + std::to_string(i)));
+            }
+        }
+        BOOST_CHECK(store.compaction_due());
+
+        auto old_file_size = store.file_size();
+        store.compact();
+        BOOST_CHECK_EQUAL(store.garbage_bytes(), 0);
+        BOOST_CHECK(!store.compaction_due());
+        BOOST_CHECK_LT(store.file_size(), old_file_size);
+        BOOST_CHECK_EQUAL(store.size(), num_keys / 5 + 1);
+    }
+
+    mapped_store store(path);
+    store.open();
+    BOOST_CHECK_EQUAL(store.size(), 1001);
+    mapped_store::entry e;
+    BOOST_CHECK(!store.find(string_to_vec("key1"), e));
+    BOOST_REQUIRE(store.find(string_to_vec("key10"), e));
+    BOOST_CHECK(std::vector<unsigned char>(e.data, e.data + e.size)
+        == std::vector<unsigned char>(1024, 10));
+    BOOST_CHECK(e.has_expiry);
+    BOOST_CHECK_EQUAL(e.expiry_ms, 10);
+    BOOST_REQUIRE(store.find(string_to_vec("appended"), e));
+    BOOST_CHECK_EQUAL(e.size, 200000);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_mapped_store_compact_steps, mapped_store_fixture)
+{
+    {
+        mapped_store store(path);
+        store.open();
+        const int num_keys = 5000;
+        for (int i = 0; i < num_keys; i++)
+        {
+            store.put(string_to_vec("key" + std::to_string(i)),
+                std::vector<unsigned char>(1024, i % 256), false, 0);
+        }
+        for (int i = 0; i < num_keys; i++)
+        {
+            if (i % 5 != 0)
+            {
+                store.remove(string_to_vec("key" + std::to_string(i)));
+            }
+        }
+        BOOST_REQUIRE(store.compaction_due());
+
+        // Writes made between steps end up in the new file.
+        int steps = 0;
+        while (!store.compact_step(100))
+        {
+            BOOST_CHECK(store.compacting());
+            const int i = steps * 10;
+            store.put(string_to_vec("new" + std::to_string(steps)),
+                string_to_vec("value"), false, 0);
+            store.put(string_to_vec("key" + std::to_string(i)),
+                std::vector<unsigned char>(2048, 'x'), false, 0);
+            store.remove(string_to_vec("key" + std::to_string(i + 5)));
+            steps++;
+        }
+        BOOST_CHECK_GT(steps, 1);
+        BOOST_CHECK(!store.compacting());
+        // Only the values that were moved by overwrites are left behind.
+        BOOST_CHECK_LT(store.garbage_bytes(), steps * 2048);
+    }
+
+    mapped_store store(path);
+    store.open();
+    mapped_store::entry e;
+    BOOST_REQUIRE(store.find(string_to_vec("new0"), e));
+    BOOST_CHECK_EQUAL(entry_string(e), "value");
+    BOOST_REQUIRE(store.find(string_to_vec("key0"), e));
+    BOOST_CHECK(std::vector<unsigned char>(e.data, e.data + e.size)
+        == std::vector<unsigned char>(2048, 'x'));
+    BOOST_CHECK(!store.find(string_to_vec("key5"), e));
+    BOOST_REQUIRE(store.find(string_to_vec("key4995"), e));
+    BOOST_CHECK(std::vector<unsigned char>(e.data, e.data + e.size)
+        == std::vector<unsigned char>(1024, 4995 % 256));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_mapped_store_scan, mapped_store_fixture)
+{
+    mapped_store store(path);
+    store.open();
+    for (int i = 0; i < 1000; i++)
+    {
+        store.put(string_to_vec("key" + std::to_string(i)),
+            string_to_vec("value"), false, 0);
+    }
+
+    // Keys present throughout are seen even though the index grows part way
+    // through the scan.
+    std::set<std::string> seen;
+    std::uint64_t cursor = 0;
+    int calls = 0;
+    do
+    {
+        cursor = store.scan(cursor, 10, [&seen](
+            const std::vector<unsigned char>& key, const mapped_store::entry&)
+        {
+            seen.insert(vec_to_string(key));
+        });
+        if (++calls == 10)
+        {
+            for (int i = 1000; i < 10000; i++)
+            {
+                store.put(string_to_vec("key" + std::to_string(i)),
+                    string_to_vec("value"), false, 0);
+            }
+        }
+    } while (cursor != 0);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        BOOST_CHECK(seen.count("key" + std::to_string(i)) == 1);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(test_mapped_store_corrupt, mapped_store_fixture)
+{
+    {
+        std::ofstream out(path, std::ofstream::binary);
+        out << std::string(128, 'x');
+    }
+    mapped_store store(path);
+    BOOST_CHECK_THROW(store.open(), mapped_store::store_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_mapped, mapped_store_fixture)
+{
+    {
+        exostore store(db_path);
+        store.open_mapped_store(path);
+        store.set(string_to_vec("key"), exostore::bstring(
+            string_to_vec("value")));
+        store.set(string_to_vec("zkey"), sorted_set());
+        // Strings don't need a snapshot.
+        BOOST_CHECK_EQUAL(store.dirty(), 1);
+        store.save();
+    }
+
+    exostore store(db_path);
+    store.open_mapped_store(path);
+    store.load();
+    BOOST_CHECK(store.key_exists(string_to_vec("key")));
+    BOOST_CHECK(store.get<exostore::bstring>(string_to_vec("key")).bdata()
+        == string_to_vec("value"));
+    BOOST_CHECK(store.is_type<sorted_set>(string_to_vec("zkey")));
+
+    // Replacing a string with another type takes it out of the store.
+    store.set(string_to_vec("key"), sorted_set());
+    mapped_store::entry e;
+    BOOST_CHECK(!store.store()->find(string_to_vec("key"), e));
+
+    // Scans cover both the hash table and the store.
+    store.set(string_to_vec("other key"), exostore::bstring(
+        string_to_vec("value")));
+    std::set<std::string> seen;
+    std::uint64_t cursor = 0;
+    do
+    {
+        cursor = store.scan(cursor, 1, [&seen](
+            const std::vector<unsigned char>& key, const std::string& type)
+        {
+            BOOST_CHECK(seen.insert(vec_to_string(key) + ":" + type).second);
+        });
+    } while (cursor != 0);
+    BOOST_CHECK(seen == std::set<std::string>({"key:zset", "zkey:zset",
+        "other key:string"}));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_mapped_touch_range,
+    mapped_store_fixture)
+{
+    exostore store(db_path);
+    store.open_mapped_store(path);
+    const auto key = string_to_vec("key");
+    store.set(key, exostore::bstring(string_to_vec("value")));
+
+    // Appends that fit in the record only write what was appended, and ones
+    // that don't move it.
+    std::string expected = "value";
+    for (int i = 0; i < 1000; i++)
+    {
+        auto& bdata = store.get<exostore::bstring>(key).bdata();
+        const auto tail = string_to_vec(std::to_string(i));
+        bdata.insert(bdata.end(), tail.begin(), tail.end());
+        store.touch(key, bdata.size() - tail.size(), tail.size());
+        expected += std::to_string(i);
+    }
+    mapped_store::entry e;
+    BOOST_REQUIRE(store.store()->find(key, e));
+    BOOST_CHECK_EQUAL(entry_string(e), expected);
+
+    auto& bdata = store.get<exostore::bstring>(key).bdata();
+    bdata[2] = 'L';
+    store.touch(key, 2, 1);
+    expected[2] = 'L';
+    BOOST_REQUIRE(store.store()->find(key, e));
+    BOOST_CHECK_EQUAL(entry_string(e), expected);
+    BOOST_CHECK_EQUAL(store.dirty(), 0);
+}
+
+#endif
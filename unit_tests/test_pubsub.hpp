@@ -0,0 +1,95 @@
+#ifndef __TEST_PUBSUB_HPP__
+#define __TEST_PUBSUB_HPP__
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "../pubsub.hpp"
+#include "../util.hpp"
+
+namespace
+{
+    // Records what it is sent.
+    class recording_subscriber: public pubsub::subscriber
+    {
+    public:
+        void deliver(const pubsub::message& m) override
+        {
+            messages.push_back(m);
+        }
+
+        std::vector<pubsub::message> messages;
+    };
+
+    std::string message_string(const pubsub::message& m)
+    {
+        return std::string(m->begin(), m->end());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_pubsub_publish)
+{
+    pubsub registry;
+    std::vector<recording_subscriber> subscribers(1000);
+    auto news = string_to_vec("news");
+    for (auto& s: subscribers)
+    {
+        registry.subscribe(news, &s);
+    }
+    recording_subscriber pattern_subscriber;
+    registry.psubscribe(string_to_vec("n*"), &pattern_subscriber);
+    registry.psubscribe(string_to_vec("x*"), &pattern_subscriber);
+
+    BOOST_CHECK_EQUAL(registry.publish(news, string_to_vec("hello")), 1001u);
+    BOOST_CHECK_EQUAL(registry.publish(string_to_vec("nothing"),
+        string_to_vec("hi")), 1u);
+    BOOST_CHECK_EQUAL(registry.publish(string_to_vec("other"),
+        string_to_vec("hi")), 0u);
+
+    // Every subscriber shares the one buffer.
+    BOOST_CHECK_EQUAL(message_string(subscribers[0].messages[0]),
+        "*3\r\n$7\r\nmessage\r\n$4\r\nnews\r\n$5\r\nhello\r\n");
+    for (const auto& s: subscribers)
+    {
+        BOOST_REQUIRE_EQUAL(s.messages.size(), 1u);
+        BOOST_CHECK(s.messages[0] == subscribers[0].messages[0]);
+    }
+    BOOST_REQUIRE_EQUAL(pattern_subscriber.messages.size(), 2u);
+    BOOST_CHECK_EQUAL(message_string(pattern_subscriber.messages[1]),
+        "*4\r\n$8\r\npmessage\r\n$2\r\nn*\r\n$7\r\nnothing\r\n$2\r\nhi\r\n");
+}
+
+BOOST_AUTO_TEST_CASE(test_pubsub_unsubscribe)
+{
+    pubsub registry;
+    recording_subscriber first;
+    recording_subscriber second;
+    auto a = string_to_vec("a");
+    auto b = string_to_vec("b");
+    registry.subscribe(a, &first);
+    registry.subscribe(a, &second);
+    registry.subscribe(b, &second);
+    registry.psubscribe(string_to_vec("*"), &first);
+    BOOST_CHECK_EQUAL(registry.subscriber_count(a), 2u);
+    BOOST_CHECK_EQUAL(registry.pattern_count(), 1u);
+    auto channels = registry.channels();
+    std::sort(channels.begin(), channels.end());
+    BOOST_CHECK(channels == std::vector<pubsub::channel_type>({a, b}));
+    BOOST_CHECK(registry.channels(string_to_vec("[a]"))
+        == std::vector<pubsub::channel_type>({a}));
+
+    registry.unsubscribe(a, &first);
+    registry.punsubscribe(string_to_vec("*"), &first);
+    BOOST_CHECK_EQUAL(registry.publish(a, string_to_vec("x")), 1u);
+    BOOST_CHECK(first.messages.empty());
+    BOOST_CHECK_EQUAL(second.messages.size(), 1u);
+
+    // Channels without subscribers are forgotten.
+    registry.unsubscribe(b, &second);
+    BOOST_CHECK_EQUAL(registry.subscriber_count(b), 0u);
+    BOOST_CHECK_EQUAL(registry.channels().size(), 1u);
+    BOOST_CHECK_EQUAL(registry.pattern_count(), 0u);
+}
+
+#endif
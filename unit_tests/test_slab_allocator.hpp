@@ -0,0 +1,154 @@
+#ifndef __TEST_SLAB_ALLOCATOR_HPP__
+#define __TEST_SLAB_ALLOCATOR_HPP__
+
+#include <vector>
+#include <set>
+#include <thread>
+#include <cstdint>
+
+#include "../slab_allocator.hpp"
+#include "../sorted_set.hpp"
+#include "../util.hpp"
+
+BOOST_AUTO_TEST_CASE(test_slab_pool)
+{
+    auto& pool = slab_pool::instance();
+    const auto before = pool.statistics();
+
+    // Enough 48 byte chunks to fill several slabs.
+    std::vector<void*> chunks;
+    for (int i = 0; i < 10000; i++)
+    {
+        auto chunk = pool.allocate(40);
+        BOOST_CHECK_EQUAL(reinterpret_cast<std::uintptr_t>(chunk)
+            % slab_pool::chunk_alignment, 0);
+        chunks.push_back(chunk);
+    }
+    auto full = pool.statistics();
+    BOOST_CHECK_EQUAL(full.used_bytes - before.used_bytes, 10000 * 48);
+    BOOST_CHECK_EQUAL(full.requested_bytes - before.requested_bytes,
+        10000 * 40);
+    BOOST_CHECK(full.slabs - before.slabs >= 10000 * 48 / slab_pool::slab_size);
+    std::set<void*> distinct(chunks.begin(), chunks.end());
+    BOOST_CHECK_EQUAL(distinct.size(), chunks.size());
+
+    // Freed chunks are reused before new slabs are mapped.
+    pool.deallocate(chunks.back(), 40);
+    auto reused = pool.allocate(33);
+    BOOST_CHECK(reused == chunks.back());
+    chunks.back() = reused;
+    pool.deallocate(reused, 33);
+    chunks.pop_back();
+
+    // Emptied slabs go back to the OS, apart from one kept per class.
+    for (auto chunk: chunks)
+    {
+        pool.deallocate(chunk, 40);
+    }
+    auto empty = pool.statistics();
+    BOOST_CHECK_EQUAL(empty.used_bytes, before.used_bytes);
+    BOOST_CHECK(empty.slabs <= before.slabs + 1);
+
+    BOOST_CHECK_EQUAL(slab_pool::allocation_size(1), 16);
+    BOOST_CHECK_EQUAL(slab_pool::allocation_size(40), 48);
+    BOOST_CHECK_EQUAL(slab_pool::allocation_size(256), 256);
+    BOOST_CHECK_EQUAL(slab_pool::allocation_size(257),
+        allocation_size(257));
+}
+
+BOOST_AUTO_TEST_CASE(test_slab_pool_defrag)
+{
+    auto& pool = slab_pool::instance();
+    BOOST_CHECK(!pool.should_move(&pool));
+
+    // Fill a few dozen slabs of 240 byte chunks, then leave the first half
+    // of them a quarter used.
+    std::vector<void*> chunks;
+    for (int i = 0; i < 10000; i++)
+    {
+        chunks.push_back(pool.allocate(232));
+    }
+    std::vector<void*> kept;
+    for (int i = 0; i < 10000; i++)
+    {
+        if (i < 5000 && i % 4 != 0)
+        {
+            pool.deallocate(chunks[i], 232);
+        }
+        else
+        {
+            kept.push_back(chunks[i]);
+        }
+    }
+    const auto fragmented = pool.statistics();
+
+    // Moving what should_move() picks out empties the sparse slabs.
+    std::size_t moved = 0;
+    for (int pass = 0; pass < 5; pass++)
+    {
+        for (auto& chunk: kept)
+        {
+            if (pool.should_move(chunk))
+            {
+                auto new_chunk = pool.allocate(232);
+                pool.deallocate(chunk, 232);
+                chunk = new_chunk;
+                moved++;
+            }
+        }
+    }
+    const auto compacted = pool.statistics();
+    BOOST_CHECK(moved > 0);
+    BOOST_CHECK(moved < kept.size());
+    BOOST_CHECK_EQUAL(compacted.used_bytes, fragmented.used_bytes);
+    BOOST_CHECK(compacted.slabs + 10 <= fragmented.slabs);
+
+    for (auto chunk: kept)
+    {
+        pool.deallocate(chunk, 232);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_slab_allocator_threads)
+{
+    auto& pool = slab_pool::instance();
+    const auto before = pool.statistics();
+    {
+        // Sorted sets built and destroyed on several threads at once.
+        // Boost.Test checks aren't thread safe, so the sizes are checked
+        // afterwards.
+        std::vector<std::size_t> sizes(4);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++)
+        {
+            threads.emplace_back([t, &sizes]()
+            {
+                for (int round = 0; round < 5; round++)
+                {
+                    sorted_set zset;
+                    for (int i = 0; i < 2000; i++)
+                    {
+                        zset.add(string_to_vec(std::to_string(t * 100000 + i)),
+                            i);
+                    }
+                    sizes[t] += zset.size();
+                }
+            });
+        }
+        for (auto& thread: threads)
+        {
+            thread.join();
+        }
+        for (auto size: sizes)
+        {
+            BOOST_CHECK_EQUAL(size, 5 * 2000);
+        }
+    }
+    BOOST_CHECK_EQUAL(pool.statistics().used_bytes, before.used_bytes);
+
+    sorted_set zset;
+    zset.add(string_to_vec("member"), 1.0);
+    BOOST_CHECK(pool.statistics().used_bytes > before.used_bytes);
+}
+
+#endif
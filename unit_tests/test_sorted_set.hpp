@@ -5,6 +5,11 @@
 #include "../util.hpp"
 
 #include <vector>
+#include <set>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <iterator>
 
 struct F
 {
@@ -104,4 +109,301 @@ BOOST_FIXTURE_TEST_CASE(test_sorted_set_element_range, F)
 
 }
 
+BOOST_FIXTURE_TEST_CASE(test_sorted_set_from_sorted, F)
+{
+    sorted_set::element_list elements{{1.0, v4}, {1.0, v1}, {2.0, v2},
+        {3.0, v3}};
+    sorted_set bulk(std::move(elements));
+    BOOST_CHECK_EQUAL(bulk.size(), 4);
+    BOOST_CHECK(bulk.contains_element_score(v1, 1.0));
+    BOOST_CHECK(bulk.contains_element_score(v4, 1.0));
+    BOOST_CHECK_EQUAL(bulk.count(1.0, 1.0), 2);
+
+    std::vector<std::vector<unsigned char>> expected{v4, v1, v2, v3};
+    std::vector<std::vector<unsigned char>> actual;
+    auto its = bulk.element_range(0, 3);
+    for (auto it = its.first; it != its.second; it++)
+    {
+        actual.push_back(it->member());
+    }
+    BOOST_CHECK(actual == expected);
+
+    // The set behaves normally afterwards.
+    bulk.add(v4, 4.0);
+    BOOST_CHECK(bulk.contains_element_score(v4, 4.0));
+    BOOST_CHECK_EQUAL(bulk.size(), 4);
+
+    sorted_set::element_list duplicates{{1.0, v1}, {2.0, v1}};
+    BOOST_CHECK_THROW(sorted_set(std::move(duplicates)), std::invalid_argument);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_sorted_set_memory_usage, F)
+{
+    sorted_set zset;
+    const auto empty = zset.memory_usage();
+    zset.add(std::vector<unsigned char>(1000, 'a'), 1.0);
+    const auto one = zset.memory_usage();
+    BOOST_CHECK(one >= empty + 1000);
+
+    // Changing a score doesn't allocate anything.
+    zset.add(std::vector<unsigned char>(1000, 'a'), 2.0);
+    BOOST_CHECK_EQUAL(zset.memory_usage(), one);
+
+    sorted_set::element_list elements{{1.0, std::vector<unsigned char>(1000,
+        'a')}};
+    BOOST_CHECK(sorted_set(std::move(elements)).memory_usage() >= empty + 1000);
+}
+
+BOOST_AUTO_TEST_CASE(test_sorted_set_defrag)
+{
+    // Two sets built side by side share slabs, so removing one leaves the
+    // other spread thinly over them.
+    sorted_set zset;
+    {
+        sorted_set other;
+        for (int i = 0; i < 5000; i++)
+        {
+            zset.add(string_to_vec(std::to_string(i)), i);
+            for (int j = 0; j < 3; j++)
+            {
+                other.add(string_to_vec(std::to_string(i * 3 + j)), i);
+            }
+        }
+    }
+    const auto memory = zset.memory_usage();
+    const auto slabs = slab_pool::instance().statistics().slabs;
+
+    // Each pass empties more slabs, as moved elements fill others up.
+    std::size_t moved = 0;
+    for (int pass = 0; pass < 5; pass++)
+    {
+        std::uint64_t cursor = 0;
+        do
+        {
+            cursor = zset.defrag(cursor, 100, moved);
+        } while (cursor != 0);
+    }
+    BOOST_CHECK(moved > 0);
+    BOOST_CHECK(slab_pool::instance().statistics().slabs < slabs);
+    BOOST_CHECK_EQUAL(zset.memory_usage(), memory);
+
+    // The members, scores and order are all still there.
+    BOOST_CHECK_EQUAL(zset.size(), 5000);
+    auto range = zset.element_range(0, 4999);
+    int i = 0;
+    for (auto it = range.first; it != range.second; it++, i++)
+    {
+        BOOST_CHECK_EQUAL(it->score(), i);
+        BOOST_CHECK_EQUAL(vec_to_string(it->member()), std::to_string(i));
+    }
+    BOOST_CHECK(zset.contains_element_score(string_to_vec("1234"), 1234));
+}
+
+BOOST_AUTO_TEST_CASE(test_sorted_set_scan)
+{
+    sorted_set zset;
+    for (int i = 0; i < 1000; i++)
+    {
+        zset.add(string_to_vec(std::to_string(i)), i);
+    }
+
+    // Members present throughout are seen even though the table grows
+    // part way through the scan.
+    std::set<std::string> seen;
+    std::uint64_t cursor = 0;
+    int calls = 0;
+    do
+    {
+        std::size_t returned = 0;
+        cursor = zset.scan(cursor, 10,
+            [&seen, &returned](const sorted_set::member_type& member,
+                double score)
+            {
+                BOOST_CHECK_EQUAL(std::to_string(static_cast<int>(score)),
+                    vec_to_string(member));
+                seen.insert(vec_to_string(member));
+                returned++;
+            });
+        BOOST_CHECK(returned < 100);
+        if (++calls == 10)
+        {
+            for (int i = 1000; i < 10000; i++)
+            {
+                zset.add(string_to_vec(std::to_string(i)), i);
+            }
+        }
+    } while (cursor != 0);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        BOOST_CHECK(seen.count(std::to_string(i)) == 1);
+    }
+    BOOST_CHECK(sorted_set().scan(0, 10,
+        [](const sorted_set::member_type&, double) {}) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_sorted_set_histogram)
+{
+    sorted_set zset;
+    for (int i = 0; i < 100; i++)
+    {
+        zset.add(string_to_vec(std::to_string(i)), i);
+    }
+
+    // Each bucket matches a count() over its half-open range, and the last
+    // one includes its upper boundary.
+    std::vector<double> boundaries = {10, 20, 20, 45.5, 60};
+    auto histogram = zset.histogram(boundaries);
+    BOOST_REQUIRE_EQUAL(histogram.counts.size(), 4u);
+    BOOST_CHECK_EQUAL(histogram.counts[0], 10u);
+    BOOST_CHECK_EQUAL(histogram.counts[1], 0u);
+    BOOST_CHECK_EQUAL(histogram.counts[2], 26u);
+    BOOST_CHECK_EQUAL(histogram.counts[3], 15u);
+    BOOST_CHECK_EQUAL(histogram.total, zset.count(10, 60));
+    BOOST_CHECK_EQUAL(histogram.min, 10);
+    BOOST_CHECK_EQUAL(histogram.max, 60);
+    BOOST_CHECK_EQUAL(histogram.sum, (10 + 60) * 51 / 2);
+
+    histogram = zset.histogram({200, 300});
+    BOOST_CHECK_EQUAL(histogram.counts[0], 0u);
+    BOOST_CHECK_EQUAL(histogram.total, 0u);
+    BOOST_CHECK_EQUAL(histogram.sum, 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_sorted_set_combine)
+{
+    // a: 0..9 scored i, b: 5..19 scored 10 * i, c: even numbers scored 1.
+    sorted_set a, b, c;
+    for (int i = 0; i < 20; i++)
+    {
+        auto member = string_to_vec(std::to_string(i));
+        if (i < 10)
+        {
+            a.add(member, i);
+        }
+        if (i >= 5)
+        {
+            b.add(member, 10 * i);
+        }
+        if (i % 2 == 0)
+        {
+            c.add(member, 1);
+        }
+    }
+    auto score = [](const sorted_set& set, int i)
+    {
+        return set.get_score(string_to_vec(std::to_string(i)));
+    };
+
+    auto combined = sorted_set::set_union({&a, &b}, {2, 1},
+        sorted_set::aggregate_type::sum);
+    BOOST_CHECK_EQUAL(combined.size(), 20u);
+    BOOST_CHECK_EQUAL(score(combined, 3), 6);
+    BOOST_CHECK_EQUAL(score(combined, 7), 84);
+    BOOST_CHECK_EQUAL(score(combined, 15), 150);
+    // The result is in score order.
+    auto range = combined.element_range(0, combined.size() - 1);
+    BOOST_CHECK(std::is_sorted(range.first, range.second,
+        [](const sorted_set_key& left, const sorted_set_key& right)
+        {
+            return left.score() < right.score();
+        }));
+
+    combined = sorted_set::set_intersection({&b, &a, &c}, {1, 1, 100},
+        sorted_set::aggregate_type::max);
+    BOOST_CHECK_EQUAL(combined.size(), 2u);
+    BOOST_CHECK_EQUAL(score(combined, 6), 100);
+    BOOST_CHECK_EQUAL(score(combined, 8), 100);
+    BOOST_CHECK(!combined.contains(string_to_vec("7")));
+    combined = sorted_set::set_intersection({&a, &b},
+        {1, std::numeric_limits<double>::infinity()},
+        sorted_set::aggregate_type::min);
+    BOOST_CHECK_EQUAL(combined.size(), 5u);
+    BOOST_CHECK_EQUAL(score(combined, 5), 5);
+
+    combined = sorted_set::set_difference({&a, &b, &c});
+    BOOST_CHECK_EQUAL(combined.size(), 2u);
+    BOOST_CHECK_EQUAL(score(combined, 1), 1);
+    BOOST_CHECK_EQUAL(score(combined, 3), 3);
+
+    // Infinity times a zero weight and opposite infinities add up to zero.
+    sorted_set infinite;
+    infinite.add(string_to_vec("1"), std::numeric_limits<double>::infinity());
+    sorted_set negative;
+    negative.add(string_to_vec("1"),
+        -std::numeric_limits<double>::infinity());
+    combined = sorted_set::set_union({&infinite}, {0},
+        sorted_set::aggregate_type::sum);
+    BOOST_CHECK_EQUAL(score(combined, 1), 0);
+    combined = sorted_set::set_union({&infinite, &negative}, {1, 1},
+        sorted_set::aggregate_type::sum);
+    BOOST_CHECK_EQUAL(score(combined, 1), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_sorted_set_remove_range)
+{
+    sorted_set set;
+    for (int i = 0; i < 100; i++)
+    {
+        set.add(string_to_vec(std::to_string(i)), i);
+    }
+    auto usage = set.memory_usage();
+
+    // Ranks from both halves of the set.
+    BOOST_CHECK_EQUAL(set.remove_range_by_rank(0, 9), 10u);
+    BOOST_CHECK_EQUAL(set.remove_range_by_rank(85, 89), 5u);
+    BOOST_CHECK_EQUAL(set.size(), 85u);
+    BOOST_CHECK(!set.contains(string_to_vec("9")));
+    BOOST_CHECK(!set.contains(string_to_vec("99")));
+    BOOST_CHECK(set.contains(string_to_vec("94")));
+    BOOST_CHECK_LT(set.memory_usage(), usage);
+
+    BOOST_CHECK_EQUAL(set.remove_range_by_score(20, 29.5), 10u);
+    BOOST_CHECK_EQUAL(set.remove_range_by_score(200, 300), 0u);
+    BOOST_CHECK(!set.contains(string_to_vec("25")));
+    BOOST_CHECK(set.contains(string_to_vec("30")));
+
+    // Trimming keeps the highest ranked elements.
+    BOOST_CHECK_EQUAL(set.trim(100), 0u);
+    BOOST_CHECK_EQUAL(set.trim(3), 72u);
+    BOOST_CHECK_EQUAL(set.size(), 3u);
+    auto range = set.element_range(0, 2);
+    BOOST_CHECK_EQUAL(range.first->score(), 92);
+    BOOST_CHECK_EQUAL(std::prev(range.second)->score(), 94);
+    BOOST_CHECK_EQUAL(set.remove_range_by_rank(0, 2), 3u);
+    BOOST_CHECK_EQUAL(set.size(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_sorted_set_remove_middle_ranks)
+{
+    sorted_set set;
+    for (int i = 0; i < 1001; i++)
+    {
+        set.add(string_to_vec(std::to_string(i)), i);
+    }
+
+    // Starts in the first half and runs past the middle.
+    BOOST_CHECK_EQUAL(set.remove_range_by_rank(400, 600), 201u);
+    BOOST_CHECK_EQUAL(set.size(), 800u);
+    auto range = set.element_range(398, 401);
+    std::vector<double> scores;
+    for (auto it = range.first; it != range.second; it++)
+    {
+        scores.push_back(it->score());
+    }
+    BOOST_CHECK(scores == std::vector<double>({398, 399, 601, 602}));
+
+    // Either side of the middle rank, which is found from the other end.
+    BOOST_CHECK_EQUAL(set.remove_range_by_rank(399, 400), 2u);
+    BOOST_CHECK_EQUAL(set.remove_range_by_rank(400, 401), 2u);
+    BOOST_CHECK(!set.contains(string_to_vec("399")));
+    BOOST_CHECK(!set.contains(string_to_vec("601")));
+    BOOST_CHECK(!set.contains(string_to_vec("603")));
+    BOOST_CHECK(!set.contains(string_to_vec("604")));
+    BOOST_CHECK(set.contains(string_to_vec("602")));
+    BOOST_CHECK_EQUAL(set.element_range(399, 399).first->score(), 602);
+    BOOST_CHECK_EQUAL(set.element_range(400, 400).first->score(), 605);
+    BOOST_CHECK_EQUAL(set.size(), 796u);
+}
+
 #endif
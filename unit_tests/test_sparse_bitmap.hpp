@@ -0,0 +1,246 @@
+#ifndef __TEST_SPARSE_BITMAP_HPP__
+#define __TEST_SPARSE_BITMAP_HPP__
+
+#include <vector>
+#include <random>
+#include <cstdint>
+
+#include "../sparse_bitmap.hpp"
+#include "../binary_string.hpp"
+#include "../bitops.hpp"
+
+namespace
+{
+    // Sets a bit in a plain string, growing it as SETBIT does.
+    void set_model_bit(std::vector<unsigned char>& data, std::uint64_t bit,
+        bool value)
+    {
+        if (bit / 8 >= data.size())
+        {
+            data.resize(bit / 8 + 1, 0);
+        }
+        unsigned char mask = 0x80 >> (bit % 8);
+        data[bit / 8] = value ? data[bit / 8] | mask : data[bit / 8] & ~mask;
+    }
+
+    // Checks a bitmap against the string it should stand for.
+    void check_sparse_bitmap(const sparse_bitmap& bitmap,
+        const std::vector<unsigned char>& model)
+    {
+        BOOST_REQUIRE_EQUAL(bitmap.size(), model.size());
+        BOOST_REQUIRE(bitmap.to_bytes() == model);
+        const std::uint64_t bits = model.size() * 8;
+        if (bits == 0)
+        {
+            return;
+        }
+        std::mt19937 random(7);
+        for (int i = 0; i < 50; i++)
+        {
+            std::uint64_t first = random() % bits;
+            std::uint64_t last = first + random() % (bits - first);
+            BOOST_CHECK_EQUAL(bitmap.count(first, last),
+                count_bits(model.data(), first, last));
+            BOOST_CHECK_EQUAL(bitmap.find(first, last, true),
+                find_bit(model.data(), first, last, true));
+            BOOST_CHECK_EQUAL(bitmap.find(first, last, false),
+                find_bit(model.data(), first, last, false));
+            BOOST_CHECK_EQUAL(bitmap.get(first),
+                ((model[first / 8] >> (7 - first % 8)) & 1) != 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_sparse_bitmap_set_get)
+{
+    // Chunk 0 has few bits (an array), chunk 1 many (a bitmap) and chunk 3 a
+    // long stretch of set bits that optimize() turns into runs.
+    sparse_bitmap bitmap;
+    std::vector<unsigned char> model;
+    std::mt19937 random(42);
+    for (int i = 0; i < 100; i++)
+    {
+        auto bit = random() % sparse_bitmap::chunk_bits;
+        bool old = bitmap.get(bit);
+        BOOST_CHECK_EQUAL(bitmap.set(bit, true), old);
+        set_model_bit(model, bit, true);
+    }
+    for (int i = 0; i < 20000; i++)
+    {
+        auto bit = sparse_bitmap::chunk_bits
+            + random() % sparse_bitmap::chunk_bits;
+        bitmap.set(bit, true);
+        set_model_bit(model, bit, true);
+    }
+    for (std::uint64_t bit = 3 * sparse_bitmap::chunk_bits + 100;
+        bit < 3 * sparse_bitmap::chunk_bits + 30000; bit++)
+    {
+        bitmap.set(bit, true);
+        set_model_bit(model, bit, true);
+    }
+    check_sparse_bitmap(bitmap, model);
+
+    auto before = bitmap.memory_usage();
+    bitmap.optimize();
+    BOOST_CHECK_LT(bitmap.memory_usage(), before);
+    check_sparse_bitmap(bitmap, model);
+
+    // Clearing bits splits runs, and clearing most of a bitmap container
+    // turns it back into an array.
+    for (int i = 0; i < 5000; i++)
+    {
+        auto bit = random() % (4 * sparse_bitmap::chunk_bits);
+        bool value = random() % 4 == 0;
+        bool old = bit / 8 < model.size()
+            && ((model[bit / 8] >> (7 - bit % 8)) & 1) != 0;
+        BOOST_CHECK_EQUAL(bitmap.set(bit, value), old);
+        set_model_bit(model, bit, value);
+    }
+    check_sparse_bitmap(bitmap, model);
+    for (std::uint64_t bit = sparse_bitmap::chunk_bits;
+        bit < 2 * sparse_bitmap::chunk_bits - 1000; bit++)
+    {
+        bitmap.set(bit, false);
+        set_model_bit(model, bit, false);
+    }
+    check_sparse_bitmap(bitmap, model);
+
+    // Building from a string gives the same bitmap.
+    sparse_bitmap rebuilt(model);
+    check_sparse_bitmap(rebuilt, model);
+}
+
+BOOST_AUTO_TEST_CASE(test_sparse_bitmap_far_offset)
+{
+    sparse_bitmap bitmap;
+    const std::uint64_t far = 4000000000ULL;
+    BOOST_CHECK_EQUAL(bitmap.set(far, true), false);
+    BOOST_CHECK_EQUAL(bitmap.size(), far / 8 + 1);
+    BOOST_CHECK(bitmap.get(far));
+    BOOST_CHECK(!bitmap.get(far - 1));
+    BOOST_CHECK_EQUAL(bitmap.count(0, far), 1u);
+    BOOST_CHECK_EQUAL(bitmap.find(0, far, true), static_cast<long long>(far));
+    BOOST_CHECK_EQUAL(bitmap.find(0, far, false), 0);
+    BOOST_CHECK_LT(bitmap.memory_usage(), 1024u);
+
+    auto tail = bitmap.to_bytes(far / 8 - 1, far / 8 + 1);
+    BOOST_CHECK(tail == std::vector<unsigned char>({0, 0x80 >> (far % 8)}));
+}
+
+BOOST_AUTO_TEST_CASE(test_sparse_bitmap_combine)
+{
+    std::mt19937 random(3);
+    std::vector<std::vector<unsigned char>> models(3);
+    std::vector<sparse_bitmap> bitmaps(3);
+    for (std::size_t i = 0; i < models.size(); i++)
+    {
+        // Different lengths, and a dense chunk in each.
+        auto bits = (i + 2) * sparse_bitmap::chunk_bits;
+        for (int j = 0; j < 3000; j++)
+        {
+            auto bit = random() % bits;
+            bitmaps[i].set(bit, true);
+            set_model_bit(models[i], bit, true);
+        }
+        for (int j = 0; j < 10000; j++)
+        {
+            auto bit = random() % sparse_bitmap::chunk_bits;
+            bitmaps[i].set(bit, true);
+            set_model_bit(models[i], bit, true);
+        }
+    }
+
+    std::vector<const sparse_bitmap*> sources;
+    std::vector<bit_source> byte_sources;
+    std::size_t size = 0;
+    for (std::size_t i = 0; i < models.size(); i++)
+    {
+        sources.push_back(&bitmaps[i]);
+        byte_sources.push_back({models[i].data(), models[i].size()});
+        size = std::max(size, models[i].size());
+    }
+    for (auto op: {bit_operation::bitwise_and, bit_operation::bitwise_or,
+        bit_operation::bitwise_xor})
+    {
+        std::vector<unsigned char> expected(size);
+        combine_bits(op, byte_sources, expected.data(), size);
+        check_sparse_bitmap(sparse_bitmap::combine(op, sources), expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_sparse_bitmap_serialize)
+{
+    sparse_bitmap bitmap;
+    std::vector<unsigned char> model;
+    for (std::uint64_t bit = 10; bit < 5 * sparse_bitmap::chunk_bits;
+        bit += 13)
+    {
+        bitmap.set(bit, true);
+        set_model_bit(model, bit, true);
+    }
+    for (std::uint64_t bit = 0; bit < sparse_bitmap::chunk_bits; bit++)
+    {
+        bitmap.set(bit, bit % 1000 < 600);
+        set_model_bit(model, bit, bit % 1000 < 600);
+    }
+    bitmap.set(8 * sparse_bitmap::chunk_bits + 5, false);
+    set_model_bit(model, 8 * sparse_bitmap::chunk_bits + 5, false);
+    bitmap.optimize();
+
+    auto serialized = bitmap.serialize();
+    auto loaded = sparse_bitmap::deserialize(serialized);
+    check_sparse_bitmap(loaded, model);
+    BOOST_CHECK_EQUAL(loaded.memory_usage(), bitmap.memory_usage());
+
+    serialized.pop_back();
+    BOOST_CHECK_THROW(sparse_bitmap::deserialize(serialized),
+        std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(test_bstring_sparse)
+{
+    // Stretching a string to a far offset keeps it sparse.
+    binary_string value(std::vector<unsigned char>({0xff}));
+    BOOST_CHECK_EQUAL(value.set_bit(8000000, true), false);
+    BOOST_CHECK(value.is_sparse());
+    BOOST_CHECK(!value.has_bytes());
+    BOOST_CHECK_EQUAL(value.size(), 1000001u);
+    BOOST_CHECK_LT(value.capacity(), 1024u);
+    BOOST_CHECK(value.get_bit(0));
+    BOOST_CHECK(value.get_bit(8000000));
+    BOOST_CHECK(!value.get_bit(8000001));
+
+    // Copies are deep.
+    binary_string copy(value);
+    copy.set_bit(1, false);
+    BOOST_CHECK(value.get_bit(1));
+
+    // Asking for the bytes mutably converts it.
+    auto bytes = value.bytes();
+    BOOST_CHECK_EQUAL(bytes.size(), 1000001u);
+    BOOST_CHECK_EQUAL(bytes[0], 0xff);
+    BOOST_CHECK_EQUAL(bytes.back(), 0x80);
+    BOOST_CHECK(value.bdata() == bytes);
+    BOOST_CHECK(!value.is_sparse());
+
+    // A small string stays as bytes.
+    binary_string small;
+    small.set_bit(100, true);
+    BOOST_CHECK(small.has_bytes());
+    BOOST_CHECK_EQUAL(small.size(), 13u);
+
+    // Filling in a sparse string turns it back into bytes.
+    binary_string filling;
+    filling.set_bit(1000000, true);
+    BOOST_CHECK(filling.is_sparse());
+    for (std::uint64_t bit = 0; bit < 1000000 && filling.is_sparse();
+        bit += 2)
+    {
+        filling.set_bit(bit, true);
+    }
+    BOOST_CHECK(filling.has_bytes());
+    BOOST_CHECK(filling.get_bit(1000000));
+    BOOST_CHECK(filling.get_bit(0));
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef __TEST_SPILL_LOG_HPP__
+#define __TEST_SPILL_LOG_HPP__
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "../spill_log.hpp"
+#include "../exostore.hpp"
+#include "../util.hpp"
+
+struct spill_log_fixture
+{
+public:
+    spill_log_fixture() : path("test.spill"), db_path("test_spill.erdb")
+    {
+        std::remove(db_path.c_str());
+    }
+
+    ~spill_log_fixture()
+    {
+        std::remove(path.c_str());
+        std::remove(db_path.c_str());
+    }
+
+    // Runs an asynchronous read and waits for it.
+    std::vector<spill_log::read_result> read_async(spill_log& log,
+        std::vector<spill_log::read_request> requests)
+    {
+        std::mutex mutex;
+        std::condition_variable done_cond;
+        bool done = false;
+        log.read_async(requests, [&]()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+            done_cond.notify_one();
+        });
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cond.wait(lock, [&done]() { return done; });
+        return log.take_results();
+    }
+
+    std::string path;
+    std::string db_path;
+};
+
+BOOST_FIXTURE_TEST_CASE(test_spill_log_append_read, spill_log_fixture)
+{
+    spill_log log(path);
+    log.open();
+    auto first = log.append(string_to_vec("first value"));
+    auto second = log.append(string_to_vec("second"));
+    // Nothing can be read until it's flushed.
+    BOOST_CHECK_THROW(log.read(first), spill_log::spill_error);
+    log.flush();
+
+    BOOST_CHECK(log.read(first) == string_to_vec("first value"));
+    BOOST_CHECK(log.read(second) == string_to_vec("second"));
+    BOOST_CHECK_EQUAL(log.file_size(), 17);
+    BOOST_CHECK_EQUAL(log.live_bytes(), 17);
+
+    auto results = read_async(log, {{string_to_vec("k2"), second},
+        {string_to_vec("k1"), first}});
+    BOOST_CHECK_EQUAL(results.size(), 2);
+    BOOST_CHECK(results[0].ok);
+    BOOST_CHECK(results[0].key == string_to_vec("k2"));
+    BOOST_CHECK(results[0].data == string_to_vec("second"));
+    BOOST_CHECK(results[1].data == string_to_vec("first value"));
+
+    log.release(first);
+    BOOST_CHECK_EQUAL(log.live_bytes(), 6);
+    BOOST_CHECK_EQUAL(log.file_size(), 17);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_spill_log_compaction, spill_log_fixture)
+{
+    spill_log log(path);
+    log.open();
+    const std::vector<unsigned char> big(1 << 20, 'x');
+    auto garbage = log.append(big);
+    auto kept = log.append(string_to_vec("kept"));
+    log.flush();
+    BOOST_CHECK(!log.compaction_due());
+    log.release(garbage);
+    BOOST_CHECK(log.compaction_due());
+
+    log.start_compaction({kept});
+    BOOST_CHECK(log.compacting());
+    BOOST_CHECK_THROW(log.append(big), spill_log::spill_error);
+    std::vector<spill_log::location> new_locations;
+    while (!log.finish_compaction(new_locations))
+    {
+        std::this_thread::yield();
+    }
+
+    BOOST_CHECK(!log.compacting());
+    BOOST_CHECK_EQUAL(new_locations.size(), 1);
+    BOOST_CHECK(log.read(new_locations[0]) == string_to_vec("kept"));
+    BOOST_CHECK_THROW(log.read(kept), spill_log::spill_error);
+    BOOST_CHECK_EQUAL(log.file_size(), 4);
+    BOOST_CHECK_EQUAL(log.live_bytes(), 4);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_spill, spill_log_fixture)
+{
+    {
+        exostore store(db_path);
+        store.open_spill_log(path, 0, 4);
+        store.set(string_to_vec("key"), exostore::bstring(
+            string_to_vec("some value")));
+        store.set(string_to_vec("tiny"), exostore::bstring(
+            string_to_vec("ab")));
+        store.set(string_to_vec("other"), exostore::bstring(
+            string_to_vec("other value")));
+        store.spill_cold_values();
+        BOOST_CHECK_EQUAL(store.spilled_count(), 2);
+
+        auto spilled = store.spilled_keys({string_to_vec("key"),
+            string_to_vec("tiny"), string_to_vec("missing")});
+        BOOST_CHECK_EQUAL(spilled.size(), 1);
+
+        // Read back on the worker thread.
+        std::mutex mutex;
+        std::condition_variable done_cond;
+        bool done = false;
+        store.read_back(spilled, [&]()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+            done_cond.notify_one();
+        });
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cond.wait(lock, [&done]() { return done; });
+        }
+        store.finish_read_back();
+        BOOST_CHECK_EQUAL(store.spilled_count(), 1);
+        BOOST_CHECK(store.spilled_keys({string_to_vec("key")}).empty());
+        BOOST_CHECK(store.get<exostore::bstring>(string_to_vec("key")).bdata()
+            == string_to_vec("some value"));
+
+        // Saving reads spilled values from the spill log.
+        store.save();
+
+        // Reading a spilled value directly reads it back on the spot.
+        BOOST_CHECK(store.get<exostore::bstring>(string_to_vec("other")).bdata()
+            == string_to_vec("other value"));
+        BOOST_CHECK_EQUAL(store.spilled_count(), 0);
+    }
+
+    exostore store(db_path);
+    store.load();
+    BOOST_CHECK(store.get<exostore::bstring>(string_to_vec("other")).bdata()
+        == string_to_vec("other value"));
+    BOOST_CHECK(store.get<exostore::bstring>(string_to_vec("tiny")).bdata()
+        == string_to_vec("ab"));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_spill_steps, spill_log_fixture)
+{
+    exostore store(db_path);
+    store.open_spill_log(path, 0, 4);
+    const std::size_t num_keys = 25000;
+    for (std::size_t i = 0; i < num_keys; i++)
+    {
+        store.set(string_to_vec("key" + std::to_string(i)), exostore::bstring(
+            string_to_vec("value" + std::to_string(i))));
+    }
+
+    // A large keyspace is covered over several calls.
+    store.spill_cold_values();
+    BOOST_CHECK_GT(store.spilled_count(), 0);
+    BOOST_CHECK_LT(store.spilled_count(), num_keys);
+    for (int i = 0; i < 10 && store.spilled_count() < num_keys; i++)
+    {
+        store.spill_cold_values();
+    }
+    BOOST_CHECK_EQUAL(store.spilled_count(), num_keys);
+    BOOST_CHECK(store.get<exostore::bstring>(string_to_vec("key123")).bdata()
+        == string_to_vec("value123"));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_exostore_spill_compaction_steps,
+    spill_log_fixture)
+{
+    exostore store(db_path);
+    store.open_spill_log(path, 0, 4);
+    const int num_keys = 25000;
+    auto value_of = [](int i)
+    {
+        auto value = string_to_vec("value" + std::to_string(i));
+        value.resize(100, 'x');
+        return value;
+    };
+    for (int i = 0; i < num_keys; i++)
+    {
+        store.set(string_to_vec("key" + std::to_string(i)),
+            exostore::bstring(value_of(i)));
+    }
+    for (int i = 0; i < 10 && store.spilled_count() < num_keys; i++)
+    {
+        store.spill_cold_values();
+    }
+    BOOST_REQUIRE_EQUAL(store.spilled_count(), num_keys);
+
+    // Reading most of the values back leaves the log mostly garbage.
+    for (int i = 0; i < num_keys; i++)
+    {
+        if (i % 4 != 0)
+        {
+            store.get<exostore::bstring>(string_to_vec("key"
+                + std::to_string(i)));
+        }
+    }
+    BOOST_REQUIRE(store.spill()->compaction_due());
+
+    // The spilled values are gathered over several calls before the
+    // compaction starts.
+    store.spill_cold_values();
+    BOOST_CHECK(!store.spill()->compacting());
+    int calls = 1;
+    while (!store.spill()->compacting() && calls < 10)
+    {
+        store.spill_cold_values();
+        calls++;
+    }
+    BOOST_CHECK(store.spill()->compacting());
+    while (store.spill()->compacting())
+    {
+        store.spill_cold_values();
+        std::this_thread::yield();
+    }
+    BOOST_CHECK_LT(store.spill()->file_size(), 100 * num_keys);
+    for (int i = 0; i < num_keys; i += 1000)
+    {
+        BOOST_CHECK(store.get<exostore::bstring>(string_to_vec("key"
+            + std::to_string(i))).bdata() == value_of(i));
+    }
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef __TEST_UTIL_HPP__
+#define __TEST_UTIL_HPP__
+
+#include <vector>
+#include <string>
+#include <set>
+#include <limits>
+#include <boost/unordered_map.hpp>
+
+#include "../util.hpp"
+#include "../sorted_set.hpp"
+
+namespace
+{
+    bool glob(const std::string& pattern, const std::string& str)
+    {
+        return glob_match(string_to_vec(pattern), string_to_vec(str));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_glob_match)
+{
+    BOOST_CHECK(glob("*", ""));
+    BOOST_CHECK(glob("*", "anything"));
+    BOOST_CHECK(glob("user:*", "user:42"));
+    BOOST_CHECK(!glob("user:*", "session:42"));
+    BOOST_CHECK(glob("*:42", "user:42"));
+    BOOST_CHECK(glob("u*r:*2", "user:42"));
+    BOOST_CHECK(glob("h?llo", "hello"));
+    BOOST_CHECK(!glob("h?llo", "hllo"));
+    BOOST_CHECK(glob("h[ae]llo", "hallo"));
+    BOOST_CHECK(!glob("h[ae]llo", "hillo"));
+    BOOST_CHECK(glob("h[^e]llo", "hallo"));
+    BOOST_CHECK(!glob("h[^e]llo", "hello"));
+    BOOST_CHECK(glob("h[a-c]llo", "hbllo"));
+    BOOST_CHECK(!glob("h[a-c]llo", "hdllo"));
+    BOOST_CHECK(glob("a\\*b", "a*b"));
+    BOOST_CHECK(!glob("a\\*b", "axb"));
+    BOOST_CHECK(!glob("abc", "abcd"));
+    BOOST_CHECK(!glob("", "a"));
+}
+
+BOOST_AUTO_TEST_CASE(test_next_scan_cursor)
+{
+    // Every bucket is visited exactly once.
+    const std::uint64_t mask = 15;
+    std::set<std::uint64_t> visited;
+    std::uint64_t cursor = 0;
+    do
+    {
+        BOOST_CHECK(visited.insert(cursor).second);
+        cursor = next_scan_cursor(cursor, mask);
+    } while (cursor != 0);
+    BOOST_CHECK_EQUAL(visited.size(), mask + 1);
+
+    // The order is reverse binary: 0, 8, 4, 12, 2, ...
+    BOOST_CHECK_EQUAL(next_scan_cursor(0, mask), 8);
+    BOOST_CHECK_EQUAL(next_scan_cursor(8, mask), 4);
+    BOOST_CHECK_EQUAL(next_scan_cursor(4, mask), 12);
+    BOOST_CHECK_EQUAL(next_scan_cursor(15, mask), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_scan_mask)
+{
+    BOOST_CHECK_EQUAL(scan_mask(1), 0);
+    BOOST_CHECK_EQUAL(scan_mask(16), 15);
+    BOOST_CHECK_EQUAL(scan_mask(13), 15);
+
+    // Cursors skip keys or see them twice across a resize unless the tables
+    // have a power of two buckets, so check that they still do.
+    boost::unordered_map<std::vector<unsigned char>, int,
+        boost::hash<std::vector<unsigned char>>> table;
+    sorted_set zset;
+    for (int i = 0; i < 5000; i++)
+    {
+        table[string_to_vec(std::to_string(i))] = i;
+        zset.add(string_to_vec(std::to_string(i)), i);
+        BOOST_CHECK_EQUAL(scan_mask(table.bucket_count()) + 1,
+            table.bucket_count());
+    }
+    std::uint64_t cursor = 0;
+    std::set<std::vector<unsigned char>> seen;
+    do
+    {
+        cursor = zset.scan(cursor, 100,
+            [&seen](const sorted_set::member_type& member, double)
+            {
+                seen.insert(member);
+            });
+    } while (cursor != 0);
+    BOOST_CHECK_EQUAL(seen.size(), 5000);
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_integer)
+{
+    long long value = 1;
+    BOOST_CHECK(parse_integer(string_to_vec("0"), value));
+    BOOST_CHECK_EQUAL(value, 0);
+    BOOST_CHECK(parse_integer(string_to_vec("-42"), value));
+    BOOST_CHECK_EQUAL(value, -42);
+    BOOST_CHECK(parse_integer(string_to_vec("9223372036854775807"), value));
+    BOOST_CHECK_EQUAL(value, std::numeric_limits<long long>::max());
+    BOOST_CHECK(parse_integer(string_to_vec("-9223372036854775808"), value));
+    BOOST_CHECK_EQUAL(value, std::numeric_limits<long long>::min());
+
+    // Only the way the number would be printed is accepted.
+    value = 7;
+    for (auto s: {"", "-", "-0", "007", "+1", " 1", "1 ", "1.0", "1e3", "x",
+        "9223372036854775808", "-9223372036854775809"})
+    {
+        BOOST_CHECK(!parse_integer(string_to_vec(s), value));
+    }
+    BOOST_CHECK_EQUAL(value, 7);
+}
+
+BOOST_AUTO_TEST_CASE(test_allocation_size)
+{
+    BOOST_CHECK_EQUAL(allocation_size(0), 0);
+    BOOST_CHECK_EQUAL(allocation_size(1), 32);
+    BOOST_CHECK_EQUAL(allocation_size(24), 32);
+    BOOST_CHECK_EQUAL(allocation_size(25), 48);
+    BOOST_CHECK_EQUAL(allocation_size(1000), 1008);
+}
+
+#endif
@@ -7,3 +7,15 @@
 #include "test_sorted_map_key.hpp"
 #include "test_sorted_set.hpp"
 #include "test_exostore.hpp"
+#include "test_append_log.hpp"
+#include "test_config.hpp"
+#include "test_mapped_store.hpp"
+#include "test_spill_log.hpp"
+#include "test_lazy_free.hpp"
+#include "test_util.hpp"
+#include "test_slab_allocator.hpp"
+#include "test_bitops.hpp"
+#include "test_sparse_bitmap.hpp"
+#include "test_hyperloglog.hpp"
+#include "test_hash_map.hpp"
+#include "test_pubsub.hpp"
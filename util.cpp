@@ -3,6 +3,9 @@
 #include <vector>
 #include <string>
 #include <locale>
+#include <cstring>
+#include <algorithm>
+#include <limits>
 
 std::string toupper_string(const std::string& input)
 {
@@ -30,14 +33,249 @@ void operator+=(std::vector<unsigned char>& v, unsigned char c)
     v.push_back(c);
 }
 
+bool parse_integer(const std::vector<unsigned char>& bytes, long long& value)
+{
+    // The longest is -9223372036854775808.
+    if (bytes.empty() || bytes.size() > 20)
+    {
+        return false;
+    }
+
+    std::size_t i = 0;
+    bool negative = bytes[0] == '-';
+    if (negative)
+    {
+        i++;
+    }
+    if (i == bytes.size() || (bytes[i] == '0' && bytes.size() != 1))
+    {
+        return false;
+    }
+
+    // Accumulated as a negative number, which has the larger range.
+    const long long min = std::numeric_limits<long long>::min();
+    long long result = 0;
+    for (; i < bytes.size(); i++)
+    {
+        if (bytes[i] < '0' || bytes[i] > '9')
+        {
+            return false;
+        }
+        int digit = bytes[i] - '0';
+        if (result < (min + digit) / 10)
+        {
+            return false;
+        }
+        result = result * 10 - digit;
+    }
+    if (!negative)
+    {
+        if (result == min)
+        {
+            return false;
+        }
+        result = -result;
+    }
+    value = result;
+    return true;
+}
+
 std::vector<unsigned char> vec_from_file(std::ifstream& in, std::size_t bytes)
 {
-    char c;
-    std::vector<unsigned char> ret;
-    for (std::size_t i = 0; i < bytes && in; i++)
+    std::vector<unsigned char> ret(bytes);
+    in.read(reinterpret_cast<char*>(ret.data()), bytes);
+    ret.resize(in.gcount());
+    return ret;
+}
+
+std::uint64_t murmur_hash64(const unsigned char* data, std::size_t size,
+    std::uint64_t seed)
+{
+    const std::uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    std::uint64_t h = seed ^ (size * m);
+
+    const unsigned char* end = data + (size - size % 8);
+    for (; data != end; data += 8)
+    {
+        std::uint64_t k;
+        std::memcpy(&k, data, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    switch (size % 8)
+    {
+    case 7: h ^= static_cast<std::uint64_t>(data[6]) << 48;  // fall through
+    case 6: h ^= static_cast<std::uint64_t>(data[5]) << 40;  // fall through
+    case 5: h ^= static_cast<std::uint64_t>(data[4]) << 32;  // fall through
+    case 4: h ^= static_cast<std::uint64_t>(data[3]) << 24;  // fall through
+    case 3: h ^= static_cast<std::uint64_t>(data[2]) << 16;  // fall through
+    case 2: h ^= static_cast<std::uint64_t>(data[1]) << 8;  // fall through
+    case 1: h ^= static_cast<std::uint64_t>(data[0]);
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+std::size_t allocation_size(std::size_t requested)
+{
+    if (requested == 0)
+    {
+        return 0;
+    }
+    const std::size_t with_header = (requested + sizeof(std::size_t) + 15)
+        & ~static_cast<std::size_t>(15);
+    return with_header < 32 ? 32 : with_header;
+}
+
+namespace
+{
+    bool glob_match_from(const unsigned char* pattern,
+        const unsigned char* pattern_end, const unsigned char* str,
+        const unsigned char* str_end)
+    {
+        while (pattern != pattern_end)
+        {
+            switch (*pattern)
+            {
+            case '*':
+                // Collapse runs of stars, then try every possible split.
+                while (pattern + 1 != pattern_end && pattern[1] == '*')
+                {
+                    pattern++;
+                }
+                if (pattern + 1 == pattern_end)
+                {
+                    return true;
+                }
+                for (auto rest = str; rest != str_end; rest++)
+                {
+                    if (glob_match_from(pattern + 1, pattern_end, rest,
+                        str_end))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+
+            case '?':
+                if (str == str_end)
+                {
+                    return false;
+                }
+                str++;
+                break;
+
+            case '[':
+            {
+                if (str == str_end)
+                {
+                    return false;
+                }
+                pattern++;
+                bool negate = pattern != pattern_end && *pattern == '^';
+                if (negate)
+                {
+                    pattern++;
+                }
+                bool matched = false;
+                while (pattern != pattern_end && *pattern != ']')
+                {
+                    if (*pattern == '\\' && pattern + 1 != pattern_end)
+                    {
+                        pattern++;
+                        matched = matched || *pattern == *str;
+                    }
+                    else if (pattern + 2 < pattern_end && pattern[1] == '-'
+                        && pattern[2] != ']')
+                    {
+                        auto low = std::min(pattern[0], pattern[2]);
+                        auto high = std::max(pattern[0], pattern[2]);
+                        matched = matched || (*str >= low && *str <= high);
+                        pattern += 2;
+                    }
+                    else
+                    {
+                        matched = matched || *pattern == *str;
+                    }
+                    pattern++;
+                }
+                if (matched == negate)
+                {
+                    return false;
+                }
+                if (pattern == pattern_end)
+                {
+                    // An unterminated set ends the pattern.
+                    return str + 1 == str_end;
+                }
+                str++;
+                break;
+            }
+
+            case '\\':
+                if (pattern + 1 != pattern_end)
+                {
+                    pattern++;
+                }
+                // The escaped character is matched literally.
+                // fall through
+            default:
+                if (str == str_end || *pattern != *str)
+                {
+                    return false;
+                }
+                str++;
+                break;
+            }
+            pattern++;
+        }
+        return str == str_end;
+    }
+
+    std::uint64_t reverse_bits(std::uint64_t v)
+    {
+        std::uint64_t reversed = 0;
+        for (int i = 0; i < 64; i++)
+        {
+            reversed = (reversed << 1) | (v & 1);
+            v >>= 1;
+        }
+        return reversed;
+    }
+}
+
+bool glob_match(const std::vector<unsigned char>& pattern,
+    const std::vector<unsigned char>& str)
+{
+    return glob_match_from(pattern.data(), pattern.data() + pattern.size(),
+        str.data(), str.data() + str.size());
+}
+
+std::uint64_t next_scan_cursor(std::uint64_t cursor, std::uint64_t mask)
+{
+    // Set the bits above the mask so that the increment carries through
+    // them, then increment the reversed cursor.
+    cursor |= ~mask;
+    cursor = reverse_bits(cursor);
+    cursor++;
+    return reverse_bits(cursor);
+}
+
+std::uint64_t scan_mask(std::size_t bucket_count)
+{
+    std::uint64_t mask = 0;
+    while (mask + 1 < bucket_count)
     {
-        in.get(c);
-        ret.push_back(static_cast<unsigned char>(c));
+        mask = (mask << 1) | 1;
     }
-    return std::move(ret);
+    return mask;
 }
@@ -7,6 +7,7 @@
 #include <fstream>
 #include <cstddef>
 #include <utility>
+#include <cstdint>
 
 std::string toupper_string(const std::string& input);
 
@@ -17,7 +18,42 @@ std::string vec_to_string(const std::vector<unsigned char>& v);
 // Necessary for tokenizing a vector<unsigned char>.
 void operator+=(std::vector<unsigned char>& v, unsigned char c);
 
+// Parses a decimal integer written the way it would be printed: an optional
+// minus sign and digits without leading zeros. Returns false if the bytes are
+// anything else or the value doesn't fit in a long long.
+bool parse_integer(const std::vector<unsigned char>& bytes, long long& value);
+
 // Reads a number of bytes from a file and returns them in a vector.
 std::vector<unsigned char> vec_from_file(std::ifstream&, std::size_t bytes);
 
+// 64-bit MurmurHash2 (MurmurHash64A). Unlike std::hash and boost::hash, the
+// result is stable across builds, so it can be stored on disk.
+std::uint64_t murmur_hash64(const unsigned char* data, std::size_t size,
+    std::uint64_t seed=0xadc83b19ULL);
+
+// Bytes a heap allocation of the given size really takes, as with glibc's
+// malloc on 64-bit systems: an 8 byte header, rounded up to 16 bytes, and at
+// least 32 bytes. Zero for an empty request, which allocates nothing.
+std::size_t allocation_size(std::size_t requested);
+
+// Matches a glob-style pattern, as used by SCAN's MATCH option: * matches any
+// run of bytes, ? any single byte, [abc], [^abc] and [a-z] match sets of
+// bytes, and \ escapes the next character.
+bool glob_match(const std::vector<unsigned char>& pattern,
+    const std::vector<unsigned char>& str);
+
+// Advances a cursor over the buckets of a hash table with mask + 1 buckets, a
+// power of two. The bits of the cursor are incremented from the top, so
+// buckets split by growing the table share their high bits with the bucket
+// they came from and are never visited twice or skipped. Returns 0 once every
+// bucket has been visited.
+std::uint64_t next_scan_cursor(std::uint64_t cursor, std::uint64_t mask);
+
+// The mask to scan a hash table of bucket_count buckets with. Boost gives
+// tables of non-integral keys a power of two buckets, as next_scan_cursor()
+// needs. Should a version not, the mask covers the next power of two and
+// buckets past the last one must be skipped. Every bucket is still visited,
+// but a resize part way through may then skip or repeat keys.
+std::uint64_t scan_mask(std::size_t bucket_count);
+
 #endif